@@ -56,6 +56,10 @@ NDIS_OID TAPSupportedOids[] =
         OID_GEN_XMIT_ERROR,
         OID_GEN_RCV_ERROR,
         OID_GEN_RCV_NO_BUFFER,
+        OID_GEN_RECEIVE_SCALE_PARAMETERS,
+        OID_TCP_OFFLOAD_PARAMETERS,
+        OID_OFFLOAD_ENCAPSULATION,
+        OID_TCP_RSC_STATISTICS,
         OID_802_3_PERMANENT_ADDRESS,
         OID_802_3_CURRENT_ADDRESS,
         OID_802_3_MULTICAST_LIST,
@@ -122,24 +126,30 @@ tapAdapterContextAllocate(
             return NULL;
         }
 
-        // Initialize cancel-safe IRP queue
-        tapIrpCsqInitialize(&adapter->PendingReadIrpQueue);
-
-        // Initialize TAP send packet queue.
-        tapPacketQueueInitialize(&adapter->SendPacketQueue);
+        // Initialize per-handle queue steering. The queues themselves are
+        // allocated once the queue count has been read from the registry.
+        KeInitializeSpinLock(&adapter->QueueSteeringLock);
 
         // Initialize flow control
         KeInitializeSpinLock(&adapter->FlowControlLock);
 
+        // Initialize shared-memory ring lock.
+        KeInitializeSpinLock(&adapter->RingsLock);
+
+        // Initialize inject cache lock. The cache is filled once the MTU
+        // is known.
+        KeInitializeSpinLock(&adapter->InjectCacheLock);
+
+        // Initialize TUN mode header MDL cache lock. The cache is filled
+        // when point-to-point mode is configured.
+        KeInitializeSpinLock(&adapter->PrefixMdlLock);
+
         // Allocate the adapter lock.
         NdisAllocateSpinLock(&adapter->AdapterLock);
 
         // NBL pool for making TAP receive indications.
         NdisZeroMemory(&nblPoolParameters, sizeof(NET_BUFFER_LIST_POOL_PARAMETERS));
 
-        // Initialize event used to determine when all receive NBLs have been returned.
-        NdisInitializeEvent(&adapter->ReceiveNblInFlightCountZeroEvent);
-
 
 
         // Add initial reference. Normally removed in AdapterHalt.
@@ -200,6 +210,34 @@ tapReadCurrentAddress(
     ETH_COPY_NETWORK_ADDRESS(CurrentAddress, Adapter->PermanentAddress);
 }
 
+// Read an optional integer setting. Returns DefaultValue if it is missing.
+static ULONG
+tapReadConfigurationUlong(
+    __in NDIS_HANDLE            ConfigurationHandle,
+    __in PNDIS_STRING           Keyword,
+    __in ULONG                  DefaultValue
+    )
+{
+    NDIS_STATUS                     status;
+    NDIS_CONFIGURATION_PARAMETER    *configParameter;
+
+    NdisReadConfiguration (
+        &status,
+        &configParameter,
+        ConfigurationHandle,
+        Keyword,
+        NdisParameterInteger
+        );
+
+    if (status == NDIS_STATUS_SUCCESS
+        && configParameter->ParameterType == NdisParameterInteger)
+    {
+        return configParameter->ParameterData.IntegerData;
+    }
+
+    return DefaultValue;
+}
+
 NDIS_STATUS
 tapReadConfiguration(
     __in PTAP_ADAPTER_CONTEXT     Adapter
@@ -208,6 +246,7 @@ tapReadConfiguration(
     NDIS_STATUS                 status = NDIS_STATUS_SUCCESS;
     NDIS_CONFIGURATION_OBJECT   configObject;
     NDIS_HANDLE                 configHandle;
+    ULONG                       i;
 
     DEBUGP (("[TAP] --> tapReadConfiguration\n"));
 
@@ -218,6 +257,31 @@ tapReadConfiguration(
     Adapter->MediaStateAlwaysConnected = FALSE;
     Adapter->LogicalMediaState = FALSE;
     Adapter->AllowNonAdmin = FALSE;
+    Adapter->FlowControlHighBytes = TAP_FLOW_CONTROL_HIGH_BYTES;
+    Adapter->FlowControlLowBytes = TAP_FLOW_CONTROL_LOW_BYTES;
+    Adapter->FlowControlHighPackets = 0;
+    Adapter->FlowControlLowPackets = 0;
+    Adapter->AqmParameters.Mode = TAP_AQM_MODE_NONE;
+    Adapter->AqmParameters.Target = TAP_AQM_DEFAULT_TARGET * 10;
+    Adapter->AqmParameters.Interval = TAP_AQM_DEFAULT_INTERVAL * 10;
+    Adapter->AqmParameters.MinBacklog = ETHERNET_PACKET_SIZE;
+    Adapter->SendQueueClasses = TAP_PACKET_QUEUE_MAX_CLASSES;
+    Adapter->SendQueueSchedule = TAP_PACKET_QUEUE_SCHEDULE_STRICT;
+    Adapter->SendQueueDscp = FALSE;
+    Adapter->SendQueueFlows = TAP_PACKET_QUEUE_DEFAULT_FLOWS;
+    Adapter->QueueCount = 1;
+    Adapter->WriteCopyThreshold = TAP_WRITE_COPY_THRESHOLD;
+    Adapter->ReceiveSideScaling = TRUE;
+    Adapter->LsoV2IPv4 = TRUE;
+    Adapter->LsoV2IPv6 = TRUE;
+    Adapter->RscIPv4 = TRUE;
+    Adapter->RscIPv6 = TRUE;
+
+    for(i = 0; i < TAP_CSUM_COUNT; ++i)
+    {
+        Adapter->ChecksumOffload[i] = TAP_CSUM_TX | TAP_CSUM_RX;
+    }
+
     //
     // Open the registry for this adapter to read advanced
     // configuration parameters stored by the INF file.
@@ -318,6 +382,32 @@ tapReadConfiguration(
 #if ENABLE_NONADMIN
             NDIS_STRING allowNonAdminKey = NDIS_STRING_CONST("AllowNonAdmin");
 #endif
+            NDIS_STRING flowControlHighBytesKey = NDIS_STRING_CONST("FlowControlHighBytes");
+            NDIS_STRING flowControlLowBytesKey = NDIS_STRING_CONST("FlowControlLowBytes");
+            NDIS_STRING flowControlHighPacketsKey = NDIS_STRING_CONST("FlowControlHighPackets");
+            NDIS_STRING flowControlLowPacketsKey = NDIS_STRING_CONST("FlowControlLowPackets");
+            NDIS_STRING aqmModeKey = NDIS_STRING_CONST("AqmMode");
+            NDIS_STRING aqmTargetKey = NDIS_STRING_CONST("AqmTarget");
+            NDIS_STRING aqmIntervalKey = NDIS_STRING_CONST("AqmInterval");
+            NDIS_STRING sendQueueClassesKey = NDIS_STRING_CONST("SendQueueClasses");
+            NDIS_STRING sendQueueScheduleKey = NDIS_STRING_CONST("SendQueueSchedule");
+            NDIS_STRING sendQueueDscpKey = NDIS_STRING_CONST("SendQueueDscp");
+            NDIS_STRING sendQueueFlowsKey = NDIS_STRING_CONST("SendQueueFlows");
+            NDIS_STRING maxQueuesKey = NDIS_STRING_CONST("MaxQueues");
+            NDIS_STRING writeCopyThresholdKey = NDIS_STRING_CONST("WriteCopyThreshold");
+            NDIS_STRING rssKey = NDIS_STRING_CONST("*RSS");
+            NDIS_STRING lsoV2IPv4Key = NDIS_STRING_CONST("*LsoV2IPv4");
+            NDIS_STRING lsoV2IPv6Key = NDIS_STRING_CONST("*LsoV2IPv6");
+            NDIS_STRING rscIPv4Key = NDIS_STRING_CONST("*RscIPv4");
+            NDIS_STRING rscIPv6Key = NDIS_STRING_CONST("*RscIPv6");
+            NDIS_STRING checksumKeys[TAP_CSUM_COUNT] =
+            {
+                NDIS_STRING_CONST("*IPChecksumOffloadIPv4"),
+                NDIS_STRING_CONST("*TCPChecksumOffloadIPv4"),
+                NDIS_STRING_CONST("*UDPChecksumOffloadIPv4"),
+                NDIS_STRING_CONST("*TCPChecksumOffloadIPv6"),
+                NDIS_STRING_CONST("*UDPChecksumOffloadIPv6"),
+            };
 
             // Read MTU from the registry.
             NdisReadConfiguration (
@@ -332,7 +422,7 @@ tapReadConfiguration(
             {
                 if (configParameter->ParameterType == NdisParameterInteger)
                 {
-                    int mtu = configParameter->ParameterData.IntegerData;
+                    ULONG mtu = configParameter->ParameterData.IntegerData;
 
                     if(mtu == 0)
                     {
@@ -442,6 +532,287 @@ tapReadConfiguration(
                 }
             }
 #endif
+
+            // Read optional flow control watermarks from registry.
+            Adapter->FlowControlHighBytes = tapReadConfigurationUlong(
+                configHandle,
+                &flowControlHighBytesKey,
+                Adapter->FlowControlHighBytes
+                );
+
+            Adapter->FlowControlLowBytes = tapReadConfigurationUlong(
+                configHandle,
+                &flowControlLowBytesKey,
+                Adapter->FlowControlLowBytes
+                );
+
+            Adapter->FlowControlHighPackets = tapReadConfigurationUlong(
+                configHandle,
+                &flowControlHighPacketsKey,
+                Adapter->FlowControlHighPackets
+                );
+
+            Adapter->FlowControlLowPackets = tapReadConfigurationUlong(
+                configHandle,
+                &flowControlLowPacketsKey,
+                Adapter->FlowControlLowPackets
+                );
+
+            // Sanity check
+            if (Adapter->FlowControlHighBytes == 0)
+            {
+                Adapter->FlowControlHighBytes = TAP_FLOW_CONTROL_HIGH_BYTES;
+            }
+            else if (Adapter->FlowControlHighBytes > MAXLONG)
+            {
+                Adapter->FlowControlHighBytes = MAXLONG;
+            }
+
+            if (Adapter->FlowControlHighPackets > MAXLONG)
+            {
+                Adapter->FlowControlHighPackets = MAXLONG;
+            }
+
+            if (Adapter->FlowControlLowBytes > Adapter->FlowControlHighBytes)
+            {
+                Adapter->FlowControlLowBytes = Adapter->FlowControlHighBytes;
+            }
+
+            if (Adapter->FlowControlLowPackets > Adapter->FlowControlHighPackets)
+            {
+                Adapter->FlowControlLowPackets = Adapter->FlowControlHighPackets;
+            }
+
+            DEBUGP (("[%s] Flow control watermarks: bytes %d/%d, packets %d/%d\n",
+                MINIPORT_INSTANCE_ID (Adapter),
+                Adapter->FlowControlHighBytes,
+                Adapter->FlowControlLowBytes,
+                Adapter->FlowControlHighPackets,
+                Adapter->FlowControlLowPackets
+                ));
+
+            // Read optional active queue management settings from registry.
+            // Target and interval are configured in microseconds.
+            Adapter->AqmParameters.Mode = tapReadConfigurationUlong(
+                configHandle,
+                &aqmModeKey,
+                TAP_AQM_MODE_NONE
+                );
+
+            Adapter->AqmParameters.Target = 10 * (ULONG64 )tapReadConfigurationUlong(
+                configHandle,
+                &aqmTargetKey,
+                TAP_AQM_DEFAULT_TARGET
+                );
+
+            Adapter->AqmParameters.Interval = 10 * (ULONG64 )tapReadConfigurationUlong(
+                configHandle,
+                &aqmIntervalKey,
+                TAP_AQM_DEFAULT_INTERVAL
+                );
+
+            // Sanity check
+            if (Adapter->AqmParameters.Mode > TAP_AQM_MODE_MAX)
+            {
+                Adapter->AqmParameters.Mode = TAP_AQM_MODE_NONE;
+            }
+
+            if (Adapter->AqmParameters.Target == 0
+                || Adapter->AqmParameters.Interval < Adapter->AqmParameters.Target)
+            {
+                Adapter->AqmParameters.Target = TAP_AQM_DEFAULT_TARGET * 10;
+                Adapter->AqmParameters.Interval = TAP_AQM_DEFAULT_INTERVAL * 10;
+            }
+
+            // Never drop the last full-size frame of a flow.
+            Adapter->AqmParameters.MinBacklog = ETHERNET_HEADER_SIZE + Adapter->MtuSize;
+
+            DEBUGP (("[%s] AQM mode %d, target %I64u us, interval %I64u us\n",
+                MINIPORT_INSTANCE_ID (Adapter),
+                Adapter->AqmParameters.Mode,
+                Adapter->AqmParameters.Target / 10,
+                Adapter->AqmParameters.Interval / 10
+                ));
+
+            // Read priority scheduling of frames to userspace from registry.
+            Adapter->SendQueueClasses = tapReadConfigurationUlong(
+                configHandle,
+                &sendQueueClassesKey,
+                TAP_PACKET_QUEUE_MAX_CLASSES
+                );
+
+            Adapter->SendQueueSchedule = tapReadConfigurationUlong(
+                configHandle,
+                &sendQueueScheduleKey,
+                TAP_PACKET_QUEUE_SCHEDULE_STRICT
+                );
+
+            Adapter->SendQueueDscp = tapReadConfigurationUlong(
+                configHandle,
+                &sendQueueDscpKey,
+                0
+                ) ? TRUE : FALSE;
+
+            // Sanity check
+            if (Adapter->SendQueueClasses == 0)
+            {
+                Adapter->SendQueueClasses = 1;
+            }
+            else if (Adapter->SendQueueClasses > TAP_PACKET_QUEUE_MAX_CLASSES)
+            {
+                Adapter->SendQueueClasses = TAP_PACKET_QUEUE_MAX_CLASSES;
+            }
+
+            if (Adapter->SendQueueSchedule > TAP_PACKET_QUEUE_SCHEDULE_MAX)
+            {
+                Adapter->SendQueueSchedule = TAP_PACKET_QUEUE_SCHEDULE_STRICT;
+            }
+
+            DEBUGP (("[%s] Send queue classes %d, schedule %d, DSCP %d\n",
+                MINIPORT_INSTANCE_ID (Adapter),
+                Adapter->SendQueueClasses,
+                Adapter->SendQueueSchedule,
+                Adapter->SendQueueDscp
+                ));
+
+            // Read number of flow queues for frames to userspace from registry.
+            Adapter->SendQueueFlows = tapReadConfigurationUlong(
+                configHandle,
+                &sendQueueFlowsKey,
+                TAP_PACKET_QUEUE_DEFAULT_FLOWS
+                );
+
+            // Sanity check
+            if (Adapter->SendQueueFlows == 0)
+            {
+                Adapter->SendQueueFlows = 1;
+            }
+            else if (Adapter->SendQueueFlows > TAP_PACKET_QUEUE_MAX_FLOWS)
+            {
+                Adapter->SendQueueFlows = TAP_PACKET_QUEUE_MAX_FLOWS;
+            }
+
+            DEBUGP (("[%s] Send queue flows %d\n",
+                MINIPORT_INSTANCE_ID (Adapter),
+                Adapter->SendQueueFlows
+                ));
+
+            // Read number of TAP device handles (multi-queue mode) from registry.
+            Adapter->QueueCount = tapReadConfigurationUlong(
+                configHandle,
+                &maxQueuesKey,
+                1
+                );
+
+            // Sanity check
+            if (Adapter->QueueCount == 0)
+            {
+                Adapter->QueueCount = 1;
+            }
+            else if (Adapter->QueueCount > TAP_MAX_QUEUES)
+            {
+                Adapter->QueueCount = TAP_MAX_QUEUES;
+            }
+
+            DEBUGP (("[%s] Max queues %d\n",
+                MINIPORT_INSTANCE_ID (Adapter),
+                Adapter->QueueCount
+                ));
+
+            // Read length up to which written frames are copied from registry.
+            Adapter->WriteCopyThreshold = tapReadConfigurationUlong(
+                configHandle,
+                &writeCopyThresholdKey,
+                TAP_WRITE_COPY_THRESHOLD
+                );
+
+            // Sanity check
+            if (Adapter->WriteCopyThreshold > TAP_WRITE_COPY_THRESHOLD_MAX)
+            {
+                Adapter->WriteCopyThreshold = TAP_WRITE_COPY_THRESHOLD_MAX;
+            }
+
+            DEBUGP (("[%s] Write copy threshold %d\n",
+                MINIPORT_INSTANCE_ID (Adapter),
+                Adapter->WriteCopyThreshold
+                ));
+
+            // Read standardized receive side scaling keyword from registry.
+            Adapter->ReceiveSideScaling = tapReadConfigurationUlong(
+                configHandle,
+                &rssKey,
+                1
+                ) ? TRUE : FALSE;
+
+            DEBUGP (("[%s] Receive side scaling %d\n",
+                MINIPORT_INSTANCE_ID (Adapter),
+                Adapter->ReceiveSideScaling
+                ));
+
+            // Read standardized large send offload keywords from registry.
+            Adapter->LsoV2IPv4 = tapReadConfigurationUlong(
+                configHandle,
+                &lsoV2IPv4Key,
+                1
+                ) ? TRUE : FALSE;
+
+            Adapter->LsoV2IPv6 = tapReadConfigurationUlong(
+                configHandle,
+                &lsoV2IPv6Key,
+                1
+                ) ? TRUE : FALSE;
+
+            DEBUGP (("[%s] LSOv2 IPv4 %d IPv6 %d\n",
+                MINIPORT_INSTANCE_ID (Adapter),
+                Adapter->LsoV2IPv4,
+                Adapter->LsoV2IPv6
+                ));
+
+            // Read standardized checksum offload keywords from registry.
+            for(i = 0; i < TAP_CSUM_COUNT; ++i)
+            {
+                Adapter->ChecksumOffload[i] = (UCHAR )(tapReadConfigurationUlong(
+                    configHandle,
+                    &checksumKeys[i],
+                    TAP_CSUM_TX | TAP_CSUM_RX
+                    ) & (TAP_CSUM_TX | TAP_CSUM_RX));
+            }
+
+            DEBUGP (("[%s] Checksum offload IP %d TCPv4 %d UDPv4 %d TCPv6 %d UDPv6 %d\n",
+                MINIPORT_INSTANCE_ID (Adapter),
+                Adapter->ChecksumOffload[TAP_CSUM_IPV4],
+                Adapter->ChecksumOffload[TAP_CSUM_TCPV4],
+                Adapter->ChecksumOffload[TAP_CSUM_UDPV4],
+                Adapter->ChecksumOffload[TAP_CSUM_TCPV6],
+                Adapter->ChecksumOffload[TAP_CSUM_UDPV6]
+                ));
+
+            // Read standardized receive segment coalescing keywords from
+            // registry.
+            Adapter->RscIPv4 = tapReadConfigurationUlong(
+                configHandle,
+                &rscIPv4Key,
+                1
+                ) ? TRUE : FALSE;
+
+            Adapter->RscIPv6 = tapReadConfigurationUlong(
+                configHandle,
+                &rscIPv6Key,
+                1
+                ) ? TRUE : FALSE;
+
+            // Coalesced frames are only understood from NDIS 6.30 on.
+            if(GlobalData.NdisVersion < NDIS_RUNTIME_VERSION_630)
+            {
+                Adapter->RscIPv4 = FALSE;
+                Adapter->RscIPv6 = FALSE;
+            }
+
+            DEBUGP (("[%s] RSC IPv4 %d IPv6 %d\n",
+                MINIPORT_INSTANCE_ID (Adapter),
+                Adapter->RscIPv4,
+                Adapter->RscIPv6
+                ));
         }
 
         // Close the configuration handle.
@@ -626,6 +997,10 @@ AdapterCreate(
         NDIS_MINIPORT_ADAPTER_REGISTRATION_ATTRIBUTES regAttributes = {0};
         NDIS_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES genAttributes = {0};
         NDIS_PM_CAPABILITIES pmCapabilities = {0};
+        NDIS_RECEIVE_SCALE_CAPABILITIES rssCapabilities = {0};
+        NDIS_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES offloadAttributes = {0};
+        NDIS_OFFLOAD hardwareOffload;
+        NDIS_OFFLOAD currentOffload;
 
         //
         // Allocate adapter context structure and initialize all the
@@ -657,6 +1032,43 @@ AdapterCreate(
         //
         status = tapReadConfiguration(adapter);
 
+        //
+        // TAP packet size classes depend on the configured MTU.
+        //
+        tapPacketPoolInitialize(
+            &adapter->SendPacketPool,
+            adapter->MiniportAdapterHandle,
+            adapter->MtuSize
+            );
+
+        //
+        // Inject buffers are sized for the configured MTU too.
+        //
+        tapInjectCacheInitialize(adapter);
+
+        //
+        // Allocate one queue per TAP device handle.
+        //
+        adapter->FlowHashSeed = KeQueryPerformanceCounter(NULL).LowPart;
+
+        if(tapAdapterQueuesAllocate(adapter) != NDIS_STATUS_SUCCESS)
+        {
+            DEBUGP (("[TAP] Couldn't allocate adapter queues\n"));
+            status = NDIS_STATUS_RESOURCES;
+            break;
+        }
+
+        //
+        // Set up per-processor indication for receive side scaling.
+        //
+        if(adapter->ReceiveSideScaling
+            && tapRssInitialize(adapter) != NDIS_STATUS_SUCCESS)
+        {
+            DEBUGP (("[TAP] Couldn't allocate RSS processors\n"));
+            status = NDIS_STATUS_RESOURCES;
+            break;
+        }
+
         //
         // Default priority behavior
         //
@@ -720,9 +1132,10 @@ AdapterCreate(
 
         //
         // Specifiy the maximum network frame size, in bytes, that the NIC
-        // supports excluding the header.
+        // supports excluding the header. This is the configured MTU, which
+        // may be a jumbo size.
         //
-        genAttributes.MtuSize = TAP_FRAME_MAX_DATA_SIZE;
+        genAttributes.MtuSize = adapter->MtuSize;
         genAttributes.MaxXmitLinkSpeed = TAP_XMIT_SPEED;
         genAttributes.XmitLinkSpeed = TAP_XMIT_SPEED;
         genAttributes.MaxRcvLinkSpeed = TAP_RECV_SPEED;
@@ -762,7 +1175,7 @@ AdapterCreate(
         // packets on every indication. Consequently, this value is identical
         // to that returned for OID_GEN_RECEIVE_BLOCK_SIZE.
         //
-        genAttributes.LookaheadSize = TAP_MAX_LOOKAHEAD;
+        genAttributes.LookaheadSize = adapter->MtuSize;
         genAttributes.MacOptions = TAP_MAC_OPTIONS;
         genAttributes.SupportedPacketFilters = TAP_SUPPORTED_FILTERS;
 
@@ -790,7 +1203,41 @@ AdapterCreate(
         //
         ETH_COPY_NETWORK_ADDRESS(genAttributes.CurrentMacAddress, adapter->CurrentAddress);
 
-        genAttributes.RecvScaleCapabilities = NULL;
+        //
+        // Advertise RSS. Frames are hashed and steered in software, so
+        // there is one receive queue per processor and classification
+        // happens at DPC level.
+        //
+        if(adapter->Rss.Processors != NULL)
+        {
+            rssCapabilities.Header.Type = NDIS_OBJECT_TYPE_RSS_CAPABILITIES;
+
+            if (GlobalData.NdisVersion < NDIS_RUNTIME_VERSION_630)
+            {
+                rssCapabilities.Header.Size = NDIS_SIZEOF_RECEIVE_SCALE_CAPABILITIES_REVISION_1;
+                rssCapabilities.Header.Revision = NDIS_RECEIVE_SCALE_CAPABILITIES_REVISION_1;
+            }
+            else
+            {
+                rssCapabilities.Header.Size = NDIS_SIZEOF_RECEIVE_SCALE_CAPABILITIES_REVISION_2;
+                rssCapabilities.Header.Revision = NDIS_RECEIVE_SCALE_CAPABILITIES_REVISION_2;
+                rssCapabilities.NumberOfIndirectionTableEntries = TAP_RSS_MAX_TABLE_ENTRIES;
+            }
+
+            rssCapabilities.CapabilitiesFlags = NDIS_RSS_CAPS_CLASSIFICATION_AT_DPC
+                | NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV4
+                | NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV6
+                | NdisHashFunctionToeplitz;
+            rssCapabilities.NumberOfInterruptMessages = 1;
+            rssCapabilities.NumberOfReceiveQueues = adapter->Rss.ProcessorCount;
+
+            genAttributes.RecvScaleCapabilities = &rssCapabilities;
+        }
+        else
+        {
+            genAttributes.RecvScaleCapabilities = NULL;
+        }
+
         genAttributes.AccessType = TAP_ACCESS_TYPE;
         genAttributes.DirectionType = TAP_DIRECTION_TYPE;
         genAttributes.ConnectionType = TAP_CONNECTION_TYPE;
@@ -835,6 +1282,29 @@ AdapterCreate(
             break;
         }
 
+        //
+        // Advertise task offloads.
+        //
+        tapAdapterGetOffload(adapter,TRUE,&hardwareOffload);
+        tapAdapterGetOffload(adapter,FALSE,&currentOffload);
+
+        offloadAttributes.Header.Type = NDIS_OBJECT_TYPE_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES;
+        offloadAttributes.Header.Size = NDIS_SIZEOF_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES_REVISION_1;
+        offloadAttributes.Header.Revision = NDIS_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES_REVISION_1;
+        offloadAttributes.DefaultOffloadConfiguration = &currentOffload;
+        offloadAttributes.HardwareOffloadCapabilities = &hardwareOffload;
+
+        status = NdisMSetMiniportAttributes(
+                    MiniportAdapterHandle,
+                    (PNDIS_MINIPORT_ADAPTER_ATTRIBUTES)&offloadAttributes
+                    );
+
+        if (status != NDIS_STATUS_SUCCESS)
+        {
+            DEBUGP (("[TAP] NdisMSetMiniportAttributes (offload) failed; Status 0x%08x\n",status));
+            break;
+        }
+
         //
         // Create the Win32 device I/O interface.
         //
@@ -935,6 +1405,9 @@ Return Value:
     adapter->Locked.AdapterState = MiniportHaltedState;
     tapAdapterReleaseLock(adapter,FALSE);
 
+    // Discard frames queued while paused. They were never indicated.
+    tapFlushPausedNetBufferLists(adapter,FALSE);
+
     // Remove this adapter from the global adapter list.
     tapAdapterContextRemoveFromGlobalList(adapter);
 
@@ -942,6 +1415,9 @@ Return Value:
 
     // TODO!!! More...
 
+    // Release shared-memory rings if the device is still open.
+    tapRingsUnregister(adapter,NULL);
+
     //
     // Destroy the TAP Win32 device.
     //
@@ -960,59 +1436,62 @@ Return Value:
 }
 
 VOID
-tapWaitForReceiveNblInFlightCountZeroEvent(
-    __in PTAP_ADAPTER_CONTEXT     Adapter
+tapAdapterPauseComplete(
+    __in PTAP_ADAPTER_CONTEXT     Adapter,
+    __in BOOLEAN                  Pended
     )
+/*++
+
+Routine Description:
+
+    Enter the Paused state once every in-flight receive NBL has been
+    returned, and record how long the pause took.
+
+    AdapterPause calls this if no NBL is in flight when it drops the
+    running bias of ReceiveNblInFlightCount. Otherwise the return of the
+    last NBL calls it with Pended TRUE, and the pause is completed with
+    NdisMPauseComplete. No NBL is counted in flight while pausing, so
+    this happens once per pause.
+
+Arguments:
+
+    Adapter     Pointer to the Adapter
+    Pended      TRUE if AdapterPause returned NDIS_STATUS_PENDING
+
+--*/
 {
-    LONG    nblCount;
+    ULONGLONG   latency;
 
-    //
-    // Wait until higher-level protocol has returned all NBLs
-    // to the driver.
-    //
+    tapAdapterAcquireLock(Adapter,FALSE);
 
-    // Add one NBL "bias" to insure allow event to be reset safely.
-    nblCount = NdisInterlockedIncrement(&Adapter->ReceiveNblInFlightCount);
-    ASSERT(nblCount > 0 );
-    NdisResetEvent(&Adapter->ReceiveNblInFlightCountZeroEvent);
+    ASSERT(Adapter->Locked.AdapterState == MiniportPausingState);
+    Adapter->Locked.AdapterState = MiniportPausedState;
 
-    //
-    // Now remove the bias and wait for the ReceiveNblInFlightCountZeroEvent
-    // if the count returned is not zero.
-    //
-    nblCount = NdisInterlockedDecrement(&Adapter->ReceiveNblInFlightCount);
-    ASSERT(nblCount >= 0);
+    latency = KeQueryInterruptTime() - Adapter->Locked.PauseStartTime;
+    Adapter->Locked.LastPauseLatency = latency;
 
-    if(nblCount)
+    if(latency > Adapter->Locked.MaxPauseLatency)
     {
-        LARGE_INTEGER   startTime, currentTime;
+        Adapter->Locked.MaxPauseLatency = latency;
+    }
 
-        NdisGetSystemUpTimeEx(&startTime);
+    ++Adapter->Locked.PauseCount;
 
-        for (;;)
-        {
-            BOOLEAN waitResult = NdisWaitEvent(
-                &Adapter->ReceiveNblInFlightCountZeroEvent, 
-                TAP_WAIT_POLL_LOOP_TIMEOUT
-                );
+    if(Pended)
+    {
+        ++Adapter->Locked.PendedPauseCount;
+    }
 
-            NdisGetSystemUpTimeEx(&currentTime);
+    tapAdapterReleaseLock(Adapter,FALSE);
 
-            if (waitResult)
-            {
-                break;
-            }
+    DEBUGP (("[%s] Miniport State: Paused after %d us\n",
+        MINIPORT_INSTANCE_ID (Adapter),
+        (ULONG )(latency / 10)
+        ));
 
-            DEBUGP (("[%s] Waiting for %d in-flight receive NBLs to be returned.\n",
-                MINIPORT_INSTANCE_ID (Adapter),
-                Adapter->ReceiveNblInFlightCount
-                ));
-        }
-
-        DEBUGP (("[%s] Waited %d ms for all in-flight NBLs to be returned.\n",
-            MINIPORT_INSTANCE_ID (Adapter),
-            (currentTime.LowPart - startTime.LowPart)
-            ));
+    if(Pended)
+    {
+        NdisMPauseComplete(Adapter->MiniportAdapterHandle);
     }
 }
 
@@ -1076,22 +1555,40 @@ Return Value:
 
     tapAdapterAcquireLock(adapter,FALSE);
     adapter->Locked.AdapterState = MiniportPausingState;
+    adapter->Locked.PauseStartTime = KeQueryInterruptTime();
     tapAdapterReleaseLock(adapter,FALSE);
 
     //
     // Stop the flow of network data through the receive path
     // ------------------------------------------------------
-    // In the Pausing and Paused state tapAdapterSendAndReceiveReady
+    // In the Pausing and Paused state tapAdapterTryReferenceReceive
     // will prevent new calls to NdisMIndicateReceiveNetBufferLists
-    // to indicate additional receive NBLs to the host.
+    // to indicate additional receive NBLs to the host. Frames written
+    // from now on are copied, their write IRPs completed at once, and
+    // queued until AdapterRestart.
     //
     // However, there may be some in-flight NBLs owned by the driver
     // that have been indicated to the host but have not yet been
-    // returned.
+    // returned. Each holds a reference on the write IRP it was built
+    // from, and the IRP completes when the last of them comes back.
     //
-    // Wait here for all in-flight receive indications to be returned.
+    // Drop the running bias. If NBLs remain in flight, the return of
+    // the last one completes the pause.
     //
-    tapWaitForReceiveNblInFlightCountZeroEvent(adapter);
+    if(NdisInterlockedDecrement(&adapter->ReceiveNblInFlightCount) == 0)
+    {
+        tapAdapterPauseComplete(adapter,FALSE);
+        status = NDIS_STATUS_SUCCESS;
+    }
+    else
+    {
+        DEBUGP (("[%s] Pause pending on %d in-flight receive NBLs\n",
+            MINIPORT_INSTANCE_ID (adapter),
+            adapter->ReceiveNblInFlightCount
+            ));
+
+        status = NDIS_STATUS_PENDING;
+    }
 
     //
     // Stop the flow of network data through the send path
@@ -1109,15 +1606,6 @@ Return Value:
     //
     // So, nothing to do here for the send path for now...
 
-    status = NDIS_STATUS_SUCCESS;
-
-    // Enter the Paused state.
-    DEBUGP (("[TAP] Miniport State: Paused\n"));
-
-    tapAdapterAcquireLock(adapter,FALSE);
-    adapter->Locked.AdapterState = MiniportPausedState;
-    tapAdapterReleaseLock(adapter,FALSE);
-
     DEBUGP (("[TAP] <-- AdapterPause; status = %8.8X\n",status));
 
     return status;
@@ -1175,8 +1663,15 @@ Return Value:
     // Enter the Restarting state.
     DEBUGP (("[TAP] Miniport State: Restarting\n"));
 
+    //
+    // Restore the running bias AdapterPause dropped, under the lock so
+    // it is in place before any NBL can be counted in flight. Nothing is
+    // in flight here, so the count cannot drop to zero again before the
+    // next pause.
+    //
     tapAdapterAcquireLock(adapter,FALSE);
     adapter->Locked.AdapterState = MiniportRestartingState;
+    NdisInterlockedIncrement(&adapter->ReceiveNblInFlightCount);
     tapAdapterReleaseLock(adapter,FALSE);
 
     status = NDIS_STATUS_SUCCESS;
@@ -1189,6 +1684,9 @@ Return Value:
         tapAdapterAcquireLock(adapter,FALSE);
         adapter->Locked.AdapterState = MiniportRunning;
         tapAdapterReleaseLock(adapter,FALSE);
+
+        // Indicate frames written and replies built while paused.
+        tapFlushPausedNetBufferLists(adapter,TRUE);
     }
     else
     {
@@ -1197,6 +1695,7 @@ Return Value:
 
         tapAdapterAcquireLock(adapter,FALSE);
         adapter->Locked.AdapterState = MiniportPausedState;
+        NdisInterlockedDecrement(&adapter->ReceiveNblInFlightCount);
         tapAdapterReleaseLock(adapter,FALSE);
     }
 
@@ -1205,6 +1704,238 @@ Return Value:
     return status;
 }
 
+NDIS_STATUS
+tapAdapterQueuesAllocate(
+    __in PTAP_ADAPTER_CONTEXT     Adapter
+    )
+/*++
+
+Routine Description:
+
+    Allocate and initialize QueueCount per-handle queues.
+
+    Each queue sorts frames to userspace into priority classes and
+    spreads them over flow queues, giving each flow one full-size frame
+    per round.
+
+Arguments:
+
+    Adapter              Pointer to our adapter context
+
+Return Value:
+
+    NDIS_STATUS_SUCCESS or NDIS_STATUS_RESOURCES.
+
+--*/
+{
+    ULONG   i;
+
+    Adapter->Queues = (PTAP_QUEUE )NdisAllocateMemoryWithTagPriority(
+                            Adapter->MiniportAdapterHandle,
+                            Adapter->QueueCount * sizeof(TAP_QUEUE),
+                            TAP_QUEUE_TAG,
+                            NormalPoolPriority
+                            );
+
+    if(Adapter->Queues == NULL)
+    {
+        return NDIS_STATUS_RESOURCES;
+    }
+
+    NdisZeroMemory(Adapter->Queues,Adapter->QueueCount * sizeof(TAP_QUEUE));
+
+    for(i = 0; i < Adapter->QueueCount; ++i)
+    {
+        PTAP_QUEUE  queue = &Adapter->Queues[i];
+
+        // Initialize cancel-safe IRP queue
+        tapIrpCsqInitialize(&queue->PendingReadIrpQueue);
+
+        // Initialize TAP send packet queue.
+        tapPacketQueueInitialize(&queue->SendPacketQueue);
+
+        if(tapPacketQueueConfigure(
+                &queue->SendPacketQueue,
+                Adapter->MiniportAdapterHandle,
+                Adapter->SendQueueClasses,
+                Adapter->SendQueueSchedule,
+                Adapter->SendQueueFlows,
+                ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE + Adapter->MtuSize
+                ) != NDIS_STATUS_SUCCESS)
+        {
+            // tapAdapterContextFree releases the queues configured so far.
+            return NDIS_STATUS_RESOURCES;
+        }
+    }
+
+    return NDIS_STATUS_SUCCESS;
+}
+
+VOID
+tapAdapterUpdateQueueSteering(
+    __in PTAP_ADAPTER_CONTEXT     Adapter
+    )
+/*++
+
+Routine Description:
+
+    Rebuild the table that steers frames to userspace to open queues.
+
+    Slots are dealt out round robin over the queues whose handle is open
+    and not cleaned up, so each open queue gets an equal share of flows.
+    Called whenever a handle is opened or cleaned up.
+
+    Runs at IRQL <= DISPATCH_LEVEL
+
+Arguments:
+
+    Adapter              Pointer to our adapter context
+
+Return Value:
+
+    None.
+
+--*/
+{
+    KIRQL   irql;
+    UCHAR   open[TAP_MAX_QUEUES];
+    ULONG   openCount = 0;
+    ULONG   i;
+
+    KeAcquireSpinLock(&Adapter->QueueSteeringLock,&irql);
+
+    for(i = 0; i < Adapter->QueueCount; ++i)
+    {
+        if(Adapter->Queues[i].Open)
+        {
+            open[openCount++] = (UCHAR )i;
+        }
+    }
+
+    if(openCount == 0)
+    {
+        // Nothing is open. Keep frames on queue 0 to be flushed.
+        open[openCount++] = 0;
+    }
+
+    for(i = 0; i < TAP_QUEUE_STEERING_SIZE; ++i)
+    {
+        Adapter->QueueSteering[i] = open[i % openCount];
+    }
+
+    KeReleaseSpinLock(&Adapter->QueueSteeringLock,irql);
+}
+
+static ULONG
+tapAdapterChecksumOffload(
+    __in PTAP_ADAPTER_CONTEXT     Adapter,
+    __in BOOLEAN                  Hardware,
+    __in ULONG                    Checksum,
+    __in ULONG                    Direction
+    )
+{
+    if(Hardware || (Adapter->ChecksumOffload[Checksum] & Direction))
+    {
+        return NDIS_OFFLOAD_SUPPORTED;
+    }
+
+    return NDIS_OFFLOAD_NOT_SUPPORTED;
+}
+
+VOID
+tapAdapterGetOffload(
+    __in PTAP_ADAPTER_CONTEXT     Adapter,
+    __in BOOLEAN                  Hardware,
+    __out PNDIS_OFFLOAD           Offload
+    )
+/*++
+
+Routine Description:
+
+    Describe the task offloads of the adapter.
+
+    LSOv2 and TCP/UDP checksums are offered. Each is passed to userspace
+    that selected it and done in the driver otherwise, so the capability
+    does not depend on what userspace is attached. On receive, checksums
+    are only reported as validated when userspace vouches for them.
+
+    RSC is offered from NDIS 6.30 on, which added it to NDIS_OFFLOAD.
+
+Arguments:
+
+    Adapter              Pointer to our adapter context
+    Hardware             TRUE for what the adapter supports, FALSE for what
+                         is currently enabled
+    Offload              Receives the offload description
+
+Return Value:
+
+    None.
+
+--*/
+{
+    NdisZeroMemory(Offload,sizeof(NDIS_OFFLOAD));
+
+    Offload->Header.Type = NDIS_OBJECT_TYPE_OFFLOAD;
+
+    if(GlobalData.NdisVersion < NDIS_RUNTIME_VERSION_630)
+    {
+        Offload->Header.Size = NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_1;
+        Offload->Header.Revision = NDIS_OFFLOAD_REVISION_1;
+    }
+    else
+    {
+        Offload->Header.Size = NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_3;
+        Offload->Header.Revision = NDIS_OFFLOAD_REVISION_3;
+
+        Offload->Rsc.IPv4.Enabled = (Hardware || Adapter->RscIPv4);
+        Offload->Rsc.IPv6.Enabled = (Hardware || Adapter->RscIPv6);
+    }
+
+    Offload->Checksum.IPv4Transmit.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+    Offload->Checksum.IPv4Transmit.IpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv4Transmit.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv4Transmit.IpChecksum = tapAdapterChecksumOffload(Adapter,Hardware,TAP_CSUM_IPV4,TAP_CSUM_TX);
+    Offload->Checksum.IPv4Transmit.TcpChecksum = tapAdapterChecksumOffload(Adapter,Hardware,TAP_CSUM_TCPV4,TAP_CSUM_TX);
+    Offload->Checksum.IPv4Transmit.UdpChecksum = tapAdapterChecksumOffload(Adapter,Hardware,TAP_CSUM_UDPV4,TAP_CSUM_TX);
+
+    Offload->Checksum.IPv4Receive.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+    Offload->Checksum.IPv4Receive.IpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv4Receive.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv4Receive.IpChecksum = tapAdapterChecksumOffload(Adapter,Hardware,TAP_CSUM_IPV4,TAP_CSUM_RX);
+    Offload->Checksum.IPv4Receive.TcpChecksum = tapAdapterChecksumOffload(Adapter,Hardware,TAP_CSUM_TCPV4,TAP_CSUM_RX);
+    Offload->Checksum.IPv4Receive.UdpChecksum = tapAdapterChecksumOffload(Adapter,Hardware,TAP_CSUM_UDPV4,TAP_CSUM_RX);
+
+    // Extension headers are not parsed, see tapChecksumParseFrame.
+    Offload->Checksum.IPv6Transmit.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+    Offload->Checksum.IPv6Transmit.IpExtensionHeadersSupported = NDIS_OFFLOAD_NOT_SUPPORTED;
+    Offload->Checksum.IPv6Transmit.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv6Transmit.TcpChecksum = tapAdapterChecksumOffload(Adapter,Hardware,TAP_CSUM_TCPV6,TAP_CSUM_TX);
+    Offload->Checksum.IPv6Transmit.UdpChecksum = tapAdapterChecksumOffload(Adapter,Hardware,TAP_CSUM_UDPV6,TAP_CSUM_TX);
+
+    Offload->Checksum.IPv6Receive.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+    Offload->Checksum.IPv6Receive.IpExtensionHeadersSupported = NDIS_OFFLOAD_NOT_SUPPORTED;
+    Offload->Checksum.IPv6Receive.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv6Receive.TcpChecksum = tapAdapterChecksumOffload(Adapter,Hardware,TAP_CSUM_TCPV6,TAP_CSUM_RX);
+    Offload->Checksum.IPv6Receive.UdpChecksum = tapAdapterChecksumOffload(Adapter,Hardware,TAP_CSUM_UDPV6,TAP_CSUM_RX);
+
+    if(Hardware || Adapter->LsoV2IPv4)
+    {
+        Offload->LsoV2.IPv4.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+        Offload->LsoV2.IPv4.MaxOffLoadSize = TAP_LSO_MAX_OFFLOAD_SIZE;
+        Offload->LsoV2.IPv4.MinSegmentCount = TAP_LSO_MIN_SEGMENT_COUNT;
+    }
+
+    if(Hardware || Adapter->LsoV2IPv6)
+    {
+        Offload->LsoV2.IPv6.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+        Offload->LsoV2.IPv6.MaxOffLoadSize = TAP_LSO_MAX_OFFLOAD_SIZE;
+        Offload->LsoV2.IPv6.MinSegmentCount = TAP_LSO_MIN_SEGMENT_COUNT;
+        Offload->LsoV2.IPv6.IpExtensionHeadersSupported = NDIS_OFFLOAD_NOT_SUPPORTED;
+        Offload->LsoV2.IPv6.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    }
+}
+
 BOOLEAN
 tapAdapterReadAndWriteReady(
     __in PTAP_ADAPTER_CONTEXT     Adapter
@@ -1232,7 +1963,7 @@ Return Value:
         return FALSE;
     }
 
-    if(Adapter->TapFileObject == NULL)
+    if(Adapter->TapFileOpenCount == 0)
     {
         // TAP application file object not open.
         return FALSE;
@@ -1259,6 +1990,12 @@ Return Value:
     return TRUE;
 }
 
+_Requires_lock_held_(Adapter->AdapterLock)
+static NDIS_STATUS
+tapAdapterSendAndReceiveReadyLocked(
+    __in PTAP_ADAPTER_CONTEXT     Adapter
+    );
+
 NDIS_STATUS
 tapAdapterSendAndReceiveReady(
     __in PTAP_ADAPTER_CONTEXT     Adapter
@@ -1294,14 +2031,27 @@ Return Value:
     These status values can be used directly as the completion status for
     packets that must be completed immediatly in the send path.
 --*/
+{
+    NDIS_STATUS status;
+
+    tapAdapterAcquireLock(Adapter,FALSE);
+    status = tapAdapterSendAndReceiveReadyLocked(Adapter);
+    tapAdapterReleaseLock(Adapter,FALSE);
+
+    return status;
+}
+
+_Requires_lock_held_(Adapter->AdapterLock)
+static NDIS_STATUS
+tapAdapterSendAndReceiveReadyLocked(
+    __in PTAP_ADAPTER_CONTEXT     Adapter
+    )
 {
     NDIS_STATUS status = NDIS_STATUS_SUCCESS;
 
     //
     // Check various state variables to insure adapter is ready.
     //
-    tapAdapterAcquireLock(Adapter,FALSE);
-
     if(!Adapter->LogicalMediaState)
     {
         status = NDIS_STATUS_MEDIA_DISCONNECTED;
@@ -1333,6 +2083,74 @@ Return Value:
         }
     }
 
+    return status;
+}
+
+_Requires_lock_held_(Adapter->AdapterLock)
+NDIS_STATUS
+tapAdapterTryReferenceReceiveLocked(
+    __in PTAP_ADAPTER_CONTEXT     Adapter,
+    __in ULONG                    NetBufferListCount
+    )
+/*++
+
+Routine Description:
+
+    Count NetBufferListCount receive NBLs in flight if the adapter may
+    indicate them, that is if it is ready and restarting or running.
+
+    The state is checked and the count raised under the adapter lock,
+    which AdapterPause takes to enter the Pausing state. Once pausing,
+    the count only goes down, and the NBL return that brings it to zero
+    completes the pause.
+
+Arguments:
+
+    Adapter              Pointer to our adapter context
+    NetBufferListCount   Number of NBLs about to be indicated
+
+Return Value:
+
+    NDIS_STATUS_SUCCESS if the NBLs were counted and must be indicated.
+
+    Otherwise the status tapAdapterSendAndReceiveReady would return, or
+    NDIS_STATUS_INVALID_STATE, and nothing was counted.
+
+--*/
+{
+    NDIS_STATUS status = tapAdapterSendAndReceiveReadyLocked(Adapter);
+    LONG        nblCount;
+
+    if(status == NDIS_STATUS_SUCCESS
+        && Adapter->Locked.AdapterState != MiniportRunning
+        && Adapter->Locked.AdapterState != MiniportRestartingState)
+    {
+        status = NDIS_STATUS_INVALID_STATE;
+    }
+
+    if(status == NDIS_STATUS_SUCCESS)
+    {
+        // Holds the running bias, so cannot be zero here.
+        nblCount = InterlockedExchangeAdd(
+                        &Adapter->ReceiveNblInFlightCount,
+                        (LONG )NetBufferListCount
+                        );
+        ASSERT(nblCount > 0);
+    }
+
+    return status;
+}
+
+NDIS_STATUS
+tapAdapterTryReferenceReceive(
+    __in PTAP_ADAPTER_CONTEXT     Adapter,
+    __in ULONG                    NetBufferListCount
+    )
+{
+    NDIS_STATUS status;
+
+    tapAdapterAcquireLock(Adapter,FALSE);
+    status = tapAdapterTryReferenceReceiveLocked(Adapter,NetBufferListCount);
     tapAdapterReleaseLock(Adapter,FALSE);
 
     return status;
@@ -1595,6 +2413,12 @@ tapAdapterContextFree(
 
     Adapter->NetCfgInstanceIdAnsi.Buffer = NULL;
 
+    // Free the inject cache. Its NBLs come from the receive NBL pool.
+    tapInjectCacheFree(Adapter);
+
+    // Free the TUN mode header MDLs.
+    tapPrefixMdlCacheFree(Adapter);
+
     // Free the receive NBL pool.
     if(Adapter->ReceiveNblPool != NULL )
     {
@@ -1606,6 +2430,27 @@ tapAdapterContextFree(
     // Flow control related
     ASSERT(Adapter->FlowControlList == NULL);
 
+    // Free the per-handle queues.
+    if(Adapter->Queues != NULL)
+    {
+        ULONG   i;
+
+        for(i = 0; i < Adapter->QueueCount; ++i)
+        {
+            tapPacketQueueFree(&Adapter->Queues[i].SendPacketQueue);
+        }
+
+        NdisFreeMemory(Adapter->Queues,0,0);
+    }
+
+    Adapter->Queues = NULL;
+
+    // Free the RSS processors.
+    tapRssFree(Adapter);
+
+    // Free the TAP packet pool.
+    tapPacketPoolFree(&Adapter->SendPacketPool);
+
     NdisFreeMemory(Adapter,0,0);
 
     DEBUGP (("[TAP] <-- tapAdapterContextFree\n"));
@@ -28,6 +28,9 @@
 #define TAP_ADAPTER_TAG             ((ULONG)'ApaT')     // "TapA
 #define TAP_RX_NBL_TAG              ((ULONG)'RpaT')     // "TapR
 #define TAP_RX_INJECT_BUFFER_TAG    ((ULONG)'IpaT')     // "TapI
+#define TAP_RINGS_TAG               ((ULONG)'GpaT')     // "TapG
+#define TAP_QUEUE_TAG               ((ULONG)'QpaT')     // "TapQ
+#define TAP_RSS_TAG                 ((ULONG)'SpaT')     // "TapS
 
 #define TAP_MAX_NDIS_NAME_LENGTH        64     // 38 character GUID string plus extra..
 #define TAP_MAX_NDIS_DIAG_NAME_LENGTH   96     // Diag name is a little longer
@@ -41,7 +44,41 @@
 
 #define TAP_RX_NBL_FLAGS_IS_P2P             0x00001000
 #define TAP_RX_NBL_FLAGS_IS_INJECTED        0x00002000
+#define TAP_RX_NBL_FLAGS_IS_PARTIAL_MDL     0x00004000
+#define TAP_RX_NBL_FLAGS_IS_CACHED          0x00008000
 
+// Count of NBLs built from a write IRP that have not been returned yet.
+#define TAP_WRITE_IRP_NBL_COUNT(_Irp)       ((PLONG )&(_Irp)->Tail.Overlay.DriverContext[0])
+
+
+// Multi-queue mode: number of TAP device handles, each with its own queue.
+#define TAP_MAX_QUEUES              16
+#define TAP_QUEUE_STEERING_SIZE     128     // Power of two
+
+//
+// Per-handle queue. Each open TAP device handle owns one. Frames to
+// userspace are steered to a queue by flow hash; read IRPs on a handle
+// only take packets from its own queue.
+//
+typedef struct _TAP_QUEUE
+{
+    // Handle that owns the queue, NULL while the slot is free. Open is
+    // cleared when the handle is cleaned up, ahead of the close.
+    PFILE_OBJECT                FileObject;
+    BOOLEAN                     Open;
+
+    // Cancel-Safe read IRP queue.
+    TAP_IRP_CSQ                 PendingReadIrpQueue;
+
+    // Queue containing TAP packets representing host send NBs. These are
+    // waiting to be read by user-mode application.
+    TAP_PACKET_QUEUE            SendPacketQueue;
+
+    // Read IRPs are completed outside SendPacketQueue.QueueLock in the order
+    // of sequence numbers handed out under the lock. Never reset.
+    ULONG                       ReadCompletionNext;
+    volatile LONG               ReadCompletionTurn;
+} TAP_QUEUE, *PTAP_QUEUE;
 
 // True iff the given address was assigned by the local administrator
 #define NIC_ADDR_IS_LOCALLY_ADMINISTERED(_addr) \
@@ -105,6 +142,20 @@ typedef struct _TAP_ADAPTER_CONTEXT
     struct
     {
         TAP_MINIPORT_ADAPTER_STATE  AdapterState;
+
+        // Receive NBLs built while pausing or paused. Indicated in one
+        // call by AdapterRestart. None of them refers to a write IRP.
+        PNET_BUFFER_LIST            PausedNblHead;
+        PNET_BUFFER_LIST            PausedNblTail;
+        ULONG                       PausedNblCount;
+
+        // Pause latency, from AdapterPause to the Paused state, in
+        // 100 ns units. Reported by TAP_WIN_IOCTL_GET_PAUSE_STATISTICS.
+        ULONGLONG                   PauseStartTime;
+        ULONGLONG                   LastPauseLatency;
+        ULONGLONG                   MaxPauseLatency;
+        ULONG                       PauseCount;
+        ULONG                       PendedPauseCount;
     } Locked;
 
     BOOLEAN                     ResetInProgress;
@@ -128,6 +179,7 @@ typedef struct _TAP_ADAPTER_CONTEXT
     ANSI_STRING                 NetCfgInstanceIdAnsi;   // Used occasionally
 
     ULONG                       MtuSize;        // 1500 byte (typical)
+# define TAP_ADAPTER_MAX_FRAME_SIZE(a) (TAP_FRAME_HEADER_SIZE + (a)->MtuSize)
 
     // TRUE if adapter should always be "connected" even when device node
     // is not open by a userspace process.
@@ -156,7 +208,6 @@ typedef struct _TAP_ADAPTER_CONTEXT
     PDEVICE_OBJECT              DeviceObject;
     BOOLEAN                     TapDeviceCreated;   // WAS: m_TapIsRunning
 
-    PFILE_OBJECT                TapFileObject;      // Exclusive access
     BOOLEAN                     TapFileIsOpen;      // WAS: m_TapOpens
     LONG                        TapFileOpenCount;   // WAS: m_NumTapOpens
 
@@ -169,24 +220,89 @@ typedef struct _TAP_ADAPTER_CONTEXT
     NDIS_HANDLE                 DiagDeviceHandle;
     PDEVICE_OBJECT              DiagDeviceObject;
 
-    // Cancel-Safe read IRP queue.
-    TAP_IRP_CSQ                 PendingReadIrpQueue;
-
-    // Queue containing TAP packets representing host send NBs. These are
-    // waiting to be read by user-mode application.
-    TAP_PACKET_QUEUE            SendPacketQueue;
+    // One queue per TAP device handle. QueueCount is one unless multi-queue
+    // mode is configured, in which case each handle is given a free queue.
+    PTAP_QUEUE                  Queues;
+    ULONG                       QueueCount;
+
+    // Maps flow hash to the index of an open queue. Rebuilt under
+    // QueueSteeringLock when a handle is opened or cleaned up.
+    KSPIN_LOCK                  QueueSteeringLock;
+    volatile UCHAR              QueueSteering[TAP_QUEUE_STEERING_SIZE];
+
+    // SendPacketQueue scheduling: priority classes and how they are
+    // served, whether IP packets without an 802.1p priority use their
+    // DSCP, the number of flow queues per class, and the seed for the flow
+    // hash that spreads packets over them.
+    ULONG                       SendQueueClasses;
+    ULONG                       SendQueueSchedule;
+    BOOLEAN                     SendQueueDscp;
+    ULONG                       SendQueueFlows;
+    ULONG                       FlowHashSeed;
+
+    // Active queue management applied as packets leave SendPacketQueue.
+    // The per-flow state lives in the queue's flows.
+    TAP_AQM_PARAMETERS          AqmParameters;
+    volatile LONG64             AqmDrops;
+
+    // Size-classed allocator for TAP packets in the send path.
+    TAP_PACKET_POOL             SendPacketPool;
+
+    // Shared-memory rings registered by userspace, if any.
+    KSPIN_LOCK                  RingsLock;
+    struct _TAP_RINGS           *Rings;
 
     // Transmit flow control
     KSPIN_LOCK                  FlowControlLock;
     PNET_BUFFER_LIST            FlowControlList;
+    PNET_BUFFER_LIST            FlowControlListTail;
     BOOLEAN                     FlowControlHasPackets;
 
+    // Flow control watermarks. Sends are held once the send packet queue
+    // rises above either high watermark and released once it falls to both
+    // low watermarks. Packet watermarks are disabled if FlowControlHighPackets
+    // is zero.
+    ULONG                       FlowControlHighBytes;
+    ULONG                       FlowControlLowBytes;
+    ULONG                       FlowControlHighPackets;
+    ULONG                       FlowControlLowPackets;
+
     // NBL pool for making TAP receive indications.
     NDIS_HANDLE                 ReceiveNblPool;
 
+    // Preallocated inject NBLs, each with its MDL and flat buffer already
+    // linked. Used for DHCP/ARP/ND replies and frames from the rings.
+    KSPIN_LOCK                  InjectCacheLock;
+    PNET_BUFFER_LIST            InjectCacheList;
+    ULONG                       InjectCacheBufferSize;
+    volatile LONG64             InjectCacheHits;
+    volatile LONG64             InjectCacheMisses;
+
+    // Receive side scaling. Advertised to NDIS unless the *RSS keyword
+    // is zero.
+    BOOLEAN                     ReceiveSideScaling;
+    TAP_RSS                     Rss;
+
+    // LSOv2 currently enabled by the *LsoV2IPv4 and *LsoV2IPv6 keywords
+    // or OID_TCP_OFFLOAD_PARAMETERS.
+    BOOLEAN                     LsoV2IPv4;
+    BOOLEAN                     LsoV2IPv6;
+
+    // TAP_CSUM_TX and TAP_CSUM_RX for each TAP_CSUM_XXX checksum, set by
+    // the standard checksum offload keywords or OID_TCP_OFFLOAD_PARAMETERS.
+    UCHAR                       ChecksumOffload[TAP_CSUM_COUNT];
+
+    // Receive segment coalescing currently enabled by the *RscIPv4 and
+    // *RscIPv6 keywords or OID_TCP_OFFLOAD_PARAMETERS. Needs NDIS 6.30.
+    BOOLEAN                     RscIPv4;
+    BOOLEAN                     RscIPv6;
+    TAP_RSC_STATISTICS          RscStatistics;
+
+    // Receive NBLs indicated and not yet returned, plus one while the
+    // adapter is restarting or running. Only raised under AdapterLock by
+    // tapAdapterTryReferenceReceive. AdapterPause drops the bias and the
+    // return that brings the count to zero completes the pause.
     volatile LONG               ReceiveNblInFlightCount;
-#define TAP_WAIT_POLL_LOOP_TIMEOUT  3000    // 3 seconds
-    NDIS_EVENT                  ReceiveNblInFlightCountZeroEvent;
 
     // Info for point-to-point mode
     BOOLEAN                     m_tun;
@@ -197,6 +313,16 @@ typedef struct _TAP_ADAPTER_CONTEXT
     ETH_HEADER                  m_UserToTap;
     ETH_HEADER                  m_UserToTap_IPv6; // same as UserToTap but proto=ipv6
 
+    // Reusable MDLs describing m_UserToTap and m_UserToTap_IPv6, chained in
+    // front of each frame written in point-to-point mode. They describe the
+    // headers in place, so reconfiguration does not invalidate them.
+#define TAP_PREFIX_MDL_IPV4         0
+#define TAP_PREFIX_MDL_IPV6         1
+#define TAP_PREFIX_MDL_TYPES        2
+    KSPIN_LOCK                  PrefixMdlLock;
+    PMDL                        PrefixMdlList[TAP_PREFIX_MDL_TYPES];
+    ULONG                       PrefixMdlCount[TAP_PREFIX_MDL_TYPES];
+
     // Info for DHCP server masquerade
     BOOLEAN                     m_dhcp_enabled;
     IPADDR                      m_dhcp_addr;
@@ -219,6 +345,17 @@ typedef struct _TAP_ADAPTER_CONTEXT
 
     ULONG                       PriorityBehavior;
 
+    // TRUE if userspace asked for several frames per read or write IRP.
+    BOOLEAN                     ReadBatchEnabled;
+    BOOLEAN                     WriteBatchEnabled;
+
+    // Written frames up to this length are copied, so the write IRP need
+    // not stay pended until NDIS returns them. Runt frames are always copied.
+    ULONG                       WriteCopyThreshold;
+
+    // TAP_WIN_OFFLOAD_XXX offloads userspace handles.
+    ULONG                       UserOffloads;
+
     //
     // Statistics
     // -------------------------------------------------------------------------
@@ -341,11 +478,62 @@ tapAdapterReadAndWriteReady(
     __in PTAP_ADAPTER_CONTEXT     Adapter
     );
 
+NDIS_STATUS
+tapAdapterQueuesAllocate(
+    __in PTAP_ADAPTER_CONTEXT     Adapter
+    );
+
+VOID
+tapAdapterUpdateQueueSteering(
+    __in PTAP_ADAPTER_CONTEXT     Adapter
+    );
+
+// Fill in the offloads the adapter supports, or with Hardware FALSE
+// the ones currently enabled.
+VOID
+tapAdapterGetOffload(
+    __in PTAP_ADAPTER_CONTEXT     Adapter,
+    __in BOOLEAN                  Hardware,
+    __out PNDIS_OFFLOAD           Offload
+    );
+
+// Queue that frames with the given flow hash are steered to. Uses the
+// high hash bits; the low bits pick the flow queue within a queue.
+FORCEINLINE
+PTAP_QUEUE
+tapAdapterSteerQueue(
+    __in PTAP_ADAPTER_CONTEXT     Adapter,
+    __in ULONG                    FlowHash
+    )
+{
+    return &Adapter->Queues[Adapter->QueueSteering[(FlowHash >> 16) & (TAP_QUEUE_STEERING_SIZE - 1)]];
+}
+
 NDIS_STATUS
 tapAdapterSendAndReceiveReady(
     __in PTAP_ADAPTER_CONTEXT     Adapter
     );
 
+_Requires_lock_held_(Adapter->AdapterLock)
+NDIS_STATUS
+tapAdapterTryReferenceReceiveLocked(
+    __in PTAP_ADAPTER_CONTEXT     Adapter,
+    __in ULONG                    NetBufferListCount
+    );
+
+// Count receive NBLs in flight if the adapter may indicate them.
+NDIS_STATUS
+tapAdapterTryReferenceReceive(
+    __in PTAP_ADAPTER_CONTEXT     Adapter,
+    __in ULONG                    NetBufferListCount
+    );
+
+VOID
+tapAdapterPauseComplete(
+    __in PTAP_ADAPTER_CONTEXT     Adapter,
+    __in BOOLEAN                  Pended
+    );
+
 ULONG
 tapGetRawPacketFrameType(
     __in PTAP_ADAPTER_CONTEXT    Adapter,
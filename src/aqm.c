@@ -0,0 +1,197 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This code was inspired by the CIPE-Win32 driver by Damion K. Wilson.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+//
+// Include files.
+//
+
+#include "tap.h"
+
+//======================================================================
+// Active Queue Management
+//======================================================================
+
+VOID
+tapAqmInitialize(
+    __in PTAP_AQM_STATE         State
+    )
+{
+    NdisZeroMemory(State,sizeof(TAP_AQM_STATE));
+}
+
+// Integer square root, rounded down.
+static ULONG64
+tapAqmSqrt(
+    __in ULONG64                Value
+    )
+{
+    ULONG64     root = 0;
+    ULONG64     bit = 1ULL << 62;
+
+    while(bit > Value)
+    {
+        bit >>= 2;
+    }
+
+    while(bit != 0)
+    {
+        if(Value >= root + bit)
+        {
+            Value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+
+        bit >>= 2;
+    }
+
+    return root;
+}
+
+//
+// CoDel control law: the next drop is due Interval / sqrt(Count) after
+// Time. Computed in 16.16 fixed point since floating point is not
+// available at DISPATCH_LEVEL.
+//
+static ULONG64
+tapCoDelControlLaw(
+    __in PTAP_AQM_PARAMETERS    Parameters,
+    __in ULONG64                Time,
+    __in ULONG                  Count
+    )
+{
+    ULONG64     sqrtCount = tapAqmSqrt((ULONG64 )Count << 32);     // sqrt(Count) << 16
+
+    return Time + ((Parameters->Interval << 16) / sqrtCount);
+}
+
+static BOOLEAN
+tapCoDelShouldDrop(
+    __in PTAP_AQM_PARAMETERS    Parameters,
+    __in PTAP_AQM_STATE         State,
+    __in ULONG64                EnqueueTime,
+    __in ULONG64                Now,
+    __in LONG                   BacklogBytes
+    )
+/*++
+
+Routine Description:
+
+    CoDel (RFC 8289) drop decision for the packet at the head of the queue.
+
+    The delay must stay above Target for a full Interval before the first
+    drop. While it stays above Target, further drops follow the control
+    law, getting closer together, until the delay falls below Target.
+
+--*/
+{
+    BOOLEAN     okToDrop = FALSE;
+
+    //
+    // Has the sojourn time been above target for at least an interval?
+    //
+    if(Now - EnqueueTime < Parameters->Target
+        || BacklogBytes <= (LONG )Parameters->MinBacklog)
+    {
+        State->FirstAboveTime = 0;
+    }
+    else if(State->FirstAboveTime == 0)
+    {
+        State->FirstAboveTime = Now + Parameters->Interval;
+    }
+    else if(Now >= State->FirstAboveTime)
+    {
+        okToDrop = TRUE;
+    }
+
+    if(State->Dropping)
+    {
+        if(!okToDrop)
+        {
+            // Sojourn time below target - leave dropping state.
+            State->Dropping = FALSE;
+            return FALSE;
+        }
+
+        if(Now >= State->DropNext)
+        {
+            ++State->Count;
+            State->DropNext = tapCoDelControlLaw(Parameters,State->DropNext,State->Count);
+            return TRUE;
+        }
+
+        return FALSE;
+    }
+
+    //
+    // FirstAboveTime already lies an Interval after the delay first went
+    // above Target, so okToDrop alone means it has stayed there that long.
+    //
+    if(okToDrop)
+    {
+        ULONG   delta = State->Count - State->LastCount;
+
+        State->Dropping = TRUE;
+
+        // Resume near the previous drop rate if we were dropping recently.
+        if(delta > 1 && (LONG64 )(Now - State->DropNext) < (LONG64 )(16 * Parameters->Interval))
+        {
+            State->Count = delta;
+        }
+        else
+        {
+            State->Count = 1;
+        }
+
+        State->LastCount = State->Count;
+        State->DropNext = tapCoDelControlLaw(Parameters,Now,State->Count);
+
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+BOOLEAN
+tapAqmShouldDrop(
+    __in PTAP_AQM_PARAMETERS    Parameters,
+    __in PTAP_AQM_STATE         State,
+    __in ULONG64                EnqueueTime,
+    __in ULONG64                Now,
+    __in LONG                   BacklogBytes
+    )
+{
+    switch(Parameters->Mode)
+    {
+    case TAP_AQM_MODE_CODEL:
+        return tapCoDelShouldDrop(Parameters,State,EnqueueTime,Now,BacklogBytes);
+
+    case TAP_AQM_MODE_NONE:
+    default:
+        return FALSE;
+    }
+}
@@ -0,0 +1,77 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This code was inspired by the CIPE-Win32 driver by Damion K. Wilson.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef __TAP_AQM_H_
+#define __TAP_AQM_H_
+
+//===================================================================
+// Active queue management for the send packet queue
+//
+// Packets are judged when they reach the head of the queue, using the
+// time they have spent queued. Times are in 100ns units as returned by
+// KeQueryInterruptTime.
+//===================================================================
+
+#define TAP_AQM_MODE_NONE           0
+#define TAP_AQM_MODE_CODEL          1
+#define TAP_AQM_MODE_MAX            1
+
+// CoDel defaults from RFC 8289, in microseconds.
+#define TAP_AQM_DEFAULT_TARGET      5000
+#define TAP_AQM_DEFAULT_INTERVAL    100000
+
+typedef struct _TAP_AQM_PARAMETERS
+{
+    ULONG       Mode;           // TAP_AQM_MODE_XXX
+    ULONG64     Target;         // Acceptable standing queue delay
+    ULONG64     Interval;       // Window the delay must persist for
+    ULONG       MinBacklog;     // Never drop with this many bytes or fewer queued
+} TAP_AQM_PARAMETERS, *PTAP_AQM_PARAMETERS;
+
+// Per-queue state. Protected by the queue's consumer lock.
+typedef struct _TAP_AQM_STATE
+{
+    // CoDel
+    BOOLEAN     Dropping;
+    ULONG       Count;          // Drops since entering the dropping state
+    ULONG       LastCount;
+    ULONG64     FirstAboveTime;
+    ULONG64     DropNext;
+} TAP_AQM_STATE, *PTAP_AQM_STATE;
+
+VOID
+tapAqmInitialize(
+    __in PTAP_AQM_STATE         State
+    );
+
+// Returns TRUE if the packet at the head of the queue should be dropped.
+BOOLEAN
+tapAqmShouldDrop(
+    __in PTAP_AQM_PARAMETERS    Parameters,
+    __in PTAP_AQM_STATE         State,
+    __in ULONG64                EnqueueTime,
+    __in ULONG64                Now,
+    __in LONG                   BacklogBytes
+    );
+
+#endif // __TAP_AQM_H_
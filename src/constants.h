@@ -57,9 +57,9 @@
 // Medium properties
 //===========================================================
 
+// The maximum frame data size is the configured MTU; see MtuSize in the
+// adapter context.
 #define TAP_FRAME_HEADER_SIZE       ETHERNET_HEADER_SIZE
-#define TAP_FRAME_MAX_DATA_SIZE     ETHERNET_MTU
-#define TAP_MAX_FRAME_SIZE          (TAP_FRAME_HEADER_SIZE + TAP_FRAME_MAX_DATA_SIZE)
 #define TAP_MIN_FRAME_SIZE          60
 
 #define TAP_MEDIUM_TYPE             NdisMedium802_3
@@ -89,11 +89,19 @@
 // Max number of multicast addresses supported in hardware
 #define TAP_MAX_MCAST_LIST                 32
 
-#define TAP_MAX_LOOKAHEAD                  TAP_FRAME_MAX_DATA_SIZE
-
 // Simulated send/receive buffer size for the virtual device.
 #define TAP_BUFFER_SIZE                    0x400000
 
+// Written frames up to this length are copied and the write IRP completed
+// at once. Larger frames are indicated directly from the IRP buffer.
+#define TAP_WRITE_COPY_THRESHOLD           256
+#define TAP_WRITE_COPY_THRESHOLD_MAX       ETHERNET_PACKET_SIZE
+
+// Default flow control watermarks for the send packet queue. Packet
+// count watermarks are disabled unless configured.
+#define TAP_FLOW_CONTROL_HIGH_BYTES        TAP_BUFFER_SIZE
+#define TAP_FLOW_CONTROL_LOW_BYTES         (TAP_BUFFER_SIZE / 2)
+
 // Set this value to TRUE if there is a physical adapter.
 #define TAP_HAS_PHYSICAL_CONNECTOR         FALSE
 #define TAP_ACCESS_TYPE                    NET_IF_ACCESS_BROADCAST
@@ -168,10 +176,20 @@
 
 
 #define MINIMUM_MTU                 576        // USE TCP Minimum MTU
-#define MAXIMUM_MTU                 65536      // IP maximum MTU
+
+// Largest MTU such that a full frame, VLAN tag and metadata header still fit
+// in one ring frame (TAP_WIN_RING_TRAILING_BYTES). This is just under the
+// 64 KiB IP maximum.
+#define MAXIMUM_MTU                 ((ULONG)(TAP_WIN_RING_TRAILING_BYTES \
+                                        - sizeof(TAP_WIN_FRAME_HEADER) \
+                                        - sizeof(TAP_WIN_METADATA_HEADER) \
+                                        - ETHERNET_HEADER_SIZE - VLAN_TAG_SIZE))
 
 #define PACKET_QUEUE_SIZE           64 // tap -> userspace queue size
 #define IRP_QUEUE_SIZE              16 // max number of simultaneous i/o operations from userspace
 #define INJECT_QUEUE_SIZE           16 // DHCP/ARP -> tap injection queue
+#define TAP_INJECT_CACHE_SIZE       32 // preallocated inject NBLs
+#define TAP_PREFIX_MDL_CACHE_SIZE   32 // reusable TUN Ethernet header MDLs, per header
+#define TAP_PAUSED_NBL_QUEUE_SIZE   64 // receive NBLs held while the miniport is paused
 
 #define TAP_LITTLE_ENDIAN      // affects ntohs, htonl, etc. functions
@@ -71,6 +71,13 @@ VOID tapResetAdapterState(
   Adapter->m_dhcp_received_discover = FALSE;
   Adapter->m_dhcp_bad_requests = 0;
   NdisZeroMemory (Adapter->m_dhcp_server_mac, MACADDR_SIZE);
+
+  // Batched reads and writes
+  Adapter->ReadBatchEnabled = FALSE;
+  Adapter->WriteBatchEnabled = FALSE;
+
+  // Offloads selected by userspace
+  Adapter->UserOffloads = 0;
 }
 
 // IRP_MJ_CREATE
@@ -103,7 +110,8 @@ Return Value:
     NDIS_STATUS             status;
     PIO_STACK_LOCATION      irpSp;// Pointer to current stack location
     PTAP_ADAPTER_CONTEXT    adapter = NULL;
-    PFILE_OBJECT            originalFileObject;
+    PTAP_QUEUE              queue = NULL;
+    ULONG                   i;
 
     PAGED_CODE();
 
@@ -149,16 +157,27 @@ Return Value:
         adapter->TapFileIsOpen
         ));
 
-    // Enforce exclusive access
-    originalFileObject = InterlockedCompareExchangePointer(
-                    &adapter->TapFileObject,
-                    irpSp->FileObject,
-                    NULL
-                    );
+    //
+    // Claim a free queue. Unless multi-queue mode is configured there is
+    // only one, which enforces exclusive access.
+    //
+    for(i = 0; i < adapter->QueueCount; ++i)
+    {
+        if(InterlockedCompareExchangePointer(
+                &adapter->Queues[i].FileObject,
+                irpSp->FileObject,
+                NULL
+                ) == NULL)
+        {
+            queue = &adapter->Queues[i];
+            break;
+        }
+    }
 
-    if(originalFileObject == NULL)
+    if(queue != NULL)
     {
         irpSp->FileObject->FsContext = adapter; // Quick reference
+        irpSp->FileObject->FsContext2 = queue;
 
         status = STATUS_SUCCESS;
     }
@@ -172,10 +191,17 @@ Return Value:
 
     if(status == STATUS_SUCCESS)
     {
-        // Reset adapter state on successful open.
-        tapResetAdapterState(adapter);
+        if(InterlockedIncrement(&adapter->TapFileOpenCount) == 1)
+        {
+            // Reset adapter state when the first handle is opened.
+            tapResetAdapterState(adapter);
 
-        adapter->TapFileIsOpen = 1;    // Legacy...
+            adapter->TapFileIsOpen = 1;    // Legacy...
+        }
+
+        // Start steering frames to the new queue.
+        queue->Open = TRUE;
+        tapAdapterUpdateQueueSteering(adapter);
 
         // NOTE!!! Reference added by tapAdapterContextFromDeviceObject
         // will be removed when file is closed.
@@ -455,6 +481,8 @@ Return Value:
 
                 adapter->m_tun = TRUE;
 
+                tapPrefixMdlCacheInitialize (adapter);
+
                 CheckIfDhcpAndTunMode (adapter);
 
                 Irp->IoStatus.Information = 1; // Simple boolean value
@@ -494,6 +522,8 @@ Return Value:
 
                 adapter->m_tun = TRUE;
 
+                tapPrefixMdlCacheInitialize (adapter);
+
                 CheckIfDhcpAndTunMode (adapter);
 
                 Irp->IoStatus.Information = 1; // Simple boolean value
@@ -584,6 +614,13 @@ Return Value:
     case TAP_WIN_IOCTL_GET_INFO:
         {
             char state[16];
+            char *infoEnd = NULL;
+            size_t infoRemaining = 0;
+            ULONG i;
+            PTAP_QUEUE queue = (PTAP_QUEUE )(irpSp->FileObject)->FsContext2;
+
+            // Queue statistics are those of the calling handle.
+            ASSERT(queue);
 
             // Fetch adapter (miniport) state.
             if (tapAdapterSendAndReceiveReady(adapter) == NDIS_STATUS_SUCCESS)
@@ -611,13 +648,13 @@ Return Value:
             Irp->IoStatus.Status = ntStatus = RtlStringCchPrintfExA (
                 ((LPTSTR) (Irp->AssociatedIrp.SystemBuffer)),
                 outBufLength,
-                NULL,
-                NULL,
+                &infoEnd,
+                &infoRemaining,
                 STRSAFE_FILL_BEHIND_NULL | STRSAFE_IGNORE_NULLS,
 #if PACKET_TRUNCATION_CHECK
-                "State=%s Err=[%s/%d] #O=%d Tx=[%d,%d,%d] Rx=[%d,%d,%d] IrpQ=[%d,%d,%d] PktQ=[%d,%d,%d] InjQ=[%d,%d,%d]",
+                "State=%s Err=[%s/%d] #O=%d Tx=[%d,%d,%d] Rx=[%d,%d,%d] IrpQ=[%d,%d,%d] PktQ=[%d,%d,%d] InjQ=[%d,%d,%d] PktPool=[%d,%d,%d,%d] Aqm=[%d,%d]",
 #else
-                "State=%s Err=[%s/%d] #O=%d Tx=[%d,%d] Rx=[%d,%d] IrpQ=[%d,%d,%d] PktQ=[%d,%d,%d] InjQ=[%d,%d,%d]",
+                "State=%s Err=[%s/%d] #O=%d Tx=[%d,%d] Rx=[%d,%d] IrpQ=[%d,%d,%d] PktQ=[%d,%d,%d] InjQ=[%d,%d,%d] PktPool=[%d,%d,%d,%d] Aqm=[%d,%d]",
 #endif
                 state,
                 g_LastErrorFilename,
@@ -633,19 +670,47 @@ Return Value:
 #if PACKET_TRUNCATION_CHECK
                 (int)adapter->m_RxTrunc,
 #endif
-                (int)adapter->PendingReadIrpQueue.Count,
-                (int)adapter->PendingReadIrpQueue.MaxCount,
+                (int)queue->PendingReadIrpQueue.Count,
+                (int)queue->PendingReadIrpQueue.MaxCount,
                 (int)IRP_QUEUE_SIZE,        // Ignored in NDIS 6 driver...
 
-                (int)adapter->SendPacketQueue.Count,
-                (int)adapter->SendPacketQueue.MaxCount,
+                (int)queue->SendPacketQueue.Count,
+                (int)queue->SendPacketQueue.MaxCount,
                 (int)PACKET_QUEUE_SIZE,
 
                 (int)0,         // adapter->InjectPacketQueue.Count - Unused
                 (int)0,         // adapter->InjectPacketQueue.MaxCount - Unused
-                (int)INJECT_QUEUE_SIZE
+                (int)INJECT_QUEUE_SIZE,
+
+                (int)adapter->SendPacketPool.Hits,
+                (int)adapter->SendPacketPool.Misses,
+                (int)adapter->SendPacketPool.InUseCount,
+                (int)adapter->SendPacketPool.MaxInUseCount,
+
+                (int)adapter->AqmParameters.Mode,
+                (int)adapter->AqmDrops
                 );
 
+            // Per priority class depth, max depth and drops, lowest class first.
+            for (i = 0; NT_SUCCESS(ntStatus) && i < queue->SendPacketQueue.ClassCount; ++i)
+            {
+                PTAP_PACKET_CLASS packetClass = &queue->SendPacketQueue.Classes[i];
+
+                Irp->IoStatus.Status = ntStatus = RtlStringCchPrintfExA (
+                    infoEnd,
+                    infoRemaining,
+                    &infoEnd,
+                    &infoRemaining,
+                    STRSAFE_FILL_BEHIND_NULL | STRSAFE_IGNORE_NULLS,
+                    "%s%d/%d/%d%s",
+                    (i == 0) ? " PktCls=[" : ",",
+                    (int)packetClass->Count,
+                    (int)packetClass->MaxCount,
+                    (int)packetClass->Drops,
+                    (i + 1 == queue->SendPacketQueue.ClassCount) ? "]" : ""
+                    );
+            }
+
             Irp->IoStatus.Information = outBufLength;
 
             // BUGBUG!!! Fail because this is not completely implemented.
@@ -704,6 +769,132 @@ Return Value:
         }
         break;
 
+    case TAP_WIN_IOCTL_SET_READ_BATCH:
+        {
+            if(adapter->TapFileOpenCount > 1)
+            {
+                // Framing is shared by all handles of the adapter.
+                NOTE_ERROR();
+                Irp->IoStatus.Status = ntStatus = STATUS_INVALID_DEVICE_STATE;
+            }
+            else if(inBufLength >= sizeof(ULONG))
+            {
+                ULONG parm = ((PULONG) (Irp->AssociatedIrp.SystemBuffer))[0];
+                adapter->ReadBatchEnabled = (parm != 0);
+                Irp->IoStatus.Information = 1;
+
+                DEBUGP (("[%s] Batched reads %s\n",
+                    MINIPORT_INSTANCE_ID (adapter),
+                    adapter->ReadBatchEnabled ? "enabled" : "disabled"));
+            }
+            else
+            {
+                NOTE_ERROR();
+                Irp->IoStatus.Status = ntStatus = STATUS_INVALID_PARAMETER;
+            }
+        }
+        break;
+
+    case TAP_WIN_IOCTL_SET_WRITE_BATCH:
+        {
+            if(adapter->TapFileOpenCount > 1)
+            {
+                // Framing is shared by all handles of the adapter.
+                NOTE_ERROR();
+                Irp->IoStatus.Status = ntStatus = STATUS_INVALID_DEVICE_STATE;
+            }
+            else if(inBufLength >= sizeof(ULONG))
+            {
+                ULONG parm = ((PULONG) (Irp->AssociatedIrp.SystemBuffer))[0];
+                adapter->WriteBatchEnabled = (parm != 0);
+                Irp->IoStatus.Information = 1;
+
+                DEBUGP (("[%s] Batched writes %s\n",
+                    MINIPORT_INSTANCE_ID (adapter),
+                    adapter->WriteBatchEnabled ? "enabled" : "disabled"));
+            }
+            else
+            {
+                NOTE_ERROR();
+                Irp->IoStatus.Status = ntStatus = STATUS_INVALID_PARAMETER;
+            }
+        }
+        break;
+
+    case TAP_WIN_IOCTL_SET_OFFLOADS:
+        {
+            if(adapter->TapFileOpenCount > 1)
+            {
+                // Framing is shared by all handles of the adapter.
+                NOTE_ERROR();
+                Irp->IoStatus.Status = ntStatus = STATUS_INVALID_DEVICE_STATE;
+            }
+            else if(inBufLength >= sizeof(ULONG)
+                && (((PULONG) (Irp->AssociatedIrp.SystemBuffer))[0]
+                    & ~(TAP_WIN_OFFLOAD_TSO | TAP_WIN_OFFLOAD_CSUM | TAP_WIN_OFFLOAD_METADATA)) == 0)
+            {
+                ULONG parm = ((PULONG) (Irp->AssociatedIrp.SystemBuffer))[0];
+                adapter->UserOffloads = parm;
+                Irp->IoStatus.Information = 1;
+
+                DEBUGP (("[%s] User offloads 0x%08x\n",
+                    MINIPORT_INSTANCE_ID (adapter),
+                    adapter->UserOffloads));
+            }
+            else
+            {
+                NOTE_ERROR();
+                Irp->IoStatus.Status = ntStatus = STATUS_INVALID_PARAMETER;
+            }
+        }
+        break;
+
+    case TAP_WIN_IOCTL_REGISTER_RINGS:
+        {
+            if(inBufLength >= sizeof(TAP_WIN_RING_REGISTRATION))
+            {
+                TAP_WIN_RING_REGISTRATION registration;
+
+                // Copy out of the system buffer; it is reused for output.
+                NdisMoveMemory(&registration,Irp->AssociatedIrp.SystemBuffer,sizeof(registration));
+
+                ntStatus = tapRingsRegister(adapter,irpSp->FileObject,&registration,Irp->RequestorMode);
+                Irp->IoStatus.Status = ntStatus;
+            }
+            else
+            {
+                NOTE_ERROR();
+                Irp->IoStatus.Status = ntStatus = STATUS_INVALID_PARAMETER;
+            }
+        }
+        break;
+
+    case TAP_WIN_IOCTL_GET_PAUSE_STATISTICS:
+        {
+            const ULONG size = sizeof (TAP_WIN_PAUSE_STATISTICS);
+
+            if (outBufLength >= size)
+            {
+                TAP_WIN_PAUSE_STATISTICS *stats =
+                    (TAP_WIN_PAUSE_STATISTICS *) Irp->AssociatedIrp.SystemBuffer;
+
+                tapAdapterAcquireLock(adapter,FALSE);
+                stats->PauseCount = adapter->Locked.PauseCount;
+                stats->PendedPauseCount = adapter->Locked.PendedPauseCount;
+                stats->LastPauseLatency = adapter->Locked.LastPauseLatency;
+                stats->MaxPauseLatency = adapter->Locked.MaxPauseLatency;
+                tapAdapterReleaseLock(adapter,FALSE);
+
+                Irp->IoStatus.Information = size;
+            }
+            else
+            {
+                NOTE_ERROR();
+                Irp->IoStatus.Status = ntStatus = STATUS_BUFFER_TOO_SMALL;
+            }
+        }
+        break;
+
     default:
 
         //
@@ -727,14 +918,16 @@ Return Value:
 // Flush the pending read IRP queue.
 VOID
 tapFlushIrpQueues(
-    __in PTAP_ADAPTER_CONTEXT   Adapter
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PTAP_QUEUE             Queue
     )
 {
+    UNREFERENCED_PARAMETER(Adapter);
 
     DEBUGP (("[TAP] tapFlushIrpQueues: Flushing %d pending read IRPs\n",
-        Adapter->PendingReadIrpQueue.Count));
+        Queue->PendingReadIrpQueue.Count));
 
-    tapIrpCsqFlush(&Adapter->PendingReadIrpQueue);
+    tapIrpCsqFlush(&Queue->PendingReadIrpQueue);
 }
 
 // IRP_MJ_CLEANUP
@@ -806,29 +999,43 @@ Return Value:
 
     if(adapter != NULL )
     {
-        adapter->TapFileIsOpen = 0;    // Legacy...
+        PTAP_QUEUE  queue = (PTAP_QUEUE )(irpSp->FileObject)->FsContext2;
+
+        ASSERT(queue);
 
-        // Disconnect from media.
-        tapSetMediaConnectStatus(adapter,FALSE);
+        // Stop steering frames to this handle's queue.
+        queue->Open = FALSE;
+        tapAdapterUpdateQueueSteering(adapter);
+
+        if(InterlockedDecrement(&adapter->TapFileOpenCount) == 0)
+        {
+            adapter->TapFileIsOpen = 0;    // Legacy...
+
+            // Disconnect from media.
+            tapSetMediaConnectStatus(adapter,FALSE);
+
+            // Reset adapter state when cleaning up;
+            tapResetAdapterState(adapter);
+        }
 
-        // Reset adapter state when cleaning up;
-        tapResetAdapterState(adapter);
+        // Stop using shared-memory rings registered on this handle.
+        tapRingsUnregister(adapter,irpSp->FileObject);
 
         // BUGBUG!!! Use RemoveLock???
 
         //
         // Flush pending send TAP packet queue.
         //
-        tapFlushSendPacketQueue(adapter);
+        tapFlushSendPacketQueue(adapter,queue);
 
-        ASSERT(adapter->SendPacketQueue.Count == 0);
+        ASSERT(queue->SendPacketQueue.Count == 0);
 
         //
         // Flush the pending IRP queues
         //
-        tapFlushIrpQueues(adapter);
+        tapFlushIrpQueues(adapter,queue);
 
-        ASSERT(adapter->PendingReadIrpQueue.Count == 0);
+        ASSERT(queue->PendingReadIrpQueue.Count == 0);
     }
 
     // Complete the IRP.
@@ -902,7 +1109,9 @@ Return Value:
 
     if(adapter != NULL )
     {
-        if(adapter->TapFileObject == NULL)
+        PTAP_QUEUE  queue = (PTAP_QUEUE )(irpSp->FileObject)->FsContext2;
+
+        if(queue == NULL)
         {
             // Should never happen!!!
             ASSERT(FALSE);
@@ -911,10 +1120,12 @@ Return Value:
         {
             ASSERT(irpSp->FileObject->FsContext == adapter);
 
-            ASSERT(adapter->TapFileObject == irpSp->FileObject);
+            ASSERT(queue->FileObject == irpSp->FileObject);
+
+            // Free the queue for the next handle.
+            queue->FileObject = NULL;
         }
 
-        adapter->TapFileObject = NULL;
         irpSp->FileObject = NULL;
 
         // Remove reference added by when handle was opened.
@@ -1456,6 +1667,8 @@ DestroyTapDevice(
     __in PTAP_ADAPTER_CONTEXT   Adapter
    )
 {
+    ULONG   i;
+
     DEBUGP (("[TAP] --> DestroyTapDevice; Adapter: %wZ\n",
         &Adapter->NetCfgInstanceId));
 
@@ -1465,11 +1678,14 @@ DestroyTapDevice(
     Adapter->TapDeviceCreated = FALSE;
 
     //
-    // Flush pending send TAP packet queue.
+    // Flush pending send TAP packet queues.
     //
-    tapFlushSendPacketQueue(Adapter);
+    for(i = 0; i < Adapter->QueueCount; ++i)
+    {
+        tapFlushSendPacketQueue(Adapter,&Adapter->Queues[i]);
 
-    ASSERT(Adapter->SendPacketQueue.Count == 0);
+        ASSERT(Adapter->Queues[i].SendPacketQueue.Count == 0);
+    }
 
     //
     // Flush IRP queues. Wait for pending I/O. Etc.
@@ -1494,9 +1710,12 @@ DestroyTapDevice(
     // result in the TapDeviceCleanup call being made, followed by the a call to
     // the TapDeviceClose callback.
     //
-    tapFlushIrpQueues(Adapter);
+    for(i = 0; i < Adapter->QueueCount; ++i)
+    {
+        tapFlushIrpQueues(Adapter,&Adapter->Queues[i]);
 
-    ASSERT(Adapter->PendingReadIrpQueue.Count == 0);
+        ASSERT(Adapter->Queues[i].PendingReadIrpQueue.Count == 0);
+    }
 
     //
     // Deregister the Win32 device.
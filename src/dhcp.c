@@ -41,7 +41,7 @@ SetDHCPOpt(
         {
             if (len)
             {
-                NdisMoveMemory (m->msg.options + m->optlen, data, len);
+                NdisMoveMemory (m->msg->options + m->optlen, data, len);
                 m->optlen += len;
             }
         }
@@ -179,13 +179,13 @@ SetChecksumDHCPMsg(
     )
 {
     // Set IP checksum
-    m->msg.pre.ip.check = htons (ip_checksum ((UCHAR *) &m->msg.pre.ip, sizeof (IPHDR)));
+    m->msg->pre.ip.check = htons (ip_checksum ((UCHAR *) &m->msg->pre.ip, sizeof (IPHDR)));
 
     // Set UDP Checksum
-    m->msg.pre.udp.check = htons (udp_checksum ((UCHAR *) &m->msg.pre.udp, 
+    m->msg->pre.udp.check = htons (udp_checksum ((UCHAR *) &m->msg->pre.udp, 
         sizeof (UDPHDR) + sizeof (DHCP) + m->optlen,
-        (UCHAR *)&m->msg.pre.ip.saddr,
-        (UCHAR *)&m->msg.pre.ip.daddr));
+        (UCHAR *)&m->msg->pre.ip.saddr,
+        (UCHAR *)&m->msg->pre.ip.daddr));
 }
 
 //===================
@@ -388,7 +388,9 @@ SendDHCPMsg(
     __in const DHCP *dhcp
     )
 {
-    DHCPMsg *pkt;
+    DHCPMsg reply;
+    DHCPMsg *pkt = &reply;
+    PNET_BUFFER_LIST netBufferList;
 
     if (!(type == DHCPOFFER || type == DHCPACK || type == DHCPNAK))
     {
@@ -396,9 +398,17 @@ SendDHCPMsg(
         return;
     }
 
-    pkt = (DHCPMsg *) MemAlloc (sizeof (DHCPMsg), TRUE);
+    // Only the option state lives here. The message itself is built
+    // directly in the (zeroed) inject buffer.
+    NdisZeroMemory (pkt, sizeof (DHCPMsg));
 
-    if(pkt)
+    netBufferList = tapAllocateReplyNetBufferList (
+                        Adapter,
+                        sizeof (DHCPFull),
+                        (PUCHAR *) &pkt->msg
+                        );
+
+    if(netBufferList)
     {
         //-----------------------
         // Build DHCP options
@@ -433,7 +443,7 @@ SendDHCPMsg(
             // The initial part of the DHCP message (not including options) gets built here
             BuildDHCPPre (
                 Adapter,
-                &pkt->msg.pre,
+                &pkt->msg->pre,
                 eth,
                 ip,
                 udp,
@@ -448,18 +458,18 @@ SendDHCPMsg(
                 DHCPMSG_LEN_FULL (pkt));
 
             // Return DHCP response to kernel
-            IndicateReceivePacket(
+            tapIndicateReplyNetBufferList(
                 Adapter,
-                DHCPMSG_BUF (pkt),
+                netBufferList,
                 DHCPMSG_LEN_FULL (pkt)
                 );
         }
         else
         {
             DEBUGP (("[TAP] SendDHCPMsg: DHCP buffer overflow\n"));
-        }
 
-        MemFree (pkt, sizeof (DHCPMsg));
+            tapFreeReceiveNetBufferList(Adapter, netBufferList);
+        }
     }
 }
 
@@ -89,7 +89,7 @@ typedef struct {
 typedef struct {
   unsigned int optlen;
   BOOLEAN overflow;
-  DHCPFull msg;
+  DHCPFull *msg;     /* built in place in the inject buffer */
 } DHCPMsg;
 
 //===================
@@ -99,7 +99,7 @@ typedef struct {
 #define DHCPMSG_LEN_BASE(p) (sizeof (DHCPPre))
 #define DHCPMSG_LEN_OPT(p)  ((p)->optlen)
 #define DHCPMSG_LEN_FULL(p) (DHCPMSG_LEN_BASE(p) + DHCPMSG_LEN_OPT(p))
-#define DHCPMSG_BUF(p)      ((UCHAR*) &(p)->msg)
+#define DHCPMSG_BUF(p)      ((UCHAR*) (p)->msg)
 #define DHCPMSG_OVERFLOW(p) ((p)->overflow)
 
 //========================================
@@ -83,6 +83,199 @@ MemFree(
     }
 }
 
+//======================================================================
+// TAP Packet Pool Support
+//======================================================================
+
+VOID
+tapPacketPoolInitialize(
+    __in PTAP_PACKET_POOL   TapPacketPool,
+    __in NDIS_HANDLE        MiniportAdapterHandle,
+    __in ULONG              MtuSize
+    )
+/*++
+
+Routine Description:
+
+    Set up the TAP packet size classes. Every host send NB is copied into a
+    TAP packet, so these are allocated and freed at the packet rate.
+
+    The standard class holds any Ethernet frame with an 802.1Q tag. A jumbo
+    class is only created if the configured MTU needs it.
+
+Arguments:
+
+    TapPacketPool           Pool to initialize
+    MiniportAdapterHandle   Adapter handle used for general pool allocations
+    MtuSize                 Configured adapter MTU
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG   jumboSize = ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE + MtuSize;
+    ULONG   i;
+
+    NdisZeroMemory(TapPacketPool, sizeof(TAP_PACKET_POOL));
+
+    TapPacketPool->MiniportAdapterHandle = MiniportAdapterHandle;
+
+    TapPacketPool->DataSize[TAP_PACKET_POOL_CLASS_STANDARD] =
+        ETHERNET_PACKET_SIZE + VLAN_TAG_SIZE;
+
+    if(jumboSize > TapPacketPool->DataSize[TAP_PACKET_POOL_CLASS_STANDARD])
+    {
+        TapPacketPool->DataSize[TAP_PACKET_POOL_CLASS_JUMBO] = jumboSize;
+    }
+
+    for(i = 0; i < TAP_PACKET_POOL_CLASS_COUNT; ++i)
+    {
+        if(TapPacketPool->DataSize[i] == 0)
+        {
+            continue;
+        }
+
+        NdisInitializeNPagedLookasideList(
+            &TapPacketPool->Lookaside[i],
+            NULL,       // Allocate function
+            NULL,       // Free function
+            0,          // Flags
+            TAP_PACKET_SIZE(TapPacketPool->DataSize[i]),
+            TAP_PACKET_TAG,
+            0           // Depth
+            );
+    }
+}
+
+VOID
+tapPacketPoolFree(
+    __in PTAP_PACKET_POOL   TapPacketPool
+    )
+{
+    ULONG   i;
+
+    ASSERT(TapPacketPool->InUseCount == 0);
+
+    DEBUGP (("[TAP] tapPacketPoolFree: Hits %I64d, Misses %I64d, MAX in use %d\n",
+        TapPacketPool->Hits, TapPacketPool->Misses, TapPacketPool->MaxInUseCount));
+
+    for(i = 0; i < TAP_PACKET_POOL_CLASS_COUNT; ++i)
+    {
+        if(TapPacketPool->DataSize[i] != 0)
+        {
+            NdisDeleteNPagedLookasideList(&TapPacketPool->Lookaside[i]);
+            TapPacketPool->DataSize[i] = 0;
+        }
+    }
+}
+
+PTAP_PACKET
+tapPacketAllocate(
+    __in PTAP_PACKET_POOL   TapPacketPool,
+    __in ULONG              DataSize
+    )
+{
+    PTAP_PACKET     tapPacket = NULL;
+    ULONG           poolClass = TAP_PACKET_POOL_CLASS_NONE;
+    ULONG           i;
+    LONG            inUseCount;
+    LONG            maxInUseCount;
+
+    // Find the smallest size class that fits.
+    for(i = 0; i < TAP_PACKET_POOL_CLASS_COUNT; ++i)
+    {
+        if(DataSize <= TapPacketPool->DataSize[i])
+        {
+            poolClass = i;
+            break;
+        }
+    }
+
+    if(poolClass != TAP_PACKET_POOL_CLASS_NONE)
+    {
+        tapPacket = (PTAP_PACKET )NdisAllocateFromNPagedLookasideList(
+                        &TapPacketPool->Lookaside[poolClass]
+                        );
+    }
+    else
+    {
+        tapPacket = (PTAP_PACKET )NdisAllocateMemoryWithTagPriority(
+                        TapPacketPool->MiniportAdapterHandle,
+                        TAP_PACKET_SIZE (DataSize),
+                        TAP_PACKET_TAG,
+                        NormalPoolPriority
+                        );
+    }
+
+    if(tapPacket == NULL)
+    {
+        return NULL;
+    }
+
+    // Only packets actually handed out are counted.
+    if(poolClass != TAP_PACKET_POOL_CLASS_NONE)
+    {
+        InterlockedIncrement64(&TapPacketPool->Hits);
+    }
+    else
+    {
+        InterlockedIncrement64(&TapPacketPool->Misses);
+    }
+
+    tapPacket->m_PoolClass = poolClass;
+
+    // Track the in-use high-water mark.
+    inUseCount = InterlockedIncrement(&TapPacketPool->InUseCount);
+    maxInUseCount = TapPacketPool->MaxInUseCount;
+
+    while(inUseCount > maxInUseCount)
+    {
+        LONG    previous = InterlockedCompareExchange(
+                            &TapPacketPool->MaxInUseCount,
+                            inUseCount,
+                            maxInUseCount
+                            );
+
+        if(previous == maxInUseCount)
+        {
+            DEBUGP (("[TAP] tapPacketAllocate: New MAX in-use packet count = %d\n",
+                inUseCount));
+            break;
+        }
+
+        maxInUseCount = previous;
+    }
+
+    return tapPacket;
+}
+
+VOID
+tapPacketFree(
+    __in PTAP_PACKET_POOL   TapPacketPool,
+    __in PTAP_PACKET        TapPacket
+    )
+{
+    ULONG   poolClass = TapPacket->m_PoolClass;
+
+    if(poolClass != TAP_PACKET_POOL_CLASS_NONE)
+    {
+        ASSERT(poolClass < TAP_PACKET_POOL_CLASS_COUNT);
+
+        NdisFreeToNPagedLookasideList(
+            &TapPacketPool->Lookaside[poolClass],
+            TapPacket
+            );
+    }
+    else
+    {
+        NdisFreeMemory(TapPacket,0,0);
+    }
+
+    InterlockedDecrement(&TapPacketPool->InUseCount);
+}
+
 //======================================================================
 // TAP Packet Queue Support
 //======================================================================
@@ -93,30 +286,258 @@ tapPacketQueueInsertTail(
     __in PTAP_PACKET        TapPacket
     )
 {
-    KIRQL  irql;
-
-    KeAcquireSpinLock(&TapPacketQueue->QueueLock,&irql);
-
-    InsertTailList(&TapPacketQueue->Queue,&TapPacket->QueueLink);
+    TapPacket->m_EnqueueTime = KeQueryInterruptTime();
 
     // BUGBUG!!! Enforce PACKET_QUEUE_SIZE queue count limit???
     // For NDIS 6 there is no per-packet status, so this will need to
     // be handled on per-NBL basis in AdapterSendNetBufferLists...
 
-    // Update counts
-    ++TapPacketQueue->Count;
-    TapPacketQueue->TotalBytes += (TapPacket->m_SizeFlags & TP_SIZE_MASK);
+    tapPacketQueuePushIncoming(
+        TapPacketQueue,
+        &TapPacket->IncomingLink,
+        (LONG )(TapPacket->m_SizeFlags & TP_SIZE_MASK)
+        );
+}
+
+//
+// 802.1p user priorities in increasing order of precedence. Priority 1
+// (background) ranks below priority 0 (best effort).
+//
+static const UCHAR tapPriorityRank[8] = { 1, 0, 2, 3, 4, 5, 6, 7 };
+
+static PTAP_PACKET_CLASS
+tapPacketQueueClass(
+    __in PTAP_PACKET_QUEUE  TapPacketQueue,
+    __in PTAP_PACKET        TapPacket
+    )
+{
+    ULONG   rank = tapPriorityRank[TapPacket->m_Priority & 7];
+
+    return &TapPacketQueue->Classes[rank * TapPacketQueue->ClassCount / 8];
+}
+
+// Call with QueueLock held
+static VOID
+tapPacketQueueMoveIncomingLocked(
+    __in PTAP_PACKET_QUEUE  TapPacketQueue
+    )
+{
+    PSLIST_ENTRY    entry;
+
+    entry = tapPacketQueueTakeIncomingLocked(TapPacketQueue);
+
+    // Append new arrivals to the flow queues oldest first.
+    while(entry != NULL)
+    {
+        PTAP_PACKET         tapPacket;
+        PTAP_PACKET_CLASS   packetClass;
+        PTAP_PACKET_FLOW    flow;
+
+        tapPacket = CONTAINING_RECORD(entry, TAP_PACKET, IncomingLink);
+        entry = entry->Next;
+
+        packetClass = tapPacketQueueClass(TapPacketQueue,tapPacket);
+        flow = &packetClass->Flows[tapPacket->m_FlowHash % TapPacketQueue->FlowCount];
+
+        if(IsListEmpty(&flow->Queue))
+        {
+            if(IsListEmpty(&packetClass->ActiveFlows))
+            {
+                packetClass->Deficit = 0;
+                InsertTailList(&TapPacketQueue->ActiveClasses,&packetClass->ActiveLink);
+            }
+
+            // Newly backlogged flows join the end of the round.
+            flow->Deficit = 0;
+            InsertTailList(&packetClass->ActiveFlows,&flow->ActiveLink);
+        }
+
+        InsertTailList(&flow->Queue,&tapPacket->QueueLink);
+        flow->Bytes += (LONG )(tapPacket->m_SizeFlags & TP_SIZE_MASK);
+
+        if(++packetClass->Count > packetClass->MaxCount)
+        {
+            packetClass->MaxCount = packetClass->Count;
+        }
+    }
+}
 
+//
+// Deficit round robin over the flows of a backlogged class. The flow at
+// the head of ActiveFlows sends while its deficit covers its head packet;
+// otherwise it is given another quantum and moves to the end of the round.
+//
+static PTAP_PACKET
+tapPacketClassSelectLocked(
+    __in PTAP_PACKET_QUEUE  TapPacketQueue,
+    __in PTAP_PACKET_CLASS  PacketClass,
+    __out PTAP_PACKET_FLOW  *Flow
+    )
+{
+    for(;;)
+    {
+        PTAP_PACKET_FLOW    flow;
+        PTAP_PACKET         tapPacket;
 
-    if(TapPacketQueue->Count > TapPacketQueue->MaxCount)
+        flow = CONTAINING_RECORD(PacketClass->ActiveFlows.Flink, TAP_PACKET_FLOW, ActiveLink);
+        tapPacket = CONTAINING_RECORD(flow->Queue.Flink, TAP_PACKET, QueueLink);
+
+        if(flow->Deficit >= (LONG )(tapPacket->m_SizeFlags & TP_SIZE_MASK))
+        {
+            *Flow = flow;
+            return tapPacket;
+        }
+
+        flow->Deficit += TapPacketQueue->Quantum;
+
+        RemoveEntryList(&flow->ActiveLink);
+        InsertTailList(&PacketClass->ActiveFlows,&flow->ActiveLink);
+    }
+}
+
+//
+// Pick the packet to send next from the packets already moved off the
+// Incoming list.
+//
+// The result is stable: until it is removed, the same packet is selected
+// again, because only tapPacketQueuePeekHeadLocked takes in new arrivals.
+//
+static PTAP_PACKET
+tapPacketQueueSelectLocked(
+    __in PTAP_PACKET_QUEUE  TapPacketQueue,
+    __out PTAP_PACKET_CLASS *Class,
+    __out PTAP_PACKET_FLOW  *Flow
+    )
+{
+    PTAP_PACKET_CLASS   packetClass;
+    PTAP_PACKET         tapPacket;
+    ULONG               i;
+
+    if(IsListEmpty(&TapPacketQueue->ActiveClasses))
+    {
+        return NULL;
+    }
+
+    if(TapPacketQueue->Schedule == TAP_PACKET_QUEUE_SCHEDULE_STRICT)
     {
-        TapPacketQueue->MaxCount = TapPacketQueue->Count;
+        // Highest backlogged class.
+        for(i = TapPacketQueue->ClassCount; i-- > 0; )
+        {
+            packetClass = &TapPacketQueue->Classes[i];
+
+            if(!IsListEmpty(&packetClass->ActiveFlows))
+            {
+                *Class = packetClass;
+                return tapPacketClassSelectLocked(TapPacketQueue,packetClass,Flow);
+            }
+        }
 
-        DEBUGP (("[TAP] tapPacketQueueInsertTail: New MAX queued packet count = %d\n",
-            TapPacketQueue->MaxCount));
+        ASSERT(FALSE);
+        return NULL;
     }
 
-    KeReleaseSpinLock(&TapPacketQueue->QueueLock,irql);
+    // Weighted: deficit round robin over the backlogged classes.
+    for(;;)
+    {
+        packetClass = CONTAINING_RECORD(TapPacketQueue->ActiveClasses.Flink, TAP_PACKET_CLASS, ActiveLink);
+        tapPacket = tapPacketClassSelectLocked(TapPacketQueue,packetClass,Flow);
+
+        if(packetClass->Deficit >= (LONG )(tapPacket->m_SizeFlags & TP_SIZE_MASK))
+        {
+            *Class = packetClass;
+            return tapPacket;
+        }
+
+        packetClass->Deficit += TapPacketQueue->Quantum * packetClass->Weight;
+
+        RemoveEntryList(&packetClass->ActiveLink);
+        InsertTailList(&TapPacketQueue->ActiveClasses,&packetClass->ActiveLink);
+    }
+}
+
+// Call with QueueLock held
+PTAP_PACKET
+tapPacketQueuePeekHeadLocked(
+    __in PTAP_PACKET_QUEUE      TapPacketQueue,
+    __out_opt PTAP_PACKET_FLOW  *Flow
+    )
+{
+    PTAP_PACKET_CLASS   packetClass;
+    PTAP_PACKET_FLOW    flow;
+    PTAP_PACKET         tapPacket;
+
+    // Pick up new arrivals so that they take part in the round.
+    tapPacketQueueMoveIncomingLocked(TapPacketQueue);
+
+    tapPacket = tapPacketQueueSelectLocked(TapPacketQueue,&packetClass,&flow);
+
+    if(tapPacket != NULL && Flow != NULL)
+    {
+        *Flow = flow;
+    }
+
+    return tapPacket;
+}
+
+// Call with QueueLock held
+static PTAP_PACKET
+tapPacketQueueRemoveLocked(
+    __in PTAP_PACKET_QUEUE  TapPacketQueue,
+    __out PTAP_PACKET_CLASS *Class
+    )
+{
+    PTAP_PACKET_CLASS   packetClass;
+    PTAP_PACKET_FLOW    flow;
+    PTAP_PACKET         tapPacket;
+    LONG                size;
+
+    // Remove what the last peek returned, if anything.
+    tapPacket = tapPacketQueueSelectLocked(TapPacketQueue,&packetClass,&flow);
+
+    if(tapPacket == NULL)
+    {
+        tapPacketQueueMoveIncomingLocked(TapPacketQueue);
+
+        tapPacket = tapPacketQueueSelectLocked(TapPacketQueue,&packetClass,&flow);
+
+        if(tapPacket == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    size = (LONG )(tapPacket->m_SizeFlags & TP_SIZE_MASK);
+
+    RemoveEntryList(&tapPacket->QueueLink);
+
+    flow->Deficit -= size;
+    flow->Bytes -= size;
+
+    if(IsListEmpty(&flow->Queue))
+    {
+        // Idle flows keep no credit.
+        RemoveEntryList(&flow->ActiveLink);
+        flow->Deficit = 0;
+    }
+
+    if(TapPacketQueue->Schedule == TAP_PACKET_QUEUE_SCHEDULE_WEIGHTED)
+    {
+        packetClass->Deficit -= size;
+    }
+
+    if(IsListEmpty(&packetClass->ActiveFlows))
+    {
+        RemoveEntryList(&packetClass->ActiveLink);
+        packetClass->Deficit = 0;
+    }
+
+    --packetClass->Count;
+
+    tapPacketQueueRemovedLocked(TapPacketQueue,size);
+
+    *Class = packetClass;
+
+    return tapPacket;
 }
 
 // Call with QueueLock held
@@ -125,18 +546,25 @@ tapPacketRemoveHeadLocked(
     __in PTAP_PACKET_QUEUE  TapPacketQueue
     )
 {
-    PTAP_PACKET     tapPacket = NULL;
-    PLIST_ENTRY     listEntry;
+    PTAP_PACKET_CLASS   packetClass;
 
-    listEntry = RemoveHeadList(&TapPacketQueue->Queue);
+    return tapPacketQueueRemoveLocked(TapPacketQueue,&packetClass);
+}
 
-    if(listEntry != &TapPacketQueue->Queue)
-    {
-        tapPacket = CONTAINING_RECORD(listEntry, TAP_PACKET, QueueLink);
+// Call with QueueLock held
+PTAP_PACKET
+tapPacketQueueDropHeadLocked(
+    __in PTAP_PACKET_QUEUE  TapPacketQueue
+    )
+{
+    PTAP_PACKET_CLASS   packetClass;
+    PTAP_PACKET         tapPacket;
 
-        // Update counts
-        --TapPacketQueue->Count;
-        TapPacketQueue->TotalBytes -= (tapPacket->m_SizeFlags & TP_SIZE_MASK);
+    tapPacket = tapPacketQueueRemoveLocked(TapPacketQueue,&packetClass);
+
+    if(tapPacket != NULL)
+    {
+        ++packetClass->Drops;
     }
 
     return tapPacket;
@@ -147,9 +575,105 @@ tapPacketQueueInitialize(
     __in PTAP_PACKET_QUEUE  TapPacketQueue
     )
 {
+    InitializeSListHead(&TapPacketQueue->Incoming);
+
     KeInitializeSpinLock(&TapPacketQueue->QueueLock);
 
-    NdisInitializeListHead(&TapPacketQueue->Queue);
+    NdisInitializeListHead(&TapPacketQueue->ActiveClasses);
+
+    TapPacketQueue->Classes = NULL;
+    TapPacketQueue->ClassCount = 0;
+    TapPacketQueue->FlowCount = 0;
+}
+
+NDIS_STATUS
+tapPacketQueueConfigure(
+    __in PTAP_PACKET_QUEUE  TapPacketQueue,
+    __in NDIS_HANDLE        MiniportAdapterHandle,
+    __in ULONG              ClassCount,
+    __in ULONG              Schedule,
+    __in ULONG              FlowCount,
+    __in ULONG              Quantum
+    )
+{
+    PTAP_PACKET_FLOW    flows;
+    ULONG               i;
+    ULONG               j;
+
+    ASSERT(TapPacketQueue->Count == 0);
+    ASSERT(TapPacketQueue->Classes == NULL);
+
+    ClassCount = max(1,min(ClassCount,TAP_PACKET_QUEUE_MAX_CLASSES));
+    FlowCount = max(1,min(FlowCount,TAP_PACKET_QUEUE_MAX_FLOWS));
+
+    //
+    // Allocate the classes and, behind them, the flow queues of all classes
+    // in one block, sized for the configured counts.
+    //
+    TapPacketQueue->Classes = (PTAP_PACKET_CLASS )NdisAllocateMemoryWithTagPriority(
+                                MiniportAdapterHandle,
+                                ClassCount * (sizeof(TAP_PACKET_CLASS)
+                                    + FlowCount * sizeof(TAP_PACKET_FLOW)),
+                                TAP_PACKET_TAG,
+                                NormalPoolPriority
+                                );
+
+    if(TapPacketQueue->Classes == NULL)
+    {
+        return NDIS_STATUS_RESOURCES;
+    }
+
+    NdisZeroMemory(
+        TapPacketQueue->Classes,
+        ClassCount * (sizeof(TAP_PACKET_CLASS) + FlowCount * sizeof(TAP_PACKET_FLOW))
+        );
+
+    flows = (PTAP_PACKET_FLOW )&TapPacketQueue->Classes[ClassCount];
+
+    for(i = 0; i < ClassCount; ++i)
+    {
+        PTAP_PACKET_CLASS   packetClass = &TapPacketQueue->Classes[i];
+
+        NdisInitializeListHead(&packetClass->ActiveFlows);
+        packetClass->Weight = i + 1;
+        packetClass->Flows = &flows[i * FlowCount];
+
+        for(j = 0; j < FlowCount; ++j)
+        {
+            NdisInitializeListHead(&packetClass->Flows[j].Queue);
+            tapAqmInitialize(&packetClass->Flows[j].AqmState);
+        }
+    }
+
+    TapPacketQueue->ClassCount = ClassCount;
+    TapPacketQueue->FlowCount = FlowCount;
+
+    if(Schedule > TAP_PACKET_QUEUE_SCHEDULE_MAX)
+    {
+        Schedule = TAP_PACKET_QUEUE_SCHEDULE_STRICT;
+    }
+
+    TapPacketQueue->Schedule = Schedule;
+    TapPacketQueue->Quantum = (LONG )max(Quantum,ETHERNET_PACKET_SIZE);
+
+    return NDIS_STATUS_SUCCESS;
+}
+
+VOID
+tapPacketQueueFree(
+    __in PTAP_PACKET_QUEUE  TapPacketQueue
+    )
+{
+    ASSERT(TapPacketQueue->Count == 0);
+
+    if(TapPacketQueue->Classes != NULL)
+    {
+        NdisFreeMemory(TapPacketQueue->Classes,0,0);
+    }
+
+    TapPacketQueue->Classes = NULL;
+    TapPacketQueue->ClassCount = 0;
+    TapPacketQueue->FlowCount = 0;
 }
 
 //======================================================================
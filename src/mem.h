@@ -45,34 +45,106 @@ MemFree(
 typedef
 struct _TAP_PACKET
 {
-    LIST_ENTRY                  QueueLink;
+    // A packet is first pushed onto the queue's Incoming list and later
+    // moved to its Queue list by the consumer.
+    union
+    {
+        SLIST_ENTRY             IncomingLink;
+        LIST_ENTRY              QueueLink;
+    };
 
 #   define TAP_PACKET_SIZE(data_size) (sizeof (TAP_PACKET) + (data_size))
 #   define TP_TUN 0x80000000
-#   define TP_SIZE_MASK      (~TP_TUN)
+#   define TP_OFFLOAD 0x40000000     // Read with m_Metadata.Offload in front
+#   define TP_METADATA 0x20000000    // Read with all of m_Metadata in front
+#   define TP_SIZE_MASK      (~(TP_TUN | TP_OFFLOAD | TP_METADATA))
     ULONG                       m_SizeFlags;
 
+    // TAP packet pool size class this packet was taken from.
+    ULONG                       m_PoolClass;
+
+    // Flow hash used to pick the packet's flow queue.
+    ULONG                       m_FlowHash;
+
+    // 802.1p user priority used to pick the packet's priority class.
+    ULONG                       m_Priority;
+
+    // Interrupt time when the packet was queued, used by active queue
+    // management to judge its sojourn time.
+    ULONG64                     m_EnqueueTime;
+
+    // Offload state and metadata passed to userspace if TP_OFFLOAD is
+    // set. Offsets are from the start of m_Data.
+    TAP_WIN_METADATA_HEADER     m_Metadata;
+
     // m_Data must be the last struct member
     UCHAR                       m_Data [];
 } TAP_PACKET, *PTAP_PACKET;
 
 #define TAP_PACKET_TAG      '6PAT'  // "TAP6"
 
-typedef struct _TAP_PACKET_QUEUE
+//----------------------
+// TAP Packet Pool
+//----------------------
+
+// TAP packet data size classes. Larger packets come from the general pool.
+#define TAP_PACKET_POOL_CLASS_STANDARD  0   // Ethernet frame plus 802.1Q tag
+#define TAP_PACKET_POOL_CLASS_JUMBO     1   // Configured MTU frame, if larger
+#define TAP_PACKET_POOL_CLASS_COUNT     2
+#define TAP_PACKET_POOL_CLASS_NONE      ((ULONG )-1)
+
+typedef struct _TAP_PACKET_POOL
 {
-    KSPIN_LOCK      QueueLock;
-    LIST_ENTRY      Queue;
-    ULONG           Count;          // Count of currently queued items
-    ULONG           TotalBytes;     // Total length of queued packets
-    ULONG           MaxCount;
-} TAP_PACKET_QUEUE, *PTAP_PACKET_QUEUE;
+    NPAGED_LOOKASIDE_LIST   Lookaside[TAP_PACKET_POOL_CLASS_COUNT];
+    ULONG                   DataSize[TAP_PACKET_POOL_CLASS_COUNT];  // Zero if class unused
+
+    NDIS_HANDLE             MiniportAdapterHandle;
+
+    // Statistics
+    volatile LONG64         Hits;           // Packets taken from a size class
+    volatile LONG64         Misses;         // Packets taken from the general pool
+    volatile LONG           InUseCount;     // Packets currently allocated
+    volatile LONG           MaxInUseCount;
+} TAP_PACKET_POOL, *PTAP_PACKET_POOL;
+
+VOID
+tapPacketPoolInitialize(
+    __in PTAP_PACKET_POOL   TapPacketPool,
+    __in NDIS_HANDLE        MiniportAdapterHandle,
+    __in ULONG              MtuSize
+    );
+
+VOID
+tapPacketPoolFree(
+    __in PTAP_PACKET_POOL   TapPacketPool
+    );
 
+PTAP_PACKET
+tapPacketAllocate(
+    __in PTAP_PACKET_POOL   TapPacketPool,
+    __in ULONG              DataSize
+    );
+
+VOID
+tapPacketFree(
+    __in PTAP_PACKET_POOL   TapPacketPool,
+    __in PTAP_PACKET        TapPacket
+    );
+
+// May be called concurrently from any number of CPUs.
 VOID
 tapPacketQueueInsertTail(
     __in PTAP_PACKET_QUEUE  TapPacketQueue,
     __in PTAP_PACKET        TapPacket
     );
 
+// Call with QueueLock held. Returns the packet the scheduler will remove
+// next and, optionally, the flow queue it belongs to.
+PTAP_PACKET
+tapPacketQueuePeekHeadLocked(
+    __in PTAP_PACKET_QUEUE      TapPacketQueue,
+    __out_opt PTAP_PACKET_FLOW  *Flow
+    );
 
 // Call with QueueLock held
 PTAP_PACKET
@@ -80,11 +152,36 @@ tapPacketRemoveHeadLocked(
     __in PTAP_PACKET_QUEUE  TapPacketQueue
     );
 
+// Call with QueueLock held. Like tapPacketRemoveHeadLocked, but counts
+// the packet as dropped by its priority class.
+PTAP_PACKET
+tapPacketQueueDropHeadLocked(
+    __in PTAP_PACKET_QUEUE  TapPacketQueue
+    );
+
 VOID
 tapPacketQueueInitialize(
     __in PTAP_PACKET_QUEUE  TapPacketQueue
     );
 
+// Allocates ClassCount classes of FlowCount flow queues each. Call once,
+// after tapPacketQueueInitialize and before packets are queued.
+NDIS_STATUS
+tapPacketQueueConfigure(
+    __in PTAP_PACKET_QUEUE  TapPacketQueue,
+    __in NDIS_HANDLE        MiniportAdapterHandle,
+    __in ULONG              ClassCount,
+    __in ULONG              Schedule,
+    __in ULONG              FlowCount,
+    __in ULONG              Quantum
+    );
+
+// Call once the queue is empty. Safe on a queue that was never configured.
+VOID
+tapPacketQueueFree(
+    __in PTAP_PACKET_QUEUE  TapPacketQueue
+    );
+
 //----------------------
 // Cancel-Safe IRP Queue
 //----------------------
@@ -0,0 +1,1242 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This code was inspired by the CIPE-Win32 driver by Damion K. Wilson.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+//
+// Include files.
+//
+
+#include "tap.h"
+
+//======================================================================
+// Checksums
+//======================================================================
+
+ULONG
+tapChecksumAdd(
+    __in_bcount(Length) const UCHAR *Data,
+    __in ULONG                  Length,
+    __in ULONG                  Sum
+    )
+{
+    ULONG   i;
+
+    // At most 32K words of 0xFFFF each, so this cannot overflow for any
+    // frame we handle.
+    for (i = 0; i + 1 < Length; i += 2)
+    {
+        Sum += ((ULONG )Data[i] << 8) | Data[i + 1];
+    }
+
+    // An odd trailing byte is padded with zero.
+    if (Length & 1)
+    {
+        Sum += (ULONG )Data[Length - 1] << 8;
+    }
+
+    while (Sum >> 16)
+    {
+        Sum = (Sum & 0xFFFF) + (Sum >> 16);
+    }
+
+    return Sum;
+}
+
+ULONG
+tapChecksumPseudoHeader(
+    __in const UCHAR            *SourceAddress,
+    __in const UCHAR            *DestinationAddress,
+    __in ULONG                  AddressLength,
+    __in UCHAR                  Protocol,
+    __in ULONG                  Length
+    )
+{
+    ULONG   sum;
+
+    sum = tapChecksumAdd(SourceAddress, AddressLength, 0);
+    sum = tapChecksumAdd(DestinationAddress, AddressLength, sum);
+    sum += Protocol + (Length >> 16) + (Length & 0xFFFF);
+
+    while (sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return sum;
+}
+
+//======================================================================
+// Checksum offload
+//======================================================================
+
+BOOLEAN
+tapChecksumParseFrame(
+    __in_bcount(Length) const UCHAR *Frame,
+    __in ULONG                  Length,
+    __in ULONG                  IpOffset,
+    __out PBOOLEAN              IPv6,
+    __out PUCHAR                Protocol,
+    __out PULONG                TransportOffset
+    )
+/*++
+
+Routine Description:
+
+    Locate the TCP or UDP header of an IP packet whose checksum is to be
+    offloaded. IPv4 fragments and IPv6 packets with extension headers are
+    not handled; we never advertise offloads for them.
+
+Arguments:
+
+    Frame                       Frame holding the IP packet
+    Length                      Length of Frame
+    IpOffset                    Offset of the IP header in Frame
+    IPv6                        Receives TRUE for IPv6
+    Protocol                    Receives IPPROTO_TCP or IPPROTO_UDP
+    TransportOffset             Receives the offset of the TCP or UDP header
+
+Return Value:
+
+    TRUE if the frame holds a complete TCP or UDP header.
+
+--*/
+{
+    ULONG       transportOffset;
+    UCHAR       protocol;
+
+    if (Length < IpOffset + IP_HEADER_SIZE)
+    {
+        return FALSE;
+    }
+
+    if (IPH_GET_VER(Frame[IpOffset]) == 4)
+    {
+        const IPHDR UNALIGNED *ip = (const IPHDR UNALIGNED *)(Frame + IpOffset);
+
+        if (ntohs(ip->frag_off) & (IP_OFFMASK | 0x2000))
+        {
+            return FALSE;
+        }
+
+        protocol = ip->protocol;
+        transportOffset = IpOffset + IPH_GET_LEN(ip->version_len);
+        *IPv6 = FALSE;
+    }
+    else if (IPH_GET_VER(Frame[IpOffset]) == 6 && Length >= IpOffset + IPV6_HEADER_SIZE)
+    {
+        const IPV6HDR UNALIGNED *ip = (const IPV6HDR UNALIGNED *)(Frame + IpOffset);
+
+        protocol = ip->nexthdr;
+        transportOffset = IpOffset + IPV6_HEADER_SIZE;
+        *IPv6 = TRUE;
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    if (protocol == IPPROTO_TCP)
+    {
+        if (Length < transportOffset + sizeof(TCPHDR))
+        {
+            return FALSE;
+        }
+    }
+    else if (protocol == IPPROTO_UDP)
+    {
+        if (Length < transportOffset + sizeof(UDPHDR))
+        {
+            return FALSE;
+        }
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    *Protocol = protocol;
+    *TransportOffset = transportOffset;
+
+    return TRUE;
+}
+
+VOID
+tapChecksumPrepareFrame(
+    __inout_bcount(Length) PUCHAR Frame,
+    __in ULONG                  Length,
+    __in ULONG                  IpOffset,
+    __in PVOID                  ChecksumInfo,
+    __inout_opt TAP_WIN_OFFLOAD_HEADER *OffloadHeader
+    )
+/*++
+
+Routine Description:
+
+    Carry out the checksum offloads the stack asked for on a frame it
+    sent.
+
+    The IPv4 header checksum only covers the header and is always
+    computed here. As with hardware offload, the stack leaves the
+    pseudo header sum in the TCP or UDP checksum field. With an offload
+    header, that partial checksum is passed on to userspace to finish,
+    just as virtio does. Without one the full checksum is computed here.
+
+    Frames that cannot be parsed are left alone.
+
+Arguments:
+
+    Frame                       Frame holding the IP packet
+    Length                      Length of Frame
+    IpOffset                    Offset of the IP header in Frame
+    ChecksumInfo                TcpIpChecksumNetBufferListInfo of the NBL
+    OffloadHeader               Offload header to describe the checksum in,
+                                or NULL to compute it here
+
+Return Value:
+
+    None.
+
+--*/
+{
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO checksumInfo;
+    ULONG       transportOffset;
+    ULONG       checksumOffset;
+    ULONG       sum;
+    UCHAR       protocol;
+    BOOLEAN     ipv6;
+
+    checksumInfo.Value = ChecksumInfo;
+
+    if (!tapChecksumParseFrame(Frame,Length,IpOffset,&ipv6,&protocol,&transportOffset))
+    {
+        return;
+    }
+
+    if (!ipv6 && checksumInfo.Transmit.IpHeaderChecksum)
+    {
+        IPHDR UNALIGNED *ip = (IPHDR UNALIGNED *)(Frame + IpOffset);
+
+        ip->check = 0;
+        ip->check = htons((USHORT )~tapChecksumAdd((PUCHAR )ip,IPH_GET_LEN(ip->version_len),0));
+    }
+
+    if (protocol == IPPROTO_TCP && checksumInfo.Transmit.TcpChecksum)
+    {
+        checksumOffset = TAP_TCP_CHECKSUM_OFFSET;
+    }
+    else if (protocol == IPPROTO_UDP && checksumInfo.Transmit.UdpChecksum)
+    {
+        checksumOffset = TAP_UDP_CHECKSUM_OFFSET;
+    }
+    else
+    {
+        return;
+    }
+
+    if (OffloadHeader != NULL)
+    {
+        OffloadHeader->Flags |= TAP_WIN_OFFLOAD_F_NEEDS_CSUM;
+        OffloadHeader->CsumStart = (USHORT )transportOffset;
+        OffloadHeader->CsumOffset = (USHORT )checksumOffset;
+
+        return;
+    }
+
+    if (ipv6)
+    {
+        IPV6HDR UNALIGNED *ip = (IPV6HDR UNALIGNED *)(Frame + IpOffset);
+
+        sum = tapChecksumPseudoHeader(ip->saddr,ip->daddr,sizeof(IPV6ADDR),protocol,Length - transportOffset);
+    }
+    else
+    {
+        IPHDR UNALIGNED *ip = (IPHDR UNALIGNED *)(Frame + IpOffset);
+
+        sum = tapChecksumPseudoHeader(
+                (PUCHAR )&ip->saddr,
+                (PUCHAR )&ip->daddr,
+                sizeof(ULONG),
+                protocol,
+                Length - transportOffset
+                );
+    }
+
+    Frame[transportOffset + checksumOffset] = 0;
+    Frame[transportOffset + checksumOffset + 1] = 0;
+
+    sum = (USHORT )~tapChecksumAdd(Frame + transportOffset,Length - transportOffset,sum);
+
+    // A UDP checksum of zero means none was computed.
+    if (sum == 0 && protocol == IPPROTO_UDP)
+    {
+        sum = 0xFFFF;
+    }
+
+    Frame[transportOffset + checksumOffset] = (UCHAR )(sum >> 8);
+    Frame[transportOffset + checksumOffset + 1] = (UCHAR )sum;
+}
+
+BOOLEAN
+tapChecksumCompleteFrame(
+    __inout_bcount(Length) PUCHAR Frame,
+    __in ULONG                  Length,
+    __in const TAP_WIN_OFFLOAD_HEADER *OffloadHeader
+    )
+/*++
+
+Routine Description:
+
+    Finish the partial checksum of a frame written by userspace with
+    TAP_WIN_OFFLOAD_F_NEEDS_CSUM set. The checksum field already holds
+    the pseudo header sum.
+
+Arguments:
+
+    Frame                       Frame as written
+    Length                      Length of Frame
+    OffloadHeader               Offload header written with the frame
+
+Return Value:
+
+    FALSE if the checksum location lies outside the frame.
+
+--*/
+{
+    ULONG       start = OffloadHeader->CsumStart;
+    ULONG       field = start + OffloadHeader->CsumOffset;
+    ULONG       sum;
+
+    if (start >= Length || field + sizeof(USHORT) > Length)
+    {
+        return FALSE;
+    }
+
+    sum = (USHORT )~tapChecksumAdd(Frame + start,Length - start,0);
+
+    Frame[field] = (UCHAR )(sum >> 8);
+    Frame[field + 1] = (UCHAR )sum;
+
+    return TRUE;
+}
+
+//======================================================================
+// Large Send Offload
+//======================================================================
+
+static BOOLEAN
+tapLsoParseHeaders(
+    __in_bcount(Length) const UCHAR *Frame,
+    __in ULONG                  Length,
+    __in ULONG                  TcpOffset,
+    __out PULONG                IpOffset,
+    __out PBOOLEAN              IPv6,
+    __out PULONG                HeaderLength
+    )
+/*++
+
+Routine Description:
+
+    Locate the IP header of an LSOv2 frame and check it against the TCP
+    header offset the stack gave us.
+
+Arguments:
+
+    Frame                       Ethernet frame, possibly 802.1Q tagged
+    Length                      Length of Frame
+    TcpOffset                   Offset of the TCP header
+    IpOffset                    Receives the offset of the IP header
+    IPv6                        Receives TRUE for IPv6
+    HeaderLength                Receives the length of all headers
+
+Return Value:
+
+    TRUE if the frame is a TCP segment with sane headers.
+
+--*/
+{
+    ULONG       ipOffset = ETHERNET_HEADER_SIZE;
+    ULONG       tcpLength;
+    USHORT      proto;
+
+    if (Length < ETHERNET_HEADER_SIZE)
+    {
+        return FALSE;
+    }
+
+    proto = ntohs(((const ETH_HEADER *)Frame)->proto);
+
+    if (proto == NDIS_ETH_TYPE_802_1Q && Length >= ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE)
+    {
+        proto = ntohs(((const ETH_8021Q_HEADER UNALIGNED *)(Frame + ETHERNET_HEADER_SIZE))->EtherType);
+        ipOffset += VLAN_TAG_SIZE;
+    }
+
+    if (proto == NDIS_ETH_TYPE_IPV4)
+    {
+        const IPHDR UNALIGNED *ip = (const IPHDR UNALIGNED *)(Frame + ipOffset);
+
+        if (Length < ipOffset + IP_HEADER_SIZE
+            || ip->protocol != IPPROTO_TCP
+            || ipOffset + IPH_GET_LEN(ip->version_len) != TcpOffset)
+        {
+            return FALSE;
+        }
+
+        *IPv6 = FALSE;
+    }
+    else if (proto == NDIS_ETH_TYPE_IPV6)
+    {
+        // Extension headers may sit between the IPv6 and TCP headers.
+        if (Length < ipOffset + IPV6_HEADER_SIZE
+            || TcpOffset < ipOffset + IPV6_HEADER_SIZE)
+        {
+            return FALSE;
+        }
+
+        *IPv6 = TRUE;
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    if (Length < TcpOffset + sizeof(TCPHDR))
+    {
+        return FALSE;
+    }
+
+    tcpLength = TCPH_GET_DOFF(((const TCPHDR UNALIGNED *)(Frame + TcpOffset))->doff_res);
+
+    if (tcpLength < sizeof(TCPHDR)
+        || Length < TcpOffset + tcpLength
+        || Length - ipOffset > 0xFFFF)
+    {
+        return FALSE;
+    }
+
+    *IpOffset = ipOffset;
+    *HeaderLength = TcpOffset + tcpLength;
+
+    return TRUE;
+}
+
+BOOLEAN
+tapLsoPrepareFrame(
+    __inout_bcount(Length) PUCHAR Frame,
+    __in ULONG                  Length,
+    __in ULONG                  TcpOffset,
+    __in ULONG                  Mss,
+    __out TAP_WIN_OFFLOAD_HEADER *OffloadHeader
+    )
+/*++
+
+Routine Description:
+
+    Prepare an LSOv2 frame to be handed to userspace unsegmented.
+
+    The stack leaves the IP length field of LSOv2 frames unset, so it is
+    filled in for the whole frame. The IPv4 header checksum and the TCP
+    checksum are left as the stack set them; userspace computes them for
+    each segment.
+
+Arguments:
+
+    Frame                       Ethernet frame, possibly 802.1Q tagged
+    Length                      Length of Frame
+    TcpOffset                   Offset of the TCP header
+    Mss                         TCP payload bytes per segment
+    OffloadHeader               Receives the header describing the frame
+
+Return Value:
+
+    TRUE if the frame was prepared.
+
+--*/
+{
+    ULONG       ipOffset;
+    ULONG       headerLength;
+    BOOLEAN     ipv6;
+
+    if (!tapLsoParseHeaders(Frame,Length,TcpOffset,&ipOffset,&ipv6,&headerLength))
+    {
+        return FALSE;
+    }
+
+    NdisZeroMemory(OffloadHeader,sizeof(TAP_WIN_OFFLOAD_HEADER));
+
+    if (ipv6)
+    {
+        IPV6HDR UNALIGNED *ip = (IPV6HDR UNALIGNED *)(Frame + ipOffset);
+
+        ip->payload_len = htons((USHORT )(Length - ipOffset - IPV6_HEADER_SIZE));
+        OffloadHeader->GsoType = TAP_WIN_GSO_TCPV6;
+    }
+    else
+    {
+        IPHDR UNALIGNED *ip = (IPHDR UNALIGNED *)(Frame + ipOffset);
+
+        ip->tot_len = htons((USHORT )(Length - ipOffset));
+        OffloadHeader->GsoType = TAP_WIN_GSO_TCPV4;
+    }
+
+    OffloadHeader->Flags = TAP_WIN_OFFLOAD_F_NEEDS_CSUM;
+    OffloadHeader->HeaderLength = (USHORT )headerLength;
+    OffloadHeader->GsoSize = (USHORT )Mss;
+    OffloadHeader->CsumStart = (USHORT )TcpOffset;
+    OffloadHeader->CsumOffset = TAP_TCP_CHECKSUM_OFFSET;
+
+    return TRUE;
+}
+
+static VOID
+tapLsoFixupSegment(
+    __inout_bcount(Length) PUCHAR Segment,
+    __in ULONG                  Length,
+    __in ULONG                  IpOffset,
+    __in BOOLEAN                IPv6,
+    __in ULONG                  TcpOffset,
+    __in ULONG                  Sequence,
+    __in USHORT                 Id,
+    __in BOOLEAN                First,
+    __in BOOLEAN                Last
+    )
+/*++
+
+Routine Description:
+
+    Fix up the headers copied from an LSOv2 frame into one segment: IP
+    length, IPv4 identification and header checksum, TCP sequence number,
+    flags and checksum.
+
+--*/
+{
+    TCPHDR UNALIGNED    *tcp = (TCPHDR UNALIGNED *)(Segment + TcpOffset);
+    ULONG               tcpLength = Length - TcpOffset;
+    ULONG               sum;
+
+    if (IPv6)
+    {
+        IPV6HDR UNALIGNED *ip = (IPV6HDR UNALIGNED *)(Segment + IpOffset);
+
+        ip->payload_len = htons((USHORT )(Length - IpOffset - IPV6_HEADER_SIZE));
+
+        sum = tapChecksumPseudoHeader(ip->saddr,ip->daddr,sizeof(IPV6ADDR),IPPROTO_TCP,tcpLength);
+    }
+    else
+    {
+        IPHDR UNALIGNED *ip = (IPHDR UNALIGNED *)(Segment + IpOffset);
+
+        ip->tot_len = htons((USHORT )(Length - IpOffset));
+        ip->id = htons(Id);
+        ip->check = 0;
+        ip->check = htons((USHORT )~tapChecksumAdd((PUCHAR )ip,IPH_GET_LEN(ip->version_len),0));
+
+        sum = tapChecksumPseudoHeader(
+                (PUCHAR )&ip->saddr,
+                (PUCHAR )&ip->daddr,
+                sizeof(ULONG),
+                IPPROTO_TCP,
+                tcpLength
+                );
+    }
+
+    tcp->seq = htonl(Sequence);
+
+    // FIN and PSH belong to the last segment, CWR to the first.
+    if (!Last)
+    {
+        tcp->flags &= ~(TCPH_FIN_MASK | TCPH_PSH_MASK);
+    }
+
+    if (!First)
+    {
+        tcp->flags &= ~TCPH_CWR_MASK;
+    }
+
+    tcp->check = 0;
+    tcp->check = htons((USHORT )~tapChecksumAdd((PUCHAR )tcp,tcpLength,sum));
+}
+
+BOOLEAN
+tapLsoSegmentFrame(
+    __in PTAP_PACKET_POOL       TapPacketPool,
+    __in_bcount(Length) const UCHAR *Frame,
+    __in ULONG                  Length,
+    __in ULONG                  TcpOffset,
+    __in ULONG                  Mss,
+    __inout PLIST_ENTRY         Segments
+    )
+/*++
+
+Routine Description:
+
+    Segment an LSOv2 frame in software, for userspace that did not select
+    TAP_WIN_OFFLOAD_TSO. Every segment carries a copy of the frame's
+    headers and up to Mss bytes of its TCP payload, with lengths,
+    sequence numbers and checksums fixed up.
+
+Arguments:
+
+    TapPacketPool               Pool to allocate segments from
+    Frame                       Ethernet frame, possibly 802.1Q tagged
+    Length                      Length of Frame
+    TcpOffset                   Offset of the TCP header
+    Mss                         TCP payload bytes per segment
+    Segments                    Segments are appended here, linked by
+                                QueueLink
+
+Return Value:
+
+    TRUE if the frame was segmented.
+
+--*/
+{
+    LIST_ENTRY  segments;
+    ULONG       ipOffset;
+    ULONG       headerLength;
+    ULONG       payloadOffset;
+    ULONG       sequence;
+    USHORT      id = 0;
+    USHORT      segmentIndex = 0;
+    BOOLEAN     ipv6;
+
+    if (Mss == 0
+        || !tapLsoParseHeaders(Frame,Length,TcpOffset,&ipOffset,&ipv6,&headerLength))
+    {
+        return FALSE;
+    }
+
+    sequence = ntohl(((const TCPHDR UNALIGNED *)(Frame + TcpOffset))->seq);
+
+    if (!ipv6)
+    {
+        id = ntohs(((const IPHDR UNALIGNED *)(Frame + ipOffset))->id);
+    }
+
+    InitializeListHead(&segments);
+
+    payloadOffset = headerLength;
+
+    do
+    {
+        ULONG       segmentPayload = min(Mss, Length - payloadOffset);
+        ULONG       segmentLength = headerLength + segmentPayload;
+        PTAP_PACKET tapPacket;
+
+        tapPacket = tapPacketAllocate(TapPacketPool,segmentLength);
+
+        if (tapPacket == NULL)
+        {
+            goto fail;
+        }
+
+        tapPacket->m_SizeFlags = (segmentLength & TP_SIZE_MASK);
+
+        NdisMoveMemory(tapPacket->m_Data,Frame,headerLength);
+        NdisMoveMemory(tapPacket->m_Data + headerLength,Frame + payloadOffset,segmentPayload);
+
+        tapLsoFixupSegment(
+            tapPacket->m_Data,
+            segmentLength,
+            ipOffset,
+            ipv6,
+            TcpOffset,
+            sequence + (payloadOffset - headerLength),
+            id + segmentIndex,
+            payloadOffset == headerLength,
+            payloadOffset + segmentPayload == Length
+            );
+
+        InsertTailList(&segments,&tapPacket->QueueLink);
+
+        payloadOffset += segmentPayload;
+        ++segmentIndex;
+    }
+    while (payloadOffset < Length);
+
+    while (!IsListEmpty(&segments))
+    {
+        InsertTailList(Segments,RemoveHeadList(&segments));
+    }
+
+    return TRUE;
+
+fail:
+    while (!IsListEmpty(&segments))
+    {
+        PTAP_PACKET tapPacket = CONTAINING_RECORD(RemoveHeadList(&segments), TAP_PACKET, QueueLink);
+
+        tapPacketFree(TapPacketPool,tapPacket);
+    }
+
+    return FALSE;
+}
+
+//======================================================================
+// Receive Segment Coalescing
+//======================================================================
+
+// Headers of a TCP segment that may be coalesced, copied out of its NBL.
+typedef struct _TAP_RSC_SEGMENT
+{
+    UCHAR       Header[ETHERNET_HEADER_SIZE + IPV6_HEADER_SIZE + TAP_RSC_TCP_HEADER_SIZE];
+    ULONG       HeaderLength;
+    ULONG       TcpOffset;
+    ULONG       PayloadLength;
+    ULONG       Sequence;
+    ULONG       Ack;
+    ULONG       TsVal;
+    BOOLEAN     IPv6;
+    BOOLEAN     Timestamp;
+    BOOLEAN     Push;
+} TAP_RSC_SEGMENT, *PTAP_RSC_SEGMENT;
+
+static BOOLEAN
+tapRscParseSegment(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PNET_BUFFER_LIST       NetBufferList,
+    __out PTAP_RSC_SEGMENT      Segment
+    )
+/*++
+
+Routine Description:
+
+    Decide whether a receive NBL holds a TCP segment that may be
+    coalesced, and copy out its headers.
+
+    Only data segments carrying nothing but ACK and PSH, with either no
+    TCP options or just a timestamp, qualify. Their checksums must already
+    be validated: the stack does not check the checksum of a coalesced
+    segment, so one from an unvalidated segment would be lost.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    NetBufferList               Receive NBL
+    Segment                     Receives the headers of the segment
+
+Return Value:
+
+    TRUE if the segment may be coalesced.
+
+--*/
+{
+    PNET_BUFFER nb = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO checksumInfo;
+    const TCPHDR UNALIGNED *tcp;
+    ULONG       ipOffset = ETHERNET_HEADER_SIZE;
+    ULONG       length;
+    ULONG       copyLength;
+    ULONG       tcpLength;
+
+    if (NET_BUFFER_NEXT_NB(nb) != NULL)
+    {
+        return FALSE;
+    }
+
+    checksumInfo.Value = NET_BUFFER_LIST_INFO(NetBufferList, TcpIpChecksumNetBufferListInfo);
+
+    if (!checksumInfo.Receive.TcpChecksumSucceeded)
+    {
+        return FALSE;
+    }
+
+    length = NET_BUFFER_DATA_LENGTH(nb);
+    copyLength = min(length, sizeof(Segment->Header));
+
+    if (copyLength < ETHERNET_HEADER_SIZE + IP_HEADER_SIZE + sizeof(TCPHDR)
+        || !tapCopyFromNetBuffer(nb,0,copyLength,Segment->Header))
+    {
+        return FALSE;
+    }
+
+    switch (ntohs(((const ETH_HEADER *)Segment->Header)->proto))
+    {
+    case NDIS_ETH_TYPE_IPV4:
+        {
+            const IPHDR UNALIGNED *ip = (const IPHDR UNALIGNED *)(Segment->Header + ipOffset);
+
+            // No IP options and no fragments. Frames padded to the
+            // minimum Ethernet size fail the length check.
+            if (!Adapter->RscIPv4
+                || !checksumInfo.Receive.IpChecksumSucceeded
+                || ip->version_len != 0x45
+                || ip->protocol != IPPROTO_TCP
+                || (ntohs(ip->frag_off) & (IP_OFFMASK | 0x2000))
+                || ntohs(ip->tot_len) != length - ipOffset)
+            {
+                return FALSE;
+            }
+
+            Segment->TcpOffset = ipOffset + IP_HEADER_SIZE;
+            Segment->IPv6 = FALSE;
+        }
+        break;
+
+    case NDIS_ETH_TYPE_IPV6:
+        {
+            const IPV6HDR UNALIGNED *ip = (const IPV6HDR UNALIGNED *)(Segment->Header + ipOffset);
+
+            if (!Adapter->RscIPv6
+                || copyLength < ipOffset + IPV6_HEADER_SIZE + sizeof(TCPHDR)
+                || ip->nexthdr != IPPROTO_TCP
+                || ntohs(ip->payload_len) != length - ipOffset - IPV6_HEADER_SIZE)
+            {
+                return FALSE;
+            }
+
+            Segment->TcpOffset = ipOffset + IPV6_HEADER_SIZE;
+            Segment->IPv6 = TRUE;
+        }
+        break;
+
+    default:
+        return FALSE;
+    }
+
+    tcp = (const TCPHDR UNALIGNED *)(Segment->Header + Segment->TcpOffset);
+    tcpLength = TCPH_GET_DOFF(tcp->doff_res);
+
+    if ((tcp->flags & ~TCPH_PSH_MASK) != TCPH_ACK_MASK)
+    {
+        return FALSE;
+    }
+
+    if (tcpLength == sizeof(TCPHDR))
+    {
+        Segment->Timestamp = FALSE;
+        Segment->TsVal = 0;
+    }
+    else if (tcpLength == TAP_RSC_TCP_HEADER_SIZE
+        && copyLength >= Segment->TcpOffset + tcpLength)
+    {
+        const UCHAR *options = (const UCHAR *)(tcp + 1);
+
+        if (options[0] != TCPOPT_NOP
+            || options[1] != TCPOPT_NOP
+            || options[2] != TCPOPT_TIMESTAMP
+            || options[3] != TCPOLEN_TIMESTAMP)
+        {
+            return FALSE;
+        }
+
+        Segment->Timestamp = TRUE;
+        Segment->TsVal = ntohl(*(const ULONG UNALIGNED *)(options + 4));
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    Segment->HeaderLength = Segment->TcpOffset + tcpLength;
+
+    if (length <= Segment->HeaderLength)
+    {
+        return FALSE;
+    }
+
+    Segment->PayloadLength = length - Segment->HeaderLength;
+    Segment->Sequence = ntohl(tcp->seq);
+    Segment->Ack = ntohl(tcp->ack_seq);
+    Segment->Push = (tcp->flags & TCPH_PSH_MASK) ? TRUE : FALSE;
+
+    return TRUE;
+}
+
+static BOOLEAN
+tapRscSegmentFollows(
+    __in const TAP_RSC_SEGMENT  *Last,
+    __in const TAP_RSC_SEGMENT  *Next,
+    __in ULONG                  RunLength
+    )
+/*++
+
+Routine Description:
+
+    Decide whether Next continues the run of segments ending with Last:
+    same flow and headers, in sequence, and the merged packet still fits
+    the IP length field. A PSH ends a run.
+
+--*/
+{
+    const UCHAR *lastIp = Last->Header + ETHERNET_HEADER_SIZE;
+    const UCHAR *nextIp = Next->Header + ETHERNET_HEADER_SIZE;
+
+    if (Last->IPv6 != Next->IPv6
+        || Last->HeaderLength != Next->HeaderLength
+        || Last->Timestamp != Next->Timestamp
+        || Last->Push
+        || RunLength - ETHERNET_HEADER_SIZE + Next->PayloadLength > 0xFFFF)
+    {
+        return FALSE;
+    }
+
+    if (!NdisEqualMemory(Last->Header,Next->Header,ETHERNET_HEADER_SIZE))
+    {
+        return FALSE;
+    }
+
+    if (Last->IPv6)
+    {
+        // Version, traffic class and flow label; next header and hop
+        // limit; addresses.
+        if (!NdisEqualMemory(lastIp,nextIp,4)
+            || !NdisEqualMemory(lastIp + 6,nextIp + 6,IPV6_HEADER_SIZE - 6))
+        {
+            return FALSE;
+        }
+    }
+    else
+    {
+        // Version and TOS; fragment field, TTL and protocol; addresses.
+        // The identification and checksum may differ.
+        if (!NdisEqualMemory(lastIp,nextIp,2)
+            || !NdisEqualMemory(lastIp + 6,nextIp + 6,4)
+            || !NdisEqualMemory(lastIp + 12,nextIp + 12,IP_HEADER_SIZE - 12))
+        {
+            return FALSE;
+        }
+    }
+
+    // Ports.
+    if (!NdisEqualMemory(Last->Header + Last->TcpOffset,Next->Header + Next->TcpOffset,4))
+    {
+        return FALSE;
+    }
+
+    return Next->Sequence == Last->Sequence + Last->PayloadLength
+        && (LONG )(Next->Ack - Last->Ack) >= 0
+        && (!Next->Timestamp || (LONG )(Next->TsVal - Last->TsVal) >= 0);
+}
+
+static PNET_BUFFER_LIST
+tapRscMergeRun(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PNET_BUFFER_LIST       RunNbls,
+    __in ULONG                  RunCount,
+    __in ULONG                  RunLength,
+    __in const TAP_RSC_SEGMENT  *Last,
+    __in ULONG                  FirstTsVal
+    )
+/*++
+
+Routine Description:
+
+    Build one receive NBL holding a run of coalesced segments.
+
+    The headers are those of the first segment, with the IP length
+    covering the whole run and the ACK, window and flags taken from the
+    last segment. The TCP checksum is not recomputed; the NBL carries the
+    validated checksum state of its segments. The NBLs of the run are not
+    freed.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    RunNbls                     Chain of the NBLs of the run
+    RunCount                    Number of NBLs in the run
+    RunLength                   Length of the coalesced frame
+    Last                        Headers of the last segment of the run
+    FirstTsVal                  Timestamp value of the first segment
+
+Return Value:
+
+    The coalesced NBL, or NULL if it could not be allocated.
+
+--*/
+{
+    PNET_BUFFER_LIST    netBufferList;
+    PNET_BUFFER_LIST    currentNbl;
+    PUCHAR              buffer;
+    ULONG               offset = 0;
+    TCPHDR UNALIGNED    *tcp;
+    const TCPHDR UNALIGNED *lastTcp;
+    NDIS_RSC_NBL_INFO   rscInfo;
+
+    netBufferList = tapAllocateEmptyInjectNetBufferList(Adapter,RunLength,&buffer);
+
+    if (netBufferList == NULL)
+    {
+        return NULL;
+    }
+
+    // Whole first frame, then the payload of each following one.
+    for (currentNbl = RunNbls;
+        currentNbl != NULL;
+        currentNbl = NET_BUFFER_LIST_NEXT_NBL(currentNbl))
+    {
+        PNET_BUFFER nb = NET_BUFFER_LIST_FIRST_NB(currentNbl);
+        ULONG       skip = (currentNbl == RunNbls) ? 0 : Last->HeaderLength;
+        ULONG       length = NET_BUFFER_DATA_LENGTH(nb) - skip;
+
+        if (!tapCopyFromNetBuffer(nb,skip,length,buffer + offset))
+        {
+            tapFreeReceiveNetBufferList(Adapter,netBufferList);
+            return NULL;
+        }
+
+        offset += length;
+    }
+
+    ASSERT(offset == RunLength);
+
+    tcp = (TCPHDR UNALIGNED *)(buffer + Last->TcpOffset);
+    lastTcp = (const TCPHDR UNALIGNED *)(Last->Header + Last->TcpOffset);
+
+    tcp->ack_seq = lastTcp->ack_seq;
+    tcp->flags = lastTcp->flags;
+    tcp->window = lastTcp->window;
+
+    if (Last->IPv6)
+    {
+        IPV6HDR UNALIGNED *ip = (IPV6HDR UNALIGNED *)(buffer + ETHERNET_HEADER_SIZE);
+
+        ip->payload_len = htons((USHORT )(RunLength - ETHERNET_HEADER_SIZE - IPV6_HEADER_SIZE));
+    }
+    else
+    {
+        IPHDR UNALIGNED *ip = (IPHDR UNALIGNED *)(buffer + ETHERNET_HEADER_SIZE);
+
+        ip->tot_len = htons((USHORT )(RunLength - ETHERNET_HEADER_SIZE));
+        ip->check = 0;
+        ip->check = htons((USHORT )~tapChecksumAdd((PUCHAR )ip,IP_HEADER_SIZE,0));
+    }
+
+    NET_BUFFER_LIST_INFO(netBufferList, Ieee8021QNetBufferListInfo) =
+        NET_BUFFER_LIST_INFO(RunNbls, Ieee8021QNetBufferListInfo);
+    NET_BUFFER_LIST_INFO(netBufferList, TcpIpChecksumNetBufferListInfo) =
+        NET_BUFFER_LIST_INFO(RunNbls, TcpIpChecksumNetBufferListInfo);
+
+    rscInfo.Value = NULL;
+    rscInfo.Info.CoalescedSegCount = (USHORT )RunCount;
+    rscInfo.Info.DupAckCount = 0;
+    NET_BUFFER_LIST_INFO(netBufferList, TcpRecvSegCoalesceInfo) = rscInfo.Value;
+
+    if (Last->Timestamp)
+    {
+        NET_BUFFER_LIST_INFO(netBufferList, RscTcpTimestampDelta) =
+            (PVOID )(ULONG_PTR )(Last->TsVal - FirstTsVal);
+    }
+
+    return netBufferList;
+}
+
+static VOID
+tapRscAppend(
+    __inout PNET_BUFFER_LIST    *Head,
+    __inout PNET_BUFFER_LIST    *Tail,
+    __inout PULONG              Count,
+    __in PNET_BUFFER_LIST       NetBufferLists
+    )
+{
+    if (*Tail == NULL)
+    {
+        *Head = NetBufferLists;
+    }
+    else
+    {
+        NET_BUFFER_LIST_NEXT_NBL(*Tail) = NetBufferLists;
+    }
+
+    for (*Tail = NetBufferLists; ; *Tail = NET_BUFFER_LIST_NEXT_NBL(*Tail))
+    {
+        ++(*Count);
+
+        if (NET_BUFFER_LIST_NEXT_NBL(*Tail) == NULL)
+        {
+            break;
+        }
+    }
+}
+
+static PNET_BUFFER_LIST
+tapRscCloseRun(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PNET_BUFFER_LIST       RunNbls,
+    __in ULONG                  RunCount,
+    __in ULONG                  RunLength,
+    __in const TAP_RSC_SEGMENT  *Last,
+    __in ULONG                  FirstTsVal
+    )
+/*++
+
+Routine Description:
+
+    Replace a run of two or more segments by one coalesced NBL, freeing
+    the NBLs of the run. If that fails the run is returned unchanged.
+
+--*/
+{
+    PNET_BUFFER_LIST    netBufferList;
+
+    if (RunCount < 2)
+    {
+        return RunNbls;
+    }
+
+    netBufferList = tapRscMergeRun(Adapter,RunNbls,RunCount,RunLength,Last,FirstTsVal);
+
+    if (netBufferList == NULL)
+    {
+        InterlockedIncrement64(&Adapter->RscStatistics.Aborts);
+        return RunNbls;
+    }
+
+    InterlockedIncrement64(&Adapter->RscStatistics.CoalesceEvents);
+    InterlockedAdd64(&Adapter->RscStatistics.CoalescedPackets,RunCount);
+    InterlockedAdd64(&Adapter->RscStatistics.CoalescedOctets,RunLength - Last->HeaderLength);
+
+    while (RunNbls != NULL)
+    {
+        PNET_BUFFER_LIST nextNbl = NET_BUFFER_LIST_NEXT_NBL(RunNbls);
+
+        NET_BUFFER_LIST_NEXT_NBL(RunNbls) = NULL;
+        tapFreeReceiveNetBufferList(Adapter,RunNbls);
+        RunNbls = nextNbl;
+    }
+
+    return netBufferList;
+}
+
+VOID
+tapRscCoalesceNetBufferLists(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __inout PNET_BUFFER_LIST    *NetBufferLists,
+    __inout PULONG              NetBufferListCount
+    )
+/*++
+
+Routine Description:
+
+    Coalesce the TCP segments of a chain of receive NBLs about to be
+    indicated, as a NIC doing RSC would.
+
+    Runs are only formed within the chain, which holds the frames of one
+    write or one pass over the receive ring, so nothing is held back and
+    no flush timer is needed. The order of the frames is preserved.
+
+    The NBLs are not yet counted as in flight. Coalesced NBLs are copies
+    and do not hold the write IRP of their segments.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    NetBufferLists              Chain of receive NBLs, replaced by the
+                                coalesced chain
+    NetBufferListCount          Number of NBLs in the chain, updated
+
+Return Value:
+
+    None.
+
+--*/
+{
+    TAP_RSC_SEGMENT     segments[2];
+    PTAP_RSC_SEGMENT    last = &segments[0];
+    PTAP_RSC_SEGMENT    next = &segments[1];
+    PNET_BUFFER_LIST    head = NULL;
+    PNET_BUFFER_LIST    tail = NULL;
+    PNET_BUFFER_LIST    runNbls = NULL;
+    PNET_BUFFER_LIST    runTail = NULL;
+    PNET_BUFFER_LIST    currentNbl;
+    PNET_BUFFER_LIST    nextNbl;
+    ULONG               runCount = 0;
+    ULONG               runLength = 0;
+    ULONG               firstTsVal = 0;
+    ULONG               count = 0;
+
+    if (!Adapter->RscIPv4 && !Adapter->RscIPv6)
+    {
+        return;
+    }
+
+    for (currentNbl = *NetBufferLists; currentNbl != NULL; currentNbl = nextNbl)
+    {
+        BOOLEAN     eligible;
+
+        nextNbl = NET_BUFFER_LIST_NEXT_NBL(currentNbl);
+        NET_BUFFER_LIST_NEXT_NBL(currentNbl) = NULL;
+
+        eligible = tapRscParseSegment(Adapter,currentNbl,next);
+
+        if (runCount > 0
+            && eligible
+            && NET_BUFFER_LIST_INFO(currentNbl, Ieee8021QNetBufferListInfo)
+                == NET_BUFFER_LIST_INFO(runNbls, Ieee8021QNetBufferListInfo)
+            && tapRscSegmentFollows(last,next,runLength))
+        {
+            PTAP_RSC_SEGMENT swap = last;
+
+            NET_BUFFER_LIST_NEXT_NBL(runTail) = currentNbl;
+            runTail = currentNbl;
+            ++runCount;
+            runLength += next->PayloadLength;
+
+            last = next;
+            next = swap;
+            continue;
+        }
+
+        if (runCount > 0)
+        {
+            tapRscAppend(
+                &head,
+                &tail,
+                &count,
+                tapRscCloseRun(Adapter,runNbls,runCount,runLength,last,firstTsVal)
+                );
+
+            runCount = 0;
+        }
+
+        if (eligible)
+        {
+            PTAP_RSC_SEGMENT swap = last;
+
+            runNbls = runTail = currentNbl;
+            runCount = 1;
+            runLength = next->HeaderLength + next->PayloadLength;
+            firstTsVal = next->TsVal;
+
+            last = next;
+            next = swap;
+        }
+        else
+        {
+            tapRscAppend(&head,&tail,&count,currentNbl);
+        }
+    }
+
+    if (runCount > 0)
+    {
+        tapRscAppend(
+            &head,
+            &tail,
+            &count,
+            tapRscCloseRun(Adapter,runNbls,runCount,runLength,last,firstTsVal)
+            );
+    }
+
+    *NetBufferLists = head;
+    *NetBufferListCount = count;
+}
@@ -0,0 +1,166 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This code was inspired by the CIPE-Win32 driver by Damion K. Wilson.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef __TAP_OFFLOAD_H_
+#define __TAP_OFFLOAD_H_
+
+//===================================================================
+// Task offloads
+//
+// Large TCP sends are either handed to userspace whole, described by a
+// TAP_WIN_OFFLOAD_HEADER, or cut into MTU-sized segments here for
+// userspace that has not selected TAP_WIN_OFFLOAD_TSO. Checksums are
+// likewise left to userspace that selected TAP_WIN_OFFLOAD_CSUM and
+// computed here otherwise. On receive, runs of TCP segments written by
+// userspace are coalesced into larger ones before they are indicated.
+//===================================================================
+
+// Largest TCP payload the stack may hand us in one LSOv2 send. Leaves
+// room for headers within a 64 KiB frame.
+#define TAP_LSO_MAX_OFFLOAD_SIZE    62780
+#define TAP_LSO_MIN_SEGMENT_COUNT   2
+
+// Offset of the checksum field in a TCP or UDP header.
+#define TAP_TCP_CHECKSUM_OFFSET     16
+#define TAP_UDP_CHECKSUM_OFFSET     6
+
+// Checksum offloads, each set through its standard keyword. Values use
+// the keyword encoding.
+#define TAP_CSUM_IPV4               0
+#define TAP_CSUM_TCPV4              1
+#define TAP_CSUM_UDPV4              2
+#define TAP_CSUM_TCPV6              3
+#define TAP_CSUM_UDPV6              4
+#define TAP_CSUM_COUNT              5
+
+#define TAP_CSUM_TX                 0x1
+#define TAP_CSUM_RX                 0x2
+
+// Size of the header in front of frames read and written, for the
+// TAP_WIN_OFFLOAD_XXX offloads userspace selected.
+#define TAP_OFFLOAD_READ_HEADER_SIZE(offloads) \
+    (((offloads) & TAP_WIN_OFFLOAD_METADATA) ? sizeof(TAP_WIN_METADATA_HEADER) \
+        : (offloads) ? sizeof(TAP_WIN_OFFLOAD_HEADER) : 0)
+
+#define TAP_OFFLOAD_WRITE_HEADER_SIZE(offloads) \
+    (((offloads) & TAP_WIN_OFFLOAD_METADATA) ? sizeof(TAP_WIN_METADATA_HEADER) \
+        : ((offloads) & TAP_WIN_OFFLOAD_CSUM) ? sizeof(TAP_WIN_OFFLOAD_HEADER) : 0)
+
+// Longest TCP header with only the NOP, NOP, timestamp options RSC accepts.
+#define TAP_RSC_TCP_HEADER_SIZE     (sizeof(TCPHDR) + 12)
+
+// Receive segment coalescing counters, reported by OID_TCP_RSC_STATISTICS.
+// Updated with interlocked operations, since writes on several handles and
+// the receive ring can coalesce at the same time.
+typedef struct _TAP_RSC_STATISTICS
+{
+    volatile LONG64     CoalescedPackets;   // Segments merged into larger ones
+    volatile LONG64     CoalescedOctets;    // TCP payload bytes of those segments
+    volatile LONG64     CoalesceEvents;     // Coalesced frames indicated
+    volatile LONG64     Aborts;             // Runs indicated unmerged for lack of memory
+} TAP_RSC_STATISTICS, *PTAP_RSC_STATISTICS;
+
+// One's complement sum of Data as 16-bit big-endian words, added to Sum.
+// The result is folded to 16 bits so calls can be chained.
+ULONG
+tapChecksumAdd(
+    __in_bcount(Length) const UCHAR *Data,
+    __in ULONG                  Length,
+    __in ULONG                  Sum
+    );
+
+// Sum of the IPv4 or IPv6 pseudo header. Addresses are AddressLength
+// bytes each.
+ULONG
+tapChecksumPseudoHeader(
+    __in const UCHAR            *SourceAddress,
+    __in const UCHAR            *DestinationAddress,
+    __in ULONG                  AddressLength,
+    __in UCHAR                  Protocol,
+    __in ULONG                  Length
+    );
+
+// Locate the TCP or UDP header of the IP packet at IpOffset in Frame.
+BOOLEAN
+tapChecksumParseFrame(
+    __in_bcount(Length) const UCHAR *Frame,
+    __in ULONG                  Length,
+    __in ULONG                  IpOffset,
+    __out PBOOLEAN              IPv6,
+    __out PUCHAR                Protocol,
+    __out PULONG                TransportOffset
+    );
+
+// Carry out the checksum offloads requested in ChecksumInfo, either here
+// or, with an OffloadHeader, by leaving them to userspace.
+VOID
+tapChecksumPrepareFrame(
+    __inout_bcount(Length) PUCHAR Frame,
+    __in ULONG                  Length,
+    __in ULONG                  IpOffset,
+    __in PVOID                  ChecksumInfo,
+    __inout_opt TAP_WIN_OFFLOAD_HEADER *OffloadHeader
+    );
+
+// Finish a partial checksum left by userspace.
+BOOLEAN
+tapChecksumCompleteFrame(
+    __inout_bcount(Length) PUCHAR Frame,
+    __in ULONG                  Length,
+    __in const TAP_WIN_OFFLOAD_HEADER *OffloadHeader
+    );
+
+// Describes an LSOv2 frame to userspace and fixes up its IP length field.
+// Returns FALSE if the headers are not what the stack promised.
+BOOLEAN
+tapLsoPrepareFrame(
+    __inout_bcount(Length) PUCHAR Frame,
+    __in ULONG                  Length,
+    __in ULONG                  TcpOffset,
+    __in ULONG                  Mss,
+    __out TAP_WIN_OFFLOAD_HEADER *OffloadHeader
+    );
+
+// Cut an LSOv2 frame into TAP packets of at most Mss payload bytes each,
+// appended to Segments. Returns FALSE if the frame is malformed or
+// allocation fails; no segments are returned then.
+BOOLEAN
+tapLsoSegmentFrame(
+    __in PTAP_PACKET_POOL       TapPacketPool,
+    __in_bcount(Length) const UCHAR *Frame,
+    __in ULONG                  Length,
+    __in ULONG                  TcpOffset,
+    __in ULONG                  Mss,
+    __inout PLIST_ENTRY         Segments
+    );
+
+// Merge runs of consecutive in-order TCP segments of one flow in a chain
+// of receive NBLs. NetBufferListCount is updated.
+VOID
+tapRscCoalesceNetBufferLists(
+    __in struct _TAP_ADAPTER_CONTEXT *Adapter,
+    __inout PNET_BUFFER_LIST    *NetBufferLists,
+    __inout PULONG              NetBufferListCount
+    );
+
+#endif // __TAP_OFFLOAD_H_
@@ -110,6 +110,10 @@ DBG_PRINT_OID_NAME(
         MAKECASE(OID_GEN_RCV_CRC_ERROR)
         MAKECASE(OID_GEN_TRANSMIT_QUEUE_LENGTH)
 
+        /* Receive side scaling OIDs */
+        MAKECASE(OID_GEN_RECEIVE_SCALE_CAPABILITIES)
+        MAKECASE(OID_GEN_RECEIVE_SCALE_PARAMETERS)
+
         /* Statistical OIDs for NDIS 6.0 */
         MAKECASE(OID_GEN_STATISTICS)
         MAKECASE(OID_GEN_BYTES_RCV)
@@ -202,6 +206,9 @@ DBG_PRINT_OID_NAME(
 #if (NDIS_SUPPORT_NDIS630)
         /* NDIS QoS OIDs for NDIS 6.30 */
         MAKECASE(OID_QOS_PARAMETERS)
+
+        /* RSC OIDs for NDIS 6.30 */
+        MAKECASE(OID_TCP_RSC_STATISTICS)
 #endif
     }
 
@@ -298,6 +305,341 @@ tapSetPacketFilter(
     return status;
 }
 
+NDIS_STATUS
+tapSetReceiveScaleParameters(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PNDIS_OID_REQUEST      OidRequest
+    )
+/*++
+
+Routine Description:
+
+    Apply OID_GEN_RECEIVE_SCALE_PARAMETERS. The request is validated as a
+    whole before any of it is applied, so a bad request leaves the current
+    parameters in place.
+
+    The indirection table holds PROCESSOR_NUMBERs; they are stored as
+    processor indexes.
+
+--*/
+{
+    PTAP_RSS    rss = &Adapter->Rss;
+    PNDIS_RECEIVE_SCALE_PARAMETERS  params;
+    ULONG       length = OidRequest->DATA.SET_INFORMATION.InformationBufferLength;
+    PPROCESSOR_NUMBER   table = NULL;
+    ULONG       tableSize = 0;
+    PUCHAR      key = NULL;
+    ULONG       hashInformation = 0;
+    BOOLEAN     disable;
+    LOCK_STATE_EX lockState;
+    ULONG       i;
+
+    if(rss->Processors == NULL)
+    {
+        return NDIS_STATUS_NOT_SUPPORTED;
+    }
+
+    if(length < NDIS_SIZEOF_RECEIVE_SCALE_PARAMETERS_REVISION_1)
+    {
+        OidRequest->DATA.SET_INFORMATION.BytesNeeded = NDIS_SIZEOF_RECEIVE_SCALE_PARAMETERS_REVISION_1;
+        return NDIS_STATUS_INVALID_LENGTH;
+    }
+
+    params = (PNDIS_RECEIVE_SCALE_PARAMETERS )OidRequest->DATA.SET_INFORMATION.InformationBuffer;
+
+    if(params->Header.Type != NDIS_OBJECT_TYPE_RSS_PARAMETERS)
+    {
+        return NDIS_STATUS_INVALID_PARAMETER;
+    }
+
+    disable = (params->Flags & NDIS_RSS_PARAM_FLAG_DISABLE_RSS) ? TRUE : FALSE;
+
+    if(!(params->Flags & NDIS_RSS_PARAM_FLAG_HASH_INFO_UNCHANGED))
+    {
+        hashInformation = params->HashInformation;
+
+        if(hashInformation != 0
+            && (NDIS_RSS_HASH_FUNC_FROM_HASH_INFO(hashInformation) != NdisHashFunctionToeplitz
+                || (NDIS_RSS_HASH_TYPE_FROM_HASH_INFO(hashInformation) & ~TAP_RSS_HASH_TYPES) != 0))
+        {
+            return NDIS_STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    if(!(params->Flags & NDIS_RSS_PARAM_FLAG_ITABLE_UNCHANGED))
+    {
+        if(params->IndirectionTableOffset > length
+            || params->IndirectionTableSize > length - params->IndirectionTableOffset
+            || params->IndirectionTableSize % sizeof(PROCESSOR_NUMBER) != 0)
+        {
+            return NDIS_STATUS_INVALID_LENGTH;
+        }
+
+        table = (PPROCESSOR_NUMBER )((PUCHAR )params + params->IndirectionTableOffset);
+        tableSize = params->IndirectionTableSize / sizeof(PROCESSOR_NUMBER);
+
+        // Power of two, so the table is indexed by the low hash bits.
+        if(tableSize > TAP_RSS_MAX_TABLE_ENTRIES
+            || (tableSize & (tableSize - 1)) != 0)
+        {
+            return NDIS_STATUS_INVALID_PARAMETER;
+        }
+
+        for(i = 0; i < tableSize; ++i)
+        {
+            if(KeGetProcessorIndexFromNumber(&table[i]) >= rss->ProcessorCount)
+            {
+                return NDIS_STATUS_INVALID_PARAMETER;
+            }
+        }
+    }
+
+    if(!(params->Flags & NDIS_RSS_PARAM_FLAG_HASH_KEY_UNCHANGED))
+    {
+        if(params->HashSecretKeyOffset > length
+            || params->HashSecretKeySize > length - params->HashSecretKeyOffset
+            || params->HashSecretKeySize > TAP_RSS_MAX_KEY_SIZE)
+        {
+            return NDIS_STATUS_INVALID_LENGTH;
+        }
+
+        key = (PUCHAR )params + params->HashSecretKeyOffset;
+    }
+
+    NdisAcquireRWLockWrite(rss->Lock,&lockState,0);
+
+    if(!(params->Flags & NDIS_RSS_PARAM_FLAG_HASH_INFO_UNCHANGED))
+    {
+        rss->HashInformation = hashInformation;
+    }
+
+    if(table != NULL)
+    {
+        for(i = 0; i < tableSize; ++i)
+        {
+            rss->Table[i] = KeGetProcessorIndexFromNumber(&table[i]);
+        }
+
+        rss->TableSize = tableSize;
+    }
+
+    if(key != NULL)
+    {
+        // Keys shorter than the longest hash input are zero extended.
+        NdisZeroMemory(rss->Key,sizeof(rss->Key));
+        NdisMoveMemory(rss->Key,key,params->HashSecretKeySize);
+        rss->KeySize = params->HashSecretKeySize;
+    }
+
+    rss->Enabled = !disable && rss->HashInformation != 0 && rss->TableSize != 0;
+
+    NdisReleaseRWLock(rss->Lock,&lockState);
+
+    DEBUGP (("[%s] RSS %s; hash info 0x%08x, %d table entries\n",
+        MINIPORT_INSTANCE_ID (Adapter),
+        rss->Enabled ? "enabled" : "disabled",
+        rss->HashInformation,
+        rss->TableSize
+        ));
+
+    OidRequest->DATA.SET_INFORMATION.BytesRead = length;
+
+    return NDIS_STATUS_SUCCESS;
+}
+
+static VOID
+tapIndicateOffloadCurrentConfig(
+    __in PTAP_ADAPTER_CONTEXT   Adapter
+    )
+{
+    NDIS_STATUS_INDICATION  statusIndication;
+    NDIS_OFFLOAD            offload;
+
+    tapAdapterGetOffload(Adapter,FALSE,&offload);
+
+    NdisZeroMemory(&statusIndication, sizeof(NDIS_STATUS_INDICATION));
+
+    statusIndication.Header.Type = NDIS_OBJECT_TYPE_STATUS_INDICATION;
+    statusIndication.Header.Revision = NDIS_STATUS_INDICATION_REVISION_1;
+    statusIndication.Header.Size = sizeof(NDIS_STATUS_INDICATION);
+
+    statusIndication.StatusCode = NDIS_STATUS_TASK_OFFLOAD_CURRENT_CONFIG;
+    statusIndication.SourceHandle = Adapter->MiniportAdapterHandle;
+    statusIndication.StatusBuffer = &offload;
+    statusIndication.StatusBufferSize = sizeof(NDIS_OFFLOAD);
+
+    NdisMIndicateStatusEx(Adapter->MiniportAdapterHandle, &statusIndication);
+}
+
+NDIS_STATUS
+tapSetOffloadParameters(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PNDIS_OID_REQUEST      OidRequest
+    )
+/*++
+
+Routine Description:
+
+    Apply OID_TCP_OFFLOAD_PARAMETERS. Only the checksum, LSOv2 and RSC
+    settings are acted upon; offloads we never advertised are left
+    disabled. The new current configuration is indicated to the protocols.
+
+--*/
+{
+    PNDIS_OFFLOAD_PARAMETERS    params;
+    ULONG       length = OidRequest->DATA.SET_INFORMATION.InformationBufferLength;
+    UCHAR       checksums[TAP_CSUM_COUNT];
+    ULONG       i;
+
+    if(length < NDIS_SIZEOF_OFFLOAD_PARAMETERS_REVISION_1)
+    {
+        OidRequest->DATA.SET_INFORMATION.BytesNeeded = NDIS_SIZEOF_OFFLOAD_PARAMETERS_REVISION_1;
+        return NDIS_STATUS_INVALID_LENGTH;
+    }
+
+    params = (PNDIS_OFFLOAD_PARAMETERS )OidRequest->DATA.SET_INFORMATION.InformationBuffer;
+
+    if(params->Header.Type != NDIS_OBJECT_TYPE_DEFAULT)
+    {
+        return NDIS_STATUS_INVALID_PARAMETER;
+    }
+
+    if(params->LsoV2IPv4 > NDIS_OFFLOAD_PARAMETERS_LSOV2_ENABLED
+        || params->LsoV2IPv6 > NDIS_OFFLOAD_PARAMETERS_LSOV2_ENABLED)
+    {
+        return NDIS_STATUS_INVALID_PARAMETER;
+    }
+
+    checksums[TAP_CSUM_IPV4] = params->IPv4Checksum;
+    checksums[TAP_CSUM_TCPV4] = params->TCPIPv4Checksum;
+    checksums[TAP_CSUM_UDPV4] = params->UDPIPv4Checksum;
+    checksums[TAP_CSUM_TCPV6] = params->TCPIPv6Checksum;
+    checksums[TAP_CSUM_UDPV6] = params->UDPIPv6Checksum;
+
+    for(i = 0; i < TAP_CSUM_COUNT; ++i)
+    {
+        if(checksums[i] > NDIS_OFFLOAD_PARAMETERS_TX_RX_ENABLED)
+        {
+            return NDIS_STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    for(i = 0; i < TAP_CSUM_COUNT; ++i)
+    {
+        switch(checksums[i])
+        {
+        case NDIS_OFFLOAD_PARAMETERS_TX_RX_DISABLED:
+            Adapter->ChecksumOffload[i] = 0;
+            break;
+
+        case NDIS_OFFLOAD_PARAMETERS_TX_ENABLED_RX_DISABLED:
+            Adapter->ChecksumOffload[i] = TAP_CSUM_TX;
+            break;
+
+        case NDIS_OFFLOAD_PARAMETERS_RX_ENABLED_TX_DISABLED:
+            Adapter->ChecksumOffload[i] = TAP_CSUM_RX;
+            break;
+
+        case NDIS_OFFLOAD_PARAMETERS_TX_RX_ENABLED:
+            Adapter->ChecksumOffload[i] = TAP_CSUM_TX | TAP_CSUM_RX;
+            break;
+
+        default:
+            // NDIS_OFFLOAD_PARAMETERS_NO_CHANGE
+            break;
+        }
+    }
+
+    if(params->LsoV2IPv4 != NDIS_OFFLOAD_PARAMETERS_NO_CHANGE)
+    {
+        Adapter->LsoV2IPv4 = (params->LsoV2IPv4 == NDIS_OFFLOAD_PARAMETERS_LSOV2_ENABLED);
+    }
+
+    if(params->LsoV2IPv6 != NDIS_OFFLOAD_PARAMETERS_NO_CHANGE)
+    {
+        Adapter->LsoV2IPv6 = (params->LsoV2IPv6 == NDIS_OFFLOAD_PARAMETERS_LSOV2_ENABLED);
+    }
+
+    DEBUGP (("[%s] LSOv2 IPv4 %d IPv6 %d\n",
+        MINIPORT_INSTANCE_ID (Adapter),
+        Adapter->LsoV2IPv4,
+        Adapter->LsoV2IPv6
+        ));
+
+    // RSC settings were added in revision 3, with NDIS 6.30.
+    if(params->Header.Revision >= NDIS_OFFLOAD_PARAMETERS_REVISION_3
+        && length >= NDIS_SIZEOF_OFFLOAD_PARAMETERS_REVISION_3
+        && GlobalData.NdisVersion >= NDIS_RUNTIME_VERSION_630)
+    {
+        if(params->RscIPv4 != NDIS_OFFLOAD_PARAMETERS_NO_CHANGE)
+        {
+            Adapter->RscIPv4 = (params->RscIPv4 == NDIS_OFFLOAD_PARAMETERS_RSC_ENABLED);
+        }
+
+        if(params->RscIPv6 != NDIS_OFFLOAD_PARAMETERS_NO_CHANGE)
+        {
+            Adapter->RscIPv6 = (params->RscIPv6 == NDIS_OFFLOAD_PARAMETERS_RSC_ENABLED);
+        }
+
+        DEBUGP (("[%s] RSC IPv4 %d IPv6 %d\n",
+            MINIPORT_INSTANCE_ID (Adapter),
+            Adapter->RscIPv4,
+            Adapter->RscIPv6
+            ));
+    }
+
+    tapIndicateOffloadCurrentConfig(Adapter);
+
+    OidRequest->DATA.SET_INFORMATION.BytesRead = length;
+
+    return NDIS_STATUS_SUCCESS;
+}
+
+NDIS_STATUS
+tapSetOffloadEncapsulation(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PNDIS_OID_REQUEST      OidRequest
+    )
+/*++
+
+Routine Description:
+
+    Apply OID_OFFLOAD_ENCAPSULATION. Offloads are only done on untagged
+    or 802.1Q tagged Ethernet frames.
+
+--*/
+{
+    PNDIS_OFFLOAD_ENCAPSULATION encapsulation;
+    ULONG       length = OidRequest->DATA.SET_INFORMATION.InformationBufferLength;
+
+    UNREFERENCED_PARAMETER(Adapter);
+
+    if(length < NDIS_SIZEOF_OFFLOAD_ENCAPSULATION_REVISION_1)
+    {
+        OidRequest->DATA.SET_INFORMATION.BytesNeeded = NDIS_SIZEOF_OFFLOAD_ENCAPSULATION_REVISION_1;
+        return NDIS_STATUS_INVALID_LENGTH;
+    }
+
+    encapsulation = (PNDIS_OFFLOAD_ENCAPSULATION )OidRequest->DATA.SET_INFORMATION.InformationBuffer;
+
+    if(encapsulation->Header.Type != NDIS_OBJECT_TYPE_OFFLOAD_ENCAPSULATION)
+    {
+        return NDIS_STATUS_INVALID_PARAMETER;
+    }
+
+    if((encapsulation->IPv4.Enabled == NDIS_OFFLOAD_SET_ON
+            && encapsulation->IPv4.EncapsulationType != NDIS_ENCAPSULATION_IEEE_802_3)
+        || (encapsulation->IPv6.Enabled == NDIS_OFFLOAD_SET_ON
+            && encapsulation->IPv6.EncapsulationType != NDIS_ENCAPSULATION_IEEE_802_3))
+    {
+        return NDIS_STATUS_INVALID_PARAMETER;
+    }
+
+    OidRequest->DATA.SET_INFORMATION.BytesRead = length;
+
+    return NDIS_STATUS_SUCCESS;
+}
+
 NDIS_STATUS
 AdapterSetPowerD0(
     __in PTAP_ADAPTER_CONTEXT   Adapter
@@ -432,6 +774,13 @@ Return Value:
             break;
         }
 
+        // The lookahead cannot exceed the configured MTU.
+        if (*(PULONG)OidRequest->DATA.SET_INFORMATION.InformationBuffer > Adapter->MtuSize)
+        {
+            status = NDIS_STATUS_INVALID_DATA;
+            break;
+        }
+
         Adapter->ulLookahead = *(PULONG)OidRequest->DATA.SET_INFORMATION.InformationBuffer;
 
         OidRequest->DATA.SET_INFORMATION.BytesRead = sizeof(ULONG);
@@ -498,6 +847,24 @@ Return Value:
         }
         break;
 
+    case OID_GEN_RECEIVE_SCALE_PARAMETERS:
+        //
+        // Set the RSS hash type, secret key and indirection table.
+        //
+        status = tapSetReceiveScaleParameters(Adapter,OidRequest);
+        break;
+
+    case OID_TCP_OFFLOAD_PARAMETERS:
+        //
+        // Enable or disable task offloads.
+        //
+        status = tapSetOffloadParameters(Adapter,OidRequest);
+        break;
+
+    case OID_OFFLOAD_ENCAPSULATION:
+        status = tapSetOffloadEncapsulation(Adapter,OidRequest);
+        break;
+
 #if (NDIS_SUPPORT_NDIS61)
     case OID_PNP_ADD_WAKE_UP_PATTERN:
     case OID_PNP_REMOVE_WAKE_UP_PATTERN:
@@ -643,7 +1010,7 @@ Return Value:
         // storage, in bytes, that a single packet occupies in the receive
         // buffer space of the NIC.
         //
-        ulInfo = (ULONG) TAP_MAX_FRAME_SIZE;
+        ulInfo = TAP_ADAPTER_MAX_FRAME_SIZE(Adapter);
         pInfo = &ulInfo;
         break;
     
@@ -977,6 +1344,35 @@ Return Value:
 
         break;
 
+    case OID_TCP_RSC_STATISTICS:
+
+        if (OidRequest->DATA.QUERY_INFORMATION.InformationBufferLength < NDIS_SIZEOF_RSC_STATISTICS_REVISION_1)
+        {
+            status = NDIS_STATUS_INVALID_LENGTH;
+            OidRequest->DATA.QUERY_INFORMATION.BytesNeeded = NDIS_SIZEOF_RSC_STATISTICS_REVISION_1;
+            break;
+        }
+        else
+        {
+            PNDIS_RSC_STATISTICS_INFO Statistics
+                = (PNDIS_RSC_STATISTICS_INFO)OidRequest->DATA.QUERY_INFORMATION.InformationBuffer;
+
+            NdisZeroMemory(Statistics, NDIS_SIZEOF_RSC_STATISTICS_REVISION_1);
+
+            Statistics->Header.Type = NDIS_OBJECT_TYPE_DEFAULT;
+            Statistics->Header.Size = NDIS_SIZEOF_RSC_STATISTICS_REVISION_1;
+            Statistics->Header.Revision = NDIS_RSC_STATISTICS_REVISION_1;
+
+            Statistics->CoalescedPkts = (ULONG64 )Adapter->RscStatistics.CoalescedPackets;
+            Statistics->CoalescedOctets = (ULONG64 )Adapter->RscStatistics.CoalescedOctets;
+            Statistics->CoalesceEvents = (ULONG64 )Adapter->RscStatistics.CoalesceEvents;
+            Statistics->Aborts = (ULONG64 )Adapter->RscStatistics.Aborts;
+
+            ulInfoLen = NDIS_SIZEOF_RSC_STATISTICS_REVISION_1;
+        }
+
+        break;
+
         // TODO: Inplement these query information requests.
     case OID_GEN_TRANSMIT_QUEUE_LENGTH:
     case OID_802_3_XMIT_HEARTBEAT_FAILURE:
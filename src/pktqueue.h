@@ -0,0 +1,197 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This code was inspired by the CIPE-Win32 driver by Damion K. Wilson.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef __TAP_PKTQUEUE_H_
+#define __TAP_PKTQUEUE_H_
+
+//===================================================================
+// Multi-producer, single-consumer TAP packet queue
+//
+// Producers push onto the Incoming list without taking a lock. QueueLock
+// only serializes consumers, which move Incoming packets onto per-flow
+// queues in arrival order as they need them.
+//
+// Packets are first sorted into ClassCount priority classes by their
+// 802.1p user priority. Classes are served in strict priority order, or
+// by weighted round robin with higher classes getting larger shares.
+//
+// Within a class, packets are spread over FlowCount flow queues by
+// m_FlowHash and leave in deficit round robin order, so a bulk flow
+// cannot starve the others. With one class and one flow queue this is a
+// plain FIFO.
+//
+// Count and TotalBytes are updated after a push, so a consumer may briefly
+// see fewer packets than are queued (and Count may briefly go negative),
+// but never more.
+//
+// The lock-free part below only uses SLIST, interlocked and DEBUGP
+// primitives, so tests/ also builds it in user mode.
+//===================================================================
+
+#define TAP_PACKET_QUEUE_MAX_FLOWS      64
+#define TAP_PACKET_QUEUE_DEFAULT_FLOWS  16
+
+#define TAP_PACKET_QUEUE_MAX_CLASSES    8
+
+#define TAP_PACKET_QUEUE_SCHEDULE_STRICT    0
+#define TAP_PACKET_QUEUE_SCHEDULE_WEIGHTED  1
+#define TAP_PACKET_QUEUE_SCHEDULE_MAX       1
+
+typedef struct _TAP_PACKET_FLOW
+{
+    LIST_ENTRY      Queue;          // Oldest first
+    LIST_ENTRY      ActiveLink;     // Link in ActiveFlows while not empty
+    LONG            Deficit;        // Bytes the flow may still send this round
+    LONG            Bytes;          // Total length of packets in Queue
+
+    // Active queue management state for this flow.
+    TAP_AQM_STATE   AqmState;
+} TAP_PACKET_FLOW, *PTAP_PACKET_FLOW;
+
+typedef struct _TAP_PACKET_CLASS
+{
+    LIST_ENTRY      ActiveFlows;    // Round robin order
+    LIST_ENTRY      ActiveLink;     // Link in ActiveClasses while not empty
+    LONG            Deficit;        // Weighted scheduling only
+    LONG            Weight;         // Quanta added to Deficit per round
+
+    // Statistics
+    LONG            Count;          // Packets queued in Flows
+    LONG            MaxCount;
+    ULONG64         Drops;
+
+    PTAP_PACKET_FLOW Flows;         // FlowCount flow queues
+} TAP_PACKET_CLASS, *PTAP_PACKET_CLASS;
+
+typedef struct _TAP_PACKET_QUEUE
+{
+    SLIST_HEADER    Incoming;       // Pushed by producers, newest first
+    KSPIN_LOCK      QueueLock;
+
+    // Owned by the consumer.
+    LIST_ENTRY      ActiveClasses;  // Round robin order
+    ULONG           ClassCount;
+    ULONG           Schedule;       // TAP_PACKET_QUEUE_SCHEDULE_XXX
+    ULONG           FlowCount;
+    LONG            Quantum;        // Bytes added to a flow's deficit per round
+    PTAP_PACKET_CLASS Classes;      // ClassCount classes, lowest priority first
+
+    volatile LONG   Count;          // Count of currently queued items
+    volatile LONG   TotalBytes;     // Total length of queued packets
+    volatile LONG   MaxCount;
+} TAP_PACKET_QUEUE, *PTAP_PACKET_QUEUE;
+
+FORCEINLINE
+VOID
+tapPacketQueuePushIncoming(
+    __in PTAP_PACKET_QUEUE  TapPacketQueue,
+    __in PSLIST_ENTRY       Entry,
+    __in LONG               Size
+    )
+/*++
+
+Routine Description:
+
+    Push an entry of Size bytes onto the Incoming list and account for
+    it. May be called concurrently from any number of CPUs.
+
+--*/
+{
+    LONG    count;
+    LONG    maxCount;
+
+    // Lock-free push. The consumer restores arrival order.
+    InterlockedPushEntrySList(&TapPacketQueue->Incoming,Entry);
+
+    // Update counts
+    count = InterlockedIncrement(&TapPacketQueue->Count);
+    InterlockedExchangeAdd(&TapPacketQueue->TotalBytes,Size);
+
+    maxCount = TapPacketQueue->MaxCount;
+
+    while(count > maxCount)
+    {
+        LONG    oldMaxCount;
+
+        oldMaxCount = InterlockedCompareExchange(&TapPacketQueue->MaxCount,count,maxCount);
+
+        if(oldMaxCount == maxCount)
+        {
+            DEBUGP (("[TAP] tapPacketQueuePushIncoming: New MAX queued packet count = %d\n",
+                count));
+            break;
+        }
+
+        maxCount = oldMaxCount;
+    }
+}
+
+FORCEINLINE
+PSLIST_ENTRY
+tapPacketQueueTakeIncomingLocked(
+    __in PTAP_PACKET_QUEUE  TapPacketQueue
+    )
+/*++
+
+Routine Description:
+
+    Take every entry pushed so far off the Incoming list, oldest first.
+
+    Producers only ever push and the consumer only ever takes the whole
+    list, so the list head cannot suffer from ABA.
+
+    Must be called with QueueLock held.
+
+--*/
+{
+    PSLIST_ENTRY    entry;
+    PSLIST_ENTRY    reversed = NULL;
+
+    entry = InterlockedFlushSList(&TapPacketQueue->Incoming);
+
+    // The pushed list is newest first. Reverse it.
+    while(entry != NULL)
+    {
+        PSLIST_ENTRY    next = entry->Next;
+
+        entry->Next = reversed;
+        reversed = entry;
+        entry = next;
+    }
+
+    return reversed;
+}
+
+// Call with QueueLock held, once an entry of Size bytes has left the queue.
+FORCEINLINE
+VOID
+tapPacketQueueRemovedLocked(
+    __in PTAP_PACKET_QUEUE  TapPacketQueue,
+    __in LONG               Size
+    )
+{
+    InterlockedDecrement(&TapPacketQueue->Count);
+    InterlockedExchangeAdd(&TapPacketQueue->TotalBytes,-Size);
+}
+
+#endif // __TAP_PKTQUEUE_H_
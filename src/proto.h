@@ -163,6 +163,8 @@ typedef struct {
 #define	TCPOPT_NOP     1
 #define	TCPOPT_MAXSEG  2
 #define TCPOLEN_MAXSEG 4
+#define TCPOPT_TIMESTAMP  8
+#define TCPOLEN_TIMESTAMP 10
 
 //------------
 // IPv6 Header
@@ -54,7 +54,17 @@ DestroyTapDevice(
 // Flush the pending send TAP packet queue.
 VOID
 tapFlushSendPacketQueue(
-    __in PTAP_ADAPTER_CONTEXT   Adapter
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PTAP_QUEUE             Queue
+    );
+
+// Copy part of an NB's data to a flat buffer.
+BOOLEAN
+tapCopyFromNetBuffer(
+    __in PNET_BUFFER        NetBuffer,
+    __in ULONG              Offset,
+    __in ULONG              Length,
+    __out_bcount(Length) PUCHAR Destination
     );
 
 VOID
@@ -68,10 +78,100 @@ tapCheckFlowControl(
     );
 
 VOID
-IndicateReceivePacket(
-    __in PTAP_ADAPTER_CONTEXT  Adapter,
-    __in PUCHAR packetData,
-    __in const unsigned int packetLength
+tapInjectCacheInitialize(
+    __in PTAP_ADAPTER_CONTEXT Adapter
+    );
+
+VOID
+tapInjectCacheFree(
+    __in PTAP_ADAPTER_CONTEXT Adapter
+    );
+
+VOID
+tapPrefixMdlCacheInitialize(
+    __in PTAP_ADAPTER_CONTEXT Adapter
+    );
+
+VOID
+tapPrefixMdlCacheFree(
+    __in PTAP_ADAPTER_CONTEXT Adapter
+    );
+
+PNET_BUFFER_LIST
+tapAllocateReplyNetBufferList(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in ULONG PacketLength,
+    __out PUCHAR *PacketData
+    );
+
+VOID
+tapIndicateReplyNetBufferList(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in PNET_BUFFER_LIST NetBufferList,
+    __in ULONG PacketLength
+    );
+
+PNET_BUFFER_LIST
+tapAllocateEmptyInjectNetBufferList(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in ULONG BufferLength,
+    __out PUCHAR *Buffer
+    );
+
+VOID
+tapFreeReceiveNetBufferList(
+    __in  PTAP_ADAPTER_CONTEXT  Adapter,
+    __in  PNET_BUFFER_LIST      NetBufferList
+    );
+
+VOID
+tapFreeReceiveNetBufferLists(
+    __in  PTAP_ADAPTER_CONTEXT  Adapter,
+    __in  PNET_BUFFER_LIST      NetBufferLists
+    );
+
+PNET_BUFFER_LIST
+tapAllocateInjectNetBufferList(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in_opt const PUCHAR PrefixData,
+    __in const unsigned int PrefixLength,
+    __in const PUCHAR PacketData,
+    __in const unsigned int PacketLength
+    );
+
+VOID
+tapIndicateReceiveNetBufferLists(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in PNET_BUFFER_LIST NetBufferLists,
+    __in ULONG NetBufferListCount,
+    __in ULONG ReceiveFlags
+    );
+
+VOID
+tapIndicateOrQueueReceiveNetBufferLists(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in PNET_BUFFER_LIST NetBufferLists,
+    __in ULONG NetBufferListCount,
+    __in ULONG ReceiveFlags
+    );
+
+VOID
+tapFlushPausedNetBufferLists(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in BOOLEAN Indicate
+    );
+
+// Validate and filter a frame written by userspace.
+NTSTATUS
+tapPrepareReceiveFrame(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __inout unsigned char ** FrameBuffer,
+    __inout ULONG *FrameLength,
+    __out PVOID *FramePriority,
+    __out PVOID *FrameChecksum,
+    __out PUCHAR *PrefixData,
+    __out unsigned int *PrefixLength,
+    __out BOOLEAN *Indicate
     );
 
 BOOLEAN
@@ -0,0 +1,746 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This code was inspired by the CIPE-Win32 driver by Damion K. Wilson.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+//
+// Include files.
+//
+
+#include "tap.h"
+
+//======================================================================
+// Shared-Memory Packet Rings
+//======================================================================
+//
+// Userspace may register a pair of rings instead of posting read and
+// write IRPs. Frames sent by the stack are copied into the send ring by
+// tapAdapterTransmit. Frames written by userspace into the receive ring
+// are drained by a system thread and indicated in batches.
+//
+// Adapter->Rings is set and cleared under Adapter->RingsLock. The send
+// path holds the lock while it writes to the send ring, so once
+// tapRingsUnregister has swapped the pointer out the mappings can be
+// released safely.
+//
+
+static KSTART_ROUTINE tapRingsReceiveThread;
+
+static NTSTATUS
+tapRingMap(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in TAP_WIN_RING_DESCRIPTOR *Descriptor,
+    __in KPROCESSOR_MODE        RequestorMode,
+    __in ACCESS_MASK            EventAccess,
+    __out PTAP_RING_MAPPING     Mapping
+    )
+/*++
+
+Routine Description:
+
+    Lock down a ring supplied by userspace, map it into system space and
+    reference its TailMoved event.
+
+    Must be called at PASSIVE_LEVEL in the context of the process that
+    owns the ring.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    Descriptor                  Ring descriptor passed by userspace
+    RequestorMode               Mode of the registering caller
+    EventAccess                 Access needed on the TailMoved event
+    Mapping                     Receives the mapped ring
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    NTSTATUS    ntStatus;
+    ULONG       capacity;
+    ULONG       pagePriority;
+
+    NdisZeroMemory(Mapping,sizeof(TAP_RING_MAPPING));
+
+    if(Descriptor->Size < TAP_WIN_RING_SIZE(TAP_WIN_RING_CAPACITY_MIN)
+        || Descriptor->Size > TAP_WIN_RING_SIZE(TAP_WIN_RING_CAPACITY_MAX))
+    {
+        DEBUGP (("[%s] Bad ring size %d\n",
+            MINIPORT_INSTANCE_ID (Adapter), Descriptor->Size));
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    capacity = Descriptor->Size - TAP_WIN_RING_SIZE(0);
+
+    if(capacity & (capacity - 1))
+    {
+        DEBUGP (("[%s] Ring capacity %d is not a power of two\n",
+            MINIPORT_INSTANCE_ID (Adapter), capacity));
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if(Descriptor->Ring == 0
+        || Descriptor->Ring != (ULONG_PTR )Descriptor->Ring
+        || (Descriptor->Ring & (sizeof(ULONG) - 1)))
+    {
+        DEBUGP (("[%s] Bad ring address\n", MINIPORT_INSTANCE_ID (Adapter)));
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Mapping->Mdl = IoAllocateMdl(
+                    (PVOID )(ULONG_PTR )Descriptor->Ring,
+                    Descriptor->Size,
+                    FALSE,
+                    FALSE,
+                    NULL
+                    );
+
+    if(Mapping->Mdl == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    __try
+    {
+        MmProbeAndLockPages(Mapping->Mdl,RequestorMode,IoWriteAccess);
+    }
+    __except(EXCEPTION_EXECUTE_HANDLER)
+    {
+        IoFreeMdl(Mapping->Mdl);
+        Mapping->Mdl = NULL;
+
+        return STATUS_INVALID_USER_BUFFER;
+    }
+
+    //
+    // On Windows versions 8 and above, the MDL can be marked as not executable.
+    // This is required for the driver to function under HyperVisor-enforced
+    // Code Integrity (HVCI).
+    //
+    pagePriority = NormalPagePriority;
+
+    if (GlobalData.RunningWindows8OrGreater != FALSE) {
+        pagePriority |= MdlMappingNoExecute;
+    }
+
+    Mapping->Ring = (TAP_WIN_RING *)MmGetSystemAddressForMdlSafe(Mapping->Mdl,pagePriority);
+
+    if(Mapping->Ring == NULL)
+    {
+        MmUnlockPages(Mapping->Mdl);
+        IoFreeMdl(Mapping->Mdl);
+        Mapping->Mdl = NULL;
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ntStatus = ObReferenceObjectByHandle(
+                    (HANDLE )(ULONG_PTR )Descriptor->TailMoved,
+                    EventAccess,
+                    *ExEventObjectType,
+                    RequestorMode,
+                    (PVOID *)&Mapping->TailMoved,
+                    NULL
+                    );
+
+    if(!NT_SUCCESS(ntStatus))
+    {
+        MmUnlockPages(Mapping->Mdl);
+        IoFreeMdl(Mapping->Mdl);
+        Mapping->Mdl = NULL;
+        Mapping->Ring = NULL;
+
+        return ntStatus;
+    }
+
+    Mapping->Capacity = capacity;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+tapRingUnmap(
+    __in PTAP_RING_MAPPING      Mapping
+    )
+{
+    if(Mapping->TailMoved != NULL)
+    {
+        ObDereferenceObject(Mapping->TailMoved);
+    }
+
+    if(Mapping->Mdl != NULL)
+    {
+        MmUnlockPages(Mapping->Mdl);
+        IoFreeMdl(Mapping->Mdl);
+    }
+
+    NdisZeroMemory(Mapping,sizeof(TAP_RING_MAPPING));
+}
+
+static VOID
+tapRingsFree(
+    __in PTAP_RINGS             Rings
+    )
+{
+    if(Rings->ReceiveThread != NULL)
+    {
+        KeSetEvent(&Rings->ReceiveThreadStop,IO_NO_INCREMENT,FALSE);
+
+        KeWaitForSingleObject(
+            Rings->ReceiveThread,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL
+            );
+
+        ObDereferenceObject(Rings->ReceiveThread);
+    }
+
+    DEBUGP (("[%s] Rings released; send drops %I64u, receive drops %I64u\n",
+        MINIPORT_INSTANCE_ID (Rings->Adapter),
+        Rings->SendDrops,
+        Rings->ReceiveDrops));
+
+    tapRingUnmap(&Rings->Send);
+    tapRingUnmap(&Rings->Receive);
+
+    NdisFreeMemory(Rings,0,0);
+}
+
+// Status for a registration attempt while rings are registered.
+static NTSTATUS
+tapRingsRegisteredStatus(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PFILE_OBJECT           FileObject
+    )
+{
+    NTSTATUS    ntStatus = STATUS_SUCCESS;
+    KIRQL       irql;
+
+    KeAcquireSpinLock(&Adapter->RingsLock,&irql);
+
+    if(Adapter->Rings != NULL)
+    {
+        // Only the handle owning the rings may use them.
+        ntStatus = (Adapter->Rings->Owner == FileObject)
+            ? STATUS_ALREADY_REGISTERED
+            : STATUS_ACCESS_DENIED;
+    }
+
+    KeReleaseSpinLock(&Adapter->RingsLock,irql);
+
+    return ntStatus;
+}
+
+NTSTATUS
+tapRingsRegister(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PFILE_OBJECT           FileObject,
+    __in TAP_WIN_RING_REGISTRATION *Registration,
+    __in KPROCESSOR_MODE        RequestorMode
+    )
+/*++
+
+Routine Description:
+
+    Map the rings passed with TAP_WIN_IOCTL_REGISTER_RINGS and start
+    the receive ring thread.
+
+    Called at PASSIVE_LEVEL in the context of the registering process.
+    The rings belong to the registering handle: its cleanup releases
+    them, and other handles cannot register rings meanwhile.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    FileObject                  Handle registering the rings
+    Registration                Copy of the registration from userspace
+    RequestorMode               Mode of the registering caller
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    NTSTATUS    ntStatus;
+    PTAP_RINGS  rings;
+    HANDLE      threadHandle;
+    KIRQL       irql;
+    BOOLEAN     registered = FALSE;
+
+    // Checked again when the rings are published.
+    ntStatus = tapRingsRegisteredStatus(Adapter,FileObject);
+
+    if(!NT_SUCCESS(ntStatus))
+    {
+        return ntStatus;
+    }
+
+    rings = (PTAP_RINGS )NdisAllocateMemoryWithTagPriority(
+                Adapter->MiniportAdapterHandle,
+                sizeof(TAP_RINGS),
+                TAP_RINGS_TAG,
+                NormalPoolPriority
+                );
+
+    if(rings == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    NdisZeroMemory(rings,sizeof(TAP_RINGS));
+
+    rings->Adapter = Adapter;
+    rings->Owner = FileObject;
+    KeInitializeEvent(&rings->ReceiveThreadStop,NotificationEvent,FALSE);
+
+    // Map the send ring. The driver sets its event.
+    ntStatus = tapRingMap(
+                    Adapter,
+                    &Registration->Send,
+                    RequestorMode,
+                    EVENT_MODIFY_STATE,
+                    &rings->Send
+                    );
+
+    if(NT_SUCCESS(ntStatus))
+    {
+        // Map the receive ring. The driver waits on its event.
+        ntStatus = tapRingMap(
+                        Adapter,
+                        &Registration->Receive,
+                        RequestorMode,
+                        SYNCHRONIZE,
+                        &rings->Receive
+                        );
+    }
+
+    if(NT_SUCCESS(ntStatus))
+    {
+        rings->SendTail = rings->Send.Ring->Tail;
+
+        if(rings->SendTail >= rings->Send.Capacity
+            || (rings->SendTail & (TAP_WIN_FRAME_ALIGNMENT - 1)))
+        {
+            ntStatus = STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    if(NT_SUCCESS(ntStatus))
+    {
+        ntStatus = PsCreateSystemThread(
+                        &threadHandle,
+                        THREAD_ALL_ACCESS,
+                        NULL,
+                        NULL,
+                        NULL,
+                        tapRingsReceiveThread,
+                        rings
+                        );
+
+        if(NT_SUCCESS(ntStatus))
+        {
+            ObReferenceObjectByHandle(
+                threadHandle,
+                SYNCHRONIZE,
+                *PsThreadType,
+                KernelMode,
+                (PVOID *)&rings->ReceiveThread,
+                NULL
+                );
+
+            ZwClose(threadHandle);
+        }
+    }
+
+    if(NT_SUCCESS(ntStatus))
+    {
+        // Publish the rings to the send path.
+        KeAcquireSpinLock(&Adapter->RingsLock,&irql);
+
+        if(Adapter->Rings == NULL)
+        {
+            Adapter->Rings = rings;
+            registered = TRUE;
+        }
+
+        KeReleaseSpinLock(&Adapter->RingsLock,irql);
+
+        if(!registered)
+        {
+            ntStatus = tapRingsRegisteredStatus(Adapter,FileObject);
+        }
+    }
+
+    if(!registered)
+    {
+        DEBUGP (("[%s] Ring registration failed, status = %8.8X\n",
+            MINIPORT_INSTANCE_ID (Adapter), ntStatus));
+        NOTE_ERROR ();
+
+        tapRingsFree(rings);
+    }
+    else
+    {
+        DEBUGP (("[%s] Rings registered, send capacity %d, receive capacity %d\n",
+            MINIPORT_INSTANCE_ID (Adapter),
+            rings->Send.Capacity,
+            rings->Receive.Capacity));
+    }
+
+    return ntStatus;
+}
+
+VOID
+tapRingsUnregister(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in_opt PFILE_OBJECT       FileObject
+    )
+/*++
+
+Routine Description:
+
+    Stop using the registered rings, if any, and release them.
+
+    With a FileObject, only rings registered on that handle are released.
+    The ring pages are locked in the registering process, so they must be
+    released before that process can exit.
+
+    Safe to call more than once. Must be called at PASSIVE_LEVEL.
+
+--*/
+{
+    PTAP_RINGS  rings;
+    KIRQL       irql;
+
+    KeAcquireSpinLock(&Adapter->RingsLock,&irql);
+    rings = Adapter->Rings;
+
+    if(rings != NULL && FileObject != NULL && rings->Owner != FileObject)
+    {
+        rings = NULL;
+    }
+
+    if(rings != NULL)
+    {
+        Adapter->Rings = NULL;
+    }
+
+    KeReleaseSpinLock(&Adapter->RingsLock,irql);
+
+    if(rings != NULL)
+    {
+        tapRingsFree(rings);
+    }
+}
+
+BOOLEAN
+tapRingsSendFrame(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in_bcount_opt(OffloadSize) const VOID *OffloadHeader,
+    __in ULONG                  OffloadSize,
+    __in PUCHAR                 FrameData,
+    __in ULONG                  FrameLength
+    )
+/*++
+
+Routine Description:
+
+    Copy a frame sent by the stack into the send ring and wake userspace
+    if it is waiting.
+
+    The frame is dropped if the ring is full or userspace corrupted the
+    ring's Head.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    OffloadHeader               Header to put in front of the frame, if any
+    OffloadSize                 Size of OffloadHeader, or zero
+    FrameData                   User-visible frame data
+    FrameLength                 Length of frame data
+
+Return Value:
+
+    FALSE if no rings are registered and the frame must take the queued
+    path. TRUE otherwise, whether or not the frame fit.
+
+--*/
+{
+    PTAP_RINGS              rings;
+    TAP_WIN_RING            *ring;
+    KIRQL                   irql;
+
+    KeAcquireSpinLock(&Adapter->RingsLock,&irql);
+
+    rings = Adapter->Rings;
+
+    if(rings == NULL)
+    {
+        KeReleaseSpinLock(&Adapter->RingsLock,irql);
+        return FALSE;
+    }
+
+    ring = rings->Send.Ring;
+
+    if(!tapRingWriteFrame(
+            ring,
+            rings->Send.Capacity,
+            ring->Head,
+            &rings->SendTail,
+            OffloadHeader,
+            OffloadSize,
+            FrameData,
+            FrameLength
+            ))
+    {
+        ++rings->SendDrops;
+    }
+    else
+    {
+        // Frame must be visible before the new Tail.
+        KeMemoryBarrier();
+        ring->Tail = rings->SendTail;
+        KeMemoryBarrier();
+
+        if(ring->Alertable)
+        {
+            KeSetEvent(rings->Send.TailMoved,IO_NETWORK_INCREMENT,FALSE);
+        }
+    }
+
+    KeReleaseSpinLock(&Adapter->RingsLock,irql);
+
+    return TRUE;
+}
+
+static VOID
+tapRingsReceiveThread(
+    __in PVOID                  StartContext
+    )
+/*++
+
+Routine Description:
+
+    Drain the receive ring. Frames are copied into injected NBLs and
+    indicated up to TAP_RING_RECEIVE_BATCH at a time; the ring space is
+    handed back to userspace as soon as the copies are made.
+
+    While the miniport is paused frames are consumed and queued, as for
+    writes, and indicated once it restarts; they are only dropped if the
+    paused queue is full. If userspace corrupts the ring the thread stops
+    consuming and waits to be stopped.
+
+--*/
+{
+    PTAP_RINGS              rings = (PTAP_RINGS )StartContext;
+    PTAP_ADAPTER_CONTEXT    adapter = rings->Adapter;
+    TAP_WIN_RING            *ring = rings->Receive.Ring;
+    ULONG                   capacity = rings->Receive.Capacity;
+    PVOID                   waitObjects[2];
+    ULONG                   head, tail;
+    BOOLEAN                 corrupt = FALSE;
+
+    waitObjects[0] = &rings->ReceiveThreadStop;
+    waitObjects[1] = rings->Receive.TailMoved;
+
+    head = ring->Head;
+
+    if(!tapRingOffsetValid(head,capacity))
+    {
+        corrupt = TRUE;
+    }
+
+    while(!corrupt)
+    {
+        PNET_BUFFER_LIST    netBufferLists = NULL;
+        PNET_BUFFER_LIST    tailNbl = NULL;
+        ULONG               netBufferListCount = 0;
+        NDIS_STATUS         readyStatus;
+        BOOLEAN             ready;
+
+        if(KeReadStateEvent(&rings->ReceiveThreadStop))
+        {
+            break;
+        }
+
+        tail = ring->Tail;
+
+        if(head == tail)
+        {
+            NTSTATUS    waitStatus = STATUS_SUCCESS;
+
+            // Tell userspace to set TailMoved, then check again before waiting.
+            InterlockedExchange(&ring->Alertable,TRUE);
+
+            tail = ring->Tail;
+
+            if(head == tail)
+            {
+                waitStatus = KeWaitForMultipleObjects(
+                                2,
+                                waitObjects,
+                                WaitAny,
+                                Executive,
+                                KernelMode,
+                                FALSE,
+                                NULL,
+                                NULL
+                                );
+            }
+
+            InterlockedExchange(&ring->Alertable,FALSE);
+
+            if(waitStatus == STATUS_WAIT_0)
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        if(!tapRingOffsetValid(tail,capacity))
+        {
+            corrupt = TRUE;
+            break;
+        }
+
+        // Frame data must be read after Tail.
+        KeMemoryBarrier();
+
+        // Frames read while paused are queued until Restart.
+        readyStatus = tapAdapterSendAndReceiveReady(adapter);
+        ready = (readyStatus == NDIS_STATUS_SUCCESS || readyStatus == NDIS_STATUS_PAUSED);
+
+        while(head != tail && netBufferListCount < TAP_RING_RECEIVE_BATCH)
+        {
+            TAP_WIN_FRAME_HEADER    frameHeader;
+
+            if(!tapRingReadFrameHeader(ring,capacity,head,tail,&frameHeader))
+            {
+                corrupt = TRUE;
+                break;
+            }
+
+            if(ready)
+            {
+                PNET_BUFFER_LIST    netBufferList = NULL;
+                unsigned char       *frameBuffer = ring->Data + head + sizeof(frameHeader);
+                ULONG               frameLength = frameHeader.Length;
+                PVOID               framePriority;
+                PVOID               frameChecksum;
+                PUCHAR              prefixData;
+                unsigned int        prefixLength;
+                BOOLEAN             indicate;
+                NTSTATUS            ntStatus;
+
+                ntStatus = tapPrepareReceiveFrame(
+                                adapter,
+                                &frameBuffer,
+                                &frameLength,
+                                &framePriority,
+                                &frameChecksum,
+                                &prefixData,
+                                &prefixLength,
+                                &indicate
+                                );
+
+                if(ntStatus == STATUS_SUCCESS && indicate)
+                {
+                    netBufferList = tapAllocateInjectNetBufferList(
+                                        adapter,
+                                        prefixData,
+                                        prefixLength,
+                                        frameBuffer,
+                                        frameLength
+                                        );
+
+                    if(netBufferList == NULL)
+                    {
+                        ++rings->ReceiveDrops;
+                    }
+                }
+                else if(ntStatus != STATUS_SUCCESS)
+                {
+                    ++rings->ReceiveDrops;
+                }
+
+                if(netBufferList != NULL)
+                {
+                    NET_BUFFER_LIST_INFO(netBufferList, Ieee8021QNetBufferListInfo) = framePriority;
+                    NET_BUFFER_LIST_INFO(netBufferList, TcpIpChecksumNetBufferListInfo) = frameChecksum;
+
+                    if(tailNbl == NULL)
+                    {
+                        netBufferLists = netBufferList;
+                    }
+                    else
+                    {
+                        NET_BUFFER_LIST_NEXT_NBL(tailNbl) = netBufferList;
+                    }
+
+                    tailNbl = netBufferList;
+                    ++netBufferListCount;
+                }
+            }
+
+            head = tapRingNextFrame(head,frameHeader.Length,capacity);
+        }
+
+        // Frames were copied. Hand the space back to userspace.
+        KeMemoryBarrier();
+        ring->Head = head;
+
+        if(netBufferLists != NULL)
+        {
+            tapRscCoalesceNetBufferLists(adapter,&netBufferLists,&netBufferListCount);
+
+            tapIndicateOrQueueReceiveNetBufferLists(
+                adapter,
+                netBufferLists,
+                netBufferListCount,
+                0       // ReceiveFlags
+                );
+        }
+    }
+
+    if(corrupt)
+    {
+        DEBUGP (("[%s] Receive ring corrupted by userspace; head %d\n",
+            MINIPORT_INSTANCE_ID (adapter), head));
+        NOTE_ERROR ();
+
+        KeWaitForSingleObject(
+            &rings->ReceiveThreadStop,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL
+            );
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
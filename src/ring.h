@@ -0,0 +1,92 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This code was inspired by the CIPE-Win32 driver by Damion K. Wilson.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef __TAP_RING_H_
+#define __TAP_RING_H_
+
+//===================================================================
+// Shared-memory packet rings
+//
+// See TAP_WIN_IOCTL_REGISTER_RINGS in tap-windows.h for the layout
+// shared with userspace.
+//===================================================================
+
+// Maximum number of NBLs indicated in one call from the receive ring.
+#define TAP_RING_RECEIVE_BATCH      64
+
+// One ring locked down and mapped into system space.
+typedef struct _TAP_RING_MAPPING
+{
+    PMDL                Mdl;
+    TAP_WIN_RING        *Ring;
+    ULONG               Capacity;       // Power of two
+    PKEVENT             TailMoved;
+} TAP_RING_MAPPING, *PTAP_RING_MAPPING;
+
+typedef struct _TAP_RINGS
+{
+    PTAP_ADAPTER_CONTEXT    Adapter;
+
+    // Handle that registered the rings. The ring pages are locked in
+    // its process and are released when it is cleaned up.
+    PFILE_OBJECT            Owner;
+
+    // Frames sent by the stack, produced by the driver.
+    TAP_RING_MAPPING        Send;
+    ULONG                   SendTail;   // Driver-private copy of Send.Ring->Tail
+
+    // Frames for the stack, consumed by the receive thread.
+    TAP_RING_MAPPING        Receive;
+    PKTHREAD                ReceiveThread;
+    KEVENT                  ReceiveThreadStop;
+
+    // Statistics
+    ULONG64                 SendDrops;
+    ULONG64                 ReceiveDrops;
+} TAP_RINGS, *PTAP_RINGS;
+
+NTSTATUS
+tapRingsRegister(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PFILE_OBJECT           FileObject,
+    __in TAP_WIN_RING_REGISTRATION *Registration,
+    __in KPROCESSOR_MODE        RequestorMode
+    );
+
+VOID
+tapRingsUnregister(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in_opt PFILE_OBJECT       FileObject
+    );
+
+// Returns FALSE if no rings are registered.
+BOOLEAN
+tapRingsSendFrame(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in_bcount_opt(OffloadSize) const VOID *OffloadHeader,
+    __in ULONG                  OffloadSize,
+    __in PUCHAR                 FrameData,
+    __in ULONG                  FrameLength
+    );
+
+#endif // __TAP_RING_H_
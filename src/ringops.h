@@ -0,0 +1,181 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This code was inspired by the CIPE-Win32 driver by Damion K. Wilson.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef __TAP_RINGOPS_H_
+#define __TAP_RINGOPS_H_
+
+//===================================================================
+// Shared-memory ring arithmetic
+//
+// Index checks and frame copies for the rings of
+// TAP_WIN_IOCTL_REGISTER_RINGS. Head and Tail of a ring are written by
+// userspace and are checked here before they are used. Publishing Tail
+// or Head and the memory barriers that go with it are left to the
+// caller.
+//
+// Only uses TAP_WIN_XXX definitions and NdisMoveMemory, so tests/ also
+// builds it in user mode.
+//===================================================================
+
+// Offsets taken from userspace must lie in the ring and be frame aligned.
+FORCEINLINE
+BOOLEAN
+tapRingOffsetValid(
+    __in ULONG                  Offset,
+    __in ULONG                  Capacity
+    )
+{
+    return Offset < Capacity && (Offset & (TAP_WIN_FRAME_ALIGNMENT - 1)) == 0;
+}
+
+// Room for new frames. One alignment unit is left unused so that a full
+// ring cannot be mistaken for an empty one.
+FORCEINLINE
+ULONG
+tapRingFreeSpace(
+    __in ULONG                  Head,
+    __in ULONG                  Tail,
+    __in ULONG                  Capacity
+    )
+{
+    return (Head - Tail - TAP_WIN_FRAME_ALIGNMENT) & (Capacity - 1);
+}
+
+// Offset of the frame following one of Length bytes at Offset.
+FORCEINLINE
+ULONG
+tapRingNextFrame(
+    __in ULONG                  Offset,
+    __in ULONG                  Length,
+    __in ULONG                  Capacity
+    )
+{
+    return TAP_WIN_FRAME_ALIGN(Offset + sizeof(TAP_WIN_FRAME_HEADER) + Length) & (Capacity - 1);
+}
+
+FORCEINLINE
+BOOLEAN
+tapRingWriteFrame(
+    __in TAP_WIN_RING           *Ring,
+    __in ULONG                  Capacity,
+    __in ULONG                  Head,
+    __inout PULONG              Tail,
+    __in_bcount_opt(PrefixSize) const VOID *Prefix,
+    __in ULONG                  PrefixSize,
+    __in_bcount(Length) const VOID *Data,
+    __in ULONG                  Length
+    )
+/*++
+
+Routine Description:
+
+    Copy a frame, preceded by its TAP_WIN_FRAME_HEADER and by Prefix if
+    given, to Tail and advance Tail past it. A frame never wraps; it may
+    run into the trailing bytes behind the ring.
+
+Arguments:
+
+    Ring                        Mapped ring
+    Capacity                    Ring capacity, a power of two
+    Head                        Head as read from the ring
+    Tail                        Producer's private copy of Tail
+    Prefix                      Header to put in front of the frame, if any
+    PrefixSize                  Size of Prefix, ignored if Prefix is NULL
+    Data                        Frame data
+    Length                      Length of frame data
+
+Return Value:
+
+    FALSE, with Tail unchanged, if Head is corrupt, the frame is too long
+    for the trailing bytes or the ring is too full.
+
+--*/
+{
+    TAP_WIN_FRAME_HEADER    frameHeader;
+    ULONG                   prefixSize = Prefix ? PrefixSize : 0;
+    ULONG                   tail = *Tail;
+
+    if(!tapRingOffsetValid(Head,Capacity)
+        || prefixSize > TAP_WIN_RING_TRAILING_BYTES - sizeof(frameHeader)
+        || Length > TAP_WIN_RING_TRAILING_BYTES - sizeof(frameHeader) - prefixSize
+        || TAP_WIN_FRAME_ALIGN(sizeof(frameHeader) + prefixSize + Length)
+            > tapRingFreeSpace(Head,tail,Capacity))
+    {
+        return FALSE;
+    }
+
+    frameHeader.Length = prefixSize + Length;
+    frameHeader.Flags = 0;
+
+    NdisMoveMemory(Ring->Data + tail,&frameHeader,sizeof(frameHeader));
+
+    if(prefixSize != 0)
+    {
+        NdisMoveMemory(Ring->Data + tail + sizeof(frameHeader),Prefix,prefixSize);
+    }
+
+    NdisMoveMemory(Ring->Data + tail + sizeof(frameHeader) + prefixSize,Data,Length);
+
+    *Tail = tapRingNextFrame(tail,prefixSize + Length,Capacity);
+
+    return TRUE;
+}
+
+FORCEINLINE
+BOOLEAN
+tapRingReadFrameHeader(
+    __in TAP_WIN_RING           *Ring,
+    __in ULONG                  Capacity,
+    __in ULONG                  Head,
+    __in ULONG                  Tail,
+    __out TAP_WIN_FRAME_HEADER  *FrameHeader
+    )
+/*++
+
+Routine Description:
+
+    Read the header of the frame at Head, which must differ from Tail.
+    Both must have passed tapRingOffsetValid. The frame data follows the
+    header at Ring->Data + Head.
+
+Return Value:
+
+    FALSE if the frame header does not fit between Head and Tail, or the
+    frame runs past Tail or past the trailing bytes.
+
+--*/
+{
+    ULONG   available = (Tail - Head) & (Capacity - 1);
+
+    if(available < sizeof(TAP_WIN_FRAME_HEADER))
+    {
+        return FALSE;
+    }
+
+    NdisMoveMemory(FrameHeader,Ring->Data + Head,sizeof(TAP_WIN_FRAME_HEADER));
+
+    return FrameHeader->Length <= available - sizeof(TAP_WIN_FRAME_HEADER)
+        && FrameHeader->Length <= TAP_WIN_RING_TRAILING_BYTES - sizeof(TAP_WIN_FRAME_HEADER);
+}
+
+#endif // __TAP_RINGOPS_H_
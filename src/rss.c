@@ -0,0 +1,334 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This code was inspired by the CIPE-Win32 driver by Damion K. Wilson.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+//
+// Include files.
+//
+
+#include "tap.h"
+
+//======================================================================
+// Receive Side Scaling
+//======================================================================
+
+KDEFERRED_ROUTINE tapRssDpc;
+
+NDIS_STATUS
+tapRssInitialize(
+    __in PTAP_ADAPTER_CONTEXT   Adapter
+    )
+/*++
+
+Routine Description:
+
+    Allocate one DPC per processor for indicating frames on the processor
+    the indirection table selects. RSS stays disabled until the stack sets
+    OID_GEN_RECEIVE_SCALE_PARAMETERS.
+
+Arguments:
+
+    Adapter              Pointer to our adapter context
+
+Return Value:
+
+    NDIS_STATUS_SUCCESS or NDIS_STATUS_RESOURCES.
+
+--*/
+{
+    PTAP_RSS    rss = &Adapter->Rss;
+    ULONG       i;
+
+    rss->Lock = NdisAllocateRWLock(Adapter->MiniportAdapterHandle);
+
+    if(rss->Lock == NULL)
+    {
+        return NDIS_STATUS_RESOURCES;
+    }
+
+    rss->ProcessorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    rss->Processors = (PTAP_RSS_PROCESSOR )NdisAllocateMemoryWithTagPriority(
+                            Adapter->MiniportAdapterHandle,
+                            rss->ProcessorCount * sizeof(TAP_RSS_PROCESSOR),
+                            TAP_RSS_TAG,
+                            NormalPoolPriority
+                            );
+
+    if(rss->Processors == NULL)
+    {
+        return NDIS_STATUS_RESOURCES;
+    }
+
+    NdisZeroMemory(rss->Processors,rss->ProcessorCount * sizeof(TAP_RSS_PROCESSOR));
+
+    for(i = 0; i < rss->ProcessorCount; ++i)
+    {
+        PTAP_RSS_PROCESSOR  processor = &rss->Processors[i];
+        PROCESSOR_NUMBER    number;
+
+        processor->Adapter = Adapter;
+        KeInitializeSpinLock(&processor->Lock);
+        KeInitializeDpc(&processor->Dpc,tapRssDpc,processor);
+
+        if(NT_SUCCESS(KeGetProcessorNumberFromIndex(i,&number)))
+        {
+            KeSetTargetProcessorDpcEx(&processor->Dpc,&number);
+        }
+    }
+
+    return NDIS_STATUS_SUCCESS;
+}
+
+VOID
+tapRssFree(
+    __in PTAP_ADAPTER_CONTEXT   Adapter
+    )
+{
+    PTAP_RSS    rss = &Adapter->Rss;
+
+    if(rss->Processors != NULL)
+    {
+        // Frames are counted in flight until indicated and returned, so
+        // the DPCs have nothing left to do. Wait for any still running.
+        KeFlushQueuedDpcs();
+
+        NdisFreeMemory(rss->Processors,0,0);
+        rss->Processors = NULL;
+    }
+
+    if(rss->Lock != NULL)
+    {
+        NdisFreeRWLock(rss->Lock);
+        rss->Lock = NULL;
+    }
+}
+
+static ULONG
+tapRssHashNetBufferList(
+    __in PTAP_RSS               Rss,
+    __in PNET_BUFFER_LIST       NetBufferList,
+    __out PULONG                HashValue
+    )
+/*++
+
+Routine Description:
+
+    Hash a frame the way the stack asked for in HashInformation.
+
+    Called with Rss->Lock held shared.
+
+Return Value:
+
+    The NDIS_HASH_XXX type of the hash, or zero if the frame was not
+    hashed.
+
+--*/
+{
+    PNET_BUFFER nb = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+    UCHAR       header[TAP_RSS_HEADER_SIZE];
+    ULONG       length = min(NET_BUFFER_DATA_LENGTH(nb), sizeof(header));
+
+    if(!tapCopyFromNetBuffer(nb, 0, length, header))
+    {
+        return 0;
+    }
+
+    return tapRssHashFrame(
+                Rss->Key,
+                NDIS_RSS_HASH_TYPE_FROM_HASH_INFO(Rss->HashInformation),
+                header,
+                length,
+                HashValue
+                );
+}
+
+VOID
+tapRssIndicateReceiveNetBufferLists(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PNET_BUFFER_LIST       NetBufferLists,
+    __in ULONG                  ReceiveFlags
+    )
+/*++
+
+Routine Description:
+
+    Hash each NBL of a chain and indicate it on the processor its hash
+    selects in the indirection table. NBLs for other processors are
+    queued to that processor's DPC; the rest, and NBLs that could not be
+    hashed, are indicated here.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    NetBufferLists              Chain of NBLs, already counted in flight
+    ReceiveFlags                NDIS_RECEIVE_FLAGS_XXX for NBLs indicated here
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PTAP_RSS            rss = &Adapter->Rss;
+    PNET_BUFFER_LIST    currentNbl;
+    PNET_BUFFER_LIST    nextNbl;
+    PNET_BUFFER_LIST    localHead = NULL;
+    PNET_BUFFER_LIST    localTail = NULL;
+    ULONG               localCount = 0;
+    ULONG               currentProcessor;
+    LOCK_STATE_EX       lockState;
+
+    // Shared, so writers and the ring thread hash in parallel. Raises
+    // to DISPATCH_LEVEL.
+    NdisAcquireRWLockRead(rss->Lock,&lockState,0);
+
+    currentProcessor = KeGetCurrentProcessorIndex();
+
+    for(currentNbl = NetBufferLists; currentNbl != NULL; currentNbl = nextNbl)
+    {
+        ULONG   targetProcessor = currentProcessor;
+        ULONG   hashType = 0;
+        ULONG   hashValue = 0;
+
+        nextNbl = NET_BUFFER_LIST_NEXT_NBL(currentNbl);
+        NET_BUFFER_LIST_NEXT_NBL(currentNbl) = NULL;
+
+        if(rss->Enabled)
+        {
+            hashType = tapRssHashNetBufferList(rss,currentNbl,&hashValue);
+        }
+
+        if(hashType != 0)
+        {
+            NET_BUFFER_LIST_SET_HASH_VALUE(currentNbl,hashValue);
+            NET_BUFFER_LIST_SET_HASH_TYPE(currentNbl,hashType);
+            NET_BUFFER_LIST_SET_HASH_FUNCTION(currentNbl,NdisHashFunctionToeplitz);
+
+            targetProcessor = rss->Table[TAP_RSS_TABLE_INDEX(hashValue,rss->TableSize)];
+        }
+        else
+        {
+            NET_BUFFER_LIST_SET_HASH_VALUE(currentNbl,0);
+            NET_BUFFER_LIST_SET_HASH_TYPE(currentNbl,0);
+            NET_BUFFER_LIST_SET_HASH_FUNCTION(currentNbl,0);
+        }
+
+        if(targetProcessor == currentProcessor)
+        {
+            if(localTail == NULL)
+            {
+                localHead = currentNbl;
+            }
+            else
+            {
+                NET_BUFFER_LIST_NEXT_NBL(localTail) = currentNbl;
+            }
+
+            localTail = currentNbl;
+            ++localCount;
+        }
+        else
+        {
+            PTAP_RSS_PROCESSOR  processor = &rss->Processors[targetProcessor];
+
+            KeAcquireSpinLockAtDpcLevel(&processor->Lock);
+
+            if(processor->Tail == NULL)
+            {
+                processor->Head = currentNbl;
+            }
+            else
+            {
+                NET_BUFFER_LIST_NEXT_NBL(processor->Tail) = currentNbl;
+            }
+
+            processor->Tail = currentNbl;
+            ++processor->Count;
+
+            KeReleaseSpinLockFromDpcLevel(&processor->Lock);
+
+            // Does nothing if the DPC is already queued.
+            KeInsertQueueDpc(&processor->Dpc,NULL,NULL);
+        }
+    }
+
+    NdisReleaseRWLock(rss->Lock,&lockState);
+
+    if(localHead != NULL)
+    {
+        NdisMIndicateReceiveNetBufferLists(
+            Adapter->MiniportAdapterHandle,
+            localHead,
+            NDIS_DEFAULT_PORT_NUMBER,
+            localCount,
+            ReceiveFlags
+            );
+    }
+}
+
+VOID
+tapRssDpc(
+    __in PKDPC                  Dpc,
+    __in_opt PVOID              DeferredContext,
+    __in_opt PVOID              SystemArgument1,
+    __in_opt PVOID              SystemArgument2
+    )
+/*++
+
+Routine Description:
+
+    Indicate the NBLs queued for this processor.
+
+--*/
+{
+    PTAP_RSS_PROCESSOR  processor = (PTAP_RSS_PROCESSOR )DeferredContext;
+    PNET_BUFFER_LIST    netBufferLists;
+    ULONG               netBufferListCount;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    KeAcquireSpinLockAtDpcLevel(&processor->Lock);
+
+    netBufferLists = processor->Head;
+    netBufferListCount = processor->Count;
+
+    processor->Head = NULL;
+    processor->Tail = NULL;
+    processor->Count = 0;
+
+    KeReleaseSpinLockFromDpcLevel(&processor->Lock);
+
+    if(netBufferLists != NULL)
+    {
+        NdisMIndicateReceiveNetBufferLists(
+            processor->Adapter->MiniportAdapterHandle,
+            netBufferLists,
+            NDIS_DEFAULT_PORT_NUMBER,
+            netBufferListCount,
+            NDIS_RECEIVE_FLAGS_DISPATCH_LEVEL
+            );
+    }
+}
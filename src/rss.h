@@ -0,0 +1,124 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This code was inspired by the CIPE-Win32 driver by Damion K. Wilson.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef __TAP_RSS_H_
+#define __TAP_RSS_H_
+
+//===================================================================
+// Receive side scaling for frames indicated to the stack
+//
+// Frames written by userspace are hashed with the Toeplitz function
+// and indicated on the processor the indirection table maps the hash
+// to, from a DPC targeted at that processor.
+//===================================================================
+
+#define TAP_RSS_MAX_KEY_SIZE        NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_2
+#define TAP_RSS_MAX_TABLE_ENTRIES   (NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_2 / sizeof(PROCESSOR_NUMBER))
+
+// The indirection table is indexed by the low bits of the hash.
+#define TAP_RSS_TABLE_INDEX(hash,size)  ((hash) & ((size) - 1))
+
+// Enough of a frame to hash it: Ethernet and 802.1Q headers, the largest
+// IPv4 header and the TCP ports.
+#define TAP_RSS_HEADER_SIZE     (ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE + 60 + 4)
+
+// Largest hash input: IPv6 source and destination addresses and ports.
+#define TAP_RSS_INPUT_SIZE      (2 * sizeof(IPV6ADDR) + 4)
+
+// Hash types computed for received frames.
+#define TAP_RSS_HASH_TYPES          (NDIS_HASH_IPV4 | NDIS_HASH_TCP_IPV4 | NDIS_HASH_IPV6 | NDIS_HASH_TCP_IPV6)
+
+// Frames queued for indication on one processor.
+typedef struct _TAP_RSS_PROCESSOR
+{
+    struct _TAP_ADAPTER_CONTEXT *Adapter;
+    KDPC                Dpc;
+    KSPIN_LOCK          Lock;
+    PNET_BUFFER_LIST    Head;
+    PNET_BUFFER_LIST    Tail;
+    ULONG               Count;
+} TAP_RSS_PROCESSOR, *PTAP_RSS_PROCESSOR;
+
+typedef struct _TAP_RSS
+{
+    // One entry per processor in the system, by processor index.
+    PTAP_RSS_PROCESSOR  Processors;
+    ULONG               ProcessorCount;
+
+    // Parameters set with OID_GEN_RECEIVE_SCALE_PARAMETERS. Protected
+    // by Lock, taken shared by the receive path.
+    PNDIS_RW_LOCK_EX    Lock;
+    BOOLEAN             Enabled;
+    ULONG               HashInformation;
+    UCHAR               Key[TAP_RSS_MAX_KEY_SIZE];
+    ULONG               KeySize;
+    ULONG               Table[TAP_RSS_MAX_TABLE_ENTRIES];   // Processor indexes
+    ULONG               TableSize;                          // Power of two
+} TAP_RSS, *PTAP_RSS;
+
+NDIS_STATUS
+tapRssInitialize(
+    __in struct _TAP_ADAPTER_CONTEXT *Adapter
+    );
+
+VOID
+tapRssFree(
+    __in struct _TAP_ADAPTER_CONTEXT *Adapter
+    );
+
+// Key must hold at least InputLength + 4 bytes.
+ULONG
+tapRssToeplitzHash(
+    __in_bcount(InputLength + 4) const UCHAR *Key,
+    __in_bcount(InputLength) const UCHAR *Input,
+    __in ULONG                  InputLength
+    );
+
+// Hash the first Length bytes of a frame with the NDIS_HASH_XXX types in
+// HashTypes. Returns the type of the hash, or zero if none applies.
+ULONG
+tapRssHashFrame(
+    __in const UCHAR            *Key,
+    __in ULONG                  HashTypes,
+    __in_bcount(Length) const UCHAR *Header,
+    __in ULONG                  Length,
+    __out PULONG                HashValue
+    );
+
+#if DBG
+// Check the hash against the verification vectors of the RSS
+// specification. Returns FALSE on a mismatch.
+BOOLEAN
+tapRssSelfTest(VOID);
+#endif
+
+// Hash a chain of receive NBLs and indicate each on its target processor.
+// The NBLs must already be counted as in flight.
+VOID
+tapRssIndicateReceiveNetBufferLists(
+    __in struct _TAP_ADAPTER_CONTEXT *Adapter,
+    __in PNET_BUFFER_LIST       NetBufferLists,
+    __in ULONG                  ReceiveFlags
+    );
+
+#endif // __TAP_RSS_H_
@@ -0,0 +1,371 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This code was inspired by the CIPE-Win32 driver by Damion K. Wilson.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+//
+// Include files.
+//
+
+#include "tap.h"
+
+//======================================================================
+// Receive Side Scaling Hash
+//======================================================================
+//
+// The Toeplitz hash and the hash input taken from a frame's headers.
+// Nothing here touches NDIS objects, so tests/ builds this file in user
+// mode as well.
+//
+
+ULONG
+tapRssToeplitzHash(
+    __in_bcount(InputLength + 4) const UCHAR *Key,
+    __in_bcount(InputLength) const UCHAR *Input,
+    __in ULONG                  InputLength
+    )
+/*++
+
+Routine Description:
+
+    Compute the Toeplitz hash of Input, as specified for RSS: for every
+    set bit of the input, counting from the most significant bit of the
+    first byte, the 32 bits of the key starting at the same bit position
+    are XORed into the result.
+
+Arguments:
+
+    Key                         Secret key
+    Input                       Hash input in network byte order
+    InputLength                 Length of Input
+
+Return Value:
+
+    The hash.
+
+--*/
+{
+    ULONG   result = 0;
+    ULONG   window;
+    ULONG   i;
+    int     bit;
+
+    // The 32 key bits lined up with the current input bit.
+    window = ((ULONG )Key[0] << 24) | ((ULONG )Key[1] << 16)
+        | ((ULONG )Key[2] << 8) | Key[3];
+
+    for(i = 0; i < InputLength; ++i)
+    {
+        UCHAR   nextKeyByte = Key[i + 4];
+
+        for(bit = 7; bit >= 0; --bit)
+        {
+            if(Input[i] & (1 << bit))
+            {
+                result ^= window;
+            }
+
+            window = (window << 1) | ((nextKeyByte >> bit) & 1);
+        }
+    }
+
+    return result;
+}
+
+ULONG
+tapRssHashFrame(
+    __in const UCHAR            *Key,
+    __in ULONG                  HashTypes,
+    __in_bcount(Length) const UCHAR *Header,
+    __in ULONG                  Length,
+    __out PULONG                HashValue
+    )
+/*++
+
+Routine Description:
+
+    Hash a frame with the NDIS_HASH_XXX types enabled in HashTypes.
+
+    TCP segments hash addresses and ports if the TCP hash type for their
+    IP version is enabled, and otherwise fall back to addresses only.
+    Fragments and IPv6 packets with extension headers hash addresses
+    only. Other frames are not hashed.
+
+Arguments:
+
+    Key                         Secret key, TAP_RSS_MAX_KEY_SIZE bytes
+    HashTypes                   Hash types to compute
+    Header                      Start of the frame
+    Length                      Length of Header
+
+Return Value:
+
+    The NDIS_HASH_XXX type of the hash, or zero if the frame was not
+    hashed.
+
+--*/
+{
+    const UCHAR *header = Header;
+    UCHAR       input[TAP_RSS_INPUT_SIZE];
+    ULONG       length = Length;
+    ULONG       hashTypes = HashTypes;
+    ULONG       offset = ETHERNET_HEADER_SIZE;
+    ULONG       inputLength;
+    ULONG       hashType;
+    USHORT      proto;
+
+    if(length < ETHERNET_HEADER_SIZE)
+    {
+        return 0;
+    }
+
+    proto = ntohs(((ETH_HEADER *)header)->proto);
+
+    if(proto == NDIS_ETH_TYPE_802_1Q && length >= ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE)
+    {
+        proto = ntohs(((ETH_8021Q_HEADER UNALIGNED *)(header + ETHERNET_HEADER_SIZE))->EtherType);
+        offset += VLAN_TAG_SIZE;
+    }
+
+    if(proto == NDIS_ETH_TYPE_IPV4 && length >= offset + IP_HEADER_SIZE)
+    {
+        const IPHDR UNALIGNED *ip = (const IPHDR UNALIGNED *)(header + offset);
+
+        offset += IPH_GET_LEN(ip->version_len);
+
+        // Source and destination addresses are adjacent.
+        NdisMoveMemory(input, &ip->saddr, 2 * sizeof(ULONG));
+        inputLength = 2 * sizeof(ULONG);
+        hashType = NDIS_HASH_IPV4;
+
+        // More fragments flag or a fragment offset.
+        if((hashTypes & NDIS_HASH_TCP_IPV4)
+            && ip->protocol == IPPROTO_TCP
+            && (ntohs(ip->frag_off) & (0x2000 | IP_OFFMASK)) == 0
+            && length >= offset + sizeof(ULONG))
+        {
+            NdisMoveMemory(input + inputLength, header + offset, sizeof(ULONG));
+            inputLength += sizeof(ULONG);
+            hashType = NDIS_HASH_TCP_IPV4;
+        }
+    }
+    else if(proto == NDIS_ETH_TYPE_IPV6 && length >= offset + IPV6_HEADER_SIZE)
+    {
+        const IPV6HDR UNALIGNED *ipv6 = (const IPV6HDR UNALIGNED *)(header + offset);
+
+        offset += IPV6_HEADER_SIZE;
+
+        NdisMoveMemory(input, ipv6->saddr, 2 * sizeof(IPV6ADDR));
+        inputLength = 2 * sizeof(IPV6ADDR);
+        hashType = NDIS_HASH_IPV6;
+
+        if((hashTypes & NDIS_HASH_TCP_IPV6)
+            && ipv6->nexthdr == IPPROTO_TCP
+            && length >= offset + sizeof(ULONG))
+        {
+            NdisMoveMemory(input + inputLength, header + offset, sizeof(ULONG));
+            inputLength += sizeof(ULONG);
+            hashType = NDIS_HASH_TCP_IPV6;
+        }
+    }
+    else
+    {
+        return 0;
+    }
+
+    if((hashTypes & hashType) == 0)
+    {
+        return 0;
+    }
+
+    *HashValue = tapRssToeplitzHash(Key, input, inputLength);
+
+    return hashType;
+}
+
+#if DBG
+
+// Default key of the RSS specification.
+static const UCHAR tapRssTestKey[40] =
+{
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+};
+
+// Verification vectors of the RSS specification. The hash input is the
+// source and destination addresses followed by the source and destination
+// ports.
+static const struct
+{
+    USHORT  EtherType;
+    ULONG   AddressSize;                // Both addresses
+    UCHAR   Input[TAP_RSS_INPUT_SIZE];
+    ULONG   IpHash;
+    ULONG   TcpHash;
+} tapRssTestVectors[] =
+{
+    // 66.9.149.187:2794 to 161.142.100.80:1766
+    { NDIS_ETH_TYPE_IPV4, 8,
+      { 0x42, 0x09, 0x95, 0xbb, 0xa1, 0x8e, 0x64, 0x50,
+        0x0a, 0xea, 0x06, 0xe6 },
+      0x323e8fc2, 0x51ccc178 },
+    // 199.92.111.2:14230 to 65.69.140.83:4739
+    { NDIS_ETH_TYPE_IPV4, 8,
+      { 0xc7, 0x5c, 0x6f, 0x02, 0x41, 0x45, 0x8c, 0x53,
+        0x37, 0x96, 0x12, 0x83 },
+      0xd718262a, 0xc626b0ea },
+    // 24.19.198.95:12898 to 12.22.207.184:38024
+    { NDIS_ETH_TYPE_IPV4, 8,
+      { 0x18, 0x13, 0xc6, 0x5f, 0x0c, 0x16, 0xcf, 0xb8,
+        0x32, 0x62, 0x94, 0x88 },
+      0xd2d0a5de, 0x5c2b394a },
+    // 38.27.205.30:48228 to 209.142.163.6:2217
+    { NDIS_ETH_TYPE_IPV4, 8,
+      { 0x26, 0x1b, 0xcd, 0x1e, 0xd1, 0x8e, 0xa3, 0x06,
+        0xbc, 0x64, 0x08, 0xa9 },
+      0x82989176, 0xafc7327f },
+    // 153.39.163.191:44251 to 202.188.127.2:1303
+    { NDIS_ETH_TYPE_IPV4, 8,
+      { 0x99, 0x27, 0xa3, 0xbf, 0xca, 0xbc, 0x7f, 0x02,
+        0xac, 0xdb, 0x05, 0x17 },
+      0x5d1809c5, 0x10e828a2 },
+    // [3ffe:2501:200:1fff::7]:2794 to [3ffe:2501:200:3::1]:1766
+    { NDIS_ETH_TYPE_IPV6, 32,
+      { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07,
+        0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+        0x0a, 0xea, 0x06, 0xe6 },
+      0x2cc18cd5, 0x40207d3d },
+    // [3ffe:501:8::260:97ff:fe40:efab]:14230 to [ff02::1]:4739
+    { NDIS_ETH_TYPE_IPV6, 32,
+      { 0x3f, 0xfe, 0x05, 0x01, 0x00, 0x08, 0x00, 0x00,
+        0x02, 0x60, 0x97, 0xff, 0xfe, 0x40, 0xef, 0xab,
+        0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+        0x37, 0x96, 0x12, 0x83 },
+      0x0f0c461c, 0xdde51bbf },
+    // [3ffe:1900:4545:3:200:f8ff:fe21:67cf]:44251 to [fe80::200:f8ff:fe21:67cf]:38024
+    { NDIS_ETH_TYPE_IPV6, 32,
+      { 0x3f, 0xfe, 0x19, 0x00, 0x45, 0x45, 0x00, 0x03,
+        0x02, 0x00, 0xf8, 0xff, 0xfe, 0x21, 0x67, 0xcf,
+        0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x02, 0x00, 0xf8, 0xff, 0xfe, 0x21, 0x67, 0xcf,
+        0xac, 0xdb, 0x94, 0x88 },
+      0x4b61e985, 0x02d1feef },
+};
+
+BOOLEAN
+tapRssSelfTest(VOID)
+/*++
+
+Routine Description:
+
+    Check tapRssToeplitzHash and the hash input tapRssHashFrame builds
+    from TCP/IPv4 and TCP/IPv6 frames against the verification vectors
+    of the RSS specification, and the indirection table index against
+    the low hash bits. Run once by DriverEntry in checked builds.
+
+Return Value:
+
+    TRUE if every vector matched.
+
+--*/
+{
+    UCHAR       key[TAP_RSS_MAX_KEY_SIZE];
+    UCHAR       frame[TAP_RSS_HEADER_SIZE];
+    BOOLEAN     passed = TRUE;
+    ULONG       i;
+
+    NdisZeroMemory(key,sizeof(key));
+    NdisMoveMemory(key,tapRssTestKey,sizeof(tapRssTestKey));
+
+    for(i = 0; i < sizeof(tapRssTestVectors) / sizeof(tapRssTestVectors[0]); ++i)
+    {
+        ULONG   addressSize = tapRssTestVectors[i].AddressSize;
+        ULONG   frameLength;
+        ULONG   ipHash;
+        ULONG   tcpHash;
+        ULONG   ipFrameHash = 0;
+        ULONG   tcpFrameHash = 0;
+        ULONG   ipHashType;
+        ULONG   tcpHashType;
+
+        ipHash = tapRssToeplitzHash(key,tapRssTestVectors[i].Input,addressSize);
+        tcpHash = tapRssToeplitzHash(key,tapRssTestVectors[i].Input,addressSize + 4);
+
+        // The same input laid out as an Ethernet frame with a TCP segment.
+        NdisZeroMemory(frame,sizeof(frame));
+        ((ETH_HEADER *)frame)->proto = htons(tapRssTestVectors[i].EtherType);
+
+        if(tapRssTestVectors[i].EtherType == NDIS_ETH_TYPE_IPV4)
+        {
+            IPHDR UNALIGNED *ip = (IPHDR UNALIGNED *)(frame + ETHERNET_HEADER_SIZE);
+
+            ip->version_len = 0x45;
+            ip->protocol = IPPROTO_TCP;
+            NdisMoveMemory(&ip->saddr,tapRssTestVectors[i].Input,addressSize);
+            frameLength = ETHERNET_HEADER_SIZE + IP_HEADER_SIZE;
+        }
+        else
+        {
+            IPV6HDR UNALIGNED *ip = (IPV6HDR UNALIGNED *)(frame + ETHERNET_HEADER_SIZE);
+
+            ip->version_prio = 0x60;
+            ip->nexthdr = IPPROTO_TCP;
+            NdisMoveMemory(ip->saddr,tapRssTestVectors[i].Input,addressSize);
+            frameLength = ETHERNET_HEADER_SIZE + IPV6_HEADER_SIZE;
+        }
+
+        NdisMoveMemory(frame + frameLength,tapRssTestVectors[i].Input + addressSize,4);
+        frameLength += 4;
+
+        tcpHashType = tapRssHashFrame(key,TAP_RSS_HASH_TYPES,frame,frameLength,&tcpFrameHash);
+        ipHashType = tapRssHashFrame(key,NDIS_HASH_IPV4 | NDIS_HASH_IPV6,frame,frameLength,&ipFrameHash);
+
+        if(ipHash != tapRssTestVectors[i].IpHash
+            || tcpHash != tapRssTestVectors[i].TcpHash
+            || ipFrameHash != ipHash
+            || tcpFrameHash != tcpHash
+            || ipHashType != ((addressSize == 8) ? NDIS_HASH_IPV4 : NDIS_HASH_IPV6)
+            || tcpHashType != ((addressSize == 8) ? NDIS_HASH_TCP_IPV4 : NDIS_HASH_TCP_IPV6)
+            || TAP_RSS_TABLE_INDEX(tcpHash,TAP_RSS_MAX_TABLE_ENTRIES) != tcpHash % TAP_RSS_MAX_TABLE_ENTRIES)
+        {
+            DEBUGP (("[TAP] RSS vector %d failed: IP 0x%08x/0x%08x, TCP 0x%08x/0x%08x\n",
+                i,
+                ipHash,
+                ipFrameHash,
+                tcpHash,
+                tcpFrameHash
+                ));
+
+            passed = FALSE;
+        }
+    }
+
+    return passed;
+}
+
+#endif // DBG
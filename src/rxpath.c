@@ -38,544 +38,1935 @@
 #pragma alloc_text( PAGE, TapDeviceWrite)
 #endif // ALLOC_PRAGMA
 
-//===============================================================
-// Used in cases where internally generated packets such as
-// ARP or DHCP replies must be returned to the kernel, to be
-// seen as an incoming packet "arriving" on the interface.
-//===============================================================
-
-VOID
-IndicateReceivePacket(
-    __in PTAP_ADAPTER_CONTEXT  Adapter,
-    __in PUCHAR packetData,
-    __in const unsigned int packetLength
+static PNET_BUFFER_LIST
+tapAllocateInjectDescriptor(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in ULONG BufferLength,
+    __out PUCHAR *Buffer
     )
+/*++
+
+Routine Description:
+
+    Allocate a flat buffer, an MDL and a receive NBL describing all of it.
+
+    The NBL is flagged TAP_RX_NBL_FLAGS_IS_INJECTED and owns its buffer.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    BufferLength                Length of the buffer, at least TAP_MIN_FRAME_SIZE
+    Buffer                      Receives the buffer
+
+Return Value:
+
+    The NBL, or NULL if it could not be allocated.
+
+--*/
 {
-    PUCHAR  injectBuffer;
-    unsigned int paddedPacketLength = packetLength;
-    if(paddedPacketLength < TAP_MIN_FRAME_SIZE)
+    PUCHAR              injectBuffer;
+    PMDL                mdl;
+    PNET_BUFFER_LIST    netBufferList;
+
+    // Allocate flat buffer for packet data.
+    injectBuffer = (PUCHAR )NdisAllocateMemoryWithTagPriority(
+                        Adapter->MiniportAdapterHandle,
+                        BufferLength,
+                        TAP_RX_INJECT_BUFFER_TAG,
+                        NormalPoolPriority
+                        );
+
+    if(injectBuffer == NULL)
     {
-        paddedPacketLength = TAP_MIN_FRAME_SIZE;
+        DEBUGP (("[%s] NdisAllocateMemoryWithTagPriority failed in tapAllocateInjectDescriptor\n",
+            MINIPORT_INSTANCE_ID (Adapter)));
+        NOTE_ERROR ();
+
+        return NULL;
     }
 
-    //
-    // Handle miniport Pause
-    // ---------------------
-    // NDIS 6 miniports implement a temporary "Pause" state normally followed
-    // by the Restart. While in the Pause state it is forbidden for the miniport
-    // to indicate receive NBLs.
-    //
-    // That is: The device interface may be "up", but the NDIS miniport send/receive
-    // interface may be temporarily "down".
-    //
-    // BUGBUG!!! In the initial implementation of the NDIS 6 TapOas inject path
-    // the code below will simply ignore inject packets passed to the driver while
-    // the miniport is in the Paused state.
-    //
-    // The correct implementation is to go ahead and build the NBLs corresponding
-    // to the inject packet - but queue them. When Restart is entered the
-    // queued NBLs would be dequeued and indicated to the host.
-    //
-    if(tapAdapterSendAndReceiveReady(Adapter) != NDIS_STATUS_SUCCESS)
+    // Allocate MDL for flat buffer.
+    mdl = NdisAllocateMdl(
+            Adapter->MiniportAdapterHandle,
+            injectBuffer,
+            BufferLength
+            );
+
+    if(mdl == NULL)
     {
-        DEBUGP (("[%s] Lying send in IndicateReceivePacket while adapter paused\n",
+        DEBUGP (("[%s] NdisAllocateMdl failed in tapAllocateInjectDescriptor\n",
             MINIPORT_INSTANCE_ID (Adapter)));
+        NOTE_ERROR ();
 
-        return;
+        NdisFreeMemory(injectBuffer,0,0);
+
+        return NULL;
     }
 
-    // Allocate flat buffer for packet data.
-    injectBuffer = (PUCHAR )NdisAllocateMemoryWithTagPriority(
-                        Adapter->MiniportAdapterHandle,
-                        paddedPacketLength,
-                        TAP_RX_INJECT_BUFFER_TAG,
-                        NormalPoolPriority
+    mdl->Next = NULL;   // No next MDL
+
+    // Allocate the NBL and NB. Link MDL chain to NB.
+    netBufferList = NdisAllocateNetBufferAndNetBufferList(
+                        Adapter->ReceiveNblPool,
+                        0,                  // ContextSize
+                        0,                  // ContextBackFill
+                        mdl,                // MDL chain
+                        0,
+                        BufferLength
                         );
 
-    if( injectBuffer)
+    if(netBufferList == NULL)
     {
-        PMDL    mdl;
+        DEBUGP (("[%s] NdisAllocateNetBufferAndNetBufferList failed in tapAllocateInjectDescriptor\n",
+            MINIPORT_INSTANCE_ID (Adapter)));
+        NOTE_ERROR ();
 
-        // Copy packet data to flat buffer.
-        NdisMoveMemory (injectBuffer, packetData, packetLength);
-        if(packetLength < paddedPacketLength)
-        {
-            NdisZeroMemory(injectBuffer + packetLength, paddedPacketLength - packetLength);
-        }
+        NdisFreeMdl(mdl);
+        NdisFreeMemory(injectBuffer,0,0);
 
-        // Allocate MDL for flat buffer.
-        mdl = NdisAllocateMdl(
-                Adapter->MiniportAdapterHandle,
-                injectBuffer,
-                paddedPacketLength
-                );
+        return NULL;
+    }
 
-        if( mdl )
-        {
-            PNET_BUFFER_LIST    netBufferList;
+    NET_BUFFER_LIST_NEXT_NBL(netBufferList) = NULL; // Only one NBL
 
-            mdl->Next = NULL;   // No next MDL
+    // Set flag indicating that this is an injected packet
+    TAP_RX_NBL_FLAGS_CLEAR_ALL(netBufferList);
+    TAP_RX_NBL_FLAG_SET(netBufferList,TAP_RX_NBL_FLAGS_IS_INJECTED);
 
-            // Allocate the NBL and NB. Link MDL chain to NB.
-            netBufferList = NdisAllocateNetBufferAndNetBufferList(
-                                Adapter->ReceiveNblPool,
-                                0,                  // ContextSize
-                                0,                  // ContextBackFill
-                                mdl,                // MDL chain
-                                0,
-                                paddedPacketLength
-                                );
+    netBufferList->MiniportReserved[0] = NULL;
+    netBufferList->MiniportReserved[1] = NULL;
 
-            if(netBufferList != NULL)
-            {
-                ULONG       receiveFlags = 0;
-                LONG        nblCount;
+    *Buffer = injectBuffer;
 
-                NET_BUFFER_LIST_NEXT_NBL(netBufferList) = NULL; // Only one NBL
+    return netBufferList;
+}
 
-                if(KeGetCurrentIrql() == DISPATCH_LEVEL)
-                {
-                    receiveFlags |= NDIS_RECEIVE_FLAGS_DISPATCH_LEVEL;
-                }
+static VOID
+tapInjectCacheReturn(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in PNET_BUFFER_LIST NetBufferList
+    )
+/*++
 
-                // Set flag indicating that this is an injected packet
-                TAP_RX_NBL_FLAGS_CLEAR_ALL(netBufferList);
-                TAP_RX_NBL_FLAG_SET(netBufferList,TAP_RX_NBL_FLAGS_IS_INJECTED);
-
-                netBufferList->MiniportReserved[0] = NULL;
-                netBufferList->MiniportReserved[1] = NULL;
-
-                // Increment in-flight receive NBL count.
-                nblCount = NdisInterlockedIncrement(&Adapter->ReceiveNblInFlightCount);
-                ASSERT(nblCount > 0 );
-
-                netBufferList->SourceHandle = Adapter->MiniportAdapterHandle;
-
-                //
-                // Indicate the packet
-                // -------------------
-                // Irp->AssociatedIrp.SystemBuffer with length irpSp->Parameters.Write.Length
-                // contains the complete packet including Ethernet header and payload.
-                //
-                NdisMIndicateReceiveNetBufferLists(
-                    Adapter->MiniportAdapterHandle,
-                    netBufferList,
-                    NDIS_DEFAULT_PORT_NUMBER,
-                    1,      // NumberOfNetBufferLists
-                    receiveFlags
-                    );
+Routine Description:
 
-                return;
-            }
-            else
-            {
-                DEBUGP (("[%s] NdisAllocateNetBufferAndNetBufferList failed in IndicateReceivePacket\n",
-                    MINIPORT_INSTANCE_ID (Adapter)));
-                NOTE_ERROR ();
+    Reset a cached inject NBL and put it back on the inject cache.
 
-                NdisFreeMdl(mdl);
-                NdisFreeMemory(injectBuffer,0,0);
-            }
-        }
-        else
-        {
-            DEBUGP (("[%s] NdisAllocateMdl failed in IndicateReceivePacket\n",
-                MINIPORT_INSTANCE_ID (Adapter)));
-            NOTE_ERROR ();
+--*/
+{
+    PNET_BUFFER     netBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+    KIRQL           irql;
 
-            NdisFreeMemory(injectBuffer,0,0);
-        }
-    }
-    else
-    {
-        DEBUGP (("[%s] NdisAllocateMemoryWithTagPriority failed in IndicateReceivePacket\n",
-            MINIPORT_INSTANCE_ID (Adapter)));
-        NOTE_ERROR ();
-    }
+    NET_BUFFER_CURRENT_MDL(netBuffer) = NET_BUFFER_FIRST_MDL(netBuffer);
+    NET_BUFFER_CURRENT_MDL_OFFSET(netBuffer) = 0;
+    NET_BUFFER_DATA_OFFSET(netBuffer) = 0;
+
+    NdisZeroMemory(
+        NetBufferList->NetBufferListInfo,
+        sizeof(NetBufferList->NetBufferListInfo)
+        );
+
+    NET_BUFFER_LIST_STATUS(NetBufferList) = NDIS_STATUS_SUCCESS;
+
+    TAP_RX_NBL_FLAGS_CLEAR_ALL(NetBufferList);
+    TAP_RX_NBL_FLAG_SET(NetBufferList,TAP_RX_NBL_FLAGS_IS_INJECTED);
+    TAP_RX_NBL_FLAG_SET(NetBufferList,TAP_RX_NBL_FLAGS_IS_CACHED);
+
+    NetBufferList->MiniportReserved[0] = NULL;
+    NetBufferList->MiniportReserved[1] = NULL;
+
+    KeAcquireSpinLock(&Adapter->InjectCacheLock,&irql);
+
+    NET_BUFFER_LIST_NEXT_NBL(NetBufferList) = Adapter->InjectCacheList;
+    Adapter->InjectCacheList = NetBufferList;
+
+    KeReleaseSpinLock(&Adapter->InjectCacheLock,irql);
 }
 
 VOID
-tapCompleteIrpAndFreeReceiveNetBufferList(
-    __in  PTAP_ADAPTER_CONTEXT  Adapter,
-    __in  PNET_BUFFER_LIST      NetBufferList,  // Only one NB here...
-    __in  NTSTATUS              IoCompletionStatus
+tapInjectCacheInitialize(
+    __in PTAP_ADAPTER_CONTEXT Adapter
     )
-{
-    PIRP    irp;
-    ULONG   frameType, netBufferCount, byteCount;
-    LONG    nblCount;
+/*++
 
-    // Fetch NB frame type.
-    frameType = tapGetNetBufferFrameType(NET_BUFFER_LIST_FIRST_NB(NetBufferList));
+Routine Description:
 
-    // Fetch statistics for all NBs linked to the NB.
-    netBufferCount = tapGetNetBufferCountsFromNetBufferList(
-                        NetBufferList,
-                        &byteCount
-                        );
+    Preallocate TAP_INJECT_CACHE_SIZE inject NBLs, each with its MDL and
+    flat buffer already linked. Buffers hold a full frame at the configured
+    MTU, but no more than a standard Ethernet frame; larger inject frames
+    are allocated as before.
 
-    // Update statistics by frame type
-    if(IoCompletionStatus == STATUS_SUCCESS)
-    {
-        switch(frameType)
-        {
-        case NDIS_PACKET_TYPE_DIRECTED:
-            Adapter->FramesRxDirected += netBufferCount;
-            Adapter->BytesRxDirected += byteCount;
-            break;
+    The cache is only an optimization. If some descriptors cannot be
+    allocated the adapter runs with fewer.
 
-        case NDIS_PACKET_TYPE_BROADCAST:
-            Adapter->FramesRxBroadcast += netBufferCount;
-            Adapter->BytesRxBroadcast += byteCount;
-            break;
+--*/
+{
+    ULONG   i;
 
-        case NDIS_PACKET_TYPE_MULTICAST:
-            Adapter->FramesRxMulticast += netBufferCount;
-            Adapter->BytesRxMulticast += byteCount;
-            break;
+    Adapter->InjectCacheBufferSize = min(
+        TAP_ADAPTER_MAX_FRAME_SIZE(Adapter),
+        ETHERNET_PACKET_SIZE
+        );
 
-        default:
-            ASSERT(FALSE);
+    for(i = 0; i < TAP_INJECT_CACHE_SIZE; ++i)
+    {
+        PNET_BUFFER_LIST    netBufferList;
+        PUCHAR              injectBuffer;
+
+        netBufferList = tapAllocateInjectDescriptor(
+                            Adapter,
+                            Adapter->InjectCacheBufferSize,
+                            &injectBuffer
+                            );
+
+        if(netBufferList == NULL)
+        {
             break;
         }
+
+        tapInjectCacheReturn(Adapter,netBufferList);
     }
+}
 
-    //
-    // Handle P2P Packet
-    // -----------------
-    // Free MDL allocated for P2P Ethernet header.
-    //
-    if(TAP_RX_NBL_FLAG_TEST(NetBufferList,TAP_RX_NBL_FLAGS_IS_P2P))
+VOID
+tapInjectCacheFree(
+    __in PTAP_ADAPTER_CONTEXT Adapter
+    )
+/*++
+
+Routine Description:
+
+    Free every descriptor on the inject cache. All cached NBLs must have
+    been returned by NDIS.
+
+--*/
+{
+    PNET_BUFFER_LIST    netBufferList;
+
+    DEBUGP (("[TAP] tapInjectCacheFree: Hits %I64d, Misses %I64d\n",
+        Adapter->InjectCacheHits, Adapter->InjectCacheMisses));
+
+    while((netBufferList = Adapter->InjectCacheList) != NULL)
     {
-        PNET_BUFFER     netBuffer;
-        PMDL            mdl;
+        Adapter->InjectCacheList = NET_BUFFER_LIST_NEXT_NBL(netBufferList);
 
-        netBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
-        mdl = NET_BUFFER_FIRST_MDL(netBuffer);
-        mdl->Next = NULL;
+        NET_BUFFER_LIST_NEXT_NBL(netBufferList) = NULL;
+        TAP_RX_NBL_FLAG_CLEAR(netBufferList,TAP_RX_NBL_FLAGS_IS_CACHED);
 
-        NdisFreeMdl(mdl);
+        tapFreeReceiveNetBufferList(Adapter,netBufferList);
     }
+}
 
-    //
-    // Handle Injected Packet
-    // -----------------------
-    // Free MDL and data buffer allocated for injected packet.
-    //
-    if(TAP_RX_NBL_FLAG_TEST(NetBufferList,TAP_RX_NBL_FLAGS_IS_INJECTED))
-    {
-        ULONG           pagePriority;
-        PNET_BUFFER     netBuffer;
-        PMDL            mdl;
-        PUCHAR          injectBuffer;
+PNET_BUFFER_LIST
+tapAllocateEmptyInjectNetBufferList(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in ULONG BufferLength,
+    __out PUCHAR *Buffer
+    )
+/*++
 
-        netBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
-        mdl = NET_BUFFER_FIRST_MDL(netBuffer);
+Routine Description:
 
-        //
-        // On Windows versions 8 and above, the MDL can be marked as not executable.
-        // This is required for the driver to function under HyperVisor-enforced
-        // Code Integrity (HVCI).
-        //
+    Get a flat buffer and a receive NBL describing BufferLength bytes of
+    it. The caller fills the buffer in.
 
-        pagePriority = NormalPagePriority;
+    The descriptor comes from the inject cache if the frame fits and one is
+    free. Otherwise it is allocated.
 
-        if (GlobalData.RunningWindows8OrGreater != FALSE) {
-            pagePriority |= MdlMappingNoExecute;
-        }
+    The NBL is flagged TAP_RX_NBL_FLAGS_IS_INJECTED and owns its buffer.
+    Release it with tapFreeReceiveNetBufferList.
 
-        injectBuffer = (PUCHAR )MmGetSystemAddressForMdlSafe(mdl,pagePriority);
+Arguments:
 
-        if(injectBuffer)
+    Adapter                     Pointer to our adapter context
+    BufferLength                Length of the buffer, at least TAP_MIN_FRAME_SIZE
+    Buffer                      Receives the buffer
+
+Return Value:
+
+    The NBL, or NULL if it could not be allocated.
+
+--*/
+{
+    PNET_BUFFER_LIST    netBufferList = NULL;
+    KIRQL               irql;
+
+    if(BufferLength <= Adapter->InjectCacheBufferSize)
+    {
+        KeAcquireSpinLock(&Adapter->InjectCacheLock,&irql);
+
+        netBufferList = Adapter->InjectCacheList;
+
+        if(netBufferList != NULL)
         {
-            NdisFreeMemory(injectBuffer,0,0);
+            Adapter->InjectCacheList = NET_BUFFER_LIST_NEXT_NBL(netBufferList);
         }
 
-        NdisFreeMdl(mdl);
+        KeReleaseSpinLock(&Adapter->InjectCacheLock,irql);
+    }
+
+    if(netBufferList != NULL)
+    {
+        PNET_BUFFER     netBuffer = NET_BUFFER_LIST_FIRST_NB(netBufferList);
+
+        InterlockedIncrement64(&Adapter->InjectCacheHits);
+
+        NET_BUFFER_LIST_NEXT_NBL(netBufferList) = NULL; // Only one NBL
+        NET_BUFFER_DATA_LENGTH(netBuffer) = BufferLength;
+
+        *Buffer = (PUCHAR )MmGetMdlVirtualAddress(NET_BUFFER_FIRST_MDL(netBuffer));
+
+        return netBufferList;
     }
 
+    InterlockedIncrement64(&Adapter->InjectCacheMisses);
+
+    return tapAllocateInjectDescriptor(Adapter,BufferLength,Buffer);
+}
+
+//===============================================================
+// Used in cases where internally generated packets such as
+// ARP or DHCP replies must be returned to the kernel, to be
+// seen as an incoming packet "arriving" on the interface.
+//
+// The reply is built directly in the buffer of an inject NBL.
+//===============================================================
+
+PNET_BUFFER_LIST
+tapAllocateReplyNetBufferList(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in ULONG PacketLength,
+    __out PUCHAR *PacketData
+    )
+/*++
+
+Routine Description:
+
+    Get a zeroed inject NBL large enough for a reply of PacketLength
+    bytes. The caller builds the reply in PacketData and then passes the
+    NBL to tapIndicateReplyNetBufferList, or frees it with
+    tapFreeReceiveNetBufferList.
+
+Return Value:
+
+    The NBL, or NULL if the adapter is not ready or no NBL could be
+    allocated.
+
+--*/
+{
+    PNET_BUFFER_LIST    netBufferList;
+    ULONG               bufferLength;
+    NDIS_STATUS         status;
+
     //
-    // Complete the IRP
+    // Handle miniport Pause
+    // ---------------------
+    // NDIS 6 miniports implement a temporary "Pause" state normally followed
+    // by the Restart. While in the Pause state it is forbidden for the miniport
+    // to indicate receive NBLs.
     //
-    irp = (PIRP )NetBufferList->MiniportReserved[0];
+    // Replies built while pausing or paused are queued by
+    // tapIndicateReplyNetBufferList and indicated on Restart. Replies are only
+    // dropped if the adapter is not ready for another reason.
+    //
+    status = tapAdapterSendAndReceiveReady(Adapter);
 
-    if(irp)
+    if(status != NDIS_STATUS_SUCCESS && status != NDIS_STATUS_PAUSED)
     {
-        irp->IoStatus.Status = IoCompletionStatus;
-        IoCompleteRequest(irp, IO_NO_INCREMENT);
+        DEBUGP (("[%s] Lying send in tapAllocateReplyNetBufferList while adapter not ready\n",
+            MINIPORT_INSTANCE_ID (Adapter)));
+
+        return NULL;
     }
 
-    // Decrement in-flight receive NBL count.
-    nblCount = NdisInterlockedDecrement(&Adapter->ReceiveNblInFlightCount);
-    ASSERT(nblCount >= 0 );
-    if (0 == nblCount)
+    bufferLength = max(PacketLength, TAP_MIN_FRAME_SIZE);
+
+    netBufferList = tapAllocateEmptyInjectNetBufferList(
+                        Adapter,
+                        bufferLength,
+                        PacketData
+                        );
+
+    if(netBufferList != NULL)
     {
-        NdisSetEvent(&Adapter->ReceiveNblInFlightCountZeroEvent);
+        NdisZeroMemory(*PacketData, bufferLength);
     }
 
-    // Free the NBL
-    NdisFreeNetBufferList(NetBufferList);
+    return netBufferList;
 }
 
 VOID
-AdapterReturnNetBufferLists(
-    __in  NDIS_HANDLE             MiniportAdapterContext,
-    __in  PNET_BUFFER_LIST        NetBufferLists,
-    __in  ULONG                   ReturnFlags
+tapIndicateReplyNetBufferList(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in PNET_BUFFER_LIST NetBufferList,
+    __in ULONG PacketLength
     )
-{
-    PTAP_ADAPTER_CONTEXT    adapter = (PTAP_ADAPTER_CONTEXT )MiniportAdapterContext;
-    PNET_BUFFER_LIST        currentNbl;
+/*++
 
-    UNREFERENCED_PARAMETER(ReturnFlags);
+Routine Description:
+
+    Indicate a reply built by the caller in an NBL from
+    tapAllocateReplyNetBufferList, or queue it until Restart if the
+    miniport is paused. The frame is padded to TAP_MIN_FRAME_SIZE with the
+    zeroes already in the buffer.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    NetBufferList               NBL holding the reply
+    PacketLength                Length of the reply, no larger than
+                                requested when the NBL was allocated
+
+--*/
+{
+    PNET_BUFFER     netBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+    ULONG           receiveFlags = 0;
+
+    ASSERT(max(PacketLength, TAP_MIN_FRAME_SIZE) <= NET_BUFFER_DATA_LENGTH(netBuffer));
+
+    NET_BUFFER_DATA_LENGTH(netBuffer) = max(PacketLength, TAP_MIN_FRAME_SIZE);
+
+    if(KeGetCurrentIrql() == DISPATCH_LEVEL)
+    {
+        receiveFlags |= NDIS_RECEIVE_FLAGS_DISPATCH_LEVEL;
+    }
+
+    tapIndicateOrQueueReceiveNetBufferLists(
+        Adapter,
+        NetBufferList,
+        1,
+        receiveFlags
+        );
+}
+
+PNET_BUFFER_LIST
+tapAllocateInjectNetBufferList(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in_opt const PUCHAR PrefixData,
+    __in const unsigned int PrefixLength,
+    __in const PUCHAR PacketData,
+    __in const unsigned int PacketLength
+    )
+/*++
+
+Routine Description:
+
+    Copy a frame into a flat buffer and build a receive NBL for it. The
+    frame is padded to TAP_MIN_FRAME_SIZE.
+
+    The NBL is flagged TAP_RX_NBL_FLAGS_IS_INJECTED and owns its buffer,
+    so the caller's copy of the frame may be reused as soon as this returns.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    PrefixData                  Ethernet header to prepend (TUN mode)
+    PrefixLength                Length of PrefixData, or zero
+    PacketData                  Frame data
+    PacketLength                Length of frame data
+
+Return Value:
+
+    The NBL, or NULL if it could not be allocated.
+
+--*/
+{
+    PUCHAR              injectBuffer;
+    PNET_BUFFER_LIST    netBufferList;
+    unsigned int        fullLength;
+    unsigned int        paddedPacketLength;
+
+    // check for possible overflow
+    if ((UINT_MAX - PacketLength) < PrefixLength)
+    {
+        DEBUGP (("[%s] Packet size with prefix exceeds UINT_MAX\n", MINIPORT_INSTANCE_ID (Adapter)));
+        NOTE_ERROR ();
+
+        return NULL;
+    }
+
+    fullLength = PacketLength + PrefixLength;
+
+    paddedPacketLength = fullLength;
+    if(paddedPacketLength < TAP_MIN_FRAME_SIZE)
+    {
+        paddedPacketLength = TAP_MIN_FRAME_SIZE;
+    }
+
+    netBufferList = tapAllocateEmptyInjectNetBufferList(
+                        Adapter,
+                        paddedPacketLength,
+                        &injectBuffer
+                        );
+
+    if(netBufferList == NULL)
+    {
+        return NULL;
+    }
+
+    // Copy packet data to flat buffer.
+    if(PrefixLength > 0)
+    {
+        NdisMoveMemory(injectBuffer, PrefixData, PrefixLength);
+    }
+    NdisMoveMemory (injectBuffer + PrefixLength, PacketData, PacketLength);
+    if(fullLength < paddedPacketLength)
+    {
+        NdisZeroMemory(injectBuffer + fullLength, paddedPacketLength - fullLength);
+    }
+
+    return netBufferList;
+}
+
+VOID
+tapIndicateReceiveNetBufferLists(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in PNET_BUFFER_LIST NetBufferLists,
+    __in ULONG NetBufferListCount,
+    __in ULONG ReceiveFlags
+    )
+/*++
+
+Routine Description:
+
+    Indicate a chain of receive NBLs in a single call. The NBLs must
+    already be counted in flight by tapAdapterTryReferenceReceive.
+
+    Each NBL is released through tapCompleteIrpAndFreeReceiveNetBufferList
+    when NDIS returns it.
+
+--*/
+{
+    PNET_BUFFER_LIST    currentNbl;
+
+    ASSERT(NetBufferLists != NULL);
+    ASSERT(NetBufferListCount > 0);
+
+    for(currentNbl = NetBufferLists;
+        currentNbl != NULL;
+        currentNbl = NET_BUFFER_LIST_NEXT_NBL(currentNbl))
+    {
+        currentNbl->SourceHandle = Adapter->MiniportAdapterHandle;
+    }
 
     //
-    // Process each NBL individually
+    // Indicate the packets
+    // --------------------
+    // Each NBL contains a complete packet including Ethernet header and payload.
     //
-    currentNbl = NetBufferLists;
-    while (currentNbl)
+    // With RSS enabled each NBL is indicated on the processor its hash
+    // selects.
+    //
+    if(Adapter->Rss.Enabled)
     {
-        PNET_BUFFER_LIST    nextNbl;
+        tapRssIndicateReceiveNetBufferLists(
+            Adapter,
+            NetBufferLists,
+            ReceiveFlags
+            );
+
+        return;
+    }
+
+    NdisMIndicateReceiveNetBufferLists(
+        Adapter->MiniportAdapterHandle,
+        NetBufferLists,
+        NDIS_DEFAULT_PORT_NUMBER,
+        NetBufferListCount,
+        ReceiveFlags
+        );
+}
+
+VOID
+tapIndicateOrQueueReceiveNetBufferLists(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in PNET_BUFFER_LIST NetBufferLists,
+    __in ULONG NetBufferListCount,
+    __in ULONG ReceiveFlags
+    )
+/*++
+
+Routine Description:
+
+    Indicate a chain of receive NBLs that do not refer to a write IRP.
+
+    While the miniport is pausing or paused the chain is appended to the
+    paused NBL queue instead, and AdapterRestart indicates it. The chain is
+    dropped if the queue would exceed TAP_PAUSED_NBL_QUEUE_SIZE or if the
+    adapter is not ready for another reason.
+
+--*/
+{
+    NDIS_STATUS         status;
+    BOOLEAN             queued = FALSE;
+    PNET_BUFFER_LIST    tailNbl;
+
+    ASSERT(NetBufferLists != NULL);
+    ASSERT(NetBufferListCount > 0);
+
+    for(tailNbl = NetBufferLists;
+        NET_BUFFER_LIST_NEXT_NBL(tailNbl) != NULL;
+        tailNbl = NET_BUFFER_LIST_NEXT_NBL(tailNbl))
+    {
+    }
+
+    // The state is tested under the lock AdapterRestart takes to flush the
+    // queue, so nothing is queued after the flush, and AdapterPause takes
+    // to start pausing, so nothing is counted in flight after that.
+    tapAdapterAcquireLock(Adapter,FALSE);
+
+    status = tapAdapterTryReferenceReceiveLocked(Adapter,NetBufferListCount);
+
+    if(status == NDIS_STATUS_PAUSED
+        && Adapter->Locked.PausedNblCount + NetBufferListCount <= TAP_PAUSED_NBL_QUEUE_SIZE)
+    {
+        if(Adapter->Locked.PausedNblTail == NULL)
+        {
+            Adapter->Locked.PausedNblHead = NetBufferLists;
+        }
+        else
+        {
+            NET_BUFFER_LIST_NEXT_NBL(Adapter->Locked.PausedNblTail) = NetBufferLists;
+        }
+
+        Adapter->Locked.PausedNblTail = tailNbl;
+        Adapter->Locked.PausedNblCount += NetBufferListCount;
+        queued = TRUE;
+    }
+
+    tapAdapterReleaseLock(Adapter,FALSE);
+
+    if(queued)
+    {
+        return;
+    }
+
+    if(status == NDIS_STATUS_SUCCESS)
+    {
+        tapIndicateReceiveNetBufferLists(
+            Adapter,
+            NetBufferLists,
+            NetBufferListCount,
+            ReceiveFlags
+            );
+
+        return;
+    }
+
+    DEBUGP (("[%s] Dropping %d receive NBLs while adapter not ready\n",
+        MINIPORT_INSTANCE_ID (Adapter),
+        NetBufferListCount));
+
+    tapFreeReceiveNetBufferLists(Adapter,NetBufferLists);
+}
+
+VOID
+tapFlushPausedNetBufferLists(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in BOOLEAN Indicate
+    )
+/*++
+
+Routine Description:
+
+    Take every NBL off the paused NBL queue and either indicate them in a
+    single call or free them.
+
+    Called by AdapterRestart once the adapter is Running, and by
+    AdapterHalt to discard the queue.
+
+--*/
+{
+    PNET_BUFFER_LIST    netBufferLists;
+    ULONG               netBufferListCount;
+
+    tapAdapterAcquireLock(Adapter,FALSE);
+
+    netBufferLists = Adapter->Locked.PausedNblHead;
+    netBufferListCount = Adapter->Locked.PausedNblCount;
+
+    Adapter->Locked.PausedNblHead = NULL;
+    Adapter->Locked.PausedNblTail = NULL;
+    Adapter->Locked.PausedNblCount = 0;
+
+    tapAdapterReleaseLock(Adapter,FALSE);
+
+    if(netBufferLists == NULL)
+    {
+        return;
+    }
+
+    DEBUGP (("[%s] %s %d receive NBLs queued while paused\n",
+        MINIPORT_INSTANCE_ID (Adapter),
+        Indicate ? "Indicating" : "Dropping",
+        netBufferListCount));
+
+    if(Indicate
+        && tapAdapterTryReferenceReceive(Adapter,netBufferListCount) == NDIS_STATUS_SUCCESS)
+    {
+        tapIndicateReceiveNetBufferLists(
+            Adapter,
+            netBufferLists,
+            netBufferListCount,
+            0       // ReceiveFlags
+            );
+    }
+    else
+    {
+        tapFreeReceiveNetBufferLists(Adapter,netBufferLists);
+    }
+}
+
+//======================================================================
+// TUN Mode Ethernet Header MDLs
+//======================================================================
+
+static LONG
+tapPrefixMdlType(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in const VOID *PrefixData
+    )
+{
+    if(PrefixData == &Adapter->m_UserToTap)
+    {
+        return TAP_PREFIX_MDL_IPV4;
+    }
+
+    if(PrefixData == &Adapter->m_UserToTap_IPv6)
+    {
+        return TAP_PREFIX_MDL_IPV6;
+    }
+
+    return -1;
+}
+
+static BOOLEAN
+tapPrefixMdlReturn(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in PMDL Mdl
+    )
+/*++
+
+Routine Description:
+
+    Put a header MDL back on its cache unless the cache is full.
+
+Return Value:
+
+    TRUE if the MDL was cached, FALSE if the caller must free it.
+
+--*/
+{
+    LONG        type = tapPrefixMdlType(Adapter,MmGetMdlVirtualAddress(Mdl));
+    BOOLEAN     cached = FALSE;
+    KIRQL       irql;
+
+    if(type < 0)
+    {
+        return FALSE;
+    }
+
+    Mdl->Next = NULL;
+
+    KeAcquireSpinLock(&Adapter->PrefixMdlLock,&irql);
+
+    if(Adapter->PrefixMdlCount[type] < TAP_PREFIX_MDL_CACHE_SIZE)
+    {
+        Mdl->Next = Adapter->PrefixMdlList[type];
+        Adapter->PrefixMdlList[type] = Mdl;
+        ++Adapter->PrefixMdlCount[type];
+        cached = TRUE;
+    }
+
+    KeReleaseSpinLock(&Adapter->PrefixMdlLock,irql);
+
+    return cached;
+}
+
+VOID
+tapPrefixMdlCacheInitialize(
+    __in PTAP_ADAPTER_CONTEXT Adapter
+    )
+/*++
+
+Routine Description:
+
+    Build the Ethernet header MDLs used for point-to-point mode writes.
+    Called when point-to-point mode is configured. The MDLs describe the
+    adapter's header fields, so they are built only once.
+
+    The cache is only an optimization. tapAllocatePrefixMdl falls back to
+    NdisAllocateMdl when it is empty.
+
+--*/
+{
+    ULONG   type;
+    ULONG   i;
+
+    for(type = 0; type < TAP_PREFIX_MDL_TYPES; ++type)
+    {
+        PVOID   prefixData = (type == TAP_PREFIX_MDL_IPV4)
+                                ? (PVOID )&Adapter->m_UserToTap
+                                : (PVOID )&Adapter->m_UserToTap_IPv6;
+
+        for(i = Adapter->PrefixMdlCount[type]; i < TAP_PREFIX_MDL_CACHE_SIZE; ++i)
+        {
+            PMDL    mdl = NdisAllocateMdl(
+                            Adapter->MiniportAdapterHandle,
+                            prefixData,
+                            sizeof(ETH_HEADER)
+                            );
+
+            if(mdl == NULL)
+            {
+                break;
+            }
+
+            if(!tapPrefixMdlReturn(Adapter,mdl))
+            {
+                NdisFreeMdl(mdl);
+                break;
+            }
+        }
+    }
+}
+
+VOID
+tapPrefixMdlCacheFree(
+    __in PTAP_ADAPTER_CONTEXT Adapter
+    )
+{
+    ULONG   type;
+
+    for(type = 0; type < TAP_PREFIX_MDL_TYPES; ++type)
+    {
+        PMDL    mdl;
+
+        while((mdl = Adapter->PrefixMdlList[type]) != NULL)
+        {
+            Adapter->PrefixMdlList[type] = mdl->Next;
+            mdl->Next = NULL;
+
+            NdisFreeMdl(mdl);
+        }
+
+        Adapter->PrefixMdlCount[type] = 0;
+    }
+}
+
+static PMDL
+tapAllocatePrefixMdl(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in const PUCHAR PrefixData,
+    __in const unsigned int PrefixLength
+    )
+/*++
+
+Routine Description:
+
+    Get an MDL describing the Ethernet header to put in front of a
+    point-to-point mode frame. Cached MDLs are used for the adapter's own
+    headers. Release the MDL with tapFreePrefixMdl.
+
+--*/
+{
+    LONG        type = tapPrefixMdlType(Adapter,PrefixData);
+    PMDL        mdl = NULL;
+    KIRQL       irql;
+
+    if(type >= 0 && PrefixLength == sizeof(ETH_HEADER))
+    {
+        KeAcquireSpinLock(&Adapter->PrefixMdlLock,&irql);
+
+        mdl = Adapter->PrefixMdlList[type];
+
+        if(mdl != NULL)
+        {
+            Adapter->PrefixMdlList[type] = mdl->Next;
+            --Adapter->PrefixMdlCount[type];
+        }
+
+        KeReleaseSpinLock(&Adapter->PrefixMdlLock,irql);
+    }
+
+    if(mdl == NULL)
+    {
+        mdl = NdisAllocateMdl(
+                Adapter->MiniportAdapterHandle,
+                PrefixData,
+                PrefixLength
+                );
+    }
+
+    if(mdl != NULL)
+    {
+        mdl->Next = NULL;
+    }
+
+    return mdl;
+}
+
+static VOID
+tapFreePrefixMdl(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in PMDL Mdl
+    )
+{
+    if(!tapPrefixMdlReturn(Adapter,Mdl))
+    {
+        Mdl->Next = NULL;
+        NdisFreeMdl(Mdl);
+    }
+}
+
+VOID
+tapFreeReceiveNetBufferList(
+    __in  PTAP_ADAPTER_CONTEXT  Adapter,
+    __in  PNET_BUFFER_LIST      NetBufferList
+    )
+/*++
+
+Routine Description:
+
+    Free a receive NBL and the MDLs and buffer built for it, or return it
+    to the inject cache if it came from there. Neither the write IRP nor
+    the in-flight count are touched.
+
+--*/
+{
+    //
+    // Handle Cached Inject Packet
+    // ---------------------------
+    // Return the NBL, with its MDL and buffer, to the inject cache.
+    //
+    if(TAP_RX_NBL_FLAG_TEST(NetBufferList,TAP_RX_NBL_FLAGS_IS_CACHED))
+    {
+        tapInjectCacheReturn(Adapter,NetBufferList);
+        return;
+    }
+
+    //
+    // Handle P2P Packet
+    // -----------------
+    // Release the MDL describing the P2P Ethernet header.
+    //
+    if(TAP_RX_NBL_FLAG_TEST(NetBufferList,TAP_RX_NBL_FLAGS_IS_P2P))
+    {
+        PNET_BUFFER     netBuffer;
+        PMDL            mdl;
+
+        netBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+        mdl = NET_BUFFER_FIRST_MDL(netBuffer);
+
+        // Free partial MDL built for a frame of a batched write.
+        if(TAP_RX_NBL_FLAG_TEST(NetBufferList,TAP_RX_NBL_FLAGS_IS_PARTIAL_MDL))
+        {
+            IoFreeMdl(mdl->Next);
+        }
+
+        tapFreePrefixMdl(Adapter,mdl);
+    }
+
+    //
+    // Handle Injected Packet
+    // -----------------------
+    // Free MDL and data buffer allocated for injected packet.
+    //
+    if(TAP_RX_NBL_FLAG_TEST(NetBufferList,TAP_RX_NBL_FLAGS_IS_INJECTED))
+    {
+        ULONG           pagePriority;
+        PNET_BUFFER     netBuffer;
+        PMDL            mdl;
+        PUCHAR          injectBuffer;
+
+        netBuffer = NET_BUFFER_LIST_FIRST_NB(NetBufferList);
+        mdl = NET_BUFFER_FIRST_MDL(netBuffer);
+
+        //
+        // On Windows versions 8 and above, the MDL can be marked as not executable.
+        // This is required for the driver to function under HyperVisor-enforced
+        // Code Integrity (HVCI).
+        //
+
+        pagePriority = NormalPagePriority;
+
+        if (GlobalData.RunningWindows8OrGreater != FALSE) {
+            pagePriority |= MdlMappingNoExecute;
+        }
+
+        injectBuffer = (PUCHAR )MmGetSystemAddressForMdlSafe(mdl,pagePriority);
+
+        if(injectBuffer)
+        {
+            NdisFreeMemory(injectBuffer,0,0);
+        }
+
+        NdisFreeMdl(mdl);
+    }
+
+    // Free the NBL
+    NdisFreeNetBufferList(NetBufferList);
+}
+
+VOID
+tapFreeReceiveNetBufferLists(
+    __in  PTAP_ADAPTER_CONTEXT  Adapter,
+    __in  PNET_BUFFER_LIST      NetBufferLists
+    )
+/*++
+
+Routine Description:
+
+    Free a chain of receive NBLs that were never indicated and do not
+    refer to a write IRP.
+
+--*/
+{
+    while(NetBufferLists != NULL)
+    {
+        PNET_BUFFER_LIST    nextNbl = NET_BUFFER_LIST_NEXT_NBL(NetBufferLists);
+
+        NET_BUFFER_LIST_NEXT_NBL(NetBufferLists) = NULL;
+        tapFreeReceiveNetBufferList(Adapter,NetBufferLists);
+
+        NetBufferLists = nextNbl;
+    }
+}
+
+VOID
+tapCompleteIrpAndFreeReceiveNetBufferList(
+    __in  PTAP_ADAPTER_CONTEXT  Adapter,
+    __in  PNET_BUFFER_LIST      NetBufferList,  // Only one NB here...
+    __in  NTSTATUS              IoCompletionStatus
+    )
+{
+    PIRP    irp;
+    ULONG   frameType, netBufferCount, byteCount;
+    LONG    nblCount;
+
+    // Fetch NB frame type.
+    frameType = tapGetNetBufferFrameType(NET_BUFFER_LIST_FIRST_NB(NetBufferList));
+
+    // Fetch statistics for all NBs linked to the NB.
+    netBufferCount = tapGetNetBufferCountsFromNetBufferList(
+                        NetBufferList,
+                        &byteCount
+                        );
+
+    // Update statistics by frame type
+    if(IoCompletionStatus == STATUS_SUCCESS)
+    {
+        switch(frameType)
+        {
+        case NDIS_PACKET_TYPE_DIRECTED:
+            Adapter->FramesRxDirected += netBufferCount;
+            Adapter->BytesRxDirected += byteCount;
+            break;
+
+        case NDIS_PACKET_TYPE_BROADCAST:
+            Adapter->FramesRxBroadcast += netBufferCount;
+            Adapter->BytesRxBroadcast += byteCount;
+            break;
+
+        case NDIS_PACKET_TYPE_MULTICAST:
+            Adapter->FramesRxMulticast += netBufferCount;
+            Adapter->BytesRxMulticast += byteCount;
+            break;
+
+        default:
+            ASSERT(FALSE);
+            break;
+        }
+    }
+
+    // Free MDLs and buffers describing the frame, then the NBL.
+    irp = (PIRP )NetBufferList->MiniportReserved[0];
+
+    tapFreeReceiveNetBufferList(Adapter,NetBufferList);
+
+    //
+    // Complete the IRP
+    // ----------------
+    // A write IRP may carry several frames. Complete it when the last
+    // NBL built from it comes back.
+    //
+    if(irp && InterlockedDecrement(TAP_WRITE_IRP_NBL_COUNT(irp)) == 0)
+    {
+        irp->IoStatus.Status = IoCompletionStatus;
+        IoCompleteRequest(irp, IO_NO_INCREMENT);
+    }
+
+    //
+    // Decrement in-flight receive NBL count
+    // -------------------------------------
+    // The count only drops to zero once AdapterPause has removed its
+    // running bias. The last NBL returned then completes the pause.
+    //
+    nblCount = NdisInterlockedDecrement(&Adapter->ReceiveNblInFlightCount);
+    ASSERT(nblCount >= 0 );
+    if (0 == nblCount)
+    {
+        tapAdapterPauseComplete(Adapter,TRUE);
+    }
+}
+
+VOID
+AdapterReturnNetBufferLists(
+    __in  NDIS_HANDLE             MiniportAdapterContext,
+    __in  PNET_BUFFER_LIST        NetBufferLists,
+    __in  ULONG                   ReturnFlags
+    )
+{
+    PTAP_ADAPTER_CONTEXT    adapter = (PTAP_ADAPTER_CONTEXT )MiniportAdapterContext;
+    PNET_BUFFER_LIST        currentNbl;
+
+    UNREFERENCED_PARAMETER(ReturnFlags);
+
+    //
+    // Process each NBL individually
+    //
+    currentNbl = NetBufferLists;
+    while (currentNbl)
+    {
+        PNET_BUFFER_LIST    nextNbl;
+
+        nextNbl = NET_BUFFER_LIST_NEXT_NBL(currentNbl);
+        NET_BUFFER_LIST_NEXT_NBL(currentNbl) = NULL;
+
+        // Complete write IRP and free NBL and associated resources.
+        tapCompleteIrpAndFreeReceiveNetBufferList(
+            adapter,
+            currentNbl,
+            STATUS_SUCCESS
+            );
+
+        // Move to next NBL
+        currentNbl = nextNbl;
+    }
+}
+
+static PVOID 
+TapStrip8021Q(
+    __inout unsigned char ** PacketBuffer,
+    __inout ULONG *PacketLength
+    )
+{
+    NDIS_NET_BUFFER_LIST_8021Q_INFO priorityInfo;
+    unsigned char* buffer = *PacketBuffer;
+    ULONG length = *PacketLength;
+    priorityInfo.Value = 0;
+
+    if(length >= ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE)
+    {
+        PETH_HEADER frameHeader = (PETH_HEADER) buffer;
+
+        if(frameHeader->proto == htons(ETHERTYPE_8021Q))
+        {
+            // Decode 802.1Q header
+            PETH_8021Q_HEADER tag = (PETH_8021Q_HEADER)(frameHeader+1);
+
+            priorityInfo.TagHeader.UserPriority = (tag->Tag>>13);
+            priorityInfo.TagHeader.VlanId = (tag->Tag & 0x0FFF);
+
+            // Copy the first part of the ethernet header up and over the protocol and 802.1Q data
+            // Don't copy the ethernet header's protocol, leave the inner value from the 802.1Q header.
+            RtlMoveMemory(buffer+4, buffer, ETHERNET_HEADER_SIZE-2);
+
+            // Update pointer/length to reflect this change.
+            *PacketBuffer = buffer+4;
+            *PacketLength = length-4;
+        }
+
+    }
+    return priorityInfo.Value;
+}
+
+static NTSTATUS
+tapAllocateReceiveNetBufferList(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in PIRP Irp,
+    __in unsigned char * PacketBuffer,
+    __in ULONG PacketLength,
+    __in_opt PVOID PacketPriority,
+    __in_opt const PUCHAR PrefixData,
+    __in const unsigned int PrefixLength,
+    __in BOOLEAN CopyFrame,
+    __out PNET_BUFFER_LIST *NetBufferList
+    )
+/*++
+
+Routine Description:
+
+    Build a receive NBL describing one frame taken from a write IRP.
+
+    PacketBuffer must point into Irp->AssociatedIrp.SystemBuffer. Frames up
+    to WriteCopyThreshold, runt frames, and every frame if CopyFrame is
+    set, are copied into an inject buffer and do not refer to the IRP.
+    Otherwise the NBL maps the IRP buffer directly and records the IRP in
+    MiniportReserved[0], so the IRP must stay pended until the NBL is
+    returned.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    Irp                         Write IRP that carries the frame
+    PacketBuffer                Start of frame data within the IRP buffer
+    PacketLength                Length of frame data
+    PacketPriority              802.1Q info stripped from the frame, if any
+    PrefixData                  Ethernet header to prepend (TUN mode)
+    PrefixLength                Length of PrefixData, or zero
+    CopyFrame                   TRUE to copy the frame whatever its length
+    NetBufferList               Receives the allocated NBL
+
+Return Value:
+
+    STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES.
+
+--*/
+{
+    PNET_BUFFER_LIST        netBufferList = NULL;
+    PMDL                    mdl = NULL;    // Head of MDL chain.
+    PMDL                    payloadMdl = Irp->MdlAddress;
+    ULONG                   payloadOffset;
+
+    *NetBufferList = NULL;
+
+    payloadOffset = (ULONG)(PacketBuffer-((unsigned char *)Irp->AssociatedIrp.SystemBuffer));
+
+    // check for possible ULONG overflow
+    if ((ULONG_MAX - PacketLength) < PrefixLength)
+    {
+        DEBUGP (("[%s] Packet size with prefix exceeds ULONG_MAX\n", MINIPORT_INSTANCE_ID (Adapter)));
+        NOTE_ERROR ();
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ULONG fullLength = PacketLength + PrefixLength;
+
+    if(CopyFrame
+        || fullLength < TAP_MIN_FRAME_SIZE
+        || fullLength <= Adapter->WriteCopyThreshold)
+    {
+        // Consolidate all the incoming data into a new single minimum-length allocation.
+        // This is simpler than additionally allocating another tiny MDL to tack on to the end
+        // (and then having to remove it on the cleanup path).
+        //
+        // Small frames are copied as well. The copy normally comes from the inject
+        // cache and lets the write IRP complete without waiting for the stack to
+        // return the NBL, which matters for ACKs held by the stack.
+        netBufferList = tapAllocateInjectNetBufferList(
+                            Adapter,
+                            PrefixData,
+                            PrefixLength,
+                            PacketBuffer,
+                            PacketLength
+                            );
+
+        if(netBufferList == NULL)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+    else
+    {       
+        if(PrefixLength > 0)
+        {
+            //
+            // Describe the payload
+            // --------------------
+            // The prefix MDL can only be chained to an MDL that starts with the
+            // payload. That is the IRP MDL itself for a single frame write. A frame
+            // taken from the middle of a batched write needs a partial MDL.
+            //
+            if(payloadOffset != 0)
+            {
+                PUCHAR  payloadVa = (PUCHAR )MmGetMdlVirtualAddress(Irp->MdlAddress) + payloadOffset;
+
+                payloadMdl = IoAllocateMdl(payloadVa, PacketLength, FALSE, FALSE, NULL);
+
+                if(payloadMdl == NULL)
+                {
+                    DEBUGP (("[%s] IoAllocateMdl failed in IRP_MJ_WRITE\n",
+                        MINIPORT_INSTANCE_ID (Adapter)));
+                    NOTE_ERROR ();
+
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                IoBuildPartialMdl(Irp->MdlAddress, payloadMdl, payloadVa, PacketLength);
+            }
+
+            //
+            // Get MDL for Ethernet header
+            // ---------------------------
+            // Irp->AssociatedIrp.SystemBuffer with length irpSp->Parameters.Write.Length
+            // contains the only the Ethernet payload. Prepend the user-mode provided
+            // payload with the Ethernet header pointed to by p_UserToTap. The header
+            // MDL normally comes from the prefix MDL cache.
+            //
+            mdl = tapAllocatePrefixMdl(
+                Adapter,
+                PrefixData,
+                PrefixLength
+                );
+
+            if(mdl == NULL)
+            {
+                DEBUGP (("[%s] tapAllocatePrefixMdl failed in IRP_MJ_WRITE\n",
+                    MINIPORT_INSTANCE_ID (Adapter)));
+                NOTE_ERROR ();
+
+                if(payloadMdl != Irp->MdlAddress)
+                {
+                    IoFreeMdl(payloadMdl);
+                }
+
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+
+            // Chain user's Ethernet payload behind Ethernet header.
+            mdl->Next = payloadMdl;
+            payloadMdl->Next = NULL; // No next MDL
+        }
+
+        // Allocate the NBL and NB. Link MDL chain to NB.
+        netBufferList = NdisAllocateNetBufferAndNetBufferList(
+            Adapter->ReceiveNblPool,
+            0,                              // ContextSize
+            0,                              // ContextBackFill
+            mdl==NULL?Irp->MdlAddress:mdl,  // MDL chain
+            // PacketBuffer will always be from the Irp's SystemBuffer, but may be offset beyond the start.
+            // The offset only applies if there is not a prefix (and mdl == NULL).
+            mdl==NULL?payloadOffset:0,
+            fullLength
+            );
+
+        if(netBufferList == NULL)
+        {
+            if(mdl != NULL)
+            {
+                tapFreePrefixMdl(Adapter,mdl);
+            }
+
+            if(payloadMdl != Irp->MdlAddress)
+            {
+                IoFreeMdl(payloadMdl);
+            }
+
+            DEBUGP (("[%s] NdisAllocateNetBufferAndNetBufferList failed in IRP_MJ_WRITE\n",
+                MINIPORT_INSTANCE_ID (Adapter)));
+            NOTE_ERROR ();
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        TAP_RX_NBL_FLAGS_CLEAR_ALL(netBufferList);
+        if(PrefixLength > 0)
+        {
+            TAP_RX_NBL_FLAG_SET(netBufferList,TAP_RX_NBL_FLAGS_IS_P2P);
+        }
+        if(payloadMdl != Irp->MdlAddress)
+        {
+            TAP_RX_NBL_FLAG_SET(netBufferList,TAP_RX_NBL_FLAGS_IS_PARTIAL_MDL);
+        }
+
+        // Stash IRP pointer in NBL MiniportReserved[0] field.
+        netBufferList->MiniportReserved[0] = Irp;
+        netBufferList->MiniportReserved[1] = NULL;
+    }
+
+    NET_BUFFER_LIST_NEXT_NBL(netBufferList) = NULL;
+
+    NET_BUFFER_LIST_INFO(netBufferList, Ieee8021QNetBufferListInfo) = PacketPriority;
+
+    *NetBufferList = netBufferList;
+
+    return STATUS_SUCCESS;
+}
+
+static PVOID
+tapGetReceiveChecksumInfo(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in const UCHAR *Frame,
+    __in ULONG FrameLength,
+    __in ULONG IpOffset
+    )
+/*++
+
+Routine Description:
+
+    Build the TcpIpChecksumNetBufferListInfo for a frame whose checksums
+    userspace has vouched for. Only checksums whose receive offload is
+    enabled are reported; the stack verifies the others itself.
+
+--*/
+{
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO checksumInfo;
+    ULONG       transportOffset;
+    ULONG       csum;
+    UCHAR       protocol;
+    BOOLEAN     ipv6;
+
+    checksumInfo.Value = NULL;
+
+    if(!tapChecksumParseFrame(Frame,FrameLength,IpOffset,&ipv6,&protocol,&transportOffset))
+    {
+        return NULL;
+    }
+
+    if(ipv6)
+    {
+        csum = (protocol == IPPROTO_TCP) ? TAP_CSUM_TCPV6 : TAP_CSUM_UDPV6;
+    }
+    else
+    {
+        if(Adapter->ChecksumOffload[TAP_CSUM_IPV4] & TAP_CSUM_RX)
+        {
+            checksumInfo.Receive.IpChecksumSucceeded = 1;
+        }
+
+        csum = (protocol == IPPROTO_TCP) ? TAP_CSUM_TCPV4 : TAP_CSUM_UDPV4;
+    }
+
+    if(Adapter->ChecksumOffload[csum] & TAP_CSUM_RX)
+    {
+        if(protocol == IPPROTO_TCP)
+        {
+            checksumInfo.Receive.TcpChecksumSucceeded = 1;
+        }
+        else
+        {
+            checksumInfo.Receive.UdpChecksumSucceeded = 1;
+        }
+    }
+
+    return checksumInfo.Value;
+}
+
+NTSTATUS
+tapPrepareReceiveFrame(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __inout unsigned char ** FrameBuffer,
+    __inout ULONG *FrameLength,
+    __out PVOID *FramePriority,
+    __out PVOID *FrameChecksum,
+    __out PUCHAR *PrefixData,
+    __out unsigned int *PrefixLength,
+    __out BOOLEAN *Indicate
+    )
+/*++
+
+Routine Description:
+
+    Validate and filter one frame written by userspace and work out how
+    it must be indicated.
+
+    If userspace selected TAP_WIN_OFFLOAD_CSUM or TAP_WIN_OFFLOAD_METADATA
+    the frame starts with an offload or metadata header, which is skipped.
+    A partial checksum it asks for is finished in place, and an 802.1Q tag
+    it passes in the metadata replaces any in the frame.
+
+    In TAP mode an 802.1Q header is stripped in place, which may move
+    FrameBuffer and shorten FrameLength. In TUN mode the Ethernet header
+    to prepend is returned in PrefixData.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    FrameBuffer                 Start of the frame
+    FrameLength                 Length of the frame
+    FramePriority               Receives the 802.1Q info for the frame
+    FrameChecksum               Receives the checksum info for the NBL
+    PrefixData                  Receives the Ethernet header to prepend, or NULL
+    PrefixLength                Receives the length of PrefixData
+    Indicate                    Receives FALSE if the frame was filtered
+
+Return Value:
+
+    STATUS_SUCCESS, STATUS_BUFFER_TOO_SMALL if the frame is too short for
+    the current mode, or STATUS_INVALID_BUFFER_SIZE if it exceeds the MTU.
+
+--*/
+{
+    ULONG       offloadSize = TAP_OFFLOAD_WRITE_HEADER_SIZE(Adapter->UserOffloads);
+    TAP_WIN_METADATA_HEADER offloadHeader;
+    BOOLEAN     checksumValid = FALSE;
+
+    *FramePriority = NULL;
+    *FrameChecksum = NULL;
+    *PrefixData = NULL;
+    *PrefixLength = 0;
+    *Indicate = FALSE;
+
+    NdisZeroMemory(&offloadHeader, sizeof(offloadHeader));
+
+    if (offloadSize > 0)
+    {
+        if (*FrameLength < offloadSize)
+        {
+            DEBUGP (("[%s] No offload header in IRP_MJ_WRITE, len=%d\n",
+                MINIPORT_INSTANCE_ID (Adapter),
+                *FrameLength));
+            NOTE_ERROR ();
+
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        NdisMoveMemory(&offloadHeader, *FrameBuffer, offloadSize);
+
+        *FrameBuffer += offloadSize;
+        *FrameLength -= offloadSize;
+    }
+
+    if (Adapter->UserOffloads & TAP_WIN_OFFLOAD_CSUM)
+    {
+        if (offloadHeader.Offload.Flags & TAP_WIN_OFFLOAD_F_NEEDS_CSUM)
+        {
+            checksumValid = tapChecksumCompleteFrame(*FrameBuffer, *FrameLength, &offloadHeader.Offload);
+        }
+        else if (offloadHeader.Offload.Flags & TAP_WIN_OFFLOAD_F_DATA_VALID)
+        {
+            checksumValid = TRUE;
+        }
+    }
+
+    if (!Adapter->m_tun && (*FrameLength >= ETHERNET_HEADER_SIZE))
+    {
+        // TAP mode - Send raw ethernet frame received.
+        DUMP_PACKET ("IRP_MJ_WRITE ETH",
+            *FrameBuffer,
+            *FrameLength);
+
+        //=====================================================
+        // Check incoming packet for an 802.1Q VLAN/Priority header
+        // If one exists, remove it in place.
+        // This may change the packet buffer pointer and length.
+        //=====================================================
+
+        *FramePriority = TapStrip8021Q(FrameBuffer, FrameLength);
+
+        if (*FrameLength > TAP_ADAPTER_MAX_FRAME_SIZE(Adapter))
+        {
+            DEBUGP (("[%s] Frame exceeds MTU in IRP_MJ_WRITE, len=%d\n",
+                MINIPORT_INSTANCE_ID (Adapter),
+                *FrameLength));
+            NOTE_ERROR ();
+
+            return STATUS_INVALID_BUFFER_SIZE;
+        }
+
+        //=====================================================
+        // If IPv4 packet, check whether or not packet
+        // was truncated.
+        //=====================================================
+#if PACKET_TRUNCATION_CHECK
+        IPv4PacketSizeVerify (
+            *FrameBuffer,
+            *FrameLength,
+            FALSE,
+            "RX",
+            &Adapter->m_RxTrunc
+            );
+#endif
+
+        // Determine frame type for packet filtering
+        ULONG frameType = 0;
+
+        if(!(Adapter->PacketFilter & NDIS_PACKET_TYPE_PROMISCUOUS))
+        {
+            // Only determine the frame type if we need to check it.
+            frameType = tapGetRawPacketFrameType(
+                            Adapter,
+                            *FrameBuffer,
+                            *FrameLength);
+        }
+
+        if((Adapter->PacketFilter & NDIS_PACKET_TYPE_PROMISCUOUS) ||  
+           (frameType & Adapter->PacketFilter))
+        {
+            // frame type bit is enabled in the packet filter.
+            *Indicate = TRUE;
+
+            if (checksumValid)
+            {
+                USHORT proto = ntohs(((ETH_HEADER *) *FrameBuffer)->proto);
+
+                if (proto == NDIS_ETH_TYPE_IPV4 || proto == NDIS_ETH_TYPE_IPV6)
+                {
+                    *FrameChecksum = tapGetReceiveChecksumInfo(
+                                        Adapter,
+                                        *FrameBuffer,
+                                        *FrameLength,
+                                        ETHERNET_HEADER_SIZE
+                                        );
+                }
+            }
+        }
+        else
+        {
+            DEBUGP (("[%s] Filtered send in IRP_MJ_WRITE frameType 0x%x, PacketFilter 0x%x\n",
+                MINIPORT_INSTANCE_ID (Adapter), frameType, Adapter->PacketFilter));
+        }
+    }
+    else if (Adapter->m_tun && (*FrameLength >= IP_HEADER_SIZE))
+    {
+        // TUN mode - Prepend an ethernet header 
+        PETH_HEADER         p_UserToTap = &Adapter->m_UserToTap;
+
+        if (*FrameLength > Adapter->MtuSize)
+        {
+            DEBUGP (("[%s] Packet exceeds MTU in IRP_MJ_WRITE, len=%d\n",
+                MINIPORT_INSTANCE_ID (Adapter),
+                *FrameLength));
+            NOTE_ERROR ();
+
+            return STATUS_INVALID_BUFFER_SIZE;
+        }
+        // For IPv6, need to use Ethernet header with IPv6 proto
+        if ( IPH_GET_VER( ((IPHDR*) *FrameBuffer)->version_len) == 6 )
+        {
+            p_UserToTap = &Adapter->m_UserToTap_IPv6;
+        }
+
+        DUMP_PACKET2 ("IRP_MJ_WRITE P2P",
+            p_UserToTap,
+            *FrameBuffer,
+            *FrameLength);
+
+        //=====================================================
+        // If IPv4 packet, check whether or not packet
+        // was truncated.
+        //=====================================================
+#if PACKET_TRUNCATION_CHECK
+        IPv4PacketSizeVerify (
+            *FrameBuffer,
+            *FrameLength,
+            TRUE,
+            "RX",
+            &Adapter->m_RxTrunc
+            );
+#endif
+
+        if(Adapter->PacketFilter & (NDIS_PACKET_TYPE_DIRECTED | NDIS_PACKET_TYPE_PROMISCUOUS))
+        {
+            // All packets are directed - only send directed packets if the packet filter enables this.
+            *PrefixData = (PUCHAR)p_UserToTap;
+            *PrefixLength = sizeof(ETH_HEADER);
+            *Indicate = TRUE;
+
+            if (checksumValid)
+            {
+                *FrameChecksum = tapGetReceiveChecksumInfo(
+                                    Adapter,
+                                    *FrameBuffer,
+                                    *FrameLength,
+                                    0
+                                    );
+            }
+        }
+        else
+        {
+            DEBUGP (("[%s] Filtered send in IRP_MJ_WRITE while directed packets are disabled\n",
+                MINIPORT_INSTANCE_ID (Adapter)));
+        }
+    }
+    else
+    {
+        DEBUGP (("[%s] Bad buffer size in IRP_MJ_WRITE, len=%d\n",
+            MINIPORT_INSTANCE_ID (Adapter),
+            *FrameLength));
+        NOTE_ERROR ();
 
-        nextNbl = NET_BUFFER_LIST_NEXT_NBL(currentNbl);
-        NET_BUFFER_LIST_NEXT_NBL(currentNbl) = NULL;
+        return STATUS_BUFFER_TOO_SMALL;
+    }
 
-        // Complete write IRP and free NBL and associated resources.
-        tapCompleteIrpAndFreeReceiveNetBufferList(
-            adapter,
-            currentNbl,
-            STATUS_SUCCESS
-            );
+    if (offloadHeader.Flags & TAP_WIN_METADATA_F_VLAN)
+    {
+        NDIS_NET_BUFFER_LIST_8021Q_INFO priorityInfo;
 
-        // Move to next NBL
-        currentNbl = nextNbl;
+        priorityInfo.Value = 0;
+        priorityInfo.TagHeader.UserPriority = (offloadHeader.VlanTci >> 13);
+        priorityInfo.TagHeader.VlanId = (offloadHeader.VlanTci & 0x0FFF);
+
+        *FramePriority = priorityInfo.Value;
     }
+
+    return STATUS_SUCCESS;
 }
 
-static PVOID 
-TapStrip8021Q(
-    __inout unsigned char ** PacketBuffer,
-    __inout ULONG *PacketLength
+static NTSTATUS
+tapWriteFrameToNetBufferList(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in PIRP Irp,
+    __in unsigned char * FrameBuffer,
+    __in ULONG FrameLength,
+    __in BOOLEAN CopyFrame,
+    __out PNET_BUFFER_LIST *NetBufferList
     )
-{
-    NDIS_NET_BUFFER_LIST_8021Q_INFO priorityInfo;
-    unsigned char* buffer = *PacketBuffer;
-    ULONG length = *PacketLength;
-    priorityInfo.Value = 0;
+/*++
 
-    if(length >= ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE)
-    {
-        PETH_HEADER frameHeader = (PETH_HEADER) buffer;
+Routine Description:
 
-        if(frameHeader->proto == htons(ETHERTYPE_8021Q))
-        {
-            // Decode 802.1Q header
-            PETH_8021Q_HEADER tag = (PETH_8021Q_HEADER)(frameHeader+1);
+    Validate and filter one frame written by userspace and build the NBL
+    used to indicate it.
 
-            priorityInfo.TagHeader.UserPriority = (tag->Tag>>13);
-            priorityInfo.TagHeader.VlanId = (tag->Tag & 0x0FFF);
+Arguments:
 
-            // Copy the first part of the ethernet header up and over the protocol and 802.1Q data
-            // Don't copy the ethernet header's protocol, leave the inner value from the 802.1Q header.
-            RtlMoveMemory(buffer+4, buffer, ETHERNET_HEADER_SIZE-2);
+    Adapter                     Pointer to our adapter context
+    Irp                         Write IRP that carries the frame
+    FrameBuffer                 Start of frame within the IRP buffer
+    FrameLength                 Length of the frame
+    CopyFrame                   TRUE to copy the frame so the NBL does not
+                                refer to the IRP
+    NetBufferList               Receives the NBL, or NULL if the frame
+                                was filtered
 
-            // Update pointer/length to reflect this change.
-            *PacketBuffer = buffer+4;
-            *PacketLength = length-4;
+Return Value:
+
+    STATUS_SUCCESS if the frame was filtered or an NBL was built.
+    STATUS_BUFFER_TOO_SMALL if the frame is too short for the current mode.
+    STATUS_INVALID_BUFFER_SIZE if the frame exceeds the MTU.
+    STATUS_INSUFFICIENT_RESOURCES if the NBL could not be allocated.
+
+--*/
+{
+    NTSTATUS                ntStatus;
+    PVOID                   packetPriority;
+    PVOID                   packetChecksum;
+    PUCHAR                  prefixData;
+    unsigned int            prefixLength;
+    BOOLEAN                 indicate;
+
+    *NetBufferList = NULL;
+
+    ntStatus = tapPrepareReceiveFrame(
+                    Adapter,
+                    &FrameBuffer,
+                    &FrameLength,
+                    &packetPriority,
+                    &packetChecksum,
+                    &prefixData,
+                    &prefixLength,
+                    &indicate
+                    );
+
+    if(ntStatus == STATUS_SUCCESS && indicate)
+    {
+        if(prefixLength == 0)
+        {
+            (Irp->MdlAddress)->Next = NULL; // No next MDL
         }
 
+        ntStatus = tapAllocateReceiveNetBufferList(
+            Adapter,
+            Irp,
+            FrameBuffer,
+            FrameLength,
+            packetPriority,
+            prefixData,
+            prefixLength,
+            CopyFrame,
+            NetBufferList
+            );
+
+        if(*NetBufferList != NULL)
+        {
+            NET_BUFFER_LIST_INFO(*NetBufferList, TcpIpChecksumNetBufferListInfo) = packetChecksum;
+        }
     }
-    return priorityInfo.Value;
+
+    return ntStatus;
 }
 
 static NTSTATUS
-TapSharedSendPacket(
+tapWriteBatchToNetBufferLists(
     __in PTAP_ADAPTER_CONTEXT Adapter,
     __in PIRP Irp,
-    __in unsigned char * PacketBuffer,
-    __in ULONG PacketLength,
-    __in_opt PVOID PacketPriority,
-    __in_opt const PUCHAR PrefixData,
-    __in const unsigned int PrefixLength
+    __in ULONG WriteLength,
+    __in BOOLEAN CopyFrames,
+    __out PNET_BUFFER_LIST *NetBufferLists,
+    __out PULONG NetBufferListCount
     )
-{
-    PIO_STACK_LOCATION      irpSp;
-    PNET_BUFFER_LIST        netBufferList = NULL;
-    PMDL                    mdl = NULL;    // Head of MDL chain.
-    LONG                    nblCount;
+/*++
 
-    irpSp = IoGetCurrentIrpStackLocation( Irp );
+Routine Description:
 
-    // check for possible ULONG overflow
-    if ((ULONG_MAX - PacketLength) < PrefixLength)
-    {
-        DEBUGP (("[%s] Packet size with prefix exceeds ULONG_MAX\n", MINIPORT_INSTANCE_ID (Adapter)));
-        NOTE_ERROR ();
+    Build a chain of NBLs from a batched write. The write buffer holds one
+    or more frames, each preceded by a TAP_WIN_FRAME_HEADER and starting on
+    a TAP_WIN_FRAME_ALIGNMENT boundary.
 
-        // Fail the IRP
-        Irp->IoStatus.Information = 0;
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
+    The frame headers are validated before any NBL is built so a malformed
+    batch is rejected as a whole. Frames that are filtered, too short or
+    cannot be allocated are dropped individually.
 
-    ULONG fullLength = PacketLength + PrefixLength;
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    Irp                         Batched write IRP
+    WriteLength                 Length of the write buffer
+    CopyFrames                  TRUE to copy every frame
+    NetBufferLists              Receives the NBL chain, or NULL
+    NetBufferListCount          Receives the number of NBLs in the chain
+
+Return Value:
+
+    STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+
+--*/
+{
+    PUCHAR                  buffer = (PUCHAR )Irp->AssociatedIrp.SystemBuffer;
+    PNET_BUFFER_LIST        tailNbl = NULL;
+    TAP_WIN_FRAME_HEADER    frameHeader;
+    ULONG                   offset;
+
+    *NetBufferLists = NULL;
+    *NetBufferListCount = 0;
 
-    if(fullLength < TAP_MIN_FRAME_SIZE)
+    //
+    // Validate the frame headers.
+    //
+    for(offset = 0; offset < WriteLength; )
     {
-        // Consolidate all the incoming data into a new single minimum-length allocation.
-        // This is simpler than additionally allocating another tiny MDL to tack on to the end
-        // (and then having to remove it on the cleanup path)
-        PUCHAR          allocBuffer = NULL;
-        unsigned int    paddedLength = TAP_MIN_FRAME_SIZE;
+        if(WriteLength - offset < sizeof(frameHeader))
+        {
+            break;
+        }
 
-        // Allocate flat buffer for packet data.
-        allocBuffer = (PUCHAR )NdisAllocateMemoryWithTagPriority(
-                            Adapter->MiniportAdapterHandle,
-                            paddedLength,
-                            TAP_RX_INJECT_BUFFER_TAG,
-                            NormalPoolPriority
-                            );
+        NdisMoveMemory(&frameHeader, buffer + offset, sizeof(frameHeader));
 
-        if(allocBuffer == NULL)
+        if(frameHeader.Length > WriteLength - offset - sizeof(frameHeader))
         {
-            DEBUGP (("[%s] NdisAllocateMemoryWithTagPriority failed in IRP_MJ_WRITE\n",
-                MINIPORT_INSTANCE_ID (Adapter)));
+            DEBUGP (("[%s] Bad frame length in batched IRP_MJ_WRITE, offset=%d len=%d\n",
+                MINIPORT_INSTANCE_ID (Adapter),
+                offset,
+                frameHeader.Length));
             NOTE_ERROR ();
 
-            // Fail the IRP
-            Irp->IoStatus.Information = 0;
-            return STATUS_INSUFFICIENT_RESOURCES;
+            return STATUS_INVALID_PARAMETER;
         }
 
-        // Copy packet data to flat buffer.
-        if(PrefixLength > 0)
+        offset = TAP_WIN_FRAME_ALIGN(offset + sizeof(frameHeader) + frameHeader.Length);
+    }
+
+    //
+    // Build one NBL per frame.
+    //
+    for(offset = 0; offset < WriteLength; )
+    {
+        PNET_BUFFER_LIST    netBufferList;
+        NTSTATUS            ntStatus;
+
+        if(WriteLength - offset < sizeof(frameHeader))
         {
-            NdisMoveMemory(allocBuffer, PrefixData, PrefixLength);
+            break;
         }
-        NdisMoveMemory (allocBuffer + PrefixLength, PacketBuffer, PacketLength);
-        NdisZeroMemory(allocBuffer + fullLength, paddedLength - fullLength);
 
-        // Allocate MDL for flat buffer.
-        mdl = NdisAllocateMdl(
-                Adapter->MiniportAdapterHandle,
-                allocBuffer,
-                paddedLength
-                );
+        NdisMoveMemory(&frameHeader, buffer + offset, sizeof(frameHeader));
+
+        ntStatus = tapWriteFrameToNetBufferList(
+                        Adapter,
+                        Irp,
+                        buffer + offset + sizeof(frameHeader),
+                        frameHeader.Length,
+                        CopyFrames,
+                        &netBufferList
+                        );
 
-        if(mdl == NULL)
+        if(ntStatus == STATUS_SUCCESS && netBufferList != NULL)
         {
-            DEBUGP (("[%s] NdisAllocateMdl failed in IRP_MJ_WRITE\n",
-                MINIPORT_INSTANCE_ID (Adapter)));
-            NOTE_ERROR ();
+            if(tailNbl == NULL)
+            {
+                *NetBufferLists = netBufferList;
+            }
+            else
+            {
+                NET_BUFFER_LIST_NEXT_NBL(tailNbl) = netBufferList;
+            }
 
-            NdisFreeMemory(allocBuffer,0,0);
-           
-            // Fail the IRP
-            Irp->IoStatus.Information = 0;
-            return STATUS_INSUFFICIENT_RESOURCES; 
+            tailNbl = netBufferList;
+            ++(*NetBufferListCount);
         }
 
-        mdl->Next = NULL;   // No next MDL
+        offset = TAP_WIN_FRAME_ALIGN(offset + sizeof(frameHeader) + frameHeader.Length);
+    }
 
-        // Allocate the NBL and NB. Link MDL chain to NB.
-        netBufferList = NdisAllocateNetBufferAndNetBufferList(
-                            Adapter->ReceiveNblPool,
-                            0,                  // ContextSize
-                            0,                  // ContextBackFill
-                            mdl,                // MDL chain
-                            0,
-                            paddedLength
-                            );
+    return STATUS_SUCCESS;
+}
 
-        if(netBufferList == NULL)
-        {
-            DEBUGP (("[%s] NdisAllocateNetBufferAndNetBufferList failed in IRP_MJ_WRITE\n",
-                MINIPORT_INSTANCE_ID (Adapter)));
-            NOTE_ERROR ();
+static NTSTATUS
+TapSharedSendPacket(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
+    __in PIRP Irp,
+    __in PNET_BUFFER_LIST NetBufferLists,
+    __in ULONG NetBufferListCount
+    )
+/*++
 
-            NdisFreeMdl(mdl);
-            NdisFreeMemory(allocBuffer,0,0);
-           
-            // Fail the IRP
-            Irp->IoStatus.Information = 0;
-            return STATUS_INSUFFICIENT_RESOURCES; 
-        }            
+Routine Description:
 
-        // Set flag indicating that this is an injected packet
-        // In particular, it has the same cleanup path, and that is all the flag is used for currently.
-        TAP_RX_NBL_FLAGS_CLEAR_ALL(netBufferList);
-        TAP_RX_NBL_FLAG_SET(netBufferList,TAP_RX_NBL_FLAGS_IS_INJECTED);
-    }
-    else
-    {       
-        if(PrefixLength > 0)
-        {
-            //
-            // Allocate MDL for Ethernet header
-            // --------------------------------
-            // Irp->AssociatedIrp.SystemBuffer with length irpSp->Parameters.Write.Length
-            // contains the only the Ethernet payload. Prepend the user-mode provided
-            // payload with the Ethernet header pointed to by p_UserToTap.
-            //
-            mdl = NdisAllocateMdl(
-                Adapter->MiniportAdapterHandle,
-                PrefixData,
-                PrefixLength
-                );
+    Indicate a chain of NBLs built from a write IRP in a single call.
 
-            if(mdl == NULL)            
-            {
-                DEBUGP (("[%s] NdisAllocateMdl failed in IRP_MJ_WRITE\n",
-                    MINIPORT_INSTANCE_ID (Adapter)));
-                NOTE_ERROR ();
+    If any NBL maps the IRP buffer, the IRP is pended and is completed when
+    the last such NBL has been returned to AdapterReturnNetBufferLists.
+    TCP segments are coalesced first, so the count is taken on the
+    coalesced chain. If every frame was copied the IRP is not needed
+    once the NBLs are indicated, and the caller completes it at once.
 
-                // Fail the IRP
-                Irp->IoStatus.Information = 0;
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
+    If the adapter started pausing since the caller checked, the NBLs
+    are dropped, as they may refer to the IRP and cannot be queued.
 
+Return Value:
 
-            // Chain user's Ethernet payload behind Ethernet header.
-            mdl->Next = Irp->MdlAddress;
-            (Irp->MdlAddress)->Next = NULL; // No next MDL
-        }
+    STATUS_PENDING if the IRP was pended, otherwise STATUS_SUCCESS.
 
-        // Allocate the NBL and NB. Link MDL chain to NB.
-        netBufferList = NdisAllocateNetBufferAndNetBufferList(
-            Adapter->ReceiveNblPool,
-            0,                              // ContextSize
-            0,                              // ContextBackFill
-            mdl==NULL?Irp->MdlAddress:mdl,  // MDL chain
-            // PacketBuffer will always be from the Irp's SystemBuffer, but may be offset beyond the start.
-            // This will only be the case if there is not a prefix (and mdl == NULL).
-            mdl==NULL?(ULONG)(PacketBuffer-((unsigned char *)Irp->AssociatedIrp.SystemBuffer)):0,
-            fullLength
-            );
+--*/
+{
+    PNET_BUFFER_LIST    currentNbl;
+    LONG                irpNblCount = 0;
 
-        if(netBufferList == NULL)
-        {
-            if(mdl != NULL)
-            {
-                mdl->Next = NULL;
-                NdisFreeMdl(mdl);
-            }
+    ASSERT(NetBufferLists != NULL);
+    ASSERT(NetBufferListCount > 0);
 
-            DEBUGP (("[%s] NdisAllocateNetBufferAndNetBufferList failed in IRP_MJ_WRITE\n",
-                MINIPORT_INSTANCE_ID (Adapter)));
-            NOTE_ERROR ();
+    tapRscCoalesceNetBufferLists(Adapter,&NetBufferLists,&NetBufferListCount);
 
-            // Fail the IRP
-            Irp->IoStatus.Information = 0;
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
+    if(tapAdapterTryReferenceReceive(Adapter,NetBufferListCount) != NDIS_STATUS_SUCCESS)
+    {
+        DEBUGP (("[%s] Dropping %d receive NBLs while adapter not ready\n",
+            MINIPORT_INSTANCE_ID (Adapter),
+            NetBufferListCount));
 
-        TAP_RX_NBL_FLAGS_CLEAR_ALL(netBufferList);
-        if(PrefixLength > 0)
+        tapFreeReceiveNetBufferLists(Adapter,NetBufferLists);
+
+        return STATUS_SUCCESS;
+    }
+
+    // Copied frames do not hold the IRP.
+    for(currentNbl = NetBufferLists;
+        currentNbl != NULL;
+        currentNbl = NET_BUFFER_LIST_NEXT_NBL(currentNbl))
+    {
+        if(currentNbl->MiniportReserved[0] == Irp)
         {
-            TAP_RX_NBL_FLAG_SET(netBufferList,TAP_RX_NBL_FLAGS_IS_P2P);
+            ++irpNblCount;
         }
     }
 
-    NET_BUFFER_LIST_NEXT_NBL(netBufferList) = NULL; // Only one NBL
+    if(irpNblCount == 0)
+    {
+        tapIndicateReceiveNetBufferLists(
+            Adapter,
+            NetBufferLists,
+            NetBufferListCount,
+            0       // ReceiveFlags
+            );
+
+        return STATUS_SUCCESS;
+    }
+
+    // Number of NBLs that must be returned before the IRP is completed.
+    *TAP_WRITE_IRP_NBL_COUNT(Irp) = irpNblCount;
 
     // This IRP is pended.
     IoMarkIrpPending(Irp);
@@ -583,26 +1974,10 @@ TapSharedSendPacket(
     // This IRP cannot be cancelled while in-flight.
     IoSetCancelRoutine(Irp,NULL);
 
-    // Stash IRP pointer in NBL MiniportReserved[0] field.
-    netBufferList->MiniportReserved[0] = Irp;
-    netBufferList->MiniportReserved[1] = NULL;
-
-    NET_BUFFER_LIST_INFO(netBufferList, Ieee8021QNetBufferListInfo) = PacketPriority;
-
-    // Increment in-flight receive NBL count.
-    nblCount = NdisInterlockedIncrement(&Adapter->ReceiveNblInFlightCount);
-    ASSERT(nblCount > 0 );
-
-    //
-    // Indicate the packet
-    // -------------------
-    // This NBL contains the complete packet including Ethernet header and payload.
-    //
-    NdisMIndicateReceiveNetBufferLists(
-        Adapter->MiniportAdapterHandle,
-        netBufferList,
-        NDIS_DEFAULT_PORT_NUMBER,
-        1,      // NumberOfNetBufferLists
+    tapIndicateReceiveNetBufferLists(
+        Adapter,
+        NetBufferLists,
+        NetBufferListCount,
         0       // ReceiveFlags
         );
 
@@ -620,6 +1995,7 @@ TapDeviceWrite(
     PIO_STACK_LOCATION      irpSp;// Pointer to current stack location
     PTAP_ADAPTER_CONTEXT    adapter = NULL;
     ULONG                   dataLength;
+    NDIS_STATUS             readyStatus;
 
     PAGED_CODE();
 
@@ -703,157 +2079,77 @@ TapDeviceWrite(
     // That is: The device interface may be "up", but the NDIS miniport send/receive
     // interface may be temporarily "down".
     //
-    // BUGBUG!!! In the initial implementation of the NDIS 6 TapOas receive path
-    // the code below will perform a "lying send" for write IRPs passed to the
-    // driver while the miniport is in the Paused state.
+    // While pausing or paused the frames are copied and queued, so the IRP
+    // can be completed at once, and are indicated on Restart. Writes are only
+    // dropped with a "lying send" if the adapter is not ready for another reason
+    // or the paused queue is full.
     //
-    // The correct implementation is to go ahead and build the NBLs corresponding
-    // to the user-mode write - but queue them. When Restart is entered the
-    // queued NBLs would be dequeued and indicated to the host.
-    //
-    if(tapAdapterSendAndReceiveReady(adapter) == NDIS_STATUS_SUCCESS)
-    {
-        if (!adapter->m_tun && ((irpSp->Parameters.Write.Length) >= ETHERNET_HEADER_SIZE))
-        {
-            // TAP mode - Send raw ethernet frame received.
-            unsigned char* packetBuffer = (unsigned char *) Irp->AssociatedIrp.SystemBuffer;
-            ULONG packetLength = irpSp->Parameters.Write.Length;
-            PVOID packetPriority = 0;
-
-            DUMP_PACKET ("IRP_MJ_WRITE ETH",
-                packetBuffer,
-                packetLength);
-
-            //=====================================================
-            // Check incoming packet for an 802.1Q VLAN/Priority header
-            // If one exists, remove it in place.
-            // This may change the packet buffer pointer and length.
-            //=====================================================
-
-            packetPriority = TapStrip8021Q(&packetBuffer, &packetLength);
-
-
-            //=====================================================
-            // If IPv4 packet, check whether or not packet
-            // was truncated.
-            //=====================================================
-#if PACKET_TRUNCATION_CHECK
-            IPv4PacketSizeVerify (
-                packetBuffer,
-                packetLength,
-                FALSE,
-                "RX",
-                &adapter->m_RxTrunc
-                );
-#endif
-            (Irp->MdlAddress)->Next = NULL; // No next MDL
-
-            // Determine frame type for packet filtering
-            ULONG frameType = 0;
-
-            if(!(adapter->PacketFilter & NDIS_PACKET_TYPE_PROMISCUOUS))
-            {
-                // Only determine the frame type if we need to check it.
-                frameType = tapGetRawPacketFrameType(
-                                adapter,
-                                packetBuffer,
-                                packetLength);
-            }
-
-            if((adapter->PacketFilter & NDIS_PACKET_TYPE_PROMISCUOUS) ||  
-               (frameType & adapter->PacketFilter))
-            {
-                // frame type bit is enabled in the packet filter.
-
-                ntStatus = TapSharedSendPacket(
-                    adapter,
-                    Irp,
-                    packetBuffer,
-                    packetLength,
-                    packetPriority,
-                    NULL,
-                    0
-                    );
-
-            }
-            else
-            {
-                DEBUGP (("[%s] Filtered send in IRP_MJ_WRITE frameType 0x%x, PacketFilter 0x%x\n",
-                    MINIPORT_INSTANCE_ID (adapter), frameType, adapter->PacketFilter));
-
-                ntStatus = STATUS_SUCCESS;
-            }
-
-
+    readyStatus = tapAdapterSendAndReceiveReady(adapter);
 
+    if(readyStatus == NDIS_STATUS_SUCCESS || readyStatus == NDIS_STATUS_PAUSED)
+    {
+        PNET_BUFFER_LIST    netBufferLists = NULL;
+        ULONG               netBufferListCount = 0;
+        BOOLEAN             paused = (readyStatus == NDIS_STATUS_PAUSED);
 
+        if (adapter->WriteBatchEnabled)
+        {
+            // Batched write - several length-prefixed frames.
+            ntStatus = tapWriteBatchToNetBufferLists(
+                            adapter,
+                            Irp,
+                            irpSp->Parameters.Write.Length,
+                            paused,
+                            &netBufferLists,
+                            &netBufferListCount
+                            );
         }
-        else if (adapter->m_tun && ((irpSp->Parameters.Write.Length) >= IP_HEADER_SIZE))
+        else
         {
-            // TUN mode - Prepend an ethernet header 
-            PETH_HEADER         p_UserToTap = &adapter->m_UserToTap;
+            ntStatus = tapWriteFrameToNetBufferList(
+                            adapter,
+                            Irp,
+                            (unsigned char *) Irp->AssociatedIrp.SystemBuffer,
+                            irpSp->Parameters.Write.Length,
+                            paused,
+                            &netBufferLists
+                            );
 
-            // For IPv6, need to use Ethernet header with IPv6 proto
-            if ( IPH_GET_VER( ((IPHDR*) Irp->AssociatedIrp.SystemBuffer)->version_len) == 6 )
+            if (netBufferLists != NULL)
             {
-                p_UserToTap = &adapter->m_UserToTap_IPv6;
+                netBufferListCount = 1;
             }
+        }
 
-            DUMP_PACKET2 ("IRP_MJ_WRITE P2P",
-                p_UserToTap,
-                (unsigned char *) Irp->AssociatedIrp.SystemBuffer,
-                irpSp->Parameters.Write.Length);
+        if (ntStatus != STATUS_SUCCESS)
+        {
+            // Fail the IRP
+            Irp->IoStatus.Information = 0;
+        }
+        else if (netBufferLists != NULL && paused)
+        {
+            tapRscCoalesceNetBufferLists(adapter,&netBufferLists,&netBufferListCount);
 
-            //=====================================================
-            // If IPv4 packet, check whether or not packet
-            // was truncated.
-            //=====================================================
-#if PACKET_TRUNCATION_CHECK
-            IPv4PacketSizeVerify (
-                (unsigned char *) Irp->AssociatedIrp.SystemBuffer,
-                irpSp->Parameters.Write.Length,
-                TRUE,
-                "RX",
-                &adapter->m_RxTrunc
+            tapIndicateOrQueueReceiveNetBufferLists(
+                adapter,
+                netBufferLists,
+                netBufferListCount,
+                0       // ReceiveFlags
                 );
-#endif
-
-            if(adapter->PacketFilter & (NDIS_PACKET_TYPE_DIRECTED | NDIS_PACKET_TYPE_PROMISCUOUS))
-            {
-                // All packets are directed - only send directed packets if the packet filter enables this.
-
-                ntStatus = TapSharedSendPacket(
-                    adapter,
-                    Irp,
-                    (unsigned char *) Irp->AssociatedIrp.SystemBuffer,
-                    irpSp->Parameters.Write.Length,
-                    NULL,
-                    (PUCHAR)p_UserToTap,
-                    sizeof(ETH_HEADER)
-                    );
-            }
-            else
-            {
-                DEBUGP (("[%s] Filtered send in IRP_MJ_WRITE while directed packets are disabled\n",
-                    MINIPORT_INSTANCE_ID (adapter)));
-
-                ntStatus = STATUS_SUCCESS;
-            }
         }
-        else
+        else if (netBufferLists != NULL)
         {
-            DEBUGP (("[%s] Bad buffer size in IRP_MJ_WRITE, len=%d\n",
-                MINIPORT_INSTANCE_ID (adapter),
-                irpSp->Parameters.Write.Length));
-            NOTE_ERROR ();
-
-            Irp->IoStatus.Information = 0;	// ETHERNET_HEADER_SIZE;
-            Irp->IoStatus.Status = ntStatus = STATUS_BUFFER_TOO_SMALL;
+            ntStatus = TapSharedSendPacket(
+                            adapter,
+                            Irp,
+                            netBufferLists,
+                            netBufferListCount
+                            );
         }
     }
     else
     {
-        DEBUGP (("[%s] Lying send in IRP_MJ_WRITE while adapter paused\n",
+        DEBUGP (("[%s] Lying send in IRP_MJ_WRITE while adapter not ready\n",
             MINIPORT_INSTANCE_ID (adapter)));
 
         ntStatus = STATUS_SUCCESS;
@@ -58,6 +58,200 @@
 #define TAP_PRIORITY_BEHAVIOR_ADDALWAYS     2
 #define TAP_PRIORITY_BEHAVIOR_MAX           2
 
+/* Added in 9.28 */
+
+/*
+ * Enable (1) or disable (0) batched reads. When enabled, a single read
+ * may return several frames, each preceded by a TAP_WIN_FRAME_HEADER and
+ * starting on a TAP_WIN_FRAME_ALIGNMENT boundary within the read buffer.
+ */
+#define TAP_WIN_IOCTL_SET_READ_BATCH        TAP_WIN_CONTROL_CODE (12, METHOD_BUFFERED)
+
+/*
+ * Enable (1) or disable (0) batched writes. When enabled, every write must
+ * use the batched read layout; all frames of one write are indicated to
+ * the stack together and the write completes once all of them are
+ * released.
+ */
+#define TAP_WIN_IOCTL_SET_WRITE_BATCH       TAP_WIN_CONTROL_CODE (13, METHOD_BUFFERED)
+
+/*
+ * Batching and the offloads selected with TAP_WIN_IOCTL_SET_OFFLOADS set
+ * the framing of every handle of the adapter. They can only be changed
+ * while a single handle is open, and are reset when the first handle is
+ * opened.
+ */
+
+typedef struct _TAP_WIN_FRAME_HEADER
+{
+  unsigned long Length;     /* length of frame data following the header */
+  unsigned long Flags;      /* reserved, zero */
+} TAP_WIN_FRAME_HEADER;
+
+#define TAP_WIN_FRAME_ALIGNMENT             4
+#define TAP_WIN_FRAME_ALIGN(len) \
+  (((len) + (TAP_WIN_FRAME_ALIGNMENT - 1)) & ~(TAP_WIN_FRAME_ALIGNMENT - 1))
+
+/*
+ * Register a pair of shared-memory rings, passing a
+ * TAP_WIN_RING_REGISTRATION. Frames sent by the stack are then written to
+ * the Send ring and frames for the stack are taken from the Receive ring
+ * instead of going through read and write IRPs. The rings stay registered
+ * until the handle that registered them is closed; other handles cannot
+ * register rings meanwhile.
+ */
+#define TAP_WIN_IOCTL_REGISTER_RINGS        TAP_WIN_CONTROL_CODE (14, METHOD_BUFFERED)
+
+/*
+ * A ring holds frames laid out as for batched reads. Head and Tail are
+ * byte offsets into Data and wrap at the ring capacity, which must be a
+ * power of two. A frame never wraps: Data is followed by
+ * TAP_WIN_RING_TRAILING_BYTES so a frame starting near the end of the ring
+ * may run past it. The ring is empty when Head == Tail and is never filled
+ * completely.
+ *
+ * The producer advances Tail and the consumer advances Head. A consumer
+ * with nothing to do sets Alertable, checks Tail again and then waits on
+ * the ring's TailMoved event, which the producer sets when it moves Tail
+ * while Alertable is set.
+ */
+#define TAP_WIN_RING_CAPACITY_MIN           0x20000     /* 128 KiB */
+#define TAP_WIN_RING_CAPACITY_MAX           0x4000000   /* 64 MiB */
+#define TAP_WIN_RING_TRAILING_BYTES         0x10000
+
+typedef struct _TAP_WIN_RING
+{
+  volatile unsigned long Head;
+  volatile unsigned long Tail;
+  volatile long Alertable;
+  unsigned long Reserved;
+  unsigned char Data[1];    /* capacity + TAP_WIN_RING_TRAILING_BYTES */
+} TAP_WIN_RING;
+
+#define TAP_WIN_RING_SIZE(capacity) \
+  (FIELD_OFFSET (TAP_WIN_RING, Data) + (capacity) + TAP_WIN_RING_TRAILING_BYTES)
+
+typedef struct _TAP_WIN_RING_DESCRIPTOR
+{
+  unsigned long Size;               /* TAP_WIN_RING_SIZE (capacity) */
+  unsigned long Reserved;
+  unsigned __int64 Ring;            /* TAP_WIN_RING * */
+  unsigned __int64 TailMoved;       /* HANDLE of an auto-reset event */
+} TAP_WIN_RING_DESCRIPTOR;
+
+typedef struct _TAP_WIN_RING_REGISTRATION
+{
+  TAP_WIN_RING_DESCRIPTOR Send;     /* driver to userspace */
+  TAP_WIN_RING_DESCRIPTOR Receive;  /* userspace to driver */
+} TAP_WIN_RING_REGISTRATION;
+
+/*
+ * Select the offloads (TAP_WIN_OFFLOAD_XXX) userspace handles for frames
+ * it reads, passing a ULONG mask; zero selects none. With any offload
+ * selected, every frame read, batched or not and from the send ring, is
+ * preceded by a TAP_WIN_OFFLOAD_HEADER, which is counted in the frame
+ * length. With TAP_WIN_OFFLOAD_CSUM selected, every frame written is
+ * preceded by one as well. TAP_WIN_OFFLOAD_METADATA replaces it by a
+ * larger header in both directions.
+ */
+#define TAP_WIN_IOCTL_SET_OFFLOADS          TAP_WIN_CONTROL_CODE (15, METHOD_BUFFERED)
+
+/*
+ * TCP segmentation: a frame may be a TCP segment of up to 64 KiB, to be
+ * cut into segments of GsoSize payload bytes. Its IP length field covers
+ * the whole frame. IPv4 header and TCP checksums are not valid and must
+ * be computed for each segment. Reads must be able to hold such frames.
+ */
+#define TAP_WIN_OFFLOAD_TSO                 0x00000001
+
+/*
+ * Checksums: TCP and UDP checksums of frames read may be left partial,
+ * holding only the pseudo header sum, with TAP_WIN_OFFLOAD_F_NEEDS_CSUM
+ * set. Frames written may be marked TAP_WIN_OFFLOAD_F_DATA_VALID, so the
+ * stack does not verify their checksums, or TAP_WIN_OFFLOAD_F_NEEDS_CSUM
+ * to have the driver finish a partial checksum.
+ */
+#define TAP_WIN_OFFLOAD_CSUM                0x00000002
+
+/*
+ * Per-frame offload state, laid out like Linux's struct virtio_net_hdr.
+ * Offsets are from the start of the frame as read, that is from the IP
+ * header in TUN mode.
+ */
+typedef struct _TAP_WIN_OFFLOAD_HEADER
+{
+  unsigned char Flags;          /* TAP_WIN_OFFLOAD_F_XXX */
+  unsigned char GsoType;        /* TAP_WIN_GSO_XXX */
+  unsigned short HeaderLength;  /* length of headers up to the TCP payload */
+  unsigned short GsoSize;       /* TCP payload bytes per segment */
+  unsigned short CsumStart;     /* start of the data the checksum covers */
+  unsigned short CsumOffset;    /* offset of the checksum field from CsumStart */
+} TAP_WIN_OFFLOAD_HEADER;
+
+#define TAP_WIN_OFFLOAD_F_NEEDS_CSUM        0x01
+#define TAP_WIN_OFFLOAD_F_DATA_VALID        0x02
+
+#define TAP_WIN_GSO_NONE                    0
+#define TAP_WIN_GSO_TCPV4                   1
+#define TAP_WIN_GSO_TCPV6                   4
+
+/*
+ * Per-frame metadata: with TAP_WIN_OFFLOAD_METADATA selected, frames read
+ * and written are preceded by a TAP_WIN_METADATA_HEADER instead of a
+ * TAP_WIN_OFFLOAD_HEADER. Its Offload member is used as described above
+ * for the other offloads selected, and is zero if there are none.
+ */
+#define TAP_WIN_OFFLOAD_METADATA            0x00000004
+
+typedef struct _TAP_WIN_METADATA_HEADER
+{
+  TAP_WIN_OFFLOAD_HEADER Offload;
+  unsigned short VlanTci;       /* 802.1Q priority and VLAN ID, with TAP_WIN_METADATA_F_VLAN */
+  unsigned short Flags;         /* TAP_WIN_METADATA_F_XXX */
+  unsigned short HashType;      /* TAP_WIN_HASH_XXX, zero if there is no HashValue */
+  unsigned long HashValue;      /* symmetric flow hash of a frame read */
+  unsigned long Reserved;       /* zero */
+  unsigned __int64 Timestamp;   /* interrupt time, in 100 ns units, a frame read was sent at */
+} TAP_WIN_METADATA_HEADER;
+
+/*
+ * On reads VlanTci is the tag the stack gave the frame, whether or not
+ * it is also inserted in the frame. On writes it takes precedence over
+ * an 802.1Q header in the frame. HashType, HashValue and Timestamp are
+ * ignored on writes.
+ */
+#define TAP_WIN_METADATA_F_VLAN             0x0001
+
+/*
+ * Flow hash computed by the driver over the IP addresses and protocol and
+ * the TCP or UDP ports, or the MAC addresses and type of non-IP frames.
+ * It is symmetric: both directions of a flow hash alike. The hash differs
+ * between adapters and across restarts.
+ */
+#define TAP_WIN_HASH_NONE                   0
+#define TAP_WIN_HASH_IPV4                   1
+#define TAP_WIN_HASH_TCP_IPV4               2
+#define TAP_WIN_HASH_IPV6                   3
+#define TAP_WIN_HASH_TCP_IPV6               4
+#define TAP_WIN_HASH_UDP_IPV4               5
+#define TAP_WIN_HASH_UDP_IPV6               6
+#define TAP_WIN_HASH_ETHERNET               7
+
+/*
+ * Retrieve a TAP_WIN_PAUSE_STATISTICS. Pausing the adapter waits for
+ * the stack to return every frame written that is still indicated; the
+ * latencies, in 100 ns units, measure that wait.
+ */
+#define TAP_WIN_IOCTL_GET_PAUSE_STATISTICS  TAP_WIN_CONTROL_CODE (16, METHOD_BUFFERED)
+
+typedef struct _TAP_WIN_PAUSE_STATISTICS
+{
+  unsigned long PauseCount;             /* pauses completed */
+  unsigned long PendedPauseCount;       /* of those, pauses that had to wait */
+  unsigned __int64 LastPauseLatency;    /* latency of the last pause */
+  unsigned __int64 MaxPauseLatency;     /* highest latency seen */
+} TAP_WIN_PAUSE_STATISTICS;
+
 /*
  * =================
  * Registry keys
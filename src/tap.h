@@ -33,17 +33,23 @@
 #include "lock.h"
 #include "constants.h"
 #include "proto.h"
+#include "aqm.h"
+#include "pktqueue.h"
+#include "tap-windows.h"
+#include "ringops.h"
 #include "mem.h"
+#include "offload.h"
 #include "macinfo.h"
 #include "dhcp.h"
 #include "error.h"
 #include "endian.h"
 #include "dhcp.h"
 #include "types.h"
+#include "rss.h"
 #include "adapter.h"
 #include "device.h"
 #include "prototypes.h"
-#include "tap-windows.h"
+#include "ring.h"
 
 //========================================================
 // Check for truncated IPv4 packets, log errors if found.
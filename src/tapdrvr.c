@@ -90,6 +90,15 @@ Arguments:
 
     DEBUGP (("[TAP] Registry Path: '%wZ'\n", RegistryPath));
 
+#if DBG
+    // Check the RSS hash against the specification's vectors.
+    if (!tapRssSelfTest())
+    {
+        DEBUGP (("[TAP] RSS hash self test failed\n"));
+        ASSERT(FALSE);
+    }
+#endif
+
     //
     // Initialize any driver-global variables here.
     //
@@ -102,6 +102,7 @@ HandleIPv6NeighborDiscovery(
     const IPV6HDR *ipv6 = (IPV6HDR *) (m_Data + sizeof (ETH_HEADER));
     const ICMPV6_NS * icmpv6_ns = (ICMPV6_NS *) (m_Data + sizeof (ETH_HEADER) + sizeof (IPV6HDR));
     ICMPV6_NA_PKT *na;
+    PNET_BUFFER_LIST netBufferList;
     USHORT icmpv6_len, icmpv6_csum;
 
     // we don't really care about the destination MAC address here
@@ -145,10 +146,12 @@ HandleIPv6NeighborDiscovery(
         return FALSE;				// not for us
     }
 
-    // packet identified, build magic response packet
+    // packet identified, build magic response packet directly in
+    // the (zeroed) inject buffer
 
-    na = (ICMPV6_NA_PKT *) MemAlloc (sizeof (ICMPV6_NA_PKT), TRUE);
-    if ( !na ) return FALSE;
+    netBufferList = tapAllocateReplyNetBufferList (Adapter,
+        sizeof (ICMPV6_NA_PKT), (PUCHAR *) &na);
+    if ( !netBufferList ) return FALSE;
 
     //------------------------------------------------
     // Initialize Neighbour Advertisement reply packet
@@ -200,9 +203,7 @@ HandleIPv6NeighborDiscovery(
         (unsigned char *) na,
         sizeof (ICMPV6_NA_PKT));
 
-    IndicateReceivePacket (Adapter, (UCHAR *) na, sizeof (ICMPV6_NA_PKT));
-
-    MemFree (na, sizeof (ICMPV6_NA_PKT));
+    tapIndicateReplyNetBufferList (Adapter, netBufferList, sizeof (ICMPV6_NA_PKT));
 
     return TRUE;				// all fine
 }
@@ -237,8 +238,13 @@ ProcessARP(
         && (src->m_ARP_IP_Destination & ip_netmask) == ip_network
         && src->m_ARP_IP_Destination != adapter_ip)
     {
-        ARP_PACKET *arp = (ARP_PACKET *) MemAlloc (sizeof (ARP_PACKET), TRUE);
-        if (arp)
+        ARP_PACKET *arp;
+        PNET_BUFFER_LIST netBufferList;
+
+        // Build the reply directly in the (zeroed) inject buffer
+        netBufferList = tapAllocateReplyNetBufferList (Adapter,
+            sizeof (ARP_PACKET), (PUCHAR *) &arp);
+        if (netBufferList)
         {
             //----------------------------------------------
             // Initialize ARP reply fields
@@ -264,9 +270,7 @@ ProcessARP(
                 (unsigned char *) arp,
                 sizeof (ARP_PACKET));
 
-            IndicateReceivePacket (Adapter, (UCHAR *) arp, sizeof (ARP_PACKET));
-
-            MemFree (arp, sizeof (ARP_PACKET));
+            tapIndicateReplyNetBufferList (Adapter, netBufferList, sizeof (ARP_PACKET));
         }
 
         return TRUE;
@@ -276,48 +280,133 @@ ProcessARP(
 }
 
 //=============================================================
-// CompleteIRP is normally called with an adapter -> userspace
+// Locate the part of a TAP packet that is returned to userspace.
+//
+// While TapPacket always contains a full ethernet packet,
+// including the ethernet header, in point-to-point mode we
+// only want to return the IP component.
+//
+// Returns the user-visible length, which may be negative for
+// a bogus TUN packet.
+//=============================================================
+
+static int
+tapGetTapPacketUserData(
+    __in PTAP_PACKET TapPacket,
+    __out PUCHAR *UserData
+    )
+{
+    if (TapPacket->m_SizeFlags & TP_TUN)
+    {
+        *UserData = TapPacket->m_Data + ETHERNET_HEADER_SIZE;
+        return (int) (TapPacket->m_SizeFlags & TP_SIZE_MASK) - ETHERNET_HEADER_SIZE;
+    }
+
+    *UserData = TapPacket->m_Data;
+    return (int) (TapPacket->m_SizeFlags & TP_SIZE_MASK);
+}
+
+//=============================================================
+// Returns the size of the offload header that goes in front
+// of a TAP packet's user data, and fills it in. Zero if
+// userspace did not select any offloads. Only the Offload
+// member is used unless userspace selected metadata.
+//=============================================================
+
+#define TAP_PACKET_OFFLOAD_SIZE(p) \
+    (((p)->m_SizeFlags & TP_METADATA) ? sizeof (TAP_WIN_METADATA_HEADER) \
+        : ((p)->m_SizeFlags & TP_OFFLOAD) ? sizeof (TAP_WIN_OFFLOAD_HEADER) : 0)
+
+static ULONG
+tapGetTapPacketOffloadHeader(
+    __in PTAP_PACKET TapPacket,
+    __out TAP_WIN_METADATA_HEADER *OffloadHeader
+    )
+{
+    if (!(TapPacket->m_SizeFlags & TP_OFFLOAD))
+    {
+        return 0;
+    }
+
+    *OffloadHeader = TapPacket->m_Metadata;
+
+    // Userspace offsets start at the IP header in TUN mode.
+    if (TapPacket->m_SizeFlags & TP_TUN)
+    {
+        if (OffloadHeader->Offload.Flags & TAP_WIN_OFFLOAD_F_NEEDS_CSUM)
+        {
+            OffloadHeader->Offload.CsumStart -= ETHERNET_HEADER_SIZE;
+        }
+
+        if (OffloadHeader->Offload.GsoType != TAP_WIN_GSO_NONE)
+        {
+            OffloadHeader->Offload.HeaderLength -= ETHERNET_HEADER_SIZE;
+        }
+    }
+
+    return TAP_PACKET_OFFLOAD_SIZE(TapPacket);
+}
+
+static VOID
+tapSetTapPacketMetadata(
+    __in PTAP_PACKET                    TapPacket,
+    __in ULONG                          UserOffloads,
+    __in const TAP_WIN_METADATA_HEADER  *Metadata
+    )
+/*++
+
+Routine Description:
+
+    Mark a TAP packet to be read with the header the offloads selected by
+    userspace call for, starting from Metadata.
+
+--*/
+{
+    if (UserOffloads == 0)
+    {
+        return;
+    }
+
+    TapPacket->m_Metadata = *Metadata;
+    TapPacket->m_SizeFlags |= TP_OFFLOAD;
+
+    if (UserOffloads & TAP_WIN_OFFLOAD_METADATA)
+    {
+        TapPacket->m_SizeFlags |= TP_METADATA;
+    }
+}
+
+//=============================================================
+// FillIRP is normally called with an adapter -> userspace
 // network packet and an IRP (Pending I/O request) from userspace.
 //
 // The IRP will normally represent a queued overlapped read
 // operation from userspace that is in a wait state.
 //
-// Use the ethernet packet to satisfy the IRP.
+// Use the ethernet packet to satisfy the IRP. The caller
+// completes the IRP.
 //=============================================================
 
-VOID
-tapCompletePendingReadIrp(
+static VOID
+tapFillPendingReadIrp(
+    __in PTAP_ADAPTER_CONTEXT Adapter,
     __in PIRP Irp,
     __in PTAP_PACKET TapPacket
     )
 {
-    int offset;
-    int len;
+    PUCHAR      userData;
+    int         len;
+    ULONG       offloadSize;
+    TAP_WIN_METADATA_HEADER offloadHeader;
     NTSTATUS    status = STATUS_UNSUCCESSFUL;
 
     ASSERT(Irp);
     ASSERT(TapPacket);
 
-    //-------------------------------------------
-    // While TapPacket always contains a
-    // full ethernet packet, including the
-    // ethernet header, in point-to-point mode,
-    // we only want to return the IPv4
-    // component.
-    //-------------------------------------------
-
-    if (TapPacket->m_SizeFlags & TP_TUN)
-    {
-        offset = ETHERNET_HEADER_SIZE;
-        len = (int) (TapPacket->m_SizeFlags & TP_SIZE_MASK) - ETHERNET_HEADER_SIZE;
-    }
-    else
-    {
-        offset = 0;
-        len = (TapPacket->m_SizeFlags & TP_SIZE_MASK);
-    }
+    len = tapGetTapPacketUserData(TapPacket,&userData);
+    offloadSize = tapGetTapPacketOffloadHeader(TapPacket,&offloadHeader);
 
-    if (len < 0 || (int) Irp->IoStatus.Information < len)
+    if (len < 0 || Irp->IoStatus.Information < offloadSize + len)
     {
         Irp->IoStatus.Information = 0;
         Irp->IoStatus.Status = status = STATUS_BUFFER_OVERFLOW;
@@ -325,436 +414,1668 @@ tapCompletePendingReadIrp(
     }
     else
     {
-        Irp->IoStatus.Information = len;
+        Irp->IoStatus.Information = offloadSize + len;
         Irp->IoStatus.Status = status = STATUS_SUCCESS;
 
-        // Copy packet data
+        // Copy offload header and packet data
         NdisMoveMemory(
             Irp->AssociatedIrp.SystemBuffer,
-            TapPacket->m_Data + offset,
+            &offloadHeader,
+            offloadSize
+            );
+
+        NdisMoveMemory(
+            (PUCHAR )Irp->AssociatedIrp.SystemBuffer + offloadSize,
+            userData,
             len
             );
     }
 
     // Free the TAP packet
-    NdisFreeMemory(TapPacket,0,0);
-
-    // Complete the IRP
-    IoCompleteRequest (Irp, IO_NETWORK_INCREMENT);
+    tapPacketFree(&Adapter->SendPacketPool,TapPacket);
 }
 
-VOID
-tapProcessSendPacketQueue(
-    __in PTAP_ADAPTER_CONTEXT   Adapter
+static PTAP_PACKET
+tapPeekSendPacketLocked(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PTAP_QUEUE             Queue
     )
-{
-    KIRQL  irql;
-
-    // Process the send packet queue
-    KeAcquireSpinLock(&Adapter->SendPacketQueue.QueueLock,&irql);
-
-    while(Adapter->SendPacketQueue.Count > 0 )
-    {
-        PIRP            irp;
-        PTAP_PACKET     tapPacket;
-
-        // Fetch a read IRP
-        irp = IoCsqRemoveNextIrp(
-                &Adapter->PendingReadIrpQueue.CsqQueue,
-                NULL
-                );
-
-        if( irp == NULL )
-        {
-            // No IRP to satisfy
-            break;
-        }
+/*++
 
-        // Fetch a queued TAP send packet
-        tapPacket = tapPacketRemoveHeadLocked(
-                        &Adapter->SendPacketQueue
-                        );
+Routine Description:
 
-        ASSERT(tapPacket);
+    Return the TAP packet at the head of the send packet queue without
+    removing it.
 
-        // BUGBUG!!! Investigate whether release/reacquire can cause
-        // out-of-order IRP completion. Also, whether user-mode can
-        // tolerate out-of-order packets.
+    If active queue management is enabled the head packet is judged each
+    time it is looked at, until it is removed into a read IRP. A packet
+    left queued for want of an IRP is judged again on its grown sojourn
+    time. Packets the AQM decides to drop are removed and freed here.
 
-        // Release packet queue lock while completing the IRP
-        //KeReleaseSpinLock(&Adapter->SendPacketQueue.QueueLock,irql);
+    Must be called with SendPacketQueue.QueueLock held.
 
-        // Complete the read IRP from queued TAP send packet.
-        tapCompletePendingReadIrp(irp,tapPacket);
+Arguments:
 
-        // Reqcquire packet queue lock after completing the IRP
-        //KeAcquireSpinLock(&Adapter->SendPacketQueue.QueueLock,&irql);
-    }
+    Adapter                     Pointer to our adapter context
+    Queue                       Queue to peek at
 
-    KeReleaseSpinLock(&Adapter->SendPacketQueue.QueueLock,irql);
+Return Value:
 
-    tapCheckFlowControl(Adapter);
-}
+    The TAP packet at the queue head, or NULL if the queue is empty.
 
-// Flush the pending send TAP packet queue.
-VOID
-tapFlushSendPacketQueue(
-    __in PTAP_ADAPTER_CONTEXT   Adapter
-    )
+--*/
 {
-    KIRQL  irql;
-
-    // Process the send packet queue
-    KeAcquireSpinLock(&Adapter->SendPacketQueue.QueueLock,&irql);
-
-    DEBUGP (("[TAP] tapFlushSendPacketQueue: Flushing %d TAP packets\n",
-        Adapter->SendPacketQueue.Count));
+    PTAP_PACKET         tapPacket;
+    PTAP_PACKET_FLOW    flow;
 
-    while(Adapter->SendPacketQueue.Count > 0 )
+    for(;;)
     {
-        PTAP_PACKET     tapPacket;
-
-        // Fetch a queued TAP send packet
-        tapPacket = tapPacketRemoveHeadLocked(
-                        &Adapter->SendPacketQueue
-                        );
+        tapPacket = tapPacketQueuePeekHeadLocked(&Queue->SendPacketQueue,&flow);
 
-        ASSERT(tapPacket);
+        if (tapPacket == NULL
+            || Adapter->AqmParameters.Mode == TAP_AQM_MODE_NONE)
+        {
+            return tapPacket;
+        }
 
-        // Free the TAP packet
-        NdisFreeMemory(tapPacket,0,0);
-    }
+        if (!tapAqmShouldDrop(
+                &Adapter->AqmParameters,
+                &flow->AqmState,
+                tapPacket->m_EnqueueTime,
+                KeQueryInterruptTime(),
+                flow->Bytes
+                ))
+        {
+            return tapPacket;
+        }
 
-    KeReleaseSpinLock(&Adapter->SendPacketQueue.QueueLock,irql);
+        tapPacket = tapPacketQueueDropHeadLocked(&Queue->SendPacketQueue);
+        tapPacketFree(&Adapter->SendPacketPool,tapPacket);
 
-    tapCompleteFlowControlPackets(Adapter);
+        InterlockedIncrement64(&Adapter->AqmDrops);
+    }
 }
 
-VOID
-tapAdapterTransmit(
+static VOID
+tapDequeueReadBatchLocked(
     __in PTAP_ADAPTER_CONTEXT   Adapter,
-    __in PNET_BUFFER            NetBuffer,
-    __in PNET_BUFFER_LIST       NetBufferList,    
-    __in  BOOLEAN               DispatchLevel
+    __in PTAP_QUEUE             Queue,
+    __in PIRP                   Irp,
+    __in PLIST_ENTRY            Packets
     )
 /*++
 
 Routine Description:
 
-    This routine is called to transmit an individual net buffer using a
-    style similar to the previous NDIS 5 AdapterTransmit function.
-
-    In this implementation adapter state and NB length checks have already
-    been done before this function has been called.
-
-    The net buffer will be completed by the calling routine after this
-    routine exits. So, under this design it is necessary to make a deep
-    copy of frame data in the net buffer.
+    Remove as many queued TAP packets as fit into a read IRP in batched
+    read mode. Each frame takes a TAP_WIN_FRAME_HEADER and is aligned to
+    TAP_WIN_FRAME_ALIGNMENT, and is preceded by its offload header if
+    userspace selected offloads.
 
-    This routine creates a flat buffer copy of NB frame data. This is an
-    unnecessary performance bottleneck. However, the bottleneck is probably
-    not significant or measurable except for adapters running at 1Gbps or
-    greater speeds. Since this adapter is currently running at 100Mbps this
-    defect can be ignored.
+    If not even the first queued packet fits it is dropped and Packets is
+    left empty.
 
-    Runs at IRQL <= DISPATCH_LEVEL
+    Must be called with SendPacketQueue.QueueLock held.
 
 Arguments:
 
     Adapter                     Pointer to our adapter context
-    NetBuffer                   Pointer to the net buffer to transmit
-    NetBufferList               List the net buffer was taken from
-    DispatchLevel               TRUE if called at IRQL == DISPATCH_LEVEL
+    Queue                       Queue the read IRP was removed from
+    Irp                         Read IRP removed from the pending read queue
+    Packets                     Receives the TAP packets for the IRP
 
 Return Value:
 
     None.
 
-    In the Microsoft NDIS 6 architecture there is no per-packet status.
-
 --*/
 {
-    NDIS_STATUS     status;
-    ULONG           packetLength;
-    PTAP_PACKET     tapPacket;
-    PVOID           packetData;
-    ULONG           addHeaderSize;
+    ULONG       bufferLength = (ULONG )Irp->IoStatus.Information;
+    ULONG       offset = 0;     // Start of next frame header
 
-    packetLength = NET_BUFFER_DATA_LENGTH(NetBuffer);
+    while(Queue->SendPacketQueue.Count > 0)
+    {
+        PTAP_PACKET             tapPacket;
+        PUCHAR                  userData;
+        int                     len;
+        ULONG                   offloadSize;
 
-    // Determine if we need to add an 802.1Q header
-    NDIS_NET_BUFFER_LIST_8021Q_INFO packetPriority;
-    packetPriority.Value = NET_BUFFER_LIST_INFO(NetBufferList, Ieee8021QNetBufferListInfo);
+        // Peek at the queue head; it is only removed if it fits.
+        tapPacket = tapPeekSendPacketLocked(Adapter,Queue);
 
-    addHeaderSize = 0;
-    if (!Adapter->m_tun)
-    {
-        // only add header in TAP mode
-        if(Adapter->PriorityBehavior == TAP_PRIORITY_BEHAVIOR_ADDALWAYS)
+        if (tapPacket == NULL)
         {
-            addHeaderSize = VLAN_TAG_SIZE;
+            break;
         }
-        else if (Adapter->PriorityBehavior == TAP_PRIORITY_BEHAVIOR_ENABLED)
+
+        len = tapGetTapPacketUserData(tapPacket,&userData);
+        offloadSize = TAP_PACKET_OFFLOAD_SIZE(tapPacket);
+
+        if (len >= 0
+            && (offset > bufferLength
+                || bufferLength - offset < sizeof(TAP_WIN_FRAME_HEADER) + offloadSize + (ULONG )len)
+            )
         {
-            if(packetPriority.TagHeader.UserPriority != 0 || 
-                packetPriority.TagHeader.VlanId != 0)
+            if (!IsListEmpty(Packets))
             {
-                addHeaderSize = VLAN_TAG_SIZE;
+                // Leave it for the next read IRP.
+                break;
             }
+
+            // Not even one frame fits. Drop it, like the unbatched path does.
+            len = -1;
         }
-        if(packetLength < ETHERNET_HEADER_SIZE)
+
+        tapPacket = tapPacketRemoveHeadLocked(&Queue->SendPacketQueue);
+
+        if (len < 0)
         {
-            // Sanity check - don't try to modify packets that are far too short.
-            addHeaderSize = 0;
+            NOTE_ERROR ();
+            tapPacketFree(&Adapter->SendPacketPool,tapPacket);
+
+            if (IsListEmpty(Packets))
+            {
+                break;
+            }
+
+            continue;
         }
-    }
 
-    // Allocate TAP packet memory
-    tapPacket = (PTAP_PACKET )NdisAllocateMemoryWithTagPriority(
-                    Adapter->MiniportAdapterHandle,
-                    TAP_PACKET_SIZE (packetLength+addHeaderSize),
-                    TAP_PACKET_TAG,
-                    NormalPoolPriority
-                    );
+        InsertTailList(Packets,&tapPacket->QueueLink);
 
-    if(tapPacket == NULL)
-    {
-        DEBUGP (("[TAP] tapAdapterTransmit: TAP packet allocation failed\n"));
-        return;
+        offset = TAP_WIN_FRAME_ALIGN(offset + sizeof(TAP_WIN_FRAME_HEADER) + offloadSize + len);
     }
+}
 
-    tapPacket->m_SizeFlags = ((packetLength+addHeaderSize) & TP_SIZE_MASK);
+static VOID
+tapFillPendingReadIrpBatch(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PIRP                   Irp,
+    __in PLIST_ENTRY            Packets
+    )
+/*++
 
-    //
-    // Reassemble packet contents
-    // --------------------------
-    // NdisGetDataBuffer does most of the work. There are two cases:
-    //
-    //    1.) If the NB data was not contiguous it will copy the entire
-    //        NB's data to m_data and return pointer to m_data.
-    //    2.) If the NB data was contiguous it returns a pointer to the
-    //        first byte of the contiguous data instead of a pointer to m_Data.
-    //        In this case the data will not have been copied to m_Data. Copy
-    //        to m_Data will need to be done in an extra step.
-    //
-    // Case 1.) is the most likely in normal operation.
-    //
-    packetData = NdisGetDataBuffer(NetBuffer,packetLength,tapPacket->m_Data+addHeaderSize,1,0);
+Routine Description:
 
-    if(packetData == NULL)
-    {
-        DEBUGP (("[TAP] tapAdapterTransmit: Could not get packet data\n"));
+    Copy TAP packets removed by tapDequeueReadBatchLocked into a read IRP,
+    each preceded by a TAP_WIN_FRAME_HEADER, and free them. The caller
+    completes the IRP.
 
-        NdisFreeMemory(tapPacket,0,0);
+Arguments:
 
-        return;
-    }
+    Adapter                     Pointer to our adapter context
+    Irp                         Read IRP the packets were removed for
+    Packets                     TAP packets to copy
 
-    if(packetData != (tapPacket->m_Data+addHeaderSize))
+Return Value:
+
+    None.
+
+--*/
+{
+    PUCHAR      buffer = (PUCHAR )Irp->AssociatedIrp.SystemBuffer;
+    ULONG       offset = 0;     // Start of next frame header
+    ULONG       used = 0;       // End of last copied frame
+
+    if (IsListEmpty(Packets))
     {
-        // Packet data was contiguous and not yet copied to m_Data.
-        NdisMoveMemory(tapPacket->m_Data+addHeaderSize,packetData,packetLength);
+        // The first queued packet did not fit and was dropped.
+        Irp->IoStatus.Information = 0;
+        Irp->IoStatus.Status = STATUS_BUFFER_OVERFLOW;
+        return;
     }
-    
-    if(addHeaderSize > 0)
+
+    while(!IsListEmpty(Packets))
     {
-        // Add an 802.1Q header between the ethernet header and the payload
-        NdisMoveMemory(tapPacket->m_Data,tapPacket->m_Data+addHeaderSize,ETHERNET_HEADER_SIZE-2);
-        PETH_HEADER header = (PETH_HEADER)tapPacket->m_Data;
-        PETH_8021Q_HEADER tag = (PETH_8021Q_HEADER)(header+1);
-        header->proto = htons(0x8100);
-        USHORT tagValue = 0;
-        tagValue |= packetPriority.TagHeader.UserPriority<<13;
-        tagValue |= packetPriority.TagHeader.VlanId & 0xFFF;
-        tag->Tag = tagValue;
+        PTAP_PACKET             tapPacket;
+        PUCHAR                  userData;
+        int                     len;
+        ULONG                   offloadSize;
+        TAP_WIN_FRAME_HEADER    frameHeader;
+        TAP_WIN_METADATA_HEADER offloadHeader;
 
-        packetLength += addHeaderSize;
-    }
+        tapPacket = CONTAINING_RECORD(RemoveHeadList(Packets), TAP_PACKET, QueueLink);
 
+        len = tapGetTapPacketUserData(tapPacket,&userData);
+        offloadSize = tapGetTapPacketOffloadHeader(tapPacket,&offloadHeader);
 
-    DUMP_PACKET ("AdapterTransmit", tapPacket->m_Data, packetLength);
+        frameHeader.Length = offloadSize + (ULONG )len;
+        frameHeader.Flags = 0;
 
-    //=====================================================
-    // If IPv4 packet, check whether or not packet
-    // was truncated.
-    //=====================================================
-#if PACKET_TRUNCATION_CHECK
-    IPv4PacketSizeVerify(
-        tapPacket->m_Data,
-        packetLength,
-        FALSE,
-        "TX",
-        &Adapter->m_TxTrunc
-        );
-#endif
+        NdisMoveMemory(buffer + offset, &frameHeader, sizeof(frameHeader));
+        NdisMoveMemory(buffer + offset + sizeof(frameHeader), &offloadHeader, offloadSize);
+        NdisMoveMemory(buffer + offset + sizeof(frameHeader) + offloadSize, userData, len);
 
-    //=====================================================
-    // Are we running in DHCP server masquerade mode?
-    //
-    // If so, catch both DHCP requests and ARP queries
-    // to resolve the address of our virtual DHCP server.
-    //=====================================================
-    if (Adapter->m_dhcp_enabled)
+        used = offset + sizeof(frameHeader) + offloadSize + len;
+        offset = TAP_WIN_FRAME_ALIGN(used);
+
+        // Free the TAP packet
+        tapPacketFree(&Adapter->SendPacketPool,tapPacket);
+    }
+
+    Irp->IoStatus.Information = used;
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+}
+
+//
+// Read IRP completion order
+// -------------------------
+// Read IRPs are matched to TAP packets under SendPacketQueue.QueueLock but
+// filled and completed after it is released. Every matched IRP takes a
+// sequence number while the lock is held, and IRPs are completed strictly
+// in sequence order so userspace sees frames in the order they were queued
+// even when several CPUs drain the queue at once. Each per-handle queue
+// has its own sequence.
+//
+// Callers stay at DISPATCH_LEVEL from taking their sequence numbers until
+// they end their turn, so a turn holder can never be preempted by a CPU
+// waiting on it.
+//
+
+// Call with QueueLock held
+static ULONG
+tapReserveReadCompletionLocked(
+    __in PTAP_QUEUE             Queue,
+    __in ULONG                  Count
+    )
+{
+    ULONG   sequence = Queue->ReadCompletionNext;
+
+    Queue->ReadCompletionNext += Count;
+
+    return sequence;
+}
+
+static VOID
+tapWaitForReadCompletionTurn(
+    __in PTAP_QUEUE             Queue,
+    __in ULONG                  Sequence
+    )
+{
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    while((ULONG )Queue->ReadCompletionTurn != Sequence)
+    {
+        YieldProcessor();
+    }
+
+    KeMemoryBarrier();
+}
+
+static VOID
+tapEndReadCompletionTurn(
+    __in PTAP_QUEUE             Queue,
+    __in ULONG                  Count
+    )
+{
+    InterlockedExchangeAdd(&Queue->ReadCompletionTurn,(LONG )Count);
+}
+
+// Maximum number of read IRPs matched per QueueLock acquisition.
+#define TAP_READ_COMPLETION_BATCH   16
+
+typedef struct _TAP_READ_COMPLETION
+{
+    PIRP            Irp;
+    LIST_ENTRY      Packets;    // TAP packets to copy into Irp
+    BOOLEAN         Batched;    // Packets use the batched read layout
+} TAP_READ_COMPLETION;
+
+static VOID
+tapProcessQueue(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PTAP_QUEUE             Queue
+    )
+/*++
+
+Routine Description:
+
+    Complete pending read IRPs of a per-handle queue with TAP packets
+    from the same queue.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    Queue                       Queue to process
+
+Return Value:
+
+    None.
+
+--*/
+{
+    KIRQL                   irql;
+    TAP_READ_COMPLETION     completions[TAP_READ_COMPLETION_BATCH];
+
+    for(;;)
+    {
+        ULONG   count = 0;
+        ULONG   sequence;
+        ULONG   i;
+
+        // Process the send packet queue
+        KeAcquireSpinLock(&Queue->SendPacketQueue.QueueLock,&irql);
+
+        while(count < TAP_READ_COMPLETION_BATCH && Queue->SendPacketQueue.Count > 0 )
+        {
+            PIRP            irp;
+            PTAP_PACKET     tapPacket;
+
+            // Let AQM drop stale packets before an IRP is committed.
+            if(tapPeekSendPacketLocked(Adapter,Queue) == NULL)
+            {
+                break;
+            }
+
+            // Fetch a read IRP
+            irp = IoCsqRemoveNextIrp(
+                    &Queue->PendingReadIrpQueue.CsqQueue,
+                    NULL
+                    );
+
+            if( irp == NULL )
+            {
+                // No IRP to satisfy
+                break;
+            }
+
+            completions[count].Irp = irp;
+            completions[count].Batched = Adapter->ReadBatchEnabled;
+            InitializeListHead(&completions[count].Packets);
+
+            if(completions[count].Batched)
+            {
+                // Take as many queued TAP send packets as fit into the IRP.
+                tapDequeueReadBatchLocked(Adapter,Queue,irp,&completions[count].Packets);
+            }
+            else
+            {
+                // Fetch a queued TAP send packet
+                tapPacket = tapPacketRemoveHeadLocked(
+                                &Queue->SendPacketQueue
+                                );
+
+                ASSERT(tapPacket);
+
+                InsertTailList(&completions[count].Packets,&tapPacket->QueueLink);
+            }
+
+            ++count;
+        }
+
+        sequence = tapReserveReadCompletionLocked(Queue,count);
+
+        // Stay at DISPATCH_LEVEL until our turn is over.
+        KeReleaseSpinLockFromDpcLevel(&Queue->SendPacketQueue.QueueLock);
+
+        if(count == 0)
+        {
+            KeLowerIrql(irql);
+            break;
+        }
+
+        // Copy packet data outside the lock...
+        for(i = 0; i < count; ++i)
+        {
+            if(completions[i].Batched)
+            {
+                tapFillPendingReadIrpBatch(Adapter,completions[i].Irp,&completions[i].Packets);
+            }
+            else
+            {
+                PTAP_PACKET     tapPacket;
+
+                tapPacket = CONTAINING_RECORD(
+                                RemoveHeadList(&completions[i].Packets),
+                                TAP_PACKET,
+                                QueueLink
+                                );
+
+                tapFillPendingReadIrp(Adapter,completions[i].Irp,tapPacket);
+            }
+        }
+
+        // ... then complete the read IRPs in order.
+        tapWaitForReadCompletionTurn(Queue,sequence);
+
+        for(i = 0; i < count; ++i)
+        {
+            IoCompleteRequest (completions[i].Irp, IO_NETWORK_INCREMENT);
+        }
+
+        tapEndReadCompletionTurn(Queue,count);
+
+        KeLowerIrql(irql);
+
+        if(count < TAP_READ_COMPLETION_BATCH)
+        {
+            break;
+        }
+    }
+}
+
+VOID
+tapProcessSendPacketQueue(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in_opt PTAP_QUEUE         Queue
+    )
+/*++
+
+Routine Description:
+
+    Complete pending read IRPs with queued TAP packets, then release held
+    sends if the queues have drained.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    Queue                       Queue to process, or NULL for all queues
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG   i;
+
+    if(Queue != NULL)
+    {
+        tapProcessQueue(Adapter,Queue);
+    }
+    else
+    {
+        for(i = 0; i < Adapter->QueueCount; ++i)
+        {
+            tapProcessQueue(Adapter,&Adapter->Queues[i]);
+        }
+    }
+
+    tapCheckFlowControl(Adapter);
+}
+
+// Flush the pending send TAP packet queue.
+VOID
+tapFlushSendPacketQueue(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PTAP_QUEUE             Queue
+    )
+{
+    KIRQL  irql;
+
+    // Process the send packet queue
+    KeAcquireSpinLock(&Queue->SendPacketQueue.QueueLock,&irql);
+
+    DEBUGP (("[TAP] tapFlushSendPacketQueue: Flushing %d TAP packets\n",
+        Queue->SendPacketQueue.Count));
+
+    while(Queue->SendPacketQueue.Count > 0 )
+    {
+        PTAP_PACKET     tapPacket;
+
+        // Fetch a queued TAP send packet
+        tapPacket = tapPacketRemoveHeadLocked(
+                        &Queue->SendPacketQueue
+                        );
+
+        ASSERT(tapPacket);
+
+        // Free the TAP packet
+        tapPacketFree(&Adapter->SendPacketPool,tapPacket);
+    }
+
+    KeReleaseSpinLock(&Queue->SendPacketQueue.QueueLock,irql);
+
+    tapCompleteFlowControlPackets(Adapter);
+}
+
+BOOLEAN
+tapCopyFromNetBuffer(
+    __in PNET_BUFFER        NetBuffer,
+    __in ULONG              Offset,
+    __in ULONG              Length,
+    __out_bcount(Length) PUCHAR Destination
+    )
+/*++
+
+Routine Description:
+
+    Copy Length bytes starting Offset bytes into the NB's data to a flat
+    buffer, walking the MDL chain directly.
+
+    Runs at IRQL <= DISPATCH_LEVEL
+
+Return Value:
+
+    TRUE if all bytes were copied.
+
+--*/
+{
+    PMDL    mdl = NET_BUFFER_CURRENT_MDL(NetBuffer);
+    ULONG   mdlOffset = NET_BUFFER_CURRENT_MDL_OFFSET(NetBuffer) + Offset;
+    ULONG   pagePriority = NormalPagePriority;
+
+    if (GlobalData.RunningWindows8OrGreater != FALSE) {
+        pagePriority |= MdlMappingNoExecute;
+    }
+
+    while(Length > 0 && mdl != NULL)
+    {
+        ULONG   mdlLength = MmGetMdlByteCount(mdl);
+        ULONG   copyLength;
+        PUCHAR  mdlData;
+
+        if(mdlOffset >= mdlLength)
+        {
+            // Skip MDLs that precede the requested data.
+            mdlOffset -= mdlLength;
+            mdl = mdl->Next;
+            continue;
+        }
+
+        mdlData = (PUCHAR )MmGetSystemAddressForMdlSafe(mdl,pagePriority);
+
+        if(mdlData == NULL)
+        {
+            return FALSE;
+        }
+
+        copyLength = min(mdlLength - mdlOffset, Length);
+
+        NdisMoveMemory(Destination, mdlData + mdlOffset, copyLength);
+
+        Destination += copyLength;
+        Length -= copyLength;
+        mdlOffset = 0;
+        mdl = mdl->Next;
+    }
+
+    return (Length == 0);
+}
+
+BOOLEAN
+tapAdapterTransmitDirect(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PTAP_QUEUE             Queue,
+    __in PNET_BUFFER            NetBuffer,
+    __in ULONG                  PacketLength,
+    __in USHORT                 VlanTag,
+    __in ULONG                  AddHeaderSize,
+    __in ULONG                  UserOffloads,
+    __in PVOID                  ChecksumInfo,
+    __in const TAP_WIN_METADATA_HEADER *Metadata
+    )
+/*++
+
+Routine Description:
+
+    Fast path for tapAdapterTransmit. If userspace already has a read IRP
+    pending and nothing is queued ahead of this frame, copy the NB straight
+    into the IRP buffer instead of going through a TAP packet.
+
+    Only frames that need no inspection beyond their headers take this path:
+    DHCP masquerade, batched reads, ARP and IPv6 ICMP in TUN mode all fall
+    back to the queued path.
+
+    Frames the queued path would drop, because the adapter is not ready,
+    and frames for a registered send ring fall back to it as well.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    Queue                       Queue the frame is steered to
+    NetBuffer                   Pointer to the net buffer to transmit
+    PacketLength                Length of NB data
+    VlanTag                     802.1Q tag to insert if AddHeaderSize is not zero
+    AddHeaderSize               Size of 802.1Q header to insert, or zero
+    UserOffloads                TAP_WIN_OFFLOAD_XXX selected by userspace
+    ChecksumInfo                Checksum offloads requested by the stack
+    Metadata                    Header to start from if userspace selected
+                                any offloads
+
+Return Value:
+
+    TRUE if the NB was consumed by a read IRP.
+
+    FALSE if it must take the queued path.
+
+--*/
+{
+    KIRQL       irql;
+    PIRP        irp = NULL;
+    ULONG       offset = 0;
+    ULONG       offloadSize = TAP_OFFLOAD_READ_HEADER_SIZE(UserOffloads);
+    TAP_WIN_METADATA_HEADER offloadHeader;
+    ULONG       userLength;
+    PUCHAR      userBuffer;
+    BOOLEAN     copied;
+    ULONG       sequence;
+
+    if(Adapter->ReadBatchEnabled || Adapter->m_dhcp_enabled)
+    {
+        return FALSE;
+    }
+
+    if(Queue->PendingReadIrpQueue.Count == 0)
+    {
+        // Unlocked peek. Reads are usually posted ahead of time.
+        return FALSE;
+    }
+
+    if(Adapter->m_tun)
+    {
+        ETH_HEADER  eth;
+        IPV6HDR     ipv6;
+
+        if(!tapCopyFromNetBuffer(NetBuffer, 0, ETHERNET_HEADER_SIZE, (PUCHAR )&eth))
+        {
+            return FALSE;
+        }
+
+        switch (ntohs (eth.proto))
+        {
+        case NDIS_ETH_TYPE_IPV4:
+
+            // Only accept directed packets, not broadcasts.
+            if (PacketLength < (ETHERNET_HEADER_SIZE + IP_HEADER_SIZE)
+                || memcmp (&eth, &Adapter->m_TapToUser, ETHERNET_HEADER_SIZE))
+            {
+                return FALSE;
+            }
+            break;
+
+        case NDIS_ETH_TYPE_IPV6:
+
+            // ICMPv6 may be neighbor discovery handled by the driver.
+            if (PacketLength < (ETHERNET_HEADER_SIZE + IPV6_HEADER_SIZE)
+                || !tapCopyFromNetBuffer(NetBuffer, ETHERNET_HEADER_SIZE, sizeof(ipv6), (PUCHAR )&ipv6)
+                || ipv6.nexthdr == IPPROTO_ICMPV6)
+            {
+                return FALSE;
+            }
+            break;
+
+        default:
+            return FALSE;
+        }
+
+        // Only the IP packet goes to userspace.
+        offset = ETHERNET_HEADER_SIZE;
+    }
+
+    if(!tapAdapterReadAndWriteReady(Adapter) || Adapter->Rings != NULL)
+    {
+        return FALSE;
+    }
+
+    //
+    // Fetch a read IRP, but only if no queued packet must go first.
+    //
+    KeAcquireSpinLock(&Queue->SendPacketQueue.QueueLock,&irql);
+
+    if(Queue->SendPacketQueue.Count == 0)
+    {
+        irp = IoCsqRemoveNextIrp(
+                &Queue->PendingReadIrpQueue.CsqQueue,
+                NULL
+                );
+    }
+
+    if(irp == NULL)
+    {
+        KeReleaseSpinLock(&Queue->SendPacketQueue.QueueLock,irql);
+        return FALSE;
+    }
+
+    sequence = tapReserveReadCompletionLocked(Queue,1);
+
+    // Stay at DISPATCH_LEVEL until our completion turn is over.
+    KeReleaseSpinLockFromDpcLevel(&Queue->SendPacketQueue.QueueLock);
+
+    userBuffer = (PUCHAR )irp->AssociatedIrp.SystemBuffer;
+    userLength = PacketLength - offset + AddHeaderSize;
+
+    if ((ULONG )irp->IoStatus.Information < offloadSize + userLength)
+    {
+        irp->IoStatus.Information = 0;
+        irp->IoStatus.Status = STATUS_BUFFER_OVERFLOW;
+        NOTE_ERROR ();
+
+        goto complete;
+    }
+
+    offloadHeader = *Metadata;
+    userBuffer += offloadSize;
+
+    if(AddHeaderSize > 0)
+    {
+        // Copy MAC addresses, add the 802.1Q header, then copy the rest
+        // starting with the original ethertype.
+        PETH_HEADER header = (PETH_HEADER)userBuffer;
+        PETH_8021Q_HEADER tag = (PETH_8021Q_HEADER)(header+1);
+
+        copied = tapCopyFromNetBuffer(NetBuffer, 0, ETHERNET_HEADER_SIZE - 2, userBuffer);
+
+        header->proto = htons(ETHERTYPE_8021Q);
+        tag->Tag = VlanTag;
+
+        copied = copied && tapCopyFromNetBuffer(
+                                NetBuffer,
+                                ETHERNET_HEADER_SIZE - 2,
+                                PacketLength - (ETHERNET_HEADER_SIZE - 2),
+                                userBuffer + ETHERNET_HEADER_SIZE - 2 + AddHeaderSize
+                                );
+    }
+    else
+    {
+        copied = tapCopyFromNetBuffer(NetBuffer, offset, userLength, userBuffer);
+    }
+
+    if(copied)
+    {
+        if(ChecksumInfo != NULL)
+        {
+            tapChecksumPrepareFrame(
+                userBuffer,
+                userLength,
+                Adapter->m_tun ? 0 : ETHERNET_HEADER_SIZE + AddHeaderSize,
+                ChecksumInfo,
+                (UserOffloads & TAP_WIN_OFFLOAD_CSUM) ? &offloadHeader.Offload : NULL
+                );
+        }
+
+        NdisMoveMemory(userBuffer - offloadSize, &offloadHeader, offloadSize);
+
+        irp->IoStatus.Information = offloadSize + userLength;
+        irp->IoStatus.Status = STATUS_SUCCESS;
+    }
+    else
+    {
+        DEBUGP (("[TAP] tapAdapterTransmitDirect: Could not get packet data\n"));
+
+        irp->IoStatus.Information = 0;
+        irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // Complete in order with IRPs matched to queued packets.
+complete:
+    tapWaitForReadCompletionTurn(Queue,sequence);
+    IoCompleteRequest (irp, IO_NETWORK_INCREMENT);
+    tapEndReadCompletionTurn(Queue,1);
+
+    KeLowerIrql(irql);
+
+    return TRUE;
+}
+
+// Mix one 32-bit word into a flow hash.
+#define TAP_FLOW_HASH_MIX(h,w)  ((h) = ((h) ^ (ULONG )(w)) * 0x9E3779B1, (h) ^= (h) >> 15)
+
+//
+// Flow hash and priority of a frame to userspace. Computed at most once
+// per frame, by tapSteerNetBuffer when steering or metadata needs them and
+// otherwise by tapAdapterTransmitPacket when the frame is queued, and
+// shared by all segments of a large send.
+//
+typedef struct _TAP_FLOW_CLASS
+{
+    BOOLEAN     Valid;
+    ULONG       UserPriority;   // 802.1p user priority from the NBL
+    ULONG       FlowHash;
+    ULONG       Priority;
+} TAP_FLOW_CLASS, *PTAP_FLOW_CLASS;
+
+static VOID
+tapClassifyFrame(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PUCHAR                 Data,
+    __in ULONG                  Length,
+    __in ULONG                  UserPriority,
+    __out PULONG                FlowHash,
+    __out PULONG                Priority,
+    __out_opt PULONG            HashType
+    )
+/*++
+
+Routine Description:
+
+    Compute the flow hash and priority a frame to userspace is steered and
+    scheduled by.
+
+    IPv4 and IPv6 packets hash their addresses, protocol and, for TCP and
+    UDP, ports. Fragments and IPv6 packets with extension headers only
+    hash addresses and protocol so they stay with the rest of their flow
+    as far as possible. Other frames hash their MAC addresses and type.
+
+    The hash is symmetric, so userspace can use it to keep both directions
+    of a flow together: the endpoints are mixed in in a fixed order, lower
+    address first, whichever is the source.
+
+    The priority is the 802.1p user priority. If the host did not set one
+    and SendQueueDscp is enabled, IP packets use the precedence bits of
+    their DSCP instead.
+
+    Data may be just the start of the frame; fields beyond Length are
+    left out.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    Data                        Ethernet frame, possibly 802.1Q tagged
+    Length                      Length of Data
+    UserPriority                802.1p user priority from the NBL
+    FlowHash                    Receives the flow hash
+    Priority                    Receives the priority
+    HashType                    Receives the TAP_WIN_HASH_XXX of the hash
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PUCHAR      data = Data;
+    ULONG       length = Length;
+    ULONG       offset = ETHERNET_HEADER_SIZE;
+    ULONG       hash = Adapter->FlowHashSeed;
+    ULONG       hashType;
+    USHORT      proto;
+    UCHAR       ipProto;
+    UCHAR       precedence;
+    BOOLEAN     ports = FALSE;
+    BOOLEAN     ipv6 = FALSE;
+    int         order;          // Source address compared to destination
+
+    *FlowHash = hash;
+    *Priority = UserPriority;
+
+    if (HashType != NULL)
+    {
+        *HashType = TAP_WIN_HASH_NONE;
+    }
+
+    if (length < ETHERNET_HEADER_SIZE)
+    {
+        return;
+    }
+
+    proto = ntohs(((ETH_HEADER *)data)->proto);
+
+    // Skip an 802.1Q tag inserted by tapAdapterTransmit.
+    if (proto == NDIS_ETH_TYPE_802_1Q && length >= ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE)
+    {
+        proto = ntohs(((ETH_8021Q_HEADER UNALIGNED *)(data + ETHERNET_HEADER_SIZE))->EtherType);
+        offset += VLAN_TAG_SIZE;
+    }
+
+    if (proto == NDIS_ETH_TYPE_IPV4 && length >= offset + IP_HEADER_SIZE)
+    {
+        const IPHDR UNALIGNED *ip = (const IPHDR UNALIGNED *)(data + offset);
+
+        ULONG saddr = ntohl(ip->saddr);
+        ULONG daddr = ntohl(ip->daddr);
+
+        ipProto = ip->protocol;
+        precedence = ip->tos >> 5;
+
+        order = (saddr > daddr) - (saddr < daddr);
+
+        TAP_FLOW_HASH_MIX(hash, min(saddr, daddr));
+        TAP_FLOW_HASH_MIX(hash, max(saddr, daddr));
+
+        // More fragments flag or a fragment offset.
+        ports = (ntohs(ip->frag_off) & (0x2000 | IP_OFFMASK)) == 0;
+        offset += IPH_GET_LEN(ip->version_len);
+    }
+    else if (proto == NDIS_ETH_TYPE_IPV6 && length >= offset + IPV6_HEADER_SIZE)
+    {
+        const IPV6HDR UNALIGNED *ip = (const IPV6HDR UNALIGNED *)(data + offset);
+        const ULONG UNALIGNED *low;
+        const ULONG UNALIGNED *high;
+        int i;
+
+        ipProto = ip->nexthdr;
+        precedence = (ip->version_prio & 0x0F) >> 1;
+
+        order = memcmp(ip->saddr, ip->daddr, sizeof(IPV6ADDR));
+        low = (const ULONG UNALIGNED *)((order > 0) ? ip->daddr : ip->saddr);
+        high = (const ULONG UNALIGNED *)((order > 0) ? ip->saddr : ip->daddr);
+
+        for (i = 0; i < 4; ++i)
+        {
+            TAP_FLOW_HASH_MIX(hash, low[i]);
+        }
+
+        for (i = 0; i < 4; ++i)
+        {
+            TAP_FLOW_HASH_MIX(hash, high[i]);
+        }
+
+        ipv6 = TRUE;
+        ports = TRUE;
+        offset += IPV6_HEADER_SIZE;
+    }
+    else
+    {
+        const ETH_HEADER *eth = (const ETH_HEADER *)data;
+        const UCHAR *low = eth->dest;
+        const UCHAR *high = eth->src;
+
+        if (memcmp(low, high, sizeof(MACADDR)) > 0)
+        {
+            low = eth->src;
+            high = eth->dest;
+        }
+
+        // Lower and higher MAC address, then type.
+        TAP_FLOW_HASH_MIX(hash, *(const ULONG UNALIGNED *)low);
+        TAP_FLOW_HASH_MIX(hash, ((ULONG )low[4] << 24) | ((ULONG )low[5] << 16) | ((ULONG )high[0] << 8) | high[1]);
+        TAP_FLOW_HASH_MIX(hash, *(const ULONG UNALIGNED *)(high + 2));
+        TAP_FLOW_HASH_MIX(hash, proto);
+
+        *FlowHash = hash;
+
+        if (HashType != NULL)
+        {
+            *HashType = TAP_WIN_HASH_ETHERNET;
+        }
+
+        return;
+    }
+
+    TAP_FLOW_HASH_MIX(hash, ipProto);
+    hashType = ipv6 ? TAP_WIN_HASH_IPV6 : TAP_WIN_HASH_IPV4;
+
+    // Source and destination ports start both the TCP and UDP header.
+    // They go in in address order; between equal addresses the lower
+    // port goes first.
+    if (ports
+        && (ipProto == IPPROTO_TCP || ipProto == IPPROTO_UDP)
+        && length >= offset + sizeof(ULONG))
+    {
+        const UDPHDR UNALIGNED *udp = (const UDPHDR UNALIGNED *)(data + offset);
+        ULONG sport = ntohs(udp->source);
+        ULONG dport = ntohs(udp->dest);
+
+        if (order > 0 || (order == 0 && sport > dport))
+        {
+            TAP_FLOW_HASH_MIX(hash, (dport << 16) | sport);
+        }
+        else
+        {
+            TAP_FLOW_HASH_MIX(hash, (sport << 16) | dport);
+        }
+
+        if (ipProto == IPPROTO_TCP)
+        {
+            hashType = ipv6 ? TAP_WIN_HASH_TCP_IPV6 : TAP_WIN_HASH_TCP_IPV4;
+        }
+        else
+        {
+            hashType = ipv6 ? TAP_WIN_HASH_UDP_IPV6 : TAP_WIN_HASH_UDP_IPV4;
+        }
+    }
+
+    *FlowHash = hash;
+
+    if (HashType != NULL)
+    {
+        *HashType = hashType;
+    }
+
+    if (UserPriority == 0 && Adapter->SendQueueDscp)
+    {
+        *Priority = precedence;
+    }
+}
+
+// Enough of a frame to classify it: Ethernet and 802.1Q headers, the
+// largest IPv4 header and the TCP/UDP ports.
+#define TAP_CLASSIFY_HEADER_SIZE    (ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE + 60 + 4)
+
+static PTAP_QUEUE
+tapSteerNetBuffer(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PNET_BUFFER            NetBuffer,
+    __in ULONG                  PacketLength,
+    __inout_opt TAP_WIN_METADATA_HEADER *Metadata,
+    __inout PTAP_FLOW_CLASS     FlowClass
+    )
+/*++
+
+Routine Description:
+
+    Pick the per-handle queue a frame to userspace goes to. In multi-queue
+    mode frames are steered by flow hash, so each flow stays on one handle.
+
+    The same hash is passed to userspace that selected metadata, so it
+    can shard flows across its own workers without parsing frames again.
+
+    The frame is classified here only if steering or metadata needs it.
+    FlowClass then carries the result to tapAdapterTransmitPacket.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    NetBuffer                   Pointer to the net buffer to transmit
+    PacketLength                Length of NB data
+    Metadata                    Metadata to fill the flow hash in, if any
+    FlowClass                   Classification of the frame, with
+                                UserPriority set
+
+Return Value:
+
+    The queue.
+
+--*/
+{
+    UCHAR       header[TAP_CLASSIFY_HEADER_SIZE];
+    ULONG       length = min(PacketLength, sizeof(header));
+    ULONG       hashType;
+
+    if(Adapter->QueueCount == 1 && Metadata == NULL)
+    {
+        return &Adapter->Queues[0];
+    }
+
+    if(!tapCopyFromNetBuffer(NetBuffer, 0, length, header))
+    {
+        length = 0;
+    }
+
+    tapClassifyFrame(
+        Adapter,
+        header,
+        length,
+        FlowClass->UserPriority,
+        &FlowClass->FlowHash,
+        &FlowClass->Priority,
+        &hashType
+        );
+
+    FlowClass->Valid = TRUE;
+
+    if(Metadata != NULL)
+    {
+        Metadata->HashType = (USHORT )hashType;
+        Metadata->HashValue = (hashType != TAP_WIN_HASH_NONE) ? FlowClass->FlowHash : 0;
+    }
+
+    if(Adapter->QueueCount == 1)
+    {
+        return &Adapter->Queues[0];
+    }
+
+    return tapAdapterSteerQueue(Adapter,FlowClass->FlowHash);
+}
+
+static VOID
+tapAdapterTransmitPacket(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PTAP_QUEUE             Queue,
+    __in PTAP_PACKET            TapPacket,
+    __inout PTAP_FLOW_CLASS     FlowClass
+    )
+/*++
+
+Routine Description:
+
+    Second half of tapAdapterTransmit. Answer or filter a frame that has
+    been copied into a TAP packet and queue it for userspace. Segments of
+    a large send come through here one by one.
+
+    The TAP packet is consumed.
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    Queue                       Queue the frame is steered to
+    TapPacket                   TAP packet holding the frame
+    FlowClass                   Classification of the frame, computed
+                                here if tapSteerNetBuffer did not
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG           packetLength = TapPacket->m_SizeFlags & TP_SIZE_MASK;
+
+    DUMP_PACKET ("AdapterTransmit", TapPacket->m_Data, packetLength);
+
+    //=====================================================
+    // If IPv4 packet, check whether or not packet
+    // was truncated.
+    //=====================================================
+#if PACKET_TRUNCATION_CHECK
+    IPv4PacketSizeVerify(
+        TapPacket->m_Data,
+        packetLength,
+        FALSE,
+        "TX",
+        &Adapter->m_TxTrunc
+        );
+#endif
+
+    //=====================================================
+    // Are we running in DHCP server masquerade mode?
+    //
+    // If so, catch both DHCP requests and ARP queries
+    // to resolve the address of our virtual DHCP server.
+    //=====================================================
+    if (Adapter->m_dhcp_enabled)
+    {
+        const ETH_HEADER *eth = (ETH_HEADER *) TapPacket->m_Data;
+        const IPHDR *ip = (IPHDR *) (TapPacket->m_Data + sizeof (ETH_HEADER));
+        const UDPHDR *udp = (UDPHDR *) (TapPacket->m_Data + sizeof (ETH_HEADER) + sizeof (IPHDR));
+
+        // ARP packet?
+        if (packetLength == sizeof (ARP_PACKET)
+            && eth->proto == htons (NDIS_ETH_TYPE_ARP)
+            && Adapter->m_dhcp_server_arp
+            )
+        {
+            if (ProcessARP(
+                    Adapter,
+                    (PARP_PACKET) TapPacket->m_Data,
+                    Adapter->m_dhcp_addr,
+                    Adapter->m_dhcp_server_ip,
+                    ~0,
+                    Adapter->m_dhcp_server_mac)
+                    )
+            {
+                goto no_queue;
+            }
+        }
+
+        // DHCP packet?
+        else if (packetLength >= sizeof (ETH_HEADER) + sizeof (IPHDR) + sizeof (UDPHDR) + sizeof (DHCP)
+            && eth->proto == htons (NDIS_ETH_TYPE_IPV4)
+            && ip->version_len == 0x45 // IPv4, 20 byte header
+            && ip->protocol == IPPROTO_UDP
+            && udp->dest == htons (BOOTPS_PORT)
+            )
+        {
+            const DHCP *dhcp = (DHCP *) (TapPacket->m_Data
+                + sizeof (ETH_HEADER)
+                + sizeof (IPHDR)
+                + sizeof (UDPHDR));
+
+            const int optlen = packetLength
+                - sizeof (ETH_HEADER)
+                - sizeof (IPHDR)
+                - sizeof (UDPHDR)
+                - sizeof (DHCP);
+
+            if (optlen > 0) // we must have at least one DHCP option
+            {
+                if (ProcessDHCP (Adapter, eth, ip, udp, dhcp, optlen))
+                {
+                    goto no_queue;
+                }
+            }
+            else
+            {
+                goto no_queue;
+            }
+        }
+    }
+
+    //===============================================
+    // In Point-To-Point mode, check to see whether
+    // packet is ARP (handled) or IPv4 (sent to app).
+    // IPv6 packets are inspected for neighbour discovery
+    // (to be handled locally), and the rest is forwarded
+    // all other protocols are dropped
+    //===============================================
+    if (Adapter->m_tun)
     {
-        const ETH_HEADER *eth = (ETH_HEADER *) tapPacket->m_Data;
-        const IPHDR *ip = (IPHDR *) (tapPacket->m_Data + sizeof (ETH_HEADER));
-        const UDPHDR *udp = (UDPHDR *) (tapPacket->m_Data + sizeof (ETH_HEADER) + sizeof (IPHDR));
+        ETH_HEADER *e;
 
-        // ARP packet?
-        if (packetLength == sizeof (ARP_PACKET)
-            && eth->proto == htons (NDIS_ETH_TYPE_ARP)
-            && Adapter->m_dhcp_server_arp
-            )
+        e = (ETH_HEADER *) TapPacket->m_Data;
+
+        switch (ntohs (e->proto))
         {
-            if (ProcessARP(
-                    Adapter,
-                    (PARP_PACKET) tapPacket->m_Data,
-                    Adapter->m_dhcp_addr,
-                    Adapter->m_dhcp_server_ip,
-                    ~0,
-                    Adapter->m_dhcp_server_mac)
-                    )
+        case NDIS_ETH_TYPE_ARP:
+
+            // Make sure that packet is the right size for ARP.
+            if (packetLength != sizeof (ARP_PACKET))
+            {
+                goto no_queue;
+            }
+
+            ProcessARP (
+                Adapter,
+                (PARP_PACKET) TapPacket->m_Data,
+                Adapter->m_localIP,
+                Adapter->m_remoteNetwork,
+                Adapter->m_remoteNetmask,
+                Adapter->m_TapToUser.dest
+                );
+
+        default:
+            goto no_queue;
+
+        case NDIS_ETH_TYPE_IPV4:
+
+            // Make sure that packet is large enough to be IPv4.
+            if (packetLength < (ETHERNET_HEADER_SIZE + IP_HEADER_SIZE))
+            {
+                goto no_queue;
+            }
+
+            // Only accept directed packets, not broadcasts.
+            if (memcmp (e, &Adapter->m_TapToUser, ETHERNET_HEADER_SIZE))
+            {
+                goto no_queue;
+            }
+
+            // Packet looks like IPv4, queue it. :-)
+            TapPacket->m_SizeFlags |= TP_TUN;
+            break;
+
+        case NDIS_ETH_TYPE_IPV6:
+            // Make sure that packet is large enough to be IPv6.
+            if (packetLength < (ETHERNET_HEADER_SIZE + IPV6_HEADER_SIZE))
+            {
+                goto no_queue;
+            }
+
+            // Broadcasts and multicasts are handled specially
+            // (to be implemented)
+
+            // Neighbor discovery packets to fe80::8 are special
+            // OpenVPN sets this next-hop to signal "handled by tapdrv"
+            if ( HandleIPv6NeighborDiscovery(Adapter,TapPacket->m_Data,
+                                             packetLength) )
             {
                 goto no_queue;
             }
+
+            // Packet looks like IPv6, queue it. :-)
+            TapPacket->m_SizeFlags |= TP_TUN;
         }
+    }
 
-        // DHCP packet?
-        else if (packetLength >= sizeof (ETH_HEADER) + sizeof (IPHDR) + sizeof (UDPHDR) + sizeof (DHCP)
-            && eth->proto == htons (NDIS_ETH_TYPE_IPV4)
-            && ip->version_len == 0x45 // IPv4, 20 byte header
-            && ip->protocol == IPPROTO_UDP
-            && udp->dest == htons (BOOTPS_PORT)
-            )
+    //===============================================
+    // Push packet onto queue to wait for read from
+    // userspace.
+    //===============================================
+    if(tapAdapterReadAndWriteReady(Adapter))
+    {
+        PUCHAR  userData;
+        int     userLength;
+        TAP_WIN_METADATA_HEADER offloadHeader;
+        ULONG   offloadSize;
+
+        userLength = tapGetTapPacketUserData(TapPacket,&userData);
+        offloadSize = tapGetTapPacketOffloadHeader(TapPacket,&offloadHeader);
+
+        // Copy to the shared send ring if userspace registered one.
+        if(userLength >= 0
+            && tapRingsSendFrame(
+                    Adapter,
+                    offloadSize ? &offloadHeader : NULL,
+                    offloadSize,
+                    userData,
+                    (ULONG )userLength
+                    ))
         {
-            const DHCP *dhcp = (DHCP *) (tapPacket->m_Data
-                + sizeof (ETH_HEADER)
-                + sizeof (IPHDR)
-                + sizeof (UDPHDR));
+            tapPacketFree(&Adapter->SendPacketPool,TapPacket);
+        }
+        else
+        {
+            if(!FlowClass->Valid)
+            {
+                tapClassifyFrame(
+                    Adapter,
+                    TapPacket->m_Data,
+                    TapPacket->m_SizeFlags & TP_SIZE_MASK,
+                    FlowClass->UserPriority,
+                    &FlowClass->FlowHash,
+                    &FlowClass->Priority,
+                    NULL
+                    );
+
+                FlowClass->Valid = TRUE;
+            }
+
+            TapPacket->m_FlowHash = FlowClass->FlowHash;
+            TapPacket->m_Priority = FlowClass->Priority;
+
+            tapPacketQueueInsertTail(&Queue->SendPacketQueue,TapPacket);
+        }
+    }
+    else
+    {
+        //
+        // Tragedy. All this work and the packet is of no use... 
+        //
+        tapPacketFree(&Adapter->SendPacketPool,TapPacket);
+    }
+
+    // Return after queuing or freeing TAP packet.
+    return;
+
+    // Free TAP packet without queuing.
+no_queue:
+    tapPacketFree(&Adapter->SendPacketPool,TapPacket);
+}
+
+static VOID
+tapInitializeMetadata(
+    __in USHORT                     VlanTci,
+    __out TAP_WIN_METADATA_HEADER   *Metadata
+    )
+/*++
+
+Routine Description:
+
+    Start the metadata read with a frame: the 802.1Q tag the stack gave
+    it and the time it was sent. The flow hash is filled in by
+    tapSteerNetBuffer and the Offload member is left zero.
+
+--*/
+{
+    NdisZeroMemory(Metadata,sizeof(TAP_WIN_METADATA_HEADER));
+
+    if(VlanTci != 0)
+    {
+        Metadata->VlanTci = VlanTci;
+        Metadata->Flags |= TAP_WIN_METADATA_F_VLAN;
+    }
+
+    Metadata->Timestamp = KeQueryInterruptTime();
+}
+
+VOID
+tapAdapterTransmit(
+    __in PTAP_ADAPTER_CONTEXT   Adapter,
+    __in PNET_BUFFER            NetBuffer,
+    __in PNET_BUFFER_LIST       NetBufferList,    
+    __in  BOOLEAN               DispatchLevel
+    )
+/*++
+
+Routine Description:
+
+    This routine is called to transmit an individual net buffer using a
+    style similar to the previous NDIS 5 AdapterTransmit function.
+
+    In this implementation adapter state and NB length checks have already
+    been done before this function has been called.
+
+    The net buffer will be completed by the calling routine after this
+    routine exits. So, under this design it is necessary to make a deep
+    copy of frame data in the net buffer.
+
+    This routine creates a flat buffer copy of NB frame data, which is later
+    copied again into a read IRP. When a read IRP is already pending and no
+    packets are queued, tapAdapterTransmitDirect copies the NB straight into
+    the IRP buffer instead.
+
+    Runs at IRQL <= DISPATCH_LEVEL
+
+Arguments:
+
+    Adapter                     Pointer to our adapter context
+    NetBuffer                   Pointer to the net buffer to transmit
+    NetBufferList               List the net buffer was taken from
+    DispatchLevel               TRUE if called at IRQL == DISPATCH_LEVEL
+
+Return Value:
+
+    None.
+
+    In the Microsoft NDIS 6 architecture there is no per-packet status.
+
+--*/
+{
+    NDIS_STATUS     status;
+    ULONG           packetLength;
+    PTAP_PACKET     tapPacket;
+    PVOID           packetData;
+    ULONG           addHeaderSize;
+    USHORT          tagValue;
+    PTAP_QUEUE      queue;
+    ULONG           userOffloads = Adapter->UserOffloads;
+    ULONG           mss = 0;
+    PVOID           checksumInfo;
+    TAP_WIN_METADATA_HEADER metadata;
+    TAP_FLOW_CLASS  flowClass;
+
+    packetLength = NET_BUFFER_DATA_LENGTH(NetBuffer);
+
+    // LSOv2 frames carry the MSS to segment at.
+    NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO lsoInfo;
+    lsoInfo.Value = NET_BUFFER_LIST_INFO(NetBufferList, TcpLargeSendNetBufferListInfo);
+
+    if(lsoInfo.Transmit.Type == NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE)
+    {
+        mss = lsoInfo.LsoV2Transmit.MSS;
+    }
+
+    // Other frames may ask for checksums to be computed.
+    checksumInfo = NET_BUFFER_LIST_INFO(NetBufferList, TcpIpChecksumNetBufferListInfo);
+
+    // Determine if we need to add an 802.1Q header
+    NDIS_NET_BUFFER_LIST_8021Q_INFO packetPriority;
+    packetPriority.Value = NET_BUFFER_LIST_INFO(NetBufferList, Ieee8021QNetBufferListInfo);
+
+    addHeaderSize = 0;
+    if (!Adapter->m_tun)
+    {
+        // only add header in TAP mode
+        if(Adapter->PriorityBehavior == TAP_PRIORITY_BEHAVIOR_ADDALWAYS)
+        {
+            addHeaderSize = VLAN_TAG_SIZE;
+        }
+        else if (Adapter->PriorityBehavior == TAP_PRIORITY_BEHAVIOR_ENABLED)
+        {
+            if(packetPriority.TagHeader.UserPriority != 0 || 
+                packetPriority.TagHeader.VlanId != 0)
+            {
+                addHeaderSize = VLAN_TAG_SIZE;
+            }
+        }
+        if(packetLength < ETHERNET_HEADER_SIZE)
+        {
+            // Sanity check - don't try to modify packets that are far too short.
+            addHeaderSize = 0;
+        }
+    }
+
+    tagValue = 0;
+    tagValue |= packetPriority.TagHeader.UserPriority<<13;
+    tagValue |= packetPriority.TagHeader.VlanId & 0xFFF;
+
+    // Per-frame metadata for userspace that selected it.
+    NdisZeroMemory(&metadata,sizeof(metadata));
+
+    if(userOffloads & TAP_WIN_OFFLOAD_METADATA)
+    {
+        tapInitializeMetadata(tagValue,&metadata);
+    }
+
+    // Pick the handle the frame goes to.
+    NdisZeroMemory(&flowClass,sizeof(flowClass));
+    flowClass.UserPriority = packetPriority.TagHeader.UserPriority;
+
+    queue = tapSteerNetBuffer(
+                Adapter,
+                NetBuffer,
+                packetLength,
+                (userOffloads & TAP_WIN_OFFLOAD_METADATA) ? &metadata : NULL,
+                &flowClass
+                );
+
+    // Copy straight into a pending read IRP if possible.
+    if(mss == 0
+        && tapAdapterTransmitDirect(
+                Adapter,
+                queue,
+                NetBuffer,
+                packetLength,
+                tagValue,
+                addHeaderSize,
+                userOffloads,
+                checksumInfo,
+                &metadata
+                ))
+    {
+        return;
+    }
+
+    // Allocate TAP packet memory
+    tapPacket = tapPacketAllocate(
+                    &Adapter->SendPacketPool,
+                    packetLength+addHeaderSize
+                    );
+
+    if(tapPacket == NULL)
+    {
+        DEBUGP (("[TAP] tapAdapterTransmit: TAP packet allocation failed\n"));
+        return;
+    }
+
+    tapPacket->m_SizeFlags = ((packetLength+addHeaderSize) & TP_SIZE_MASK);
+
+    tapSetTapPacketMetadata(tapPacket,userOffloads,&metadata);
+
+    //
+    // Reassemble packet contents
+    // --------------------------
+    // NdisGetDataBuffer does most of the work. There are two cases:
+    //
+    //    1.) If the NB data was not contiguous it will copy the entire
+    //        NB's data to m_data and return pointer to m_data.
+    //    2.) If the NB data was contiguous it returns a pointer to the
+    //        first byte of the contiguous data instead of a pointer to m_Data.
+    //        In this case the data will not have been copied to m_Data. Copy
+    //        to m_Data will need to be done in an extra step.
+    //
+    // Case 1.) is the most likely in normal operation.
+    //
+    packetData = NdisGetDataBuffer(NetBuffer,packetLength,tapPacket->m_Data+addHeaderSize,1,0);
 
-            const int optlen = packetLength
-                - sizeof (ETH_HEADER)
-                - sizeof (IPHDR)
-                - sizeof (UDPHDR)
-                - sizeof (DHCP);
+    if(packetData == NULL)
+    {
+        DEBUGP (("[TAP] tapAdapterTransmit: Could not get packet data\n"));
 
-            if (optlen > 0) // we must have at least one DHCP option
-            {
-                if (ProcessDHCP (Adapter, eth, ip, udp, dhcp, optlen))
-                {
-                    goto no_queue;
-                }
-            }
-            else
-            {
-                goto no_queue;
-            }
-        }
+        tapPacketFree(&Adapter->SendPacketPool,tapPacket);
+
+        return;
     }
 
-    //===============================================
-    // In Point-To-Point mode, check to see whether
-    // packet is ARP (handled) or IPv4 (sent to app).
-    // IPv6 packets are inspected for neighbour discovery
-    // (to be handled locally), and the rest is forwarded
-    // all other protocols are dropped
-    //===============================================
-    if (Adapter->m_tun)
+    if(packetData != (tapPacket->m_Data+addHeaderSize))
     {
-        ETH_HEADER *e;
+        // Packet data was contiguous and not yet copied to m_Data.
+        NdisMoveMemory(tapPacket->m_Data+addHeaderSize,packetData,packetLength);
+    }
+    
+    if(addHeaderSize > 0)
+    {
+        // Add an 802.1Q header between the ethernet header and the payload
+        NdisMoveMemory(tapPacket->m_Data,tapPacket->m_Data+addHeaderSize,ETHERNET_HEADER_SIZE-2);
+        PETH_HEADER header = (PETH_HEADER)tapPacket->m_Data;
+        PETH_8021Q_HEADER tag = (PETH_8021Q_HEADER)(header+1);
+        header->proto = htons(0x8100);
+        tag->Tag = tagValue;
 
-        e = (ETH_HEADER *) tapPacket->m_Data;
+        packetLength += addHeaderSize;
+    }
 
-        switch (ntohs (e->proto))
-        {
-        case NDIS_ETH_TYPE_ARP:
 
-            // Make sure that packet is the right size for ARP.
-            if (packetLength != sizeof (ARP_PACKET))
-            {
-                goto no_queue;
-            }
+    //
+    // Checksum offload
+    // ----------------
+    // Userspace that selected TAP_WIN_OFFLOAD_CSUM finishes the checksum.
+    // Otherwise it is computed here.
+    //
+    if(mss == 0 && checksumInfo != NULL)
+    {
+        tapChecksumPrepareFrame(
+            tapPacket->m_Data,
+            packetLength,
+            ETHERNET_HEADER_SIZE + addHeaderSize,
+            checksumInfo,
+            (userOffloads & TAP_WIN_OFFLOAD_CSUM) ? &tapPacket->m_Metadata.Offload : NULL
+            );
+    }
 
-            ProcessARP (
-                Adapter,
-                (PARP_PACKET) tapPacket->m_Data,
-                Adapter->m_localIP,
-                Adapter->m_remoteNetwork,
-                Adapter->m_remoteNetmask,
-                Adapter->m_TapToUser.dest
-                );
+    //
+    // Large send
+    // ----------
+    // Userspace that selected TAP_WIN_OFFLOAD_TSO gets the frame whole.
+    // Otherwise it is cut into MTU-sized segments here.
+    //
+    if(mss != 0)
+    {
+        ULONG   tcpOffset = lsoInfo.LsoV2Transmit.TcpHeaderOffset + addHeaderSize;
 
-        default:
-            goto no_queue;
+        if(userOffloads & TAP_WIN_OFFLOAD_TSO)
+        {
+            if(!tapLsoPrepareFrame(tapPacket->m_Data,packetLength,tcpOffset,mss,&tapPacket->m_Metadata.Offload))
+            {
+                DEBUGP (("[TAP] tapAdapterTransmit: Bad large send frame\n"));
+                NOTE_ERROR ();
 
-        case NDIS_ETH_TYPE_IPV4:
+                tapPacketFree(&Adapter->SendPacketPool,tapPacket);
 
-            // Make sure that packet is large enough to be IPv4.
-            if (packetLength < (ETHERNET_HEADER_SIZE + IP_HEADER_SIZE))
-            {
-                goto no_queue;
+                return;
             }
+        }
+        else
+        {
+            LIST_ENTRY  segments;
+            BOOLEAN     segmented;
+
+            InitializeListHead(&segments);
+
+            segmented = tapLsoSegmentFrame(
+                            &Adapter->SendPacketPool,
+                            tapPacket->m_Data,
+                            packetLength,
+                            tcpOffset,
+                            mss,
+                            &segments
+                            );
 
-            // Only accept directed packets, not broadcasts.
-            if (memcmp (e, &Adapter->m_TapToUser, ETHERNET_HEADER_SIZE))
+            tapPacketFree(&Adapter->SendPacketPool,tapPacket);
+
+            if(!segmented)
             {
-                goto no_queue;
-            }
+                DEBUGP (("[TAP] tapAdapterTransmit: Could not segment large send\n"));
+                NOTE_ERROR ();
 
-            // Packet looks like IPv4, queue it. :-)
-            tapPacket->m_SizeFlags |= TP_TUN;
-            break;
+                return;
+            }
 
-        case NDIS_ETH_TYPE_IPV6:
-            // Make sure that packet is large enough to be IPv6.
-            if (packetLength < (ETHERNET_HEADER_SIZE + IPV6_HEADER_SIZE))
+            while(!IsListEmpty(&segments))
             {
-                goto no_queue;
-            }
+                tapPacket = CONTAINING_RECORD(RemoveHeadList(&segments), TAP_PACKET, QueueLink);
 
-            // Broadcasts and multicasts are handled specially
-            // (to be implemented)
+                tapSetTapPacketMetadata(tapPacket,userOffloads,&metadata);
 
-            // Neighbor discovery packets to fe80::8 are special
-            // OpenVPN sets this next-hop to signal "handled by tapdrv"
-            if ( HandleIPv6NeighborDiscovery(Adapter,tapPacket->m_Data,
-                                             packetLength) )
-            {
-                goto no_queue;
+                tapAdapterTransmitPacket(
+                    Adapter,
+                    queue,
+                    tapPacket,
+                    &flowClass
+                    );
             }
 
-            // Packet looks like IPv6, queue it. :-)
-            tapPacket->m_SizeFlags |= TP_TUN;
+            return;
         }
     }
 
-    //===============================================
-    // Push packet onto queue to wait for read from
-    // userspace.
-    //===============================================
-    if(tapAdapterReadAndWriteReady(Adapter))
-    {
-        tapPacketQueueInsertTail(&Adapter->SendPacketQueue,tapPacket);
-    }
-    else
-    {
-        //
-        // Tragedy. All this work and the packet is of no use... 
-        //
-        NdisFreeMemory(tapPacket,0,0);
-    }
-
-    // Return after queuing or freeing TAP packet.
-    return;
-
-    // Free TAP packet without queuing.
-no_queue:
-    if(tapPacket != NULL )
-    {
-        NdisFreeMemory(tapPacket,0,0);
-    }
-  
-    return;
+    tapAdapterTransmitPacket(
+        Adapter,
+        queue,
+        tapPacket,
+        &flowClass
+        );
 }
 
 VOID
@@ -784,6 +2105,21 @@ tapSendNetBufferListsComplete(
         // Set NBL completion status.
         NET_BUFFER_LIST_STATUS(currentNbl) = SendCompletionStatus;
 
+        // LSOv2 sends must be completed with the LSOv2 completion info.
+        {
+            NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO lsoInfo;
+
+            lsoInfo.Value = NET_BUFFER_LIST_INFO(currentNbl, TcpLargeSendNetBufferListInfo);
+
+            if(lsoInfo.Transmit.Type == NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE)
+            {
+                lsoInfo.LsoV2TransmitComplete.Type = NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE;
+                lsoInfo.LsoV2TransmitComplete.Reserved = 0;
+
+                NET_BUFFER_LIST_INFO(currentNbl, TcpLargeSendNetBufferListInfo) = lsoInfo.Value;
+            }
+        }
+
         // Fetch first NBs frame type. All linked NBs will have same type.
         frameType = tapGetNetBufferFrameType(NET_BUFFER_LIST_FIRST_NB(currentNbl));
 
@@ -840,20 +2176,20 @@ tapSendNetBufferListsComplete(
         );
 }
 
-BOOLEAN
-tapNetBufferListNetBufferLengthsValid(
+static BOOLEAN
+tapNetBufferLengthValid(
     __in PTAP_ADAPTER_CONTEXT   Adapter,
-    __in  PNET_BUFFER_LIST      NetBufferLists
+    __in PNET_BUFFER            NetBuffer,
+    __in BOOLEAN                LargeSend
     )
 /*++
 
 Routine Description:
 
-    Scan all NBLs and their linked NBs for valid lengths.
+    Check an NB for a valid length.
 
     Fairly absurd to find and packets with bogus lengths, but wise
-    to check anyway. If ANY packet has a bogus length, then abort the
-    entire send.
+    to check anyway.
 
     The only time that one might see this check fail might be during
     HCK driver testing. The HKC test might send oversize packets to
@@ -865,66 +2201,102 @@ Routine Description:
 Arguments:
 
     Adapter                 Pointer to our adapter context
-    NetBufferLists          Head of a list of NBLs to examine
+    NetBuffer               NB to examine
+    LargeSend               TRUE if the NB is an LSOv2 send
 
 Return Value:
 
-    Returns TRUE if all NBs have reasonable lengths.
+    Returns TRUE if the NB has a reasonable length.
     Otherwise, returns FALSE.
 
 --*/
 {
-    PNET_BUFFER_LIST        currentNbl;
+    ULONG       packetLength;
 
-    currentNbl = NetBufferLists;
+    packetLength = NET_BUFFER_DATA_LENGTH(NetBuffer);
 
-    while (currentNbl)
+    // Minimum packet size is size of Ethernet.
+    ASSERT(packetLength >= ETHERNET_HEADER_SIZE);
+
+    if(packetLength < ETHERNET_HEADER_SIZE)
     {
-        PNET_BUFFER_LIST    nextNbl;
-        PNET_BUFFER         currentNb;
+        return FALSE;
+    }
 
-        // Locate next NBL
-        nextNbl = NET_BUFFER_LIST_NEXT_NBL(currentNbl);
+    // Large sends may carry up to a 64 KiB IP packet.
+    if(LargeSend)
+    {
+        return (packetLength <= (ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE + 0xFFFF));
+    }
 
-        // Locate first NB (aka "packet")
-        currentNb = NET_BUFFER_LIST_FIRST_NB(currentNbl);
+    // Maximum size should be Ethernet header size plus MTU plus modest pad for
+    // VLAN tag.
+    ASSERT( packetLength <= (ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE + Adapter->MtuSize));
 
-        //
-        // Process all NBs linked to this NBL
-        //
-        while(currentNb)
-        {
-            PNET_BUFFER nextNb;
-            ULONG       packetLength;
+    if(packetLength > (ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE + Adapter->MtuSize))
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
 
-            // Locate next NB
-            nextNb = NET_BUFFER_NEXT_NB(currentNb);
+//
+// Flow control watermarks
+// -----------------------
+// Once any send packet queue rises above a high watermark sends are held
+// on FlowControlList. They are released only once all queues have drained
+// to the low watermarks, so the stack is not paused and released on every
+// packet around a single threshold.
+//
 
-            packetLength = NET_BUFFER_DATA_LENGTH(currentNb);
+static BOOLEAN
+tapFlowControlAboveHighWatermark(
+    __in PTAP_ADAPTER_CONTEXT   Adapter
+    )
+{
+    ULONG   i;
 
-            // Minimum packet size is size of Ethernet.
-            ASSERT(packetLength >= ETHERNET_HEADER_SIZE);
+    for(i = 0; i < Adapter->QueueCount; ++i)
+    {
+        PTAP_PACKET_QUEUE   sendPacketQueue = &Adapter->Queues[i].SendPacketQueue;
 
-            if(packetLength < ETHERNET_HEADER_SIZE)
-            {
-                return FALSE;
-            }
+        if(sendPacketQueue->TotalBytes > (LONG )Adapter->FlowControlHighBytes)
+        {
+            return TRUE;
+        }
 
-            // Maximum size should be Ethernet header size plus MTU plus modest pad for
-            // VLAN tag.
-            ASSERT( packetLength <= (ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE + Adapter->MtuSize));
+        if(Adapter->FlowControlHighPackets != 0
+            && sendPacketQueue->Count > (LONG )Adapter->FlowControlHighPackets)
+        {
+            return TRUE;
+        }
+    }
 
-            if(packetLength > (ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE + Adapter->MtuSize))
-            {
-                return FALSE;
-            }
+    return FALSE;
+}
 
-            // Move to next NB
-            currentNb = nextNb;
+static BOOLEAN
+tapFlowControlAtLowWatermark(
+    __in PTAP_ADAPTER_CONTEXT   Adapter
+    )
+{
+    ULONG   i;
+
+    for(i = 0; i < Adapter->QueueCount; ++i)
+    {
+        PTAP_PACKET_QUEUE   sendPacketQueue = &Adapter->Queues[i].SendPacketQueue;
+
+        if(sendPacketQueue->TotalBytes > (LONG )Adapter->FlowControlLowBytes)
+        {
+            return FALSE;
         }
 
-        // Move to next NBL
-        currentNbl = nextNbl;
+        if(Adapter->FlowControlHighPackets != 0
+            && sendPacketQueue->Count > (LONG )Adapter->FlowControlLowPackets)
+        {
+            return FALSE;
+        }
     }
 
     return TRUE;
@@ -943,6 +2315,7 @@ tapCompleteFlowControlPackets(
 
     completeList = Adapter->FlowControlList;
     Adapter->FlowControlList = NULL;
+    Adapter->FlowControlListTail = NULL;
     Adapter->FlowControlHasPackets = FALSE;
 
     KeReleaseSpinLock(&Adapter->FlowControlLock,irql);
@@ -964,7 +2337,7 @@ tapCheckFlowControl(
     )
 {
     if(Adapter->FlowControlHasPackets &&
-        Adapter->SendPacketQueue.TotalBytes < TAP_BUFFER_SIZE)
+        tapFlowControlAtLowWatermark(Adapter))
     {
         tapCompleteFlowControlPackets(Adapter);
     }
@@ -1017,9 +2390,12 @@ Return Value:
     PTAP_ADAPTER_CONTEXT    adapter = (PTAP_ADAPTER_CONTEXT )MiniportAdapterContext;
     BOOLEAN                 DispatchLevel = (SendFlags & NDIS_SEND_FLAGS_DISPATCH_LEVEL);
     PNET_BUFFER_LIST        currentNbl;
-    BOOLEAN                 validNbLengths;
+    PNET_BUFFER_LIST        sentNbls = NULL;
+    PNET_BUFFER_LIST        *sentNblsTail = &sentNbls;
+    PNET_BUFFER_LIST        lastSentNbl = NULL;
+    PNET_BUFFER_LIST        invalidNbls = NULL;
+    PNET_BUFFER_LIST        *invalidNblsTail = &invalidNbls;
 
-    UNREFERENCED_PARAMETER(NetBufferLists);
     UNREFERENCED_PARAMETER(PortNumber);
     UNREFERENCED_PARAMETER(SendFlags);
 
@@ -1031,7 +2407,7 @@ Return Value:
     // Just perform a "lying send" and return packets as if they
     // were successfully sent.
     //
-    if(adapter->TapFileObject == NULL)
+    if(adapter->TapFileOpenCount == 0)
     {
         //
         // Complete all NBLs and return if adapter not ready.
@@ -1066,39 +2442,13 @@ Return Value:
         return;
     }
 
-    //
-    // Scan all NBLs and linked packets for valid lengths.
-    // ---------------------------------------------------
-    // If _ANY_ NB length is invalid, then fail the entire send operation.
-    //
-    //    BUGBUG!!! Perhaps this should be less agressive. Fail only individual
-    //    NBLs...
-    //    
-    // If length check is valid, then TAP_PACKETS can be safely allocated
-    // and processed for all NBs being sent.
-    //
-    validNbLengths = tapNetBufferListNetBufferLengthsValid(
-                        adapter,
-                        NetBufferLists
-                        );
-
-    if(!validNbLengths)
-    {
-        //
-        // Complete all NBLs and return if and NB length is invalid.
-        //
-        tapSendNetBufferListsComplete(
-            adapter,
-            NetBufferLists,
-            NDIS_STATUS_INVALID_LENGTH,
-            DispatchLevel
-            );
-
-        return;
-    }
-
     //
     // Process each NBL individually
+    // -----------------------------
+    // The lengths of all NBs of an NBL are checked before any of them is
+    // transmitted. An NBL with an NB of invalid length is failed as a whole
+    // with NDIS_STATUS_INVALID_LENGTH and none of its NBs is transmitted.
+    // Other NBLs in the same send are not affected.
     //
     currentNbl = NetBufferLists;
 
@@ -1106,58 +2456,116 @@ Return Value:
     {
         PNET_BUFFER_LIST    nextNbl;
         PNET_BUFFER         currentNb;
+        BOOLEAN             validNbLengths = TRUE;
+        BOOLEAN             largeSend;
+        NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO lsoInfo;
 
         // Locate next NBL
         nextNbl = NET_BUFFER_LIST_NEXT_NBL(currentNbl);
+        NET_BUFFER_LIST_NEXT_NBL(currentNbl) = NULL;
 
         // Locate first NB (aka "packet")
         currentNb = NET_BUFFER_LIST_FIRST_NB(currentNbl);
 
-        // Transmit all NBs linked to this NBL
+        lsoInfo.Value = NET_BUFFER_LIST_INFO(currentNbl, TcpLargeSendNetBufferListInfo);
+        largeSend = (lsoInfo.Transmit.Type == NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE
+                        && lsoInfo.LsoV2Transmit.MSS != 0);
+
+        // Validate all NBs linked to this NBL
         while(currentNb)
         {
-            PNET_BUFFER nextNb;
+            if(!tapNetBufferLengthValid(adapter,currentNb,largeSend))
+            {
+                validNbLengths = FALSE;
+                break;
+            }
 
-            // Locate next NB
-            nextNb = NET_BUFFER_NEXT_NB(currentNb);
+            // Move to next NB
+            currentNb = NET_BUFFER_NEXT_NB(currentNb);
+        }
 
-            // Transmit the NB
-            tapAdapterTransmit(adapter,currentNb,currentNbl,DispatchLevel);
+        // Transmit all NBs linked to this NBL
+        if(validNbLengths)
+        {
+            currentNb = NET_BUFFER_LIST_FIRST_NB(currentNbl);
 
-            // Move to next NB
-            currentNb = nextNb;
+            while(currentNb)
+            {
+                PNET_BUFFER nextNb;
+
+                // Locate next NB
+                nextNb = NET_BUFFER_NEXT_NB(currentNb);
+
+                // Transmit the NB
+                tapAdapterTransmit(adapter,currentNb,currentNbl,DispatchLevel);
+
+                // Move to next NB
+                currentNb = nextNb;
+            }
+        }
+
+        // Sort the NBL onto the sent or the invalid list, keeping order.
+        if(validNbLengths)
+        {
+            *sentNblsTail = currentNbl;
+            sentNblsTail = &NET_BUFFER_LIST_NEXT_NBL(currentNbl);
+            lastSentNbl = currentNbl;
+        }
+        else
+        {
+            *invalidNblsTail = currentNbl;
+            invalidNblsTail = &NET_BUFFER_LIST_NEXT_NBL(currentNbl);
         }
 
         // Move to next NBL
         currentNbl = nextNbl;
     }
 
-    if(adapter->SendPacketQueue.TotalBytes > TAP_BUFFER_SIZE)
+    if(invalidNbls != NULL)
+    {
+        //
+        // Complete NBLs that had an NB with an invalid length.
+        //
+        tapSendNetBufferListsComplete(
+            adapter,
+            invalidNbls,
+            NDIS_STATUS_INVALID_LENGTH,
+            DispatchLevel
+            );
+    }
+
+    NetBufferLists = sentNbls;
+
+    if(NetBufferLists != NULL
+        && (adapter->FlowControlHasPackets || tapFlowControlAboveHighWatermark(adapter)))
     {
-        // Flow control - Don't complete NBLs until transmit buffer drains below buffer size.
+        // Flow control - Don't complete NBLs until transmit buffer drains to the low watermark.
         KIRQL  irql;
 
         KeAcquireSpinLock(&adapter->FlowControlLock,&irql);
 
-        if(adapter->FlowControlList == NULL)
-        {
-            adapter->FlowControlList = NetBufferLists;
-        }
-        else
+        // Recheck under the lock; the list may just have been released.
+        if(adapter->FlowControlHasPackets || tapFlowControlAboveHighWatermark(adapter))
         {
-            PNET_BUFFER_LIST flowControlList = adapter->FlowControlList;
-            while(flowControlList->Next)
+            if(adapter->FlowControlList == NULL)
+            {
+                adapter->FlowControlList = NetBufferLists;
+            }
+            else
             {
-                flowControlList = flowControlList->Next;
+                // Append new NBLs at the end of the existing list of NBLs
+                NET_BUFFER_LIST_NEXT_NBL(adapter->FlowControlListTail) = NetBufferLists;
             }
-            // Append new NBLs at the end of the existing list of NBLs
-            flowControlList->Next = NetBufferLists;
+            adapter->FlowControlListTail = lastSentNbl;
+            adapter->FlowControlHasPackets = TRUE;
+
+            NetBufferLists = NULL;
         }
-        adapter->FlowControlHasPackets = TRUE;
 
         KeReleaseSpinLock(&adapter->FlowControlLock,irql);
     }
-    else
+
+    if(NetBufferLists != NULL)
     {
         // Complete all NBLs
         tapSendNetBufferListsComplete(
@@ -1169,8 +2577,8 @@ Return Value:
     }
 
     // Attempt to complete pending read IRPs from pending TAP 
-    // send packet queue.
-    tapProcessSendPacketQueue(adapter);
+    // send packet queues.
+    tapProcessSendPacketQueue(adapter,NULL);
 }
 
 VOID
@@ -1203,6 +2611,7 @@ TapDeviceRead(
     NTSTATUS                ntStatus = STATUS_SUCCESS;// Assume success
     PIO_STACK_LOCATION      irpSp;// Pointer to current stack location
     PTAP_ADAPTER_CONTEXT    adapter = NULL;
+    PTAP_QUEUE              queue = NULL;
     ULONG                   pagePriority;
 
     PAGED_CODE();
@@ -1212,9 +2621,11 @@ TapDeviceRead(
     //
     // Fetch adapter context for this device.
     // --------------------------------------
-    // Adapter pointer was stashed in FsContext when handle was opened.
+    // Adapter and queue pointers were stashed in FsContext and FsContext2
+    // when handle was opened.
     //
     adapter = (PTAP_ADAPTER_CONTEXT )(irpSp->FileObject)->FsContext;
+    queue = (PTAP_QUEUE )(irpSp->FileObject)->FsContext2;
 
     ASSERT(adapter);
 
@@ -1293,11 +2704,11 @@ TapDeviceRead(
     //
     // Is this needed???
     //
-    IoCsqInsertIrp(&adapter->PendingReadIrpQueue.CsqQueue, Irp, NULL);
+    IoCsqInsertIrp(&queue->PendingReadIrpQueue.CsqQueue, Irp, NULL);
 
     // Attempt to complete pending read IRPs from pending TAP 
     // send packet queue.
-    tapProcessSendPacketQueue(adapter);
+    tapProcessSendPacketQueue(adapter,queue);
 
     ntStatus = STATUS_PENDING;
 
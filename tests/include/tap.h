@@ -0,0 +1,227 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef __TAP_H
+#define __TAP_H
+
+//===================================================================
+// User-mode stand-in for src/tap.h
+//
+// Provides just enough of the WDK for the driver headers and sources
+// the tests build, with GCC atomics in place of the interlocked and
+// SLIST routines. Driver sources that include "tap.h" pick this file up
+// instead of the real one.
+//===================================================================
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+//
+// Basic types. ULONG is 32 bits as on Windows.
+//
+typedef void                VOID, *PVOID;
+typedef uint8_t             UCHAR, *PUCHAR, BOOLEAN;
+typedef uint16_t            USHORT, *PUSHORT;
+typedef int32_t             LONG, *PLONG;
+typedef uint32_t            ULONG, *PULONG;
+typedef int64_t             LONG64, *PLONG64;
+typedef uint64_t            ULONG64, *PULONG64;
+typedef uintptr_t           ULONG_PTR, KSPIN_LOCK;
+
+#define TRUE                1
+#define FALSE               0
+
+#define FORCEINLINE         static inline
+#define UNALIGNED
+
+// SAL annotations.
+#define __in
+#define __in_opt
+#define __out
+#define __out_opt
+#define __inout
+#define __in_bcount(x)
+#define __in_bcount_opt(x)
+#define __out_bcount(x)
+
+#define ASSERT(x)           assert(x)
+#define DEBUGP(fmt)
+#define NOTE_ERROR()
+
+#ifndef min
+#define min(a,b)            (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b)            (((a) > (b)) ? (a) : (b))
+#endif
+
+#define FIELD_OFFSET(type,field)            offsetof(type,field)
+#define CONTAINING_RECORD(address,type,field) \
+    ((type *)((char *)(address) - offsetof(type,field)))
+
+#define NdisZeroMemory(d,n)                 memset((d),0,(n))
+#define NdisMoveMemory(d,s,n)               memcpy((d),(s),(n))
+
+#define KeMemoryBarrier()                   __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define RtlUshortByteSwap(x)                __builtin_bswap16(x)
+#define RtlUlongByteSwap(x)                 __builtin_bswap32(x)
+
+//
+// NDIS definitions used by the driver headers.
+//
+#define NDIS620_MINIPORT
+#define NDIS630_MINIPORT
+
+typedef int                 NDIS_STATUS;
+typedef struct _KDPC        { PVOID Reserved; } KDPC;
+typedef struct _PROCESSOR_NUMBER
+{
+    USHORT  Group;
+    UCHAR   Number;
+    UCHAR   Reserved;
+} PROCESSOR_NUMBER;
+typedef struct _NET_BUFFER_LIST *PNET_BUFFER_LIST;
+typedef struct _NDIS_RW_LOCK_EX *PNDIS_RW_LOCK_EX;
+
+#define NDIS_ETH_TYPE_IPV4                  0x0800
+#define NDIS_ETH_TYPE_802_1Q                0x8100
+#define NDIS_ETH_TYPE_IPV6                  0x86dd
+
+#define NDIS_HASH_IPV4                      0x00000100
+#define NDIS_HASH_TCP_IPV4                  0x00000200
+#define NDIS_HASH_IPV6                      0x00000400
+#define NDIS_HASH_TCP_IPV6                  0x00001000
+
+#define NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_2        40
+#define NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_2      (128 * sizeof(PROCESSOR_NUMBER))
+
+//
+// Interlocked operations.
+//
+#define InterlockedIncrement(p)             __atomic_add_fetch((p),1,__ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)             __atomic_sub_fetch((p),1,__ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(p,v)         __atomic_fetch_add((p),(v),__ATOMIC_SEQ_CST)
+#define InterlockedExchange(p,v)            __atomic_exchange_n((p),(v),__ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(p)           __atomic_add_fetch((p),1,__ATOMIC_SEQ_CST)
+#define InterlockedAdd64(p,v)               __atomic_add_fetch((p),(v),__ATOMIC_SEQ_CST)
+
+FORCEINLINE LONG
+InterlockedCompareExchange(volatile LONG *Destination, LONG Exchange, LONG Comparand)
+{
+    __atomic_compare_exchange_n(Destination,&Comparand,Exchange,0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+//
+// Doubly linked lists.
+//
+typedef struct _LIST_ENTRY
+{
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+FORCEINLINE VOID
+InitializeListHead(PLIST_ENTRY ListHead)
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+#define NdisInitializeListHead(h)           InitializeListHead(h)
+#define IsListEmpty(h)                      ((h)->Flink == (h))
+
+FORCEINLINE VOID
+InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    Entry->Flink = ListHead;
+    Entry->Blink = ListHead->Blink;
+    ListHead->Blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+FORCEINLINE BOOLEAN
+RemoveEntryList(PLIST_ENTRY Entry)
+{
+    Entry->Blink->Flink = Entry->Flink;
+    Entry->Flink->Blink = Entry->Blink;
+    return Entry->Flink == Entry->Blink;
+}
+
+//
+// Interlocked singly linked lists. Only push and flush are provided,
+// which is all the driver uses; without pop the head needs no ABA tag.
+//
+typedef struct _SLIST_ENTRY
+{
+    struct _SLIST_ENTRY *Next;
+} SLIST_ENTRY, *PSLIST_ENTRY;
+
+typedef struct _SLIST_HEADER
+{
+    PSLIST_ENTRY    Head;
+} SLIST_HEADER, *PSLIST_HEADER;
+
+#define InitializeSListHead(h)              ((h)->Head = NULL)
+
+FORCEINLINE PSLIST_ENTRY
+InterlockedPushEntrySList(PSLIST_HEADER ListHead, PSLIST_ENTRY Entry)
+{
+    PSLIST_ENTRY    first = __atomic_load_n(&ListHead->Head,__ATOMIC_RELAXED);
+
+    do
+    {
+        Entry->Next = first;
+    }
+    while(!__atomic_compare_exchange_n(&ListHead->Head,&first,Entry,1,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+
+    return first;
+}
+
+FORCEINLINE PSLIST_ENTRY
+InterlockedFlushSList(PSLIST_HEADER ListHead)
+{
+    return __atomic_exchange_n(&ListHead->Head,NULL,__ATOMIC_ACQUIRE);
+}
+
+//
+// Driver headers that build in user mode, in the order of src/tap.h.
+// They use long for 32-bit fields, as on LLP64 Windows.
+//
+#define long                int
+#define __int64             int __attribute__((mode(DI)))
+
+#include "constants.h"
+#include "proto.h"
+#include "aqm.h"
+#include "pktqueue.h"
+#include "tap-windows.h"
+#include "ringops.h"
+#include "endian.h"
+#include "rss.h"
+
+#undef long
+#undef __int64
+
+#endif // __TAP_H
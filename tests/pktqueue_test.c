@@ -0,0 +1,386 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+//
+// Stress test and contention benchmark for the lock-free producer side of
+// the TAP packet queue (src/pktqueue.h).
+//
+// Several producer threads push numbered entries while one consumer
+// takes them off the Incoming list, as tapProcessQueue does under
+// QueueLock. The consumer checks that no entry is lost or duplicated,
+// that each producer's entries arrive in order, and that Count never
+// exceeds the number of entries actually pushed.
+//
+// Run with --bench to compare push throughput against a mutex-protected
+// list for 1 to 8 producers.
+//
+
+#include "tap.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TEST_PRODUCERS          4
+#define TEST_ENTRIES            250000      // Per producer
+#define BENCH_MAX_PRODUCERS     8
+#define BENCH_ENTRIES           200000      // Per producer
+
+typedef struct _TEST_ENTRY
+{
+    SLIST_ENTRY     IncomingLink;
+    LIST_ENTRY      QueueLink;              // Mutex baseline only
+    ULONG           Producer;
+    ULONG           Sequence;
+    LONG            Size;
+} TEST_ENTRY;
+
+typedef struct _TEST_PRODUCER
+{
+    pthread_t       Thread;
+    ULONG           Index;
+    ULONG           EntryCount;
+    TEST_ENTRY      *Entries;
+} TEST_PRODUCER;
+
+static TAP_PACKET_QUEUE     testQueue;
+static volatile LONG        testPushStarted;    // Raised before each push
+static volatile LONG        testStart;
+
+// Mutex-protected baseline for the benchmark.
+static pthread_mutex_t      baselineLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_ENTRY           baselineList;
+static LONG                 baselineCount;
+static int                  useBaseline;
+
+static int                  failures;
+
+#define CHECK(cond)                                                     \
+    do                                                                  \
+    {                                                                   \
+        if(!(cond))                                                     \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                __FILE__, __LINE__, #cond);                             \
+            ++failures;                                                 \
+        }                                                               \
+    } while(0)
+
+static LONG
+testEntrySize(ULONG Producer, ULONG Sequence)
+{
+    return 60 + (LONG )((Producer * 7919 + Sequence) % 1455);
+}
+
+static void
+testQueueInitialize(void)
+{
+    memset(&testQueue, 0, sizeof(testQueue));
+    InitializeSListHead(&testQueue.Incoming);
+    InitializeListHead(&testQueue.ActiveClasses);
+
+    testPushStarted = 0;
+    testStart = 0;
+
+    InitializeListHead(&baselineList);
+    baselineCount = 0;
+}
+
+static void *
+testProducer(void *Context)
+{
+    TEST_PRODUCER   *producer = Context;
+    ULONG           i;
+
+    while(!__atomic_load_n(&testStart, __ATOMIC_ACQUIRE))
+    {
+        sched_yield();
+    }
+
+    for(i = 0; i < producer->EntryCount; ++i)
+    {
+        TEST_ENTRY  *entry = &producer->Entries[i];
+
+        entry->Producer = producer->Index;
+        entry->Sequence = i;
+        entry->Size = testEntrySize(producer->Index, i);
+
+        if(useBaseline)
+        {
+            pthread_mutex_lock(&baselineLock);
+            InsertTailList(&baselineList, &entry->QueueLink);
+            ++baselineCount;
+            pthread_mutex_unlock(&baselineLock);
+        }
+        else
+        {
+            InterlockedIncrement(&testPushStarted);
+            tapPacketQueuePushIncoming(&testQueue, &entry->IncomingLink, entry->Size);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+testStartProducers(TEST_PRODUCER *Producers, ULONG ProducerCount, ULONG EntryCount)
+{
+    ULONG   i;
+
+    for(i = 0; i < ProducerCount; ++i)
+    {
+        Producers[i].Index = i;
+        Producers[i].EntryCount = EntryCount;
+        Producers[i].Entries = calloc(EntryCount, sizeof(TEST_ENTRY));
+
+        if(Producers[i].Entries == NULL
+            || pthread_create(&Producers[i].Thread, NULL, testProducer, &Producers[i]) != 0)
+        {
+            fprintf(stderr, "cannot start producer %u\n", i);
+            exit(2);
+        }
+    }
+
+    __atomic_store_n(&testStart, 1, __ATOMIC_RELEASE);
+}
+
+static void
+testJoinProducers(TEST_PRODUCER *Producers, ULONG ProducerCount)
+{
+    ULONG   i;
+
+    for(i = 0; i < ProducerCount; ++i)
+    {
+        pthread_join(Producers[i].Thread, NULL);
+        free(Producers[i].Entries);
+    }
+}
+
+//
+// Consume everything pushed, as the driver's consumer does, checking
+// each entry. Returns the number of entries taken.
+//
+static ULONG64
+testConsume(ULONG ProducerCount, ULONG EntryCount, int Verify)
+{
+    ULONG       expected[BENCH_MAX_PRODUCERS] = { 0 };
+    ULONG64     total = (ULONG64 )ProducerCount * EntryCount;
+    ULONG64     consumed = 0;
+
+    while(consumed < total)
+    {
+        PSLIST_ENTRY    entry;
+        LONG            count;
+        LONG            started;
+
+        if(useBaseline)
+        {
+            pthread_mutex_lock(&baselineLock);
+
+            while(!IsListEmpty(&baselineList))
+            {
+                PLIST_ENTRY link = baselineList.Flink;
+
+                RemoveEntryList(link);
+                --baselineCount;
+                ++consumed;
+            }
+
+            pthread_mutex_unlock(&baselineLock);
+            sched_yield();
+            continue;
+        }
+
+        // Count is raised after the push, so it may lag but never lead.
+        count = __atomic_load_n(&testQueue.Count, __ATOMIC_SEQ_CST);
+        started = __atomic_load_n(&testPushStarted, __ATOMIC_SEQ_CST);
+
+        if(Verify)
+        {
+            CHECK((LONG64 )count <= (LONG64 )started - (LONG64 )consumed);
+        }
+
+        entry = tapPacketQueueTakeIncomingLocked(&testQueue);
+
+        if(entry == NULL)
+        {
+            sched_yield();
+            continue;
+        }
+
+        while(entry != NULL)
+        {
+            TEST_ENTRY  *testEntry = CONTAINING_RECORD(entry, TEST_ENTRY, IncomingLink);
+
+            entry = entry->Next;
+
+            if(Verify)
+            {
+                CHECK(testEntry->Producer < ProducerCount);
+
+                if(testEntry->Producer < ProducerCount)
+                {
+                    // Oldest first within each producer, nothing lost or repeated.
+                    CHECK(testEntry->Sequence == expected[testEntry->Producer]);
+                    expected[testEntry->Producer] = testEntry->Sequence + 1;
+                }
+
+                CHECK(testEntry->Size == testEntrySize(testEntry->Producer, testEntry->Sequence));
+            }
+
+            tapPacketQueueRemovedLocked(&testQueue, testEntry->Size);
+            ++consumed;
+        }
+    }
+
+    return consumed;
+}
+
+static void
+testStress(void)
+{
+    TEST_PRODUCER   producers[TEST_PRODUCERS];
+    ULONG64         consumed;
+
+    testQueueInitialize();
+    useBaseline = 0;
+
+    testStartProducers(producers, TEST_PRODUCERS, TEST_ENTRIES);
+    consumed = testConsume(TEST_PRODUCERS, TEST_ENTRIES, TRUE);
+    testJoinProducers(producers, TEST_PRODUCERS);
+
+    CHECK(consumed == (ULONG64 )TEST_PRODUCERS * TEST_ENTRIES);
+    CHECK(tapPacketQueueTakeIncomingLocked(&testQueue) == NULL);
+    CHECK(testQueue.Count == 0);
+    CHECK(testQueue.TotalBytes == 0);
+    CHECK(testQueue.MaxCount >= 1);
+    CHECK(testQueue.MaxCount <= TEST_PRODUCERS * TEST_ENTRIES);
+
+    printf("stress: %u producers x %u entries, max queued %d\n",
+        TEST_PRODUCERS, TEST_ENTRIES, (int )testQueue.MaxCount);
+}
+
+static void
+testOrder(void)
+{
+    TEST_ENTRY      entries[5];
+    PSLIST_ENTRY    entry;
+    ULONG           i;
+
+    testQueueInitialize();
+
+    for(i = 0; i < 5; ++i)
+    {
+        entries[i].Sequence = i;
+        tapPacketQueuePushIncoming(&testQueue, &entries[i].IncomingLink, 100);
+    }
+
+    CHECK(testQueue.Count == 5);
+    CHECK(testQueue.TotalBytes == 500);
+    CHECK(testQueue.MaxCount == 5);
+
+    entry = tapPacketQueueTakeIncomingLocked(&testQueue);
+
+    for(i = 0; i < 5; ++i)
+    {
+        CHECK(entry != NULL);
+
+        if(entry == NULL)
+        {
+            break;
+        }
+
+        CHECK(CONTAINING_RECORD(entry, TEST_ENTRY, IncomingLink)->Sequence == i);
+        tapPacketQueueRemovedLocked(&testQueue, 100);
+        entry = entry->Next;
+    }
+
+    CHECK(entry == NULL);
+    CHECK(tapPacketQueueTakeIncomingLocked(&testQueue) == NULL);
+    CHECK(testQueue.Count == 0);
+    CHECK(testQueue.TotalBytes == 0);
+}
+
+static double
+testNow(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void
+testBenchmark(void)
+{
+    ULONG   producerCount;
+
+    printf("%-10s %14s %14s\n", "producers", "lock-free ns", "mutex ns");
+
+    for(producerCount = 1; producerCount <= BENCH_MAX_PRODUCERS; producerCount *= 2)
+    {
+        TEST_PRODUCER   producers[BENCH_MAX_PRODUCERS];
+        double          nsPerPush[2];
+
+        for(useBaseline = 0; useBaseline < 2; ++useBaseline)
+        {
+            double  start;
+
+            testQueueInitialize();
+
+            start = testNow();
+            testStartProducers(producers, producerCount, BENCH_ENTRIES);
+            testConsume(producerCount, BENCH_ENTRIES, FALSE);
+            testJoinProducers(producers, producerCount);
+
+            nsPerPush[useBaseline] = (testNow() - start) * 1e9
+                / ((double )producerCount * BENCH_ENTRIES);
+        }
+
+        printf("%-10u %14.1f %14.1f\n", producerCount, nsPerPush[0], nsPerPush[1]);
+    }
+
+    useBaseline = 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    if(argc > 1 && strcmp(argv[1], "--bench") == 0)
+    {
+        testBenchmark();
+        return 0;
+    }
+
+    testOrder();
+    testStress();
+
+    if(failures != 0)
+    {
+        fprintf(stderr, "pktqueue_test: %d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("pktqueue_test: passed\n");
+    return 0;
+}
@@ -0,0 +1,381 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+//
+// Tests for the shared-memory ring arithmetic (src/ringops.h) used by
+// tapRingsSendFrame and tapRingsReceiveThread: empty and full rings,
+// frames wrapping around the end of the ring, and Head, Tail and frame
+// headers corrupted by userspace.
+//
+
+#include "tap.h"
+
+#include <stdlib.h>
+
+#define CAPACITY            TAP_WIN_RING_CAPACITY_MIN
+#define HEADER_SIZE         ((ULONG )sizeof(TAP_WIN_FRAME_HEADER))
+#define MAX_FRAME_LENGTH    (TAP_WIN_RING_TRAILING_BYTES - HEADER_SIZE)
+
+static int                  failures;
+
+#define CHECK(cond)                                                     \
+    do                                                                  \
+    {                                                                   \
+        if(!(cond))                                                     \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                __FILE__, __LINE__, #cond);                             \
+            ++failures;                                                 \
+        }                                                               \
+    } while(0)
+
+static TAP_WIN_RING *
+testRingAllocate(void)
+{
+    TAP_WIN_RING    *ring = calloc(1, TAP_WIN_RING_SIZE(CAPACITY));
+
+    if(ring == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+    }
+
+    return ring;
+}
+
+static void
+testFill(UCHAR *Data, ULONG Length, ULONG Seed)
+{
+    ULONG   i;
+
+    for(i = 0; i < Length; ++i)
+    {
+        Data[i] = (UCHAR )(Seed * 31 + i * 7);
+    }
+}
+
+// Consume the frame at *Head, checking it carries Length bytes of Seed.
+static BOOLEAN
+testReadFrame(TAP_WIN_RING *Ring, ULONG *Head, ULONG Tail, ULONG Length, ULONG Seed)
+{
+    static UCHAR            expected[TAP_WIN_RING_TRAILING_BYTES];
+    TAP_WIN_FRAME_HEADER    frameHeader;
+
+    if(*Head == Tail
+        || !tapRingReadFrameHeader(Ring, CAPACITY, *Head, Tail, &frameHeader)
+        || frameHeader.Length != Length)
+    {
+        return FALSE;
+    }
+
+    testFill(expected, Length, Seed);
+
+    if(memcmp(Ring->Data + *Head + HEADER_SIZE, expected, Length) != 0)
+    {
+        return FALSE;
+    }
+
+    *Head = tapRingNextFrame(*Head, frameHeader.Length, CAPACITY);
+
+    return tapRingOffsetValid(*Head, CAPACITY);
+}
+
+static void
+testEmpty(void)
+{
+    TAP_WIN_RING    *ring = testRingAllocate();
+    UCHAR           frame[64];
+    ULONG           head = 0;
+    ULONG           tail = 0;
+
+    // An empty ring offers all but one alignment unit.
+    CHECK(tapRingFreeSpace(0, 0, CAPACITY) == CAPACITY - TAP_WIN_FRAME_ALIGNMENT);
+    CHECK(tapRingFreeSpace(CAPACITY - 4, CAPACITY - 4, CAPACITY) == CAPACITY - TAP_WIN_FRAME_ALIGNMENT);
+
+    // Zero-length frames still take a header.
+    CHECK(tapRingWriteFrame(ring, CAPACITY, head, &tail, NULL, 0, frame, 0));
+    CHECK(tail == HEADER_SIZE);
+    CHECK(testReadFrame(ring, &head, tail, 0, 0));
+    CHECK(head == tail);
+
+    // Lengths are rounded up to the frame alignment.
+    testFill(frame, 13, 1);
+    CHECK(tapRingWriteFrame(ring, CAPACITY, head, &tail, NULL, 0, frame, 13));
+    CHECK(tail == HEADER_SIZE + TAP_WIN_FRAME_ALIGN(HEADER_SIZE + 13));
+    CHECK(testReadFrame(ring, &head, tail, 13, 1));
+    CHECK(head == tail);
+
+    free(ring);
+}
+
+static void
+testPrefix(void)
+{
+    TAP_WIN_RING            *ring = testRingAllocate();
+    TAP_WIN_FRAME_HEADER    frameHeader;
+    UCHAR                   prefix[10];
+    UCHAR                   frame[100];
+    ULONG                   tail = 0;
+
+    memset(prefix, 0xa5, sizeof(prefix));
+    testFill(frame, sizeof(frame), 2);
+
+    CHECK(tapRingWriteFrame(ring, CAPACITY, 0, &tail, prefix, sizeof(prefix), frame, sizeof(frame)));
+    CHECK(tapRingReadFrameHeader(ring, CAPACITY, 0, tail, &frameHeader));
+    CHECK(frameHeader.Length == sizeof(prefix) + sizeof(frame));
+    CHECK(frameHeader.Flags == 0);
+    CHECK(memcmp(ring->Data + HEADER_SIZE, prefix, sizeof(prefix)) == 0);
+    CHECK(memcmp(ring->Data + HEADER_SIZE + sizeof(prefix), frame, sizeof(frame)) == 0);
+
+    // A NULL prefix is ignored whatever its size.
+    tail = 0;
+    CHECK(tapRingWriteFrame(ring, CAPACITY, 0, &tail, NULL, sizeof(prefix), frame, sizeof(frame)));
+    CHECK(tapRingReadFrameHeader(ring, CAPACITY, 0, tail, &frameHeader));
+    CHECK(frameHeader.Length == sizeof(frame));
+
+    free(ring);
+}
+
+static void
+testFull(void)
+{
+    TAP_WIN_RING    *ring = testRingAllocate();
+    static UCHAR    frame[1500];
+    ULONG           frameSize = TAP_WIN_FRAME_ALIGN(HEADER_SIZE + sizeof(frame));
+    ULONG           head = 0;
+    ULONG           tail = 0;
+    ULONG           written = 0;
+    ULONG           savedTail;
+    ULONG           lastLength;
+    ULONG           i;
+
+    for(;;)
+    {
+        testFill(frame, sizeof(frame), written);
+
+        if(!tapRingWriteFrame(ring, CAPACITY, head, &tail, NULL, 0, frame, sizeof(frame)))
+        {
+            break;
+        }
+
+        ++written;
+    }
+
+    // Filled up to the last frame that fits, never to Head.
+    CHECK(written == (CAPACITY - TAP_WIN_FRAME_ALIGNMENT) / frameSize);
+    CHECK(tail != head);
+    CHECK(tapRingFreeSpace(head, tail, CAPACITY) < frameSize);
+
+    // A failed write leaves Tail alone; a smaller frame may still fit.
+    savedTail = tail;
+    CHECK(!tapRingWriteFrame(ring, CAPACITY, head, &tail, NULL, 0, frame, sizeof(frame)));
+    CHECK(tail == savedTail);
+
+    // Fill the last bytes exactly, leaving only the unused alignment unit.
+    lastLength = tapRingFreeSpace(head, tail, CAPACITY) - HEADER_SIZE;
+    CHECK(tapRingWriteFrame(ring, CAPACITY, head, &tail, NULL, 0, frame, lastLength));
+    CHECK(tapRingFreeSpace(head, tail, CAPACITY) == 0);
+    CHECK(((tail + TAP_WIN_FRAME_ALIGNMENT) & (CAPACITY - 1)) == head);
+    CHECK(!tapRingWriteFrame(ring, CAPACITY, head, &tail, NULL, 0, frame, 0));
+
+    // Everything comes back out in order.
+    for(i = 0; i < written; ++i)
+    {
+        CHECK(testReadFrame(ring, &head, tail, sizeof(frame), i));
+    }
+
+    CHECK(testReadFrame(ring, &head, tail, lastLength, written));
+    CHECK(head == tail);
+
+    free(ring);
+}
+
+static void
+testWraparound(void)
+{
+    TAP_WIN_RING    *ring = testRingAllocate();
+    static UCHAR    frame[MAX_FRAME_LENGTH];
+    ULONG           head = CAPACITY - 8;
+    ULONG           tail = CAPACITY - 8;
+
+    // A frame starting near the end runs into the trailing bytes...
+    testFill(frame, 100, 3);
+    CHECK(tapRingWriteFrame(ring, CAPACITY, head, &tail, NULL, 0, frame, 100));
+    CHECK(tail == TAP_WIN_FRAME_ALIGN(100));
+    CHECK(tapRingFreeSpace(head, tail, CAPACITY) == CAPACITY - TAP_WIN_FRAME_ALIGNMENT - (HEADER_SIZE + TAP_WIN_FRAME_ALIGN(100)));
+
+    // ... and is read back in one piece, the next one starting from the front.
+    CHECK(testReadFrame(ring, &head, tail, 100, 3));
+    CHECK(head == tail);
+
+    // The longest frame fits the trailing bytes from the last ring offset.
+    head = tail = CAPACITY - TAP_WIN_FRAME_ALIGNMENT;
+    testFill(frame, MAX_FRAME_LENGTH, 4);
+    CHECK(tapRingWriteFrame(ring, CAPACITY, head, &tail, NULL, 0, frame, MAX_FRAME_LENGTH));
+    CHECK(testReadFrame(ring, &head, tail, MAX_FRAME_LENGTH, 4));
+    CHECK(head == tail);
+
+    // Longer frames are refused, with or without a prefix.
+    CHECK(!tapRingWriteFrame(ring, CAPACITY, head, &tail, NULL, 0, frame, MAX_FRAME_LENGTH + 1));
+    CHECK(!tapRingWriteFrame(ring, CAPACITY, head, &tail, frame, 2, frame, MAX_FRAME_LENGTH - 1));
+    CHECK(!tapRingWriteFrame(ring, CAPACITY, head, &tail, frame, 0xffffffff, frame, 8));
+    CHECK(!tapRingWriteFrame(ring, CAPACITY, head, &tail, frame, 8, frame, 0xfffffffc));
+    CHECK(head == tail);
+
+    free(ring);
+}
+
+//
+// Producer and consumer interleaved at random, with random frame sizes,
+// for many trips around the ring.
+//
+static void
+testRandom(void)
+{
+    TAP_WIN_RING    *ring = testRingAllocate();
+    static UCHAR    frame[9000];
+    static ULONG    lengths[CAPACITY / HEADER_SIZE];
+    ULONG           head = 0;
+    ULONG           tail = 0;
+    ULONG           produced = 0;
+    ULONG           consumed = 0;
+    ULONG64         bytes = 0;
+    ULONG           i;
+
+    srand(1);
+
+    for(i = 0; i < 2000000 && failures == 0; ++i)
+    {
+        if(rand() % 2)
+        {
+            ULONG   length = (rand() % 8) ? (ULONG )(rand() % 1600) : (ULONG )(rand() % sizeof(frame));
+            ULONG   before = tapRingFreeSpace(head, tail, CAPACITY);
+
+            testFill(frame, length, produced);
+
+            if(tapRingWriteFrame(ring, CAPACITY, head, &tail, NULL, 0, frame, length))
+            {
+                CHECK(tapRingFreeSpace(head, tail, CAPACITY) == before - TAP_WIN_FRAME_ALIGN(HEADER_SIZE + length));
+                lengths[produced % (sizeof(lengths) / sizeof(lengths[0]))] = length;
+                ++produced;
+                bytes += length;
+            }
+            else
+            {
+                CHECK(before < TAP_WIN_FRAME_ALIGN(HEADER_SIZE + length));
+            }
+        }
+        else if(head != tail)
+        {
+            CHECK(testReadFrame(ring, &head, tail, lengths[consumed % (sizeof(lengths) / sizeof(lengths[0]))], consumed));
+            ++consumed;
+        }
+        else
+        {
+            CHECK(produced == consumed);
+        }
+    }
+
+    CHECK(bytes > 20ULL * CAPACITY);
+
+    printf("random: %u frames, %llu bytes, %llu trips around the ring\n",
+        produced, (unsigned long long )bytes, (unsigned long long )(bytes / CAPACITY));
+
+    free(ring);
+}
+
+static void
+testCorrupt(void)
+{
+    TAP_WIN_RING            *ring = testRingAllocate();
+    TAP_WIN_FRAME_HEADER    frameHeader;
+    UCHAR                   frame[64] = { 0 };
+    ULONG                   tail = 0;
+
+    // Head and Tail outside the ring or not frame aligned.
+    CHECK(tapRingOffsetValid(0, CAPACITY));
+    CHECK(tapRingOffsetValid(CAPACITY - TAP_WIN_FRAME_ALIGNMENT, CAPACITY));
+    CHECK(!tapRingOffsetValid(CAPACITY, CAPACITY));
+    CHECK(!tapRingOffsetValid(0xfffffffc, CAPACITY));
+    CHECK(!tapRingOffsetValid(2, CAPACITY));
+    CHECK(!tapRingOffsetValid(CAPACITY - 1, CAPACITY));
+
+    // The producer drops frames rather than trust a bad Head.
+    CHECK(!tapRingWriteFrame(ring, CAPACITY, CAPACITY, &tail, NULL, 0, frame, sizeof(frame)));
+    CHECK(!tapRingWriteFrame(ring, CAPACITY, 0xfffffff0, &tail, NULL, 0, frame, sizeof(frame)));
+    CHECK(!tapRingWriteFrame(ring, CAPACITY, 6, &tail, NULL, 0, frame, sizeof(frame)));
+    CHECK(tail == 0);
+
+    // A Head just past Tail leaves no room at all.
+    CHECK(!tapRingWriteFrame(ring, CAPACITY, TAP_WIN_FRAME_ALIGNMENT, &tail, NULL, 0, frame, 0));
+
+    // Tail too close to Head to hold a frame header.
+    CHECK(!tapRingReadFrameHeader(ring, CAPACITY, 0, TAP_WIN_FRAME_ALIGNMENT, &frameHeader));
+
+    // Frame header lengths running past Tail or past the trailing bytes.
+    frameHeader.Length = 100;
+    frameHeader.Flags = 0;
+    memcpy(ring->Data, &frameHeader, sizeof(frameHeader));
+    CHECK(tapRingReadFrameHeader(ring, CAPACITY, 0, TAP_WIN_FRAME_ALIGN(HEADER_SIZE + 100), &frameHeader));
+    CHECK(!tapRingReadFrameHeader(ring, CAPACITY, 0, HEADER_SIZE + 96, &frameHeader));
+
+    frameHeader.Length = 0xfffffff8;
+    memcpy(ring->Data, &frameHeader, sizeof(frameHeader));
+    CHECK(!tapRingReadFrameHeader(ring, CAPACITY, 0, CAPACITY - TAP_WIN_FRAME_ALIGNMENT, &frameHeader));
+
+    frameHeader.Length = MAX_FRAME_LENGTH + TAP_WIN_FRAME_ALIGNMENT;
+    memcpy(ring->Data, &frameHeader, sizeof(frameHeader));
+    CHECK(!tapRingReadFrameHeader(ring, CAPACITY, 0, CAPACITY - TAP_WIN_FRAME_ALIGNMENT, &frameHeader));
+
+    // A frame claimed to wrap past Tail from the end of the ring.
+    frameHeader.Length = 64;
+    memcpy(ring->Data + CAPACITY - 8, &frameHeader, sizeof(frameHeader));
+    CHECK(!tapRingReadFrameHeader(ring, CAPACITY, CAPACITY - 8, 16, &frameHeader));
+    frameHeader.Length = 64;
+    memcpy(ring->Data + CAPACITY - 8, &frameHeader, sizeof(frameHeader));
+    CHECK(tapRingReadFrameHeader(ring, CAPACITY, CAPACITY - 8, 64, &frameHeader));
+
+    free(ring);
+}
+
+int
+main(void)
+{
+    // Laid out as on Windows, see include/tap.h.
+    CHECK(HEADER_SIZE == 8);
+
+    testEmpty();
+    testPrefix();
+    testFull();
+    testWraparound();
+    testCorrupt();
+    testRandom();
+
+    if(failures != 0)
+    {
+        fprintf(stderr, "ring_test: %d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("ring_test: passed\n");
+    return 0;
+}
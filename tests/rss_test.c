@@ -0,0 +1,299 @@
+/*
+ *  TAP-Windows -- A kernel driver to provide virtual tap
+ *                 device functionality on Windows.
+ *
+ *  This source code is Copyright (C) 2002-2014 OpenVPN Technologies, Inc.,
+ *  and is released under the GPL version 2 (see below).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+//
+// Tests for the RSS hash (src/rsshash.c), built from the driver source
+// with DBG set so the checked-build self test runs here too.
+//
+// Besides the verification vectors of the RSS specification, checks how
+// tapRssHashFrame picks the hash input: 802.1Q tags, IPv4 options,
+// fragments, other transports, disabled hash types and frames that are
+// too short or not IP.
+//
+
+#include "tap.h"
+
+// First verification vector of the RSS specification:
+// 66.9.149.187:2794 to 161.142.100.80:1766, and
+// [3ffe:2501:200:1fff::7]:2794 to [3ffe:2501:200:3::1]:1766.
+#define TEST_IPV4_HASH          0x323e8fc2
+#define TEST_TCP_IPV4_HASH      0x51ccc178
+#define TEST_IPV6_HASH          0x2cc18cd5
+#define TEST_TCP_IPV6_HASH      0x40207d3d
+
+static const UCHAR testIpv4Addresses[8] =
+{
+    0x42, 0x09, 0x95, 0xbb, 0xa1, 0x8e, 0x64, 0x50
+};
+
+static const UCHAR testIpv6Addresses[32] =
+{
+    0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07,
+    0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01
+};
+
+static const UCHAR testPorts[4] = { 0x0a, 0xea, 0x06, 0xe6 };
+
+static const UCHAR testKey[TAP_RSS_MAX_KEY_SIZE] =
+{
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+};
+
+static int                  failures;
+
+#define CHECK(cond)                                                     \
+    do                                                                  \
+    {                                                                   \
+        if(!(cond))                                                     \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                __FILE__, __LINE__, #cond);                             \
+            ++failures;                                                 \
+        }                                                               \
+    } while(0)
+
+//
+// Build a TCP/IPv4 frame for the first vector. Returns its length.
+//
+static ULONG
+testIpv4Frame(UCHAR *Frame, BOOLEAN Tagged, ULONG OptionSize, UCHAR Protocol, USHORT FragOff)
+{
+    ULONG       offset = ETHERNET_HEADER_SIZE;
+    IPHDR       *ip;
+
+    memset(Frame, 0, TAP_RSS_HEADER_SIZE + 16);
+
+    if(Tagged)
+    {
+        ETH_8021Q_HEADER    *tag = (ETH_8021Q_HEADER *)(Frame + ETHERNET_HEADER_SIZE);
+
+        ((ETH_HEADER *)Frame)->proto = htons(NDIS_ETH_TYPE_802_1Q);
+        tag->Tag = htons(42);
+        tag->EtherType = htons(NDIS_ETH_TYPE_IPV4);
+        offset += VLAN_TAG_SIZE;
+    }
+    else
+    {
+        ((ETH_HEADER *)Frame)->proto = htons(NDIS_ETH_TYPE_IPV4);
+    }
+
+    ip = (IPHDR *)(Frame + offset);
+    ip->version_len = 0x45 + OptionSize / 4;
+    ip->protocol = Protocol;
+    ip->frag_off = htons(FragOff);
+    memcpy(&ip->saddr, testIpv4Addresses, sizeof(testIpv4Addresses));
+
+    // Options are NOPs; the ports follow them.
+    offset += IP_HEADER_SIZE;
+    memset(Frame + offset, 1, OptionSize);
+    offset += OptionSize;
+
+    memcpy(Frame + offset, testPorts, sizeof(testPorts));
+    return offset + sizeof(testPorts);
+}
+
+//
+// Build a TCP/IPv6 frame for the first vector. Returns its length.
+//
+static ULONG
+testIpv6Frame(UCHAR *Frame, UCHAR NextHeader)
+{
+    IPV6HDR     *ip = (IPV6HDR *)(Frame + ETHERNET_HEADER_SIZE);
+
+    memset(Frame, 0, TAP_RSS_HEADER_SIZE + 16);
+    ((ETH_HEADER *)Frame)->proto = htons(NDIS_ETH_TYPE_IPV6);
+
+    ip->version_prio = 0x60;
+    ip->nexthdr = NextHeader;
+    memcpy(ip->saddr, testIpv6Addresses, sizeof(testIpv6Addresses));
+
+    memcpy(Frame + ETHERNET_HEADER_SIZE + IPV6_HEADER_SIZE, testPorts, sizeof(testPorts));
+    return ETHERNET_HEADER_SIZE + IPV6_HEADER_SIZE + sizeof(testPorts);
+}
+
+static void
+testSpecification(void)
+{
+    UCHAR   zeroKey[TAP_RSS_MAX_KEY_SIZE] = { 0 };
+
+    CHECK(tapRssSelfTest());
+
+    CHECK(tapRssToeplitzHash(testKey, testIpv4Addresses, sizeof(testIpv4Addresses)) == TEST_IPV4_HASH);
+    CHECK(tapRssToeplitzHash(zeroKey, testIpv6Addresses, sizeof(testIpv6Addresses)) == 0);
+    CHECK(tapRssToeplitzHash(testKey, testIpv4Addresses, 0) == 0);
+}
+
+static void
+testIpv4(void)
+{
+    UCHAR   frame[TAP_RSS_HEADER_SIZE + 16];
+    ULONG   length;
+    ULONG   hash;
+
+    // Untagged and 802.1Q tagged frames hash the same.
+    length = testIpv4Frame(frame, FALSE, 0, IPPROTO_TCP, 0);
+    hash = 0;
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, length, &hash) == NDIS_HASH_TCP_IPV4);
+    CHECK(hash == TEST_TCP_IPV4_HASH);
+
+    length = testIpv4Frame(frame, TRUE, 0, IPPROTO_TCP, 0);
+    hash = 0;
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, length, &hash) == NDIS_HASH_TCP_IPV4);
+    CHECK(hash == TEST_TCP_IPV4_HASH);
+
+    // The ports follow the options, up to the largest IPv4 header.
+    length = testIpv4Frame(frame, TRUE, 40, IPPROTO_TCP, 0);
+    CHECK(length == TAP_RSS_HEADER_SIZE);
+    hash = 0;
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, length, &hash) == NDIS_HASH_TCP_IPV4);
+    CHECK(hash == TEST_TCP_IPV4_HASH);
+
+    // Without the ports only the addresses are hashed.
+    hash = 0;
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, length - 1, &hash) == NDIS_HASH_IPV4);
+    CHECK(hash == TEST_IPV4_HASH);
+
+    // Fragments, whether first or not, hash the addresses.
+    length = testIpv4Frame(frame, FALSE, 0, IPPROTO_TCP, 0x2000);
+    hash = 0;
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, length, &hash) == NDIS_HASH_IPV4);
+    CHECK(hash == TEST_IPV4_HASH);
+
+    length = testIpv4Frame(frame, FALSE, 0, IPPROTO_TCP, 185);
+    hash = 0;
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, length, &hash) == NDIS_HASH_IPV4);
+    CHECK(hash == TEST_IPV4_HASH);
+
+    // Don't fragment does not make a fragment.
+    length = testIpv4Frame(frame, FALSE, 0, IPPROTO_TCP, 0x4000);
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, length, &hash) == NDIS_HASH_TCP_IPV4);
+
+    // Other transports hash the addresses.
+    length = testIpv4Frame(frame, FALSE, 0, IPPROTO_UDP, 0);
+    hash = 0;
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, length, &hash) == NDIS_HASH_IPV4);
+    CHECK(hash == TEST_IPV4_HASH);
+
+    // Disabled hash types.
+    length = testIpv4Frame(frame, FALSE, 0, IPPROTO_TCP, 0);
+    hash = 0;
+    CHECK(tapRssHashFrame(testKey, NDIS_HASH_IPV4 | NDIS_HASH_IPV6, frame, length, &hash) == NDIS_HASH_IPV4);
+    CHECK(hash == TEST_IPV4_HASH);
+
+    hash = 0;
+    CHECK(tapRssHashFrame(testKey, NDIS_HASH_TCP_IPV4, frame, length, &hash) == NDIS_HASH_TCP_IPV4);
+    CHECK(hash == TEST_TCP_IPV4_HASH);
+
+    length = testIpv4Frame(frame, FALSE, 0, IPPROTO_UDP, 0);
+    hash = 0x5a5a5a5a;
+    CHECK(tapRssHashFrame(testKey, NDIS_HASH_TCP_IPV4, frame, length, &hash) == 0);
+    CHECK(tapRssHashFrame(testKey, NDIS_HASH_IPV6 | NDIS_HASH_TCP_IPV6, frame, length, &hash) == 0);
+    CHECK(hash == 0x5a5a5a5a);
+}
+
+static void
+testIpv6(void)
+{
+    UCHAR   frame[TAP_RSS_HEADER_SIZE + 16];
+    ULONG   length;
+    ULONG   hash;
+
+    length = testIpv6Frame(frame, IPPROTO_TCP);
+    hash = 0;
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, length, &hash) == NDIS_HASH_TCP_IPV6);
+    CHECK(hash == TEST_TCP_IPV6_HASH);
+
+    hash = 0;
+    CHECK(tapRssHashFrame(testKey, NDIS_HASH_IPV6, frame, length, &hash) == NDIS_HASH_IPV6);
+    CHECK(hash == TEST_IPV6_HASH);
+
+    hash = 0;
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, length - 1, &hash) == NDIS_HASH_IPV6);
+    CHECK(hash == TEST_IPV6_HASH);
+
+    // Extension headers (hop-by-hop options here) hash the addresses.
+    length = testIpv6Frame(frame, 0);
+    hash = 0;
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, length, &hash) == NDIS_HASH_IPV6);
+    CHECK(hash == TEST_IPV6_HASH);
+
+    CHECK(tapRssHashFrame(testKey, NDIS_HASH_IPV4 | NDIS_HASH_TCP_IPV4, frame, length, &hash) == 0);
+}
+
+static void
+testNotHashed(void)
+{
+    UCHAR   frame[TAP_RSS_HEADER_SIZE + 16];
+    ULONG   length;
+    ULONG   hash = 0x5a5a5a5a;
+
+    // Shorter than the Ethernet header.
+    length = testIpv4Frame(frame, FALSE, 0, IPPROTO_TCP, 0);
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, ETHERNET_HEADER_SIZE - 1, &hash) == 0);
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, 0, &hash) == 0);
+
+    // Truncated IP headers.
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, ETHERNET_HEADER_SIZE + IP_HEADER_SIZE - 1, &hash) == 0);
+
+    length = testIpv4Frame(frame, TRUE, 0, IPPROTO_TCP, 0);
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE, &hash) == 0);
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame,
+        ETHERNET_HEADER_SIZE + VLAN_TAG_SIZE + IP_HEADER_SIZE - 1, &hash) == 0);
+
+    length = testIpv6Frame(frame, IPPROTO_TCP);
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, ETHERNET_HEADER_SIZE + IPV6_HEADER_SIZE - 1, &hash) == 0);
+
+    // ARP, and an 802.1Q tag around it.
+    length = testIpv4Frame(frame, FALSE, 0, IPPROTO_TCP, 0);
+    ((ETH_HEADER *)frame)->proto = htons(0x0806);
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, length, &hash) == 0);
+
+    length = testIpv4Frame(frame, TRUE, 0, IPPROTO_TCP, 0);
+    ((ETH_8021Q_HEADER *)(frame + ETHERNET_HEADER_SIZE))->EtherType = htons(0x0806);
+    CHECK(tapRssHashFrame(testKey, TAP_RSS_HASH_TYPES, frame, length, &hash) == 0);
+
+    CHECK(hash == 0x5a5a5a5a);
+}
+
+int
+main(int argc, char **argv)
+{
+    testSpecification();
+    testIpv4();
+    testIpv6();
+    testNotHashed();
+
+    if(failures != 0)
+    {
+        fprintf(stderr, "rss_test: %d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("rss_test: passed\n");
+    return 0;
+}